@@ -2,23 +2,45 @@
 
 #define _OLE32_
 
+#include <winsock2.h>
+#include <afunix.h>
 #include <windows.h>
 
 #include <ppl.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <limits.h>
 #include <float.h>
 #include <eh.h>
 #include <math.h>
+#include <time.h>
 
 #include <memory>
 #include <mutex>
+#include <functional>
+#include <thread>
+#include <algorithm>
+#include <set>
 
 #include <djlimagedata.hxx>
 #include <djlenum.hxx>
 #include <djlexcept.hxx>
 #include <djl_sha256.hxx>
+#include <djl_geo.hxx>
+#include <djl_dup.hxx>
+#include <djl_bulkwrite.hxx>
+#include <djl_watch.hxx>
+#include <djl_usock.hxx>
+#include <djl_sample.hxx>
+#include <djl_partial.hxx>
+#include <djl_iosched.hxx>
+#include <djl_layout.hxx>
+#include <djl_dcjpg.hxx>
+#include <djl_sketch.hxx>
+#include <djl_progress.hxx>
+#include <djl_guard.hxx>
+#include <djl_bgio.hxx>
 
 using namespace std;
 using namespace concurrency;
@@ -28,18 +50,53 @@ using namespace concurrency;
 CDJLTrace tracer;
 
 const int MetadataBufferSize = 100;
+const ULONG PreloadBytes = 256 * 1024;     // read by the I/O stage; enough for the metadata of most formats
+const __int64 MaxLookBytes = 64 * 1024 * 1024;
 
-enum EnumAppMode { modeSerialNumbers, modeFocalLengths, modeFNumbers, modeModels, modeLenses, modeHasImage, modeHasGPS, modeEmbedded, modeAdobeEdits, modeRatings };
+enum EnumAppMode { modeSerialNumbers, modeFocalLengths, modeFNumbers, modeModels, modeLenses, modeHasImage, modeHasGPS, modeEmbedded, modeAdobeEdits, modeRatings, modeDuplicates, modeLooks, modeExposure };
+
+// Reports are written to stdout, or appended to a string when the daemon renders them for clients.
+
+class CReportOutput
+{
+    private:
+        string * pText;
+
+    public:
+        CReportOutput( string * p = NULL ) : pText( p ) {}
+
+        void Printf( const char * format, ... )
+        {
+            va_list args;
+            va_start( args, format );
+
+            if ( NULL == pText )
+                vprintf( format, args );
+            else
+            {
+                char ac[ 1024 ];
+                int len = _vsnprintf_s( ac, _countof( ac ), _TRUNCATE, format, args );
+                pText->append( ac, ( len < 0 ) ? strlen( ac ) : len );
+            }
+
+            va_end( args );
+        }
+};
 
 class GenericEntry
 {
     private:
         size_t count;
+        size_t id;          // assigned by CEntryTracker; stays with the entry when it's sorted
 
     public:
-        GenericEntry() { count = 1; }
+        GenericEntry() { count = 1; id = 0; }
         size_t Count() { return count; }
-        void IncrementCount() { count++; }
+        void SetCount( size_t c ) { count = c; }
+        size_t Id() { return id; }
+        void SetId( size_t i ) { id = i; }
+        void IncrementCount( size_t n = 1 ) { count += n; }
+        void DecrementCount() { count--; }
 
         static int EntryCompareCount( const void * a, const void * b )
         {
@@ -75,6 +132,22 @@ class EmbeddedImageEntry : public GenericEntry
             wcscpy( awcPath, path );
         }
 
+        EmbeddedImageEntry( CPartialReader & r )
+        {
+            offset = r.Get<unsigned int>();
+            length = r.Get<unsigned int>();
+            r.GetString( acSha256, _countof( acSha256 ) );
+            r.GetString( awcPath, _countof( awcPath ) );
+        }
+
+        void Write( CPartialWriter & w )
+        {
+            w.Put( offset );
+            w.Put( length );
+            w.PutString( acSha256 );
+            w.PutString( awcPath );
+        }
+
         bool Same( EmbeddedImageEntry & entry )
         {
             return ( entry.length == length && !strcmp( entry.acSha256, acSha256 ) );
@@ -98,15 +171,15 @@ class EmbeddedImageEntry : public GenericEntry
         unsigned int Length() { return length; };
         WCHAR * Path() { return awcPath; };
     
-        static void PrintHeader()
+        static void PrintHeader( CReportOutput & out )
         {
-            printf( "   length     count sha256\n" );
-            printf( "   ------     ----- ------\n" );
+            out.Printf( "   length     count sha256\n" );
+            out.Printf( "   ------     ----- ------\n" );
         }
     
-        void PrintItem()
+        void PrintItem( CReportOutput & out )
         {
-            printf( "%9u %9zu %s %ws\n", length, Count(), acSha256, awcPath );
+            out.Printf( "%9u %9zu %s %ws\n", length, Count(), acSha256, awcPath );
         }
 };
 
@@ -120,6 +193,9 @@ class FocalLengthEntry : public GenericEntry
         {
             focalLength = fl;
         }
+
+        FocalLengthEntry( CPartialReader & r ) { focalLength = r.Get<unsigned int>(); }
+        void Write( CPartialWriter & w ) { w.Put( focalLength ); }
     
         bool Same( FocalLengthEntry & entry )
         {
@@ -140,15 +216,15 @@ class FocalLengthEntry : public GenericEntry
             return 0;
         } //EntryCompare
     
-        static void PrintHeader()
+        static void PrintHeader( CReportOutput & out )
         {
-            printf( "focal length        count\n" );
-            printf( "------------        -----\n" );
+            out.Printf( "focal length        count\n" );
+            out.Printf( "------------        -----\n" );
         }
     
-        void PrintItem()
+        void PrintItem( CReportOutput & out )
         {
-            printf( "%12u %12zu\n", focalLength, Count() );
+            out.Printf( "%12u %12zu\n", focalLength, Count() );
         }
 };
 
@@ -162,6 +238,9 @@ class FNumberEntry : public GenericEntry
         {
             fNumber = fn;
         }
+
+        FNumberEntry( CPartialReader & r ) { fNumber = r.Get<double>(); }
+        void Write( CPartialWriter & w ) { w.Put( fNumber ); }
     
         bool Same( FNumberEntry & entry )
         {
@@ -182,15 +261,15 @@ class FNumberEntry : public GenericEntry
             return 0;
         } //EntryCompare
     
-        static void PrintHeader()
+        static void PrintHeader( CReportOutput & out )
         {
-            printf( "F Number            count\n" );
-            printf( "------------        -----\n" );
+            out.Printf( "F Number            count\n" );
+            out.Printf( "------------        -----\n" );
         }
     
-        void PrintItem()
+        void PrintItem( CReportOutput & out )
         {
-            printf( "%12.1lf %12zu\n", fNumber, Count() );
+            out.Printf( "%12.1lf %12zu\n", fNumber, Count() );
         }
 };
 
@@ -204,6 +283,9 @@ class RatingEntry : public GenericEntry
         {
             rating = r;
         }
+
+        RatingEntry( CPartialReader & r ) { rating = r.Get<int>(); }
+        void Write( CPartialWriter & w ) { w.Put( rating ); }
     
         bool Same( RatingEntry & entry )
         {
@@ -224,15 +306,15 @@ class RatingEntry : public GenericEntry
             return 0;
         } //EntryCompare
     
-        static void PrintHeader()
+        static void PrintHeader( CReportOutput & out )
         {
-            printf( "rating              count\n" );
-            printf( "------------        -----\n" );
+            out.Printf( "rating              count\n" );
+            out.Printf( "------------        -----\n" );
         }
     
-        void PrintItem()
+        void PrintItem( CReportOutput & out )
         {
-            printf( "%12d %12zu\n", rating, Count() );
+            out.Printf( "%12d %12zu\n", rating, Count() );
         }
 };
 
@@ -244,12 +326,26 @@ class SerialNumberEntry : public GenericEntry
         char acSerialNumber[ MetadataBufferSize ];
     
     public:
-        SerialNumberEntry( char * pcMake, char * pcModel, char * pcSerialNumber )
+        SerialNumberEntry( const char * pcMake, const char * pcModel, const char * pcSerialNumber )
         {
             strcpy( acMake, pcMake );
             strcpy( acModel, pcModel );
             strcpy( acSerialNumber, pcSerialNumber );
         }
+
+        SerialNumberEntry( CPartialReader & r )
+        {
+            r.GetString( acMake, _countof( acMake ) );
+            r.GetString( acModel, _countof( acModel ) );
+            r.GetString( acSerialNumber, _countof( acSerialNumber ) );
+        }
+
+        void Write( CPartialWriter & w )
+        {
+            w.PutString( acMake );
+            w.PutString( acModel );
+            w.PutString( acSerialNumber );
+        }
     
         bool Same( SerialNumberEntry & entry )
         {
@@ -274,15 +370,15 @@ class SerialNumberEntry : public GenericEntry
             return diff;
         } //EntryCompare
     
-        static void PrintHeader()
+        static void PrintHeader( CReportOutput & out )
         {
-            printf( "make                           model                                            serial number                                             count\n" );
-            printf( "----                           -----                                            -------------                                             -----\n" );
+            out.Printf( "make                           model                                            serial number                                             count\n" );
+            out.Printf( "----                           -----                                            -------------                                             -----\n" );
         }
     
-        void PrintItem()
+        void PrintItem( CReportOutput & out )
         {
-            printf( "%-29s  %-47s  %-50s %12zu\n", acMake, acModel, acSerialNumber, Count() );
+            out.Printf( "%-29s  %-47s  %-50s %12zu\n", acMake, acModel, acSerialNumber, Count() );
         }
 };
 
@@ -293,11 +389,23 @@ class ModelEntry : public GenericEntry
         char acModel[ MetadataBufferSize ];
     
     public:
-        ModelEntry( char * pcMake, char * pcModel )
+        ModelEntry( const char * pcMake, const char * pcModel )
         {
             strcpy( acMake, pcMake );
             strcpy( acModel, pcModel );
         }
+
+        ModelEntry( CPartialReader & r )
+        {
+            r.GetString( acMake, _countof( acMake ) );
+            r.GetString( acModel, _countof( acModel ) );
+        }
+
+        void Write( CPartialWriter & w )
+        {
+            w.PutString( acMake );
+            w.PutString( acModel );
+        }
     
         bool Same( ModelEntry & entry )
         {
@@ -319,15 +427,73 @@ class ModelEntry : public GenericEntry
             return diff;
         } //EntryCompare
     
-        static void PrintHeader()
+        static void PrintHeader( CReportOutput & out )
         {
-            printf( "make                           model                                                   count\n" );
-            printf( "----                           -----                                                   -----\n" );
+            out.Printf( "make                           model                                                   count\n" );
+            out.Printf( "----                           -----                                                   -----\n" );
         }
     
-        void PrintItem()
+        void PrintItem( CReportOutput & out )
+        {
+            out.Printf( "%-29s  %-47s  %12zu\n", acMake, acModel, Count() );
+        }
+};
+
+// Images with the same dominant color and mean brightness, in 8 bands of 32
+
+class LookEntry : public GenericEntry
+{
+    private:
+        int color;
+        int brightness;
+
+    public:
+        LookEntry( int c, int b )
+        {
+            color = c;
+            brightness = b;
+        }
+
+        LookEntry( CPartialReader & r )
+        {
+            color = r.Get<int>();
+            brightness = r.Get<int>();
+        }
+
+        void Write( CPartialWriter & w )
+        {
+            w.Put( color );
+            w.Put( brightness );
+        }
+
+        bool Same( LookEntry & entry )
+        {
+            return ( color == entry.color && brightness == entry.brightness );
+        }
+
+        static int EntryCompare( const void * a, const void * b )
+        {
+            LookEntry *pa = (LookEntry *) a;
+            LookEntry *pb = (LookEntry *) b;
+
+            if ( pa->color != pb->color )
+                return ( pa->color > pb->color ) ? 1 : -1;
+
+            if ( pa->brightness != pb->brightness )
+                return ( pa->brightness > pb->brightness ) ? 1 : -1;
+
+            return 0;
+        } //EntryCompare
+
+        static void PrintHeader( CReportOutput & out )
+        {
+            out.Printf( "dominant color      brightness        count\n" );
+            out.Printf( "--------------      ----------        -----\n" );
+        }
+
+        void PrintItem( CReportOutput & out )
         {
-            printf( "%-29s  %-47s  %12zu\n", acMake, acModel, Count() );
+            out.Printf( "%-14s         %3d..%-3d %12zu\n", CDCJpeg::ColorName( color ), brightness * 32, brightness * 32 + 31, Count() );
         }
 };
 
@@ -336,6 +502,7 @@ template<class T> class CEntryTracker
     private:
         std::mutex g_mtx;
         vector<T> entries;
+        size_t nextId;
 
         void SortEntries( bool sortOnCount )
         {
@@ -346,13 +513,15 @@ template<class T> class CEntryTracker
         }
 
     public:
-        CEntryTracker() {}
+        CEntryTracker() : nextId( 0 ) {}
 
         size_t Count() { return entries.size(); }
 
         T & operator[] ( size_t i ) { return entries[ i ]; }
 
-        void AddOrUpdate( T & item )
+        // Returns the id of the entry that was added or updated. count is more than 1 when merging partial results
+
+        size_t AddOrUpdate( T & item, size_t count = 1 )
         {
             lock_guard<mutex> lock( g_mtx );
 
@@ -363,40 +532,249 @@ template<class T> class CEntryTracker
             {
                 if ( entries[i].Same( item ) )
                 {
-                    entries[ i ].IncrementCount();
-                    return;
+                    entries[ i ].IncrementCount( count );
+                    return entries[ i ].Id();
                 }
             }
 
+            item.SetCount( count );
+            item.SetId( nextId++ );
             entries.push_back( item );
+            return item.Id();
+        }
+
+        void Remove( T & item )
+        {
+            lock_guard<mutex> lock( g_mtx );
+
+            for ( int i = 0; i < entries.size(); i++ )
+            {
+                if ( entries[i].Same( item ) )
+                {
+                    if ( entries[ i ].Count() > 1 )
+                        entries[ i ].DecrementCount();
+                    else
+                        entries.erase( entries.begin() + i );
+
+                    return;
+                }
+            }
+        }
+
+        void Write( CPartialWriter & w )
+        {
+            lock_guard<mutex> lock( g_mtx );
+
+            w.Put( (ULONGLONG) entries.size() );
+
+            for ( size_t i = 0; i < entries.size(); i++ )
+            {
+                w.Put( (ULONGLONG) entries[ i ].Count() );
+                entries[ i ].Write( w );
+            }
+        }
+
+        // Adds the entries in a partial result to these
+
+        bool Read( CPartialReader & r )
+        {
+            ULONGLONG count = r.Get<ULONGLONG>();
+
+            for ( ULONGLONG i = 0; i < count && r.Ok(); i++ )
+            {
+                ULONGLONG entryCount = r.Get<ULONGLONG>();
+                T item( r );
+
+                if ( r.Ok() && 0 != entryCount )
+                    AddOrUpdate( item, (size_t) entryCount );
+            }
+
+            return r.Ok();
         }
 
         void PrintEntries( const char * entryType, bool sortOnCount = false )
+        {
+            CReportOutput out;
+            PrintEntries( out, entryType, sortOnCount );
+        }
+
+        // When the files are a sample, each row starts with the estimated count across all files and its 95% interval
+
+        void PrintEntries( CReportOutput & out, const char * entryType, bool sortOnCount = false, CStratifiedSample * pSample = NULL )
         {
             size_t fileCount = 0;
 
             for ( int i = 0; i < entries.size(); i++ )
                 fileCount += entries[ i ].Count();
 
-            printf( "found %Iu unique %s in %Iu files with that data\n", entries.size(), entryType, fileCount );
+            out.Printf( "found %Iu unique %s in %Iu files with that data\n", entries.size(), entryType, fileCount );
             SortEntries( sortOnCount );
 
-            T::PrintHeader();
+            if ( NULL == pSample )
+            {
+                T::PrintHeader( out );
+
+                for ( int i = 0; i < entries.size(); i++ )
+                {
+                    entries[i].PrintItem( out );
+                }
+
+                return;
+            }
+
+            string header;
+            CReportOutput headerOut( &header );
+            T::PrintHeader( headerOut );
+
+            size_t eol = header.find( '\n' );
+            out.Printf( "%10s  %22s  %s", "estimate", "95% interval", header.substr( 0, eol + 1 ).c_str() );
+            out.Printf( "%10s  %22s  %s", "--------", "------------", header.substr( eol + 1 ).c_str() );
 
             for ( int i = 0; i < entries.size(); i++ )
             {
-                entries[i].PrintItem();
+                double estimate, low, high;
+                pSample->Estimate( this, entries[ i ].Id(), estimate, low, high );
+                out.Printf( "%10.0lf  %10.0lf..%-10.0lf  ", estimate, low, high );
+                entries[i].PrintItem( out );
             }
         }
 };
 
+// Everything a scan accumulates. ProcessFile adds each file's data here.
+
+class CAggregates
+{
+    public:
+        CEntryTracker<SerialNumberEntry> bodies;
+        CEntryTracker<SerialNumberEntry> lenses;
+        CEntryTracker<FocalLengthEntry> focalLengths;
+        CEntryTracker<FNumberEntry> fNumbers;
+        CEntryTracker<RatingEntry> ratings;
+        CEntryTracker<ModelEntry> models;
+        CEntryTracker<ModelEntry> lensModels;
+        CEntryTracker<EmbeddedImageEntry> embeddedImages;
+        CEntryTracker<LookEntry> looks;
+        LONG hasImageCount;
+        LONG hasGPSCount;
+        LONG withAdobeEdits;
+        LONG withoutAdobeEdits;
+        CGeoIndex geoIndex;
+        CDuplicateFinder duplicates;
+        CExposureStats exposures;
+        CStratifiedSample * pSample;        // non-NULL when only a sample of the files is parsed
+
+        CAggregates( int geohashPrecision ) :
+            hasImageCount( 0 ), hasGPSCount( 0 ), withAdobeEdits( 0 ), withoutAdobeEdits( 0 ), geoIndex( geohashPrecision ), pSample( NULL ) {}
+
+        // Partial results hold the tables, exposure sketches, and counters, but not the GPS grid or duplicate candidates
+
+        void Write( CPartialWriter & w )
+        {
+            bodies.Write( w );
+            lenses.Write( w );
+            focalLengths.Write( w );
+            fNumbers.Write( w );
+            ratings.Write( w );
+            models.Write( w );
+            lensModels.Write( w );
+            embeddedImages.Write( w );
+            looks.Write( w );
+            exposures.Write( w );
+            w.Put( hasImageCount );
+            w.Put( hasGPSCount );
+            w.Put( withAdobeEdits );
+            w.Put( withoutAdobeEdits );
+        } //Write
+
+        bool Read( CPartialReader & r )
+        {
+            bodies.Read( r );
+            lenses.Read( r );
+            focalLengths.Read( r );
+            fNumbers.Read( r );
+            ratings.Read( r );
+            models.Read( r );
+            lensModels.Read( r );
+            embeddedImages.Read( r );
+            looks.Read( r );
+            exposures.Read( r );
+            hasImageCount += r.Get<LONG>();
+            hasGPSCount += r.Get<LONG>();
+            withAdobeEdits += r.Get<LONG>();
+            withoutAdobeEdits += r.Get<LONG>();
+
+            return r.Ok();
+        } //Read
+};
+
+struct ReportOptions
+{
+    bool sortOnCount;
+    bool verboseTracing;
+    bool oneThread;
+    bool createEmbeddedImages;
+    bool radiusQuery;
+    double queryLat, queryLon, queryKm;
+    bool countsOnly;        // the geohash grid isn't maintained incrementally, so print just the GPS count
+};
+
+// Watch mode needs to back out what a file added to the aggregates when the file changes or is removed.
+// When a FileContributions is passed to ProcessFile, it gets an undo action for each addition.
+
+typedef vector<function<void()>> FileContributions;
+
+// What else a file's additions update: undo actions in watch mode, and per-stratum tallies when sampling.
+
+struct FileTally
+{
+    FileContributions * pContributions;
+    CStratifiedSample * pSample;
+    size_t stratum;
+};
+
+template<class T> void Track( CEntryTracker<T> & tracker, T & item, FileTally & tally )
+{
+    size_t id = tracker.AddOrUpdate( item );
+
+    if ( NULL != tally.pContributions )
+        tally.pContributions->push_back( [&tracker, item] () mutable { tracker.Remove( item ); } );
+
+    if ( NULL != tally.pSample )
+        tally.pSample->Tally( &tracker, id, tally.stratum );
+} //Track
+
+void CountFile( LONG & counter, FileTally & tally )
+{
+    InterlockedIncrement( &counter );
+
+    if ( NULL != tally.pContributions )
+    {
+        LONG * pCounter = &counter;
+        tally.pContributions->push_back( [pCounter] () { InterlockedDecrement( pCounter ); } );
+    }
+
+    if ( NULL != tally.pSample )
+        tally.pSample->Tally( &counter, 0, tally.stratum );
+} //CountFile
+
 void Usage()
 {
     printf( "usage: aid [filename] /p:[rootpath] /e:[extesion] /a:X /m:[model] [/v]\n" );
+    printf( "       aid /b:[listfile] [/j:[journal]] [/f:X]\n" );
+    printf( "       aid /u:resume|rollback [/j:[journal]]\n" );
+    printf( "       aid /d:[socket] /p:[rootpath] /e:[extension] [/w:N]\n" );
+    printf( "       aid /q:[socket] \"request\"\n" );
+    printf( "       aid /merge:[partials] /s:X\n" );
+    printf( "       aid @[listfile] /a:X [/each]\n" );
     printf( "Aggregate Image Data\n" );
     printf( "       filename       Retrieves data of just one file. Can't be used with /p and /e.\n" );
+    printf( "       @listfile      Parse the files in the list, - for stdin, like those under /p. Paths are separated by newlines\n" );
+    printf( "                      or NULs; the list is UTF-8 or UTF-16 with a byte order mark. Not for /w.\n" );
     printf( "       /a:X           App Mode. Default is Serial Numbers\n" );
-    printf( "                          a   Adobe Edits\n" );
+    printf( "                          a   Adobe Edits, embedded or in .xmp sidecars next to RAW files\n" );
+    printf( "                          c   Color and brightness, from the DC coefficients of the preview or JPG\n" );
+    printf( "                          x   Exposure: ISO, shutter speed, and aperture percentiles per model and lens\n" );
+    printf( "                          d   Duplicate files\n" );
     printf( "                          e   Embedded Images (flac/mp3)\n" );
     printf( "                          f   Focal Lengths\n" );
     printf( "                          g   GPS data\n" );
@@ -405,21 +783,80 @@ void Usage()
     printf( "                          m   Models\n" );
     printf( "                          n   F Number\n" );
     printf( "                          s   Serial Numbers\n" );
-    printf( "                          r   Rating\n" );
+    printf( "                          r   Rating, embedded or in .xmp sidecars next to RAW files\n" );
+    printf( "       /background    Scan with very low I/O and memory priority so other apps on the machine keep their disk\n" );
+    printf( "                      time and cached data. /background:unbuffered also reads /a:c previews bypassing the cache.\n" );
+    printf( "       /budget:ms     Give up on files still being read or parsed after this many milliseconds. Default is none.\n" );
+    printf( "                      Files that fault, run out of time, or take over half of it (10 seconds with no budget)\n" );
+    printf( "                      are listed after the report, or written to the /quarantine file.\n" );
+    printf( "       /b:            Bulk update of ratings and rotation. Each line of the list file (- for stdin) is an action\n" );
+    printf( "                      then a path. Actions are 0-5 to set the rating, r to rotate right, l to rotate left.\n" );
     printf( "       /c             Used with /a:e, creates a file for each embedded image in the 'out' subdirectory.\n" );
+    printf( "       /d:            Daemon. Hold the metadata of files under /p in memory and answer requests on this Unix domain\n" );
+    printf( "                      socket. /p can list several roots separated with ;. Refreshes every /w:N seconds, default 300.\n" );
     printf( "       /e:            Specifies the file extension to include. Default is *\n" );
+    printf( "       /each          Print the results for each file as it's parsed, not just the report.\n" );
+    printf( "       /f:X           Used with /b and /u, when to flush file writes to disk. Default is f\n" );
+    printf( "                          f   after each File is updated\n" );
+    printf( "                          n   never; leave it to the OS (faster, not crash-safe)\n" );
+    printf( "       /g:N           Used with /a:g, geohash precision 1..12 for grouping locations. Default is 5 (about 5km cells).\n" );
+    printf( "       /j:            Used with /b and /u, the journal file. Default is aid-journal.txt\n" );
     printf( "       /m:            Used with /p and /e. The model substring must be in the EquipModel case insensitive.\n" );
+    printf( "       /merge:        Combine /partial files into one report. A ;-separated list; file names can have wildcards.\n" );
+    printf( "       /cpu:N         Parse at most N files at once. Default is the number of cores.\n" );
+    printf( "       /io:X          How many files to read at once, separately from parsing. Default is auto.\n" );
+    printf( "                          auto  tune between 1 and 64 by measuring throughput\n" );
+    printf( "                          hdd   1 or 2, and enumerate folders one at a time so the disk doesn't seek\n" );
+    printf( "                          ssd   tune between 4 and 64\n" );
+    printf( "                          net   tune between 8 and 128 for network shares\n" );
+    printf( "                          N     exactly N\n" );
+    printf( "       /order:X       The order files are parsed in. Default is path\n" );
+    printf( "                          path  by path\n" );
+    printf( "                          disk  by where the data is on disk. Use with /io:hdd for rotational disks\n" );
     printf( "       /o             Use One thread for parsing files, not parallelized. (enumeration uses many threads).\n" );
     printf( "       /p:            Specifies the root of the file system enumeration.\n" );
+    printf( "       /partial:      Write the tables and counts to this binary partial results file for /merge, not a report.\n" );
+    printf( "       /progress      Show files done, files/s, MB/s, errors, and time left on stderr while parsing, if it's a console.\n" );
+    printf( "       /quarantine:   Write the files that faulted, ran out of time, or were slow to this file with the reasons.\n" );
+    printf( "       /q:            Send a request to a /d daemon listening on this socket and print the response. Requests:\n" );
+    printf( "                          report X [count]  the table for /a:X (a f g i l m n r s), count sorts on count\n" );
+    printf( "                          files [k=v ...]   a row per file. filters: path make model serial lens rating focal fnumber gps\n" );
+    printf( "                          stats             snapshot size and age\n" );
+    printf( "                          refresh           rescan now, parsing only new and changed files\n" );
+    printf( "       /r:lat,lon,km  Used with /a:g, lists files within km kilometers of the latitude and longitude.\n" );
     printf( "       /s:X           Sort criteria. Default is App Mode setting /a\n" );
     printf( "                          c   Count of entries\n" );
-    printf( "       /v             Enable verbose tracing.\n" );
+    printf( "       /shard:i/n     Parse just shard i (0..n-1) of n, chosen by a hash of the path under /p. Not for /a:d.\n" );
+    printf( "       /sample:N[%%][,d]\n" );
+    printf( "                      Parse a random sample of N files (or N percent of them) and estimate the counts for all files\n" );
+    printf( "                      with 95%% confidence intervals. ,d stratifies by the folder under /p. Not for /a:d /a:e /a:x /w.\n" );
+    printf( "       /u:            Finish an interrupted /b bulk update from its journal: resume or rollback.\n" );
+    printf( "       /v[:L[,C]]     Enable verbose tracing, also to aid.txt. L is the level: 0 errors, 1 warnings, 2 info (default),\n" );
+    printf( "                      3 verbose. C is a hex mask of categories: 1 general, 2 parsing. Default is all.\n" );
+    printf( "       /w[:N]         Watch the /p folder after the scan, parsing only files that change and printing the\n" );
+    printf( "                      report every N seconds if anything changed. Default is 60. Not for /a:d /a:e /a:x.\n" );
+    printf( "       /z             Also look inside .zip and .tar files. Members are named archive|member. Not for /w.\n" );
     printf( "   examples:    aid c:\\pictures\\whitney.jpg\n" );
     printf( "                aid /p:c:\\pictures /e:jpg\n" );
     printf( "                aid /a:f /p:c:\\pictures /e:jpg\n" );
     printf( "                aid /p:c:\\pictures /e:dng /m:leica\n" );
     printf( "                aid /p:d:\\ /e:cr? /a:l /s:c\n" );
     printf( "                aid /p:d:\\ /e:rw2 /a:m /s:c\n" );
+    printf( "                aid /p:c:\\pictures /e:jpg /a:g /g:4 /s:c /r:47.6062,-122.3321,25\n" );
+    printf( "                aid /p:d:\\ingest /e:cr3 /a:l /s:c /w:300\n" );
+    printf( "                aid /p:d:\\ /e:* /a:l /s:c /sample:2%%,d\n" );
+    printf( "                aid /p:e:\\ /e:nef /a:f /io:hdd /order:disk\n" );
+    printf( "                aid /p:\\\\nas\\photos /e:* /a:c /s:c /background:unbuffered\n" );
+    printf( "                aid /b:ratings.txt /j:d:\\ratings-journal.txt\n" );
+    printf( "                aid /d:c:\\temp\\aid.sock /p:c:\\pictures;d:\\ingest /e:cr3 /w:600\n" );
+    printf( "                aid /q:c:\\temp\\aid.sock \"report l count\"\n" );
+    printf( "                aid /p:\\\\nas\\photos /e:* /a:l /shard:2/8 /partial:\\\\nas\\scan\\lenses-2.aidp\n" );
+    printf( "                aid /merge:\\\\nas\\scan\\lenses-*.aidp /s:c\n" );
+    printf( "                aid /p:c:\\backups /e:jpg /a:d /z\n" );
+    printf( "                aid @new-files.txt /a:s /each\n" );
+    printf( "                aid /p:c:\\pictures /e:jpg /a:c /s:c\n" );
+    printf( "                aid /p:c:\\pictures /e:* /a:x /s:c\n" );
+    printf( "                aid \"c:\\backups\\2019.zip|dcim\\img_0042.jpg\"\n" );
     printf( "   notes:       Supported extensions: JPG, TIF, RW2, RAF, ARW, .ORF, .CR2, .CR3, .NEF, .DNG, .FLAC, .MP3, etc.\n" );
     exit( 1 );
 } //Usage
@@ -502,9 +939,11 @@ void CreateEmbeddedImages( CEntryTracker<EmbeddedImageEntry> & embeddedImages )
             WCHAR * pwcExtension = wcsrchr( awc, L'.' );
             if ( 0 != pwcExtension && embeddedImages[i].Length() > 8 )
             {
-                CStream stream( embeddedImages[i].Path(), embeddedImages[i].Offset(), embeddedImages[i].Length() );
+                unique_ptr<CStream> stream( CArchive::Open( embeddedImages[i].Path(), embeddedImages[i].Offset(), embeddedImages[i].Length() ) );
                 vector<byte> vImage( embeddedImages[i].Length() );
-                stream.Read( vImage.data(), embeddedImages[i].Length() );
+
+                if ( stream )
+                    stream->Read( vImage.data(), embeddedImages[i].Length() );
 
                 unsigned long long header = 0;
                 memcpy( &header, vImage.data(), sizeof header );
@@ -524,27 +963,80 @@ void CreateEmbeddedImages( CEntryTracker<EmbeddedImageEntry> & embeddedImages )
     }
 } //CreateEmbeddedImages
 
+// Decodes just the DC coefficients of the embedded preview, or of the file itself if it has no preview.
+// Previews are much smaller than the full image and the 1/8 scale result is plenty to judge color.
+
+bool GetLook( CImageData & id, const WCHAR * pwcPath, CDCJpeg::Look & look )
+{
+    long long offset, length;
+    int orientation, width, height, fullWidth, fullHeight;
+
+    if ( !id.FindEmbeddedImage( pwcPath, &offset, &length, &orientation, &width, &height, &fullWidth, &fullHeight ) )
+    {
+        offset = 0;
+        length = _I64_MAX;
+    }
+
+    unique_ptr<CStream> stream( CArchive::Open( pwcPath, offset, length ) );
+    if ( !stream || !stream->Ok() || stream->Length() < 4 || stream->Length() > MaxLookBytes )
+        return false;
+
+    // Files with no preview are read whole, so make sure it's a JPG before reading up to MaxLookBytes
+
+    BYTE soi[ 2 ] = { 0, 0 };
+    if ( sizeof soi != stream->Read( soi, sizeof soi ) || 0xff != soi[ 0 ] || 0xd8 != soi[ 1 ] || !stream->Seek( 0 ) )
+        return false;
+
+    // Previews are read once, so in background mode large ones don't go through the cache
+
+    vector<BYTE> data( (size_t) stream->Length() );
+    ULONG cb = (ULONG) data.size();
+
+    if ( CBackgroundIo::Unbuffered() && cb >= CBackgroundIo::MinUnbufferedBytes && !CArchive::IsMemberPath( pwcPath ) )
+    {
+        if ( cb != CBackgroundIo::ReadUnbuffered( pwcPath, offset, data.data(), cb ) )
+            return false;
+    }
+    else if ( cb != stream->Read( data.data(), cb ) )
+        return false;
+
+    CDCJpeg jpg;
+    if ( !jpg.Decode( data.data(), data.size() ) )
+        return false;
+
+    jpg.Analyze( look );
+    return true;
+} //GetLook
+
+// The make is left out when the model already starts with it, e.g. Canon's "Canon EOS R5"
+
+void ExposureModelName( const char * pcMake, const char * pcModel, char * pc, size_t cc )
+{
+    size_t makeLen = strlen( pcMake );
+
+    if ( 0 == pcModel[ 0 ] )
+        strcpy_s( pc, cc, ( 0 == makeLen ) ? "(unknown)" : pcMake );
+    else if ( 0 == makeLen || !_strnicmp( pcModel, pcMake, makeLen ) )
+        strcpy_s( pc, cc, pcModel );
+    else
+        sprintf_s( pc, cc, "%s %s", pcMake, pcModel );
+} //ExposureModelName
+
 void ProcessFile(
     EnumAppMode appMode,
     bool verboseTracing,
     std::mutex & mtx,
     char * acCameraModel,
-    LONG & hasImageCount,
-    LONG & hasGPSCount,
     CStringArray & array,
     int i,
-    CEntryTracker<SerialNumberEntry> & bodies,
-    CEntryTracker<SerialNumberEntry> & lenses,
-    CEntryTracker<FocalLengthEntry> & focalLengths,
-    CEntryTracker<FNumberEntry> & fNumbers,
-    CEntryTracker<RatingEntry> & ratings,
-    CEntryTracker<ModelEntry> & models,
-    CEntryTracker<EmbeddedImageEntry> & embeddedImages,
-    LONG & withAdobeEdits,
-    LONG & withoutAdobeEdits )
+    CAggregates & agg,
+    FileContributions * pContributions = NULL,
+    CImageData * pPreloaded = NULL )
 {
-    unique_ptr<CImageData> id( new CImageData() );
+    unique_ptr<CImageData> owned( ( NULL == pPreloaded ) ? new CImageData() : NULL );
+    CImageData * id = ( NULL == pPreloaded ) ? owned.get() : pPreloaded;
     char acModel[ MetadataBufferSize ]; acModel[0] = 0;
+    FileTally tally = { pContributions, agg.pSample, ( NULL == agg.pSample ) ? 0 : agg.pSample->StratumOf( i ) };
 
     if ( EnumAppMode::modeAdobeEdits == appMode )
     {
@@ -557,9 +1049,9 @@ void ProcessFile(
         }
 
         if ( edits )
-            InterlockedIncrement( & withAdobeEdits );
+            CountFile( agg.withAdobeEdits, tally );
         else
-            InterlockedIncrement( & withoutAdobeEdits );
+            CountFile( agg.withoutAdobeEdits, tally );
     }
     else if ( EnumAppMode::modeSerialNumbers == appMode )
     {
@@ -597,13 +1089,13 @@ void ProcessFile(
             if ( 0 != acSerialNumber[ 0 ] )
             {
                 SerialNumberEntry body( acMake, acModel, acSerialNumber );
-                bodies.AddOrUpdate( body );
+                Track( agg.bodies, body, tally );
             }
 
             if ( 0 != acLensSerialNumber[ 0 ] )
             {
                 SerialNumberEntry lens( acLensMake, acLensModel, acLensSerialNumber );
-                lenses.AddOrUpdate( lens );
+                Track( agg.lenses, lens, tally );
             }
         }
     }
@@ -619,7 +1111,7 @@ void ProcessFile(
             unsigned int focalLen = (unsigned int) lroundl( flBestGuess );
 
             FocalLengthEntry fl( focalLen );
-            focalLengths.AddOrUpdate( fl );
+            Track( agg.focalLengths, fl, tally );
 
             if ( verboseTracing )
             {
@@ -644,7 +1136,7 @@ void ProcessFile(
         {
             fNumber = round( 10.0 * fNumber ) / 10.0;
             FNumberEntry fne( fNumber );
-            fNumbers.AddOrUpdate( fne );
+            Track( agg.fNumbers, fne, tally );
 
             if ( verboseTracing )
             {
@@ -663,7 +1155,7 @@ void ProcessFile(
         if ( found && ModelInName( acModel, acCameraModel ) )
         {
             RatingEntry re( rating );
-            ratings.AddOrUpdate( re );
+            Track( agg.ratings, re, tally );
 
             if ( verboseTracing )
             {
@@ -694,7 +1186,7 @@ void ProcessFile(
             if ( 0 != acModel[ 0 ] )
             {
                 ModelEntry model( acMake, acModel );
-                models.AddOrUpdate( model );
+                Track( agg.models, model, tally );
             }
         }
     }
@@ -723,7 +1215,7 @@ void ProcessFile(
             if ( 0 != acLensModel[ 0 ] )
             {
                 ModelEntry model( acLensMake, acLensModel );
-                models.AddOrUpdate( model );
+                Track( agg.lensModels, model, tally );
             }
         }
     }
@@ -734,7 +1226,13 @@ void ProcessFile(
         bool hasImage = id->FindEmbeddedImage( array[ i ], &offset, &length, &orientation, &width, &height, &fullWidth, &fullHeight );
 
         if ( hasImage )
-            InterlockedIncrement( &hasImageCount );
+            CountFile( agg.hasImageCount, tally );
+
+        if ( verboseTracing )
+        {
+            lock_guard<mutex> lock( mtx );
+            printf( "embedded image: %s in file %ws\n", hasImage ? "yes" : "no ", array[ i ] );
+        }
     }
     else if ( EnumAppMode::modeHasGPS == appMode )
     {
@@ -743,7 +1241,12 @@ void ProcessFile(
 
         if ( hasGPS )
         {
-            InterlockedIncrement( &hasGPSCount );
+            CountFile( agg.hasGPSCount, tally );
+
+            // the geohash grid can't remove points, so it isn't maintained in watch mode
+
+            if ( NULL == pContributions )
+                agg.geoIndex.Add( lat, lon, array[ i ] );
         
             if ( verboseTracing )
             {
@@ -754,6 +1257,92 @@ void ProcessFile(
             }
         }
     }
+    else if ( EnumAppMode::modeLooks == appMode )
+    {
+        CDCJpeg::Look look;
+
+        if ( GetLook( *id, array[ i ], look ) )
+        {
+            LookEntry entry( look.dominant, __min( 7, (int) look.meanLuma / 32 ) );
+            Track( agg.looks, entry, tally );
+
+            if ( verboseTracing )
+            {
+                lock_guard<mutex> lock( mtx );
+
+                printf( "%ws\n", array[ i ] );
+                printf( "    %s (%.0lf%%), mean luma %.1lf, %d x %d\n", CDCJpeg::ColorName( look.dominant ), look.dominantShare * 100.0,
+                        look.meanLuma, look.width, look.height );
+            }
+        }
+    }
+    else if ( EnumAppMode::modeExposure == appMode )
+    {
+        char acMake[ MetadataBufferSize ], acSerialNumber[ MetadataBufferSize ];
+        char acLensMake[ MetadataBufferSize ], acLensModel[ MetadataBufferSize ], acLensSerialNumber[ MetadataBufferSize ];
+        char acName[ 2 * MetadataBufferSize ];
+        int iso = 0;
+        double seconds = 0.0, fNumber = 0.0;
+
+        id->GetSerialNumbers( array[ i ], acMake, MetadataBufferSize, acModel, MetadataBufferSize, acSerialNumber, MetadataBufferSize,
+                              acLensMake, MetadataBufferSize, acLensModel, MetadataBufferSize, acLensSerialNumber, MetadataBufferSize );
+
+        if ( !ModelInName( acModel, acCameraModel ) )
+            return;
+
+        bool haveISO = id->FindISO( array[ i ], &iso );
+        bool haveTime = id->FindExposureTime( array[ i ], &seconds );
+        bool haveFNumber = id->FindFNumber( array[ i ], &fNumber );
+
+        if ( haveISO || haveTime || haveFNumber )
+        {
+            ExposureModelName( acMake, acModel, acName, _countof( acName ) );
+            agg.exposures.Add( acName, acLensModel, iso, seconds, fNumber );
+
+            if ( verboseTracing )
+            {
+                lock_guard<mutex> lock( mtx );
+
+                printf( "%ws\n", array[ i ] );
+                printf( "    %s, ISO %d, %.6lf sec, f/%.1lf\n", acName, iso, seconds, fNumber );
+            }
+        }
+    }
+    else if ( EnumAppMode::modeDuplicates == appMode )
+    {
+        unsigned long long size, lastWrite;
+        if ( !CArchive::GetFileInfo( array[ i ], size, lastWrite ) )
+            return;
+
+        char acMake[ MetadataBufferSize ]; acMake[0] = 0;
+        char acSerialNumber[ MetadataBufferSize ]; acSerialNumber[0] = 0;
+        char acLensMake[ MetadataBufferSize ]; acLensMake[0] = 0;
+        char acLensModel[ MetadataBufferSize ]; acLensModel[0] = 0;
+        char acLensSerialNumber[ MetadataBufferSize ]; acLensSerialNumber[0] = 0;
+        char acDateTime[ MetadataBufferSize ]; acDateTime[0] = 0;
+
+        id->GetSerialNumbers( array[ i ], acMake, MetadataBufferSize, acModel, MetadataBufferSize, acSerialNumber, MetadataBufferSize,
+                              acLensMake, MetadataBufferSize, acLensModel, MetadataBufferSize, acLensSerialNumber, MetadataBufferSize );
+
+        if ( !ModelInName( acModel, acCameraModel ) )
+            return;
+
+        if ( !id->FindDateTime( array[ i ], acDateTime, _countof( acDateTime ) ) )
+            acDateTime[ 0 ] = 0;
+
+        long long offset, length;
+        int orientation, width, height, fullWidth, fullHeight;
+        if ( !id->FindEmbeddedImage( array[ i ], &offset, &length, &orientation, &width, &height, &fullWidth, &fullHeight ) )
+            offset = length = 0;
+
+        agg.duplicates.Add( array[ i ], size, acMake, acModel, acSerialNumber, acDateTime, offset, length );
+
+        if ( verboseTracing )
+        {
+            lock_guard<mutex> lock( mtx );
+            printf( "%ws\n    size %llu, %s %s %s, %s, preview %lld %lld\n", array[ i ], size, acMake, acModel, acSerialNumber, acDateTime, offset, length );
+        }
+    }
     else if ( EnumAppMode::modeEmbedded == appMode )
     {
         long long offset, length;
@@ -762,7 +1351,7 @@ void ProcessFile(
 
         if ( hasImage )
         {
-            InterlockedIncrement( &hasImageCount );
+            CountFile( agg.hasImageCount, tally );
 
             if ( verboseTracing )
             {
@@ -770,11 +1359,11 @@ void ProcessFile(
                 printf( "has image, offset %I64d, length %I64d\n", offset, length );
             }
 
-            CStream stream( array[ i ], offset, length );
-            if ( stream.Ok() )
+            unique_ptr<CStream> stream( CArchive::Open( array[ i ], offset, length ) );
+            if ( stream && stream->Ok() )
             {
                 vector<byte> vImage( length );
-                stream.Read( vImage.data(), length );
+                stream->Read( vImage.data(), length );
 
                 char acSha256[ 65 ];
                 acSha256[ 64 ] = 0;
@@ -792,7 +1381,7 @@ void ProcessFile(
                     }
 
                     EmbeddedImageEntry entry( acSha256, offset, length, array[ i ] );
-                    embeddedImages.AddOrUpdate( entry );
+                    Track( agg.embeddedImages, entry, tally );
                 }
             }
             else
@@ -803,48 +1392,1168 @@ void ProcessFile(
     }
 } //ProcessFile
 
-const WCHAR * MusicExtensions[] =
-{
-    L"flac",
-    L"mp3",
-};
-
-extern "C" int __cdecl wmain( int argc, WCHAR * argv[] )
+void PrintCountEstimate( CReportOutput & out, CAggregates & agg, LONG & counter )
 {
-#if false
-    int tmpFlag = _CrtSetDbgFlag( _CRTDBG_REPORT_FLAG );
-    tmpFlag |= ( _CRTDBG_LEAK_CHECK_DF | _CRTDBG_CHECK_ALWAYS_DF | _CRTDBG_DELAY_FREE_MEM_DF );
-    _CrtSetDbgFlag( tmpFlag );
-#endif
-
-    Scoped_SE_Translator scoped_se_translator{ SE_trans_func };
+    if ( NULL == agg.pSample )
+        return;
 
-    if ( argc < 2 )
-        Usage();
+    double estimate, low, high;
+    agg.pSample->Estimate( &counter, 0, estimate, low, high );
+    out.Printf( "    estimated across all %zd files: %.0lf, 95%% interval %.0lf..%.0lf\n", agg.pSample->Population(), estimate, low, high );
+} //PrintCountEstimate
 
-    tracer.Enable( false, L"aid.txt", true );
+// Tables and counts go to out. The GPS grid, duplicate sets, and embedded image files are written to stdout.
 
-    std::mutex mtx;
-    bool verboseTracing = false;
-    EnumAppMode appMode = EnumAppMode::modeSerialNumbers;
+void PrintReport( EnumAppMode appMode, CAggregates & agg, ReportOptions & options, CReportOutput & out )
+{
+    if ( EnumAppMode::modeAdobeEdits == appMode )
+    {
+        out.Printf( "files with    adobe edits: %d\n", agg.withAdobeEdits );
+        PrintCountEstimate( out, agg, agg.withAdobeEdits );
+        out.Printf( "files without adobe edits: %d\n", agg.withoutAdobeEdits );
+        PrintCountEstimate( out, agg, agg.withoutAdobeEdits );
+    }
+    else if ( EnumAppMode::modeSerialNumbers == appMode )
+    {
+        agg.bodies.PrintEntries( out, "bodies", options.sortOnCount, agg.pSample );
 
-    static WCHAR awcFilename[ MAX_PATH + 1 ] = { 0 };
-    static WCHAR awcRootPath[ MAX_PATH + 1 ] = { 0 };
-    static WCHAR awcExtension[ MAX_PATH + 1 ] = { 0 };
-    static char acCameraModel[ 100 ] = { 0 };
-    const WCHAR * pwcRoot = 0;
-    const WCHAR * pwcFile = 0;
-    bool sortOnCount = false;
-    bool createEmbeddedImages = false;
-    bool oneThread = false;
+        out.Printf( "\n" );
 
-    int iArg = 1;
-    while ( iArg < argc )
+        agg.lenses.PrintEntries( out, "lenses", options.sortOnCount, agg.pSample );
+    }
+    else if ( EnumAppMode::modeFocalLengths == appMode )
     {
-        const WCHAR * pwcArg = argv[iArg];
-        WCHAR a0 = pwcArg[0];
+        agg.focalLengths.PrintEntries( out, "focal lengths", options.sortOnCount, agg.pSample );
+    }
+    else if ( EnumAppMode::modeFNumbers == appMode )
+    {
+        agg.fNumbers.PrintEntries( out, "FNumbers", options.sortOnCount, agg.pSample );
+    }
+    else if ( EnumAppMode::modeRatings == appMode )
+    {
+        agg.ratings.PrintEntries( out, "ratings", options.sortOnCount, agg.pSample );
+    }
+    else if ( EnumAppMode::modeModels == appMode )
+    {
+        agg.models.PrintEntries( out, "models", options.sortOnCount, agg.pSample );
+    }
+    else if ( EnumAppMode::modeLenses == appMode )
+    {
+        agg.lensModels.PrintEntries( out, "lenses", options.sortOnCount, agg.pSample );
+    }
+    else if ( EnumAppMode::modeLooks == appMode )
+    {
+        agg.looks.PrintEntries( out, "looks", options.sortOnCount, agg.pSample );
+    }
+    else if ( EnumAppMode::modeHasImage == appMode )
+    {
+        out.Printf( "files with an image: %d\n", agg.hasImageCount );
+        PrintCountEstimate( out, agg, agg.hasImageCount );
+    }
+    else if ( EnumAppMode::modeHasGPS == appMode )
+    {
+        out.Printf( "files with GPS coordinates: %d\n", agg.hasGPSCount );
+        PrintCountEstimate( out, agg, agg.hasGPSCount );
+        out.Printf( "\n" );
+
+        if ( options.countsOnly )
+            return;
+
+        agg.geoIndex.Merge();
+        agg.geoIndex.PrintCells( options.sortOnCount );
+
+        if ( agg.geoIndex.CellCount() > 0 )
+        {
+            printf( "\n" );
+            agg.geoIndex.PrintTopLocations( 10 );
+        }
+
+        if ( options.radiusQuery )
+        {
+            printf( "\n" );
+            agg.geoIndex.PrintWithin( options.queryLat, options.queryLon, options.queryKm );
+        }
+    }
+    else if ( EnumAppMode::modeExposure == appMode )
+    {
+        agg.exposures.Print( options.sortOnCount );
+    }
+    else if ( EnumAppMode::modeDuplicates == appMode )
+    {
+        agg.duplicates.Find( options.oneThread );
+        agg.duplicates.PrintSets( options.sortOnCount, options.verboseTracing );
+    }
+    else if ( EnumAppMode::modeEmbedded == appMode )
+    {
+        agg.embeddedImages.PrintEntries( out, "embedded images", options.sortOnCount );
+
+        out.Printf( "found %zd unique embedded images in %d files\n", agg.embeddedImages.Count(), agg.hasImageCount );
+
+        if ( options.createEmbeddedImages )
+            CreateEmbeddedImages( agg.embeddedImages );
+    }
+} //PrintReport
+
+void PrintReport( EnumAppMode appMode, CAggregates & agg, ReportOptions & options )
+{
+    CReportOutput out;
+    PrintReport( appMode, agg, options, out );
+} //PrintReport
+
+bool MatchesSpec( const WCHAR * pwcPath, const WCHAR * pwcSpec, WCHAR ** pExtensions, int cExtensions )
+{
+    const WCHAR * pwcName = wcsrchr( pwcPath, L'\\' );
+    pwcName = ( NULL == pwcName ) ? pwcPath : pwcName + 1;
+
+    if ( !PathMatchSpec( pwcName, pwcSpec ) )
+        return false;
+
+    if ( 0 == cExtensions )
+        return true;
+
+    const WCHAR * pwcExt = wcsrchr( pwcName, L'.' );
+    if ( NULL == pwcExt )
+        return false;
+
+    for ( int e = 0; e < cExtensions; e++ )
+        if ( !_wcsicmp( pwcExt + 1, pExtensions[ e ] ) )
+            return true;
+
+    return false;
+} //MatchesSpec
+
+// Adds the tracked images a changed or removed sidecar may belong to: img.cr2 for img.cr2.xmp, else img.* for img.xmp
+
+void SidecarImages( map<wstring, FileContributions> & tracked, const wstring & sidecar, vector<wstring> & images )
+{
+    wstring stem = sidecar.substr( 0, sidecar.size() - 4 );
+
+    if ( tracked.end() != tracked.find( stem ) )
+    {
+        images.push_back( stem );
+        return;
+    }
+
+    wstring prefix = stem + L".";
+
+    for ( auto it = tracked.lower_bound( prefix ); tracked.end() != it && 0 == it->first.compare( 0, prefix.size(), prefix ); it++ )
+        if ( NULL == wcspbrk( it->first.c_str() + prefix.size(), L".\\" ) && !CSidecars::EmbedsXMP( it->first.c_str() ) )
+            images.push_back( it->first );
+} //SidecarImages
+
+void BackOut( FileContributions & contributions )
+{
+    for ( size_t c = 0; c < contributions.size(); c++ )
+        contributions[ c ]();
+
+    contributions.clear();
+} //BackOut
+
+// After the initial scan, keep the aggregates current as files are created, modified, moved, and deleted.
+// Only changed files are parsed. The report is printed every reportSeconds if anything changed.
+// Changed files are parsed under the initial scan's guard, so a bad file is quarantined rather than ending the
+// watcher, and the quarantine list covers everything seen since the watcher started.
+// With useSidecars, a changed, added, or removed .xmp sidecar re-parses the images it belongs to, and each
+// re-parsed image's sidecar is looked up again on disk.
+
+void WatchFolder( EnumAppMode appMode, bool verboseTracing, std::mutex & mtx, char * acCameraModel, const WCHAR * pwcRoot,
+                  const WCHAR * pwcSpec, WCHAR ** pExtensions, int cExtensions, CStringArray & initial, CAggregates & agg,
+                  vector<FileContributions> & initialContributions, ReportOptions & options, int reportSeconds,
+                  CFileGuard & guard, const WCHAR * pwcQuarantine, CSidecars & sidecars, bool useSidecars )
+{
+    const DWORD quietMs = 2000;          // a burst is over when nothing has changed for this long
+    const DWORD maxBatchMs = 30000;      // but don't wait forever during a long import
+
+    map<wstring, FileContributions> tracked;
+
+    for ( size_t i = 0; i < initial.Count(); i++ )
+        tracked[ initial[ i ] ].swap( initialContributions[ i ] );
+
+    CFolderWatcher watcher( pwcRoot );
+    if ( !watcher.Ok() )
+    {
+        printf( "can't watch folder %ws\n", pwcRoot );
+        return;
+    }
+
+    printf( "\nwatching %ws for changes; reporting every %d seconds if anything changes. Press ctrl-c to exit\n", pwcRoot, reportSeconds );
+
+    vector<wstring> changedFiles, addedFolders, removed;
+    bool rescan = false;
+    bool dirty = false;
+    ULONGLONG lastReport = GetTickCount64();
+
+    do
+    {
+        ULONGLONG now = GetTickCount64();
+        ULONGLONG nextReport = lastReport + 1000 * (ULONGLONG) reportSeconds;
+        DWORD timeout = ( now >= nextReport ) ? 0 : (DWORD) ( nextReport - now );
+
+        if ( watcher.WaitForBatch( timeout, quietMs, maxBatchMs, changedFiles, addedFolders, removed, rescan ) )
+        {
+            CStringArray batch;
+            vector<wstring> sidecarImages;        // tracked images whose sidecars changed
+
+            if ( rescan )
+            {
+                // notifications were lost, so compare what's on disk with what's tracked
+
+                tracer.Trace( "directory change notifications overflowed; rescanning %ws\n", pwcRoot );
+                CEnumFolder enumerate( true, &batch, pExtensions, cExtensions );
+                enumerate.Enumerate( pwcRoot, pwcSpec );
+
+                map<wstring, bool> onDisk;
+                for ( size_t i = 0; i < batch.Count(); i++ )
+                    onDisk[ batch[ i ] ] = true;
+
+                for ( auto & it : tracked )
+                    if ( onDisk.end() == onDisk.find( it.first ) )
+                        removed.push_back( it.first );
+            }
+            else
+            {
+                for ( size_t i = 0; i < changedFiles.size(); i++ )
+                {
+                    if ( MatchesSpec( changedFiles[ i ].c_str(), pwcSpec, pExtensions, cExtensions ) )
+                        batch.Add( (WCHAR *) changedFiles[ i ].c_str() );
+                    else if ( useSidecars && CSidecars::IsSidecar( changedFiles[ i ].c_str() ) )
+                        SidecarImages( tracked, changedFiles[ i ], sidecarImages );
+                }
+
+                if ( useSidecars )
+                    for ( size_t r = 0; r < removed.size(); r++ )
+                        if ( CSidecars::IsSidecar( removed[ r ].c_str() ) )
+                            SidecarImages( tracked, removed[ r ], sidecarImages );
+
+                for ( size_t i = 0; i < addedFolders.size(); i++ )
+                {
+                    CEnumFolder enumerate( true, &batch, pExtensions, cExtensions );
+                    enumerate.Enumerate( addedFolders[ i ].c_str(), pwcSpec );
+                }
+            }
+
+            // back out files that are gone, including everything in removed folders
+
+            size_t removedCount = 0;
+
+            for ( size_t r = 0; r < removed.size(); r++ )
+            {
+                wstring folder = removed[ r ] + L"\\";
+                auto it = tracked.lower_bound( removed[ r ] );
+
+                while ( tracked.end() != it && ( it->first == removed[ r ] || 0 == it->first.compare( 0, folder.size(), folder ) ) )
+                {
+                    BackOut( it->second );
+                    sidecars.Remove( it->first.c_str() );
+                    it = tracked.erase( it );
+                    removedCount++;
+                }
+            }
+
+            // images whose sidecars changed are parsed again unless they're gone or already in the batch
+
+            if ( !sidecarImages.empty() )
+            {
+                set<wstring> inBatch;
+                for ( size_t i = 0; i < batch.Count(); i++ )
+                    inBatch.insert( batch[ i ] );
+
+                for ( size_t i = 0; i < sidecarImages.size(); i++ )
+                    if ( tracked.end() != tracked.find( sidecarImages[ i ] ) && inBatch.insert( sidecarImages[ i ] ).second )
+                        batch.Add( (WCHAR *) sidecarImages[ i ].c_str() );
+            }
+
+            if ( useSidecars )
+            {
+                for ( size_t i = 0; i < batch.Count(); i++ )
+                {
+                    WCHAR awcSidecar[ MAX_PATH + 1 ];
+
+                    if ( CSidecars::FindBeside( batch[ i ], awcSidecar, _countof( awcSidecar ) ) )
+                        sidecars.Add( batch[ i ], awcSidecar );
+                    else
+                        sidecars.Remove( batch[ i ] );
+                }
+            }
+
+            // back out what changed files contributed before, then parse them again
+
+            for ( size_t i = 0; i < batch.Count(); i++ )
+            {
+                auto it = tracked.find( batch[ i ] );
+                if ( tracked.end() != it )
+                    BackOut( it->second );
+            }
+
+            vector<FileContributions> batchContributions( batch.Count() );
+            size_t guardRecords = guard.Count();
+
+            auto parse = [&] ( int i )
+            {
+                CImageData id;
+                id.UseSidecar( batch[ i ], sidecars.Find( batch[ i ] ) );
+                guard.Start();
+                guard.Run( [&] () { ProcessFile( appMode, verboseTracing, mtx, acCameraModel, batch, i, agg, & batchContributions[ i ], &id ); } );
+                guard.Finish( batch[ i ] );
+            };
+
+            if ( options.oneThread )
+            {
+                for ( int i = 0; i < batch.Count(); i++ )
+                    parse( i );
+            }
+            else
+                parallel_for ( 0, (int) batch.Count(), parse );
+
+            for ( size_t i = 0; i < batch.Count(); i++ )
+                tracked[ batch[ i ] ].swap( batchContributions[ i ] );
+
+            if ( batch.Count() > 0 || removedCount > 0 )
+            {
+                printf( "parsed %zd changed files, removed %zd files; tracking %zd files\n", batch.Count(), removedCount, tracked.size() );
+                dirty = true;
+            }
+
+            if ( guard.Count() != guardRecords )
+            {
+                printf( "%zd files quarantined, %zd slow since the scan started\n", guard.Quarantined(), guard.Slow() );
+
+                if ( 0 != pwcQuarantine[0] )
+                    guard.Write( pwcQuarantine );
+                else
+                    guard.Print( guardRecords );
+            }
+        }
+
+        now = GetTickCount64();
+
+        if ( now >= ( lastReport + 1000 * (ULONGLONG) reportSeconds ) )
+        {
+            if ( dirty )
+            {
+                printf( "\n" );
+                PrintReport( appMode, agg, options );
+                dirty = false;
+            }
+
+            lastReport = now;
+        }
+    } while ( true );
+} //WatchFolder
+
+// Daemon mode (/d) holds the metadata of every file under the roots in memory and answers requests
+// over a Unix domain socket. Requests read an immutable snapshot, so they never wait on parsing.
+// A refresh builds the next snapshot on the refresh thread, re-parsing only files whose size or last
+// write time changed, then swaps it in. Report tables are rendered once when a snapshot is built.
+
+struct FileRecord
+{
+    wstring path;
+    unsigned long long size;
+    unsigned long long lastWrite;
+    string make, model, serial;
+    string lensMake, lensModel, lensSerial;
+    unsigned int focalLength;       // 0 if unknown
+    double fNumber;                 // 0.0 if unknown
+    int rating;                     // -1 if unknown
+    bool hasGPS;
+    double lat, lon;
+    bool adobeEdits;
+    bool hasImage;
+};
+
+struct DaemonReport
+{
+    char letter;                    // same letters as /a:
+    EnumAppMode appMode;
+};
+
+const DaemonReport DaemonReports[] =
+{
+    { 'a', modeAdobeEdits }, { 'f', modeFocalLengths }, { 'g', modeHasGPS }, { 'i', modeHasImage }, { 'l', modeLenses },
+    { 'm', modeModels }, { 'n', modeFNumbers }, { 'r', modeRatings }, { 's', modeSerialNumbers },
+};
+
+struct CSnapshot
+{
+    vector<FileRecord> records;                          // sorted by path
+    string reports[ _countof( DaemonReports ) ][ 2 ];   // rendered tables, sorted by value then by count
+    time_t built;
+    ULONGLONG buildMs;
+    LONG parsed;                                         // files parsed rather than reused from the prior snapshot
+};
+
+void ExtractRecord( FileRecord & rec )
+{
+    CImageData id;
+    const WCHAR * pwc = rec.path.c_str();
+
+    char acMake[ MetadataBufferSize ], acModel[ MetadataBufferSize ], acSerialNumber[ MetadataBufferSize ];
+    char acLensMake[ MetadataBufferSize ], acLensModel[ MetadataBufferSize ], acLensSerialNumber[ MetadataBufferSize ];
+
+    id.GetSerialNumbers( pwc, acMake, MetadataBufferSize, acModel, MetadataBufferSize, acSerialNumber, MetadataBufferSize,
+                         acLensMake, MetadataBufferSize, acLensModel, MetadataBufferSize, acLensSerialNumber, MetadataBufferSize );
+
+    rec.make = acMake;
+    rec.model = acModel;
+    rec.serial = acSerialNumber;
+    rec.lensMake = acLensMake;
+    rec.lensModel = acLensModel;
+    rec.lensSerial = acLensSerialNumber;
+
+    double focalLengthLens, flGuess, flComputed;
+    int flIn35mmFilm;
+    double flBestGuess = id.FindFocalLength( pwc, focalLengthLens, flIn35mmFilm, flGuess, flComputed, acModel, _countof( acModel ) );
+    rec.focalLength = (unsigned int) lroundl( flBestGuess );
+
+    if ( id.FindFNumber( pwc, &rec.fNumber ) )
+        rec.fNumber = round( 10.0 * rec.fNumber ) / 10.0;
+    else
+        rec.fNumber = 0.0;
+
+    char rating;
+    rec.rating = id.GetRating( pwc, rating ) ? rating : -1;
+
+    rec.hasGPS = id.GetGPSLocation( pwc, &rec.lat, &rec.lon );
+    if ( !rec.hasGPS )
+        rec.lat = rec.lon = 0.0;
+
+    rec.adobeEdits = id.HoldsAdobeEditsInXMP( pwc );
+
+    long long offset, length;
+    int orientation, width, height, fullWidth, fullHeight;
+    rec.hasImage = id.FindEmbeddedImage( pwc, &offset, &length, &orientation, &width, &height, &fullWidth, &fullHeight );
+} //ExtractRecord
+
+// Empties a record's metadata but keeps the path, size, and last write time that identify the file
+
+void ClearRecord( FileRecord & rec )
+{
+    rec.make.clear();
+    rec.model.clear();
+    rec.serial.clear();
+    rec.lensMake.clear();
+    rec.lensModel.clear();
+    rec.lensSerial.clear();
+    rec.focalLength = 0;
+    rec.fNumber = 0.0;
+    rec.rating = -1;
+    rec.hasGPS = false;
+    rec.lat = rec.lon = 0.0;
+    rec.adobeEdits = false;
+    rec.hasImage = false;
+} //ClearRecord
+
+// Adds a record to the aggregates the same way ProcessFile would for each app mode
+
+void AddRecord( const FileRecord & rec, char * acCameraModel, CAggregates & agg )
+{
+    char acModel[ MetadataBufferSize ];
+    strcpy_s( acModel, _countof( acModel ), rec.model.c_str() );
+
+    if ( !ModelInName( acModel, acCameraModel ) )
+        return;
+
+    FileTally tally = { NULL, NULL, 0 };
+
+    if ( 0 != rec.serial.size() )
+    {
+        SerialNumberEntry body( rec.make.c_str(), rec.model.c_str(), rec.serial.c_str() );
+        Track( agg.bodies, body, tally );
+    }
+
+    if ( 0 != rec.lensSerial.size() )
+    {
+        SerialNumberEntry lens( rec.lensMake.c_str(), rec.lensModel.c_str(), rec.lensSerial.c_str() );
+        Track( agg.lenses, lens, tally );
+    }
+
+    if ( 0 != rec.model.size() )
+    {
+        ModelEntry model( rec.make.c_str(), rec.model.c_str() );
+        Track( agg.models, model, tally );
+    }
+
+    if ( 0 != rec.lensModel.size() && ( 0 != rec.serial.size() || 0 != rec.lensSerial.size() ) )
+    {
+        ModelEntry model( rec.lensMake.c_str(), rec.lensModel.c_str() );
+        Track( agg.lensModels, model, tally );
+    }
+
+    if ( 0 != rec.focalLength )
+    {
+        FocalLengthEntry fl( rec.focalLength );
+        Track( agg.focalLengths, fl, tally );
+    }
+
+    if ( 0.0 != rec.fNumber )
+    {
+        FNumberEntry fne( rec.fNumber );
+        Track( agg.fNumbers, fne, tally );
+    }
+
+    if ( -1 != rec.rating )
+    {
+        RatingEntry re( rec.rating );
+        Track( agg.ratings, re, tally );
+    }
+
+    if ( rec.hasImage )
+        agg.hasImageCount++;
+
+    if ( rec.hasGPS )
+        agg.hasGPSCount++;
+
+    if ( rec.adobeEdits )
+        agg.withAdobeEdits++;
+    else
+        agg.withoutAdobeEdits++;
+} //AddRecord
+
+bool ContainsNoCase( const string & text, const string & lowerValue )
+{
+    string lower( text );
+    transform( lower.begin(), lower.end(), lower.begin(), ::tolower );
+    return ( string::npos != lower.find( lowerValue ) );
+} //ContainsNoCase
+
+// filter is name=value. Text fields match a case insensitive substring, numbers match exactly.
+
+bool RecordMatches( const FileRecord & rec, const string & name, const string & value, const wstring & wideValue )
+{
+    if ( "path" == name )
+        return ( wstring::npos != rec.path.find( wideValue ) );
+
+    if ( "make" == name )
+        return ContainsNoCase( rec.make, value );
+
+    if ( "model" == name )
+        return ContainsNoCase( rec.model, value );
+
+    if ( "serial" == name )
+        return ContainsNoCase( rec.serial, value ) || ContainsNoCase( rec.lensSerial, value );
+
+    if ( "lens" == name )
+        return ContainsNoCase( rec.lensModel, value );
+
+    if ( "rating" == name )
+        return ( rec.rating == atoi( value.c_str() ) );
+
+    if ( "focal" == name )
+        return ( rec.focalLength == (unsigned int) atoi( value.c_str() ) );
+
+    if ( "fnumber" == name )
+        return ( rec.fNumber == round( 10.0 * atof( value.c_str() ) ) / 10.0 );
+
+    if ( "gps" == name )
+        return ( rec.hasGPS == ( "yes" == value ) );
+
+    return false;
+} //RecordMatches
+
+class CMetadataDaemon
+{
+    private:
+        vector<wstring> roots;                   // full paths ending in a backslash
+        wstring spec;
+        char * pcCameraModel;
+        bool oneThread;
+        bool includeArchives;
+        DWORD refreshMs;
+        HANDLE hRefreshEvent;
+        std::mutex mtxSnapshot;
+        shared_ptr<const CSnapshot> snapshot;
+        CFileGuard guard;                        // lives as long as the daemon, so quarantined files accumulate
+        wstring quarantineFile;                  // rewritten after a build that quarantines files, if not empty
+
+        shared_ptr<const CSnapshot> Current()
+        {
+            lock_guard<mutex> lock( mtxSnapshot );
+            return snapshot;
+        } //Current
+
+        shared_ptr<const CSnapshot> Build( shared_ptr<const CSnapshot> previous )
+        {
+            ULONGLONG start = GetTickCount64();
+
+            CStringArray array;
+            CEnumFolder enumerate( true, &array, NULL, 0 );
+            enumerate.IncludeArchives( includeArchives );
+
+            for ( size_t r = 0; r < roots.size(); r++ )
+                enumerate.Enumerate( roots[ r ].c_str(), spec.c_str() );
+
+            shared_ptr<CSnapshot> snap = make_shared<CSnapshot>();
+            snap->records.resize( array.Count() );
+            snap->parsed = 0;
+
+            auto extract = [&] ( int i )
+            {
+                FileRecord & rec = snap->records[ i ];
+                rec.path = array[ i ];
+                if ( !CArchive::GetFileInfo( array[ i ], rec.size, rec.lastWrite ) )
+                    rec.size = rec.lastWrite = 0;
+
+                if ( previous )
+                {
+                    auto it = lower_bound( previous->records.begin(), previous->records.end(), rec,
+                                           [] ( const FileRecord & a, const FileRecord & b ) { return a.path < b.path; } );
+
+                    if ( it != previous->records.end() && it->path == rec.path && it->size == rec.size && it->lastWrite == rec.lastWrite )
+                    {
+                        rec = *it;
+                        return;
+                    }
+                }
+
+                // A quarantined file keeps an empty record. Its size and time are kept, so it isn't parsed
+                // again until it changes.
+
+                guard.Start();
+                guard.Run( [&] () { ExtractRecord( rec ); } );
+                if ( guard.Finish( array[ i ] ) )
+                    ClearRecord( rec );
+
+                InterlockedIncrement( &snap->parsed );
+            };
+
+            size_t guardRecords = guard.Count();
+
+            if ( oneThread )
+            {
+                for ( int i = 0; i < array.Count(); i++ )
+                    extract( i );
+            }
+            else
+                parallel_for ( 0, (int) array.Count(), extract, static_partitioner() );
+
+            sort( snap->records.begin(), snap->records.end(), [] ( const FileRecord & a, const FileRecord & b ) { return a.path < b.path; } );
+
+            if ( guard.Count() != guardRecords )
+            {
+                printf( "%zd files quarantined, %zd slow since the daemon started\n", guard.Quarantined(), guard.Slow() );
+
+                if ( 0 != quarantineFile.size() )
+                    guard.Write( quarantineFile.c_str() );
+                else
+                    guard.Print( guardRecords );
+            }
+
+            CAggregates agg( CGeoIndex::DefaultPrecision );
+
+            for ( size_t i = 0; i < snap->records.size(); i++ )
+                AddRecord( snap->records[ i ], pcCameraModel, agg );
+
+            for ( int r = 0; r < _countof( DaemonReports ); r++ )
+            {
+                for ( int byCount = 0; byCount < 2; byCount++ )
+                {
+                    ReportOptions options = { 0 != byCount, false, oneThread, false, false, 0.0, 0.0, 0.0, true };
+                    CReportOutput out( & snap->reports[ r ][ byCount ] );
+                    PrintReport( DaemonReports[ r ].appMode, agg, options, out );
+                }
+            }
+
+            time( &snap->built );
+            snap->buildMs = GetTickCount64() - start;
+            tracer.Trace( "built snapshot of %zd files in %llu ms, parsed %d\n", snap->records.size(), snap->buildMs, snap->parsed );
+            return snap;
+        } //Build
+
+        void RefreshLoop()
+        {
+            do
+            {
+                WaitForSingleObject( hRefreshEvent, refreshMs );
+
+                try
+                {
+                    shared_ptr<const CSnapshot> next = Build( Current() );
+
+                    lock_guard<mutex> lock( mtxSnapshot );
+                    snapshot = next;
+                }
+                catch ( ... )
+                {
+                    // keep serving the prior snapshot
+
+                    tracer.Trace( "exception refreshing the daemon snapshot\n" );
+                }
+            } while ( true );
+        } //RefreshLoop
+
+        void Answer( const string & request, string & response )
+        {
+            vector<string> words;
+            size_t start = 0;
+
+            do
+            {
+                start = request.find_first_not_of( " \t", start );
+                if ( string::npos == start )
+                    break;
+
+                size_t end = request.find_first_of( " \t", start );
+                words.push_back( request.substr( start, end - start ) );
+                start = end;
+            } while ( string::npos != start );
+
+            if ( 0 == words.size() )
+                words.push_back( "" );
+
+            shared_ptr<const CSnapshot> snap = Current();
+            CReportOutput out( &response );
+
+            if ( "report" == words[ 0 ] && words.size() >= 2 && 1 == words[ 1 ].size() )
+            {
+                bool byCount = ( words.size() >= 3 && "count" == words[ 2 ] );
+
+                for ( int r = 0; r < _countof( DaemonReports ); r++ )
+                {
+                    if ( DaemonReports[ r ].letter == tolower( words[ 1 ][ 0 ] ) )
+                    {
+                        response = snap->reports[ r ][ byCount ];
+                        return;
+                    }
+                }
+
+                out.Printf( "error: unknown report %s\n", words[ 1 ].c_str() );
+            }
+            else if ( "files" == words[ 0 ] )
+            {
+                vector<string> names, values;
+                vector<wstring> wideValues;
+
+                for ( size_t w = 1; w < words.size(); w++ )
+                {
+                    size_t eq = words[ w ].find( '=' );
+                    if ( string::npos == eq )
+                    {
+                        out.Printf( "error: filter %s isn't name=value\n", words[ w ].c_str() );
+                        return;
+                    }
+
+                    string value = words[ w ].substr( eq + 1 );
+                    transform( value.begin(), value.end(), value.begin(), ::tolower );
+
+                    WCHAR awcValue[ MAX_PATH ] = { 0 };
+                    MultiByteToWideChar( CP_UTF8, 0, value.c_str(), -1, awcValue, _countof( awcValue ) - 1 );
+
+                    names.push_back( words[ w ].substr( 0, eq ) );
+                    values.push_back( value );
+                    wideValues.push_back( awcValue );
+                }
+
+                size_t matches = 0;
+                out.Printf( "rating\tfocal\tfnumber\tmake\tmodel\tserial\tlens\tlatitude\tlongitude\tpath\n" );
+
+                for ( size_t i = 0; i < snap->records.size(); i++ )
+                {
+                    const FileRecord & rec = snap->records[ i ];
+                    bool match = true;
+
+                    for ( size_t f = 0; match && f < names.size(); f++ )
+                        match = RecordMatches( rec, names[ f ], values[ f ], wideValues[ f ] );
+
+                    if ( match )
+                    {
+                        out.Printf( "%d\t%u\t%.1lf\t%s\t%s\t%s\t%s\t", rec.rating, rec.focalLength, rec.fNumber, rec.make.c_str(),
+                                    rec.model.c_str(), rec.serial.c_str(), rec.lensModel.c_str() );
+
+                        if ( rec.hasGPS )
+                            out.Printf( "%lf\t%lf\t", rec.lat, rec.lon );
+                        else
+                            out.Printf( "\t\t" );
+
+                        out.Printf( "%ws\n", rec.path.c_str() );
+                        matches++;
+                    }
+                }
+
+                out.Printf( "%zd of %zd files\n", matches, snap->records.size() );
+            }
+            else if ( "stats" == words[ 0 ] )
+            {
+                char acBuilt[ 32 ];
+                ctime_s( acBuilt, sizeof acBuilt, &snap->built );
+
+                out.Printf( "files:      %zd\n", snap->records.size() );
+
+                for ( size_t r = 0; r < roots.size(); r++ )
+                    out.Printf( "root:       %ws\n", roots[ r ].c_str() );
+
+                out.Printf( "built:      %s", acBuilt );
+                out.Printf( "build time: %llu ms, %d files parsed\n", snap->buildMs, snap->parsed );
+                out.Printf( "quarantined: %zd files, %zd slow\n", guard.Quarantined(), guard.Slow() );
+            }
+            else if ( "refresh" == words[ 0 ] )
+            {
+                SetEvent( hRefreshEvent );
+                out.Printf( "refresh started\n" );
+            }
+            else
+                out.Printf( "error: unknown request. use report X [count], files [name=value ...], stats, or refresh\n" );
+        } //Answer
+
+    public:
+        CMetadataDaemon( vector<wstring> & rootPaths, const WCHAR * pwcSpec, char * acCameraModel, bool one, int refreshSeconds, bool archives,
+                         DWORD budgetMs, const WCHAR * pwcQuarantine ) :
+            roots( rootPaths ), spec( pwcSpec ), pcCameraModel( acCameraModel ), oneThread( one ), includeArchives( archives ),
+            refreshMs( refreshSeconds * 1000 ), guard( budgetMs, ( 0 == budgetMs ) ? 10000 : budgetMs / 2 ), quarantineFile( pwcQuarantine )
+        {
+            hRefreshEvent = CreateEvent( NULL, FALSE, FALSE, NULL );
+        } //CMetadataDaemon
+
+        bool Run( const WCHAR * pwcSocket )
+        {
+            if ( !CUnixSocket::Startup() )
+                return false;
+
+            snapshot = Build( NULL );
+            printf( "found %zd files in %llu ms\n", snapshot->records.size(), snapshot->buildMs );
+
+            thread refresher( [this] () { RefreshLoop(); } );
+            refresher.detach();
+
+            printf( "serving requests on %ws; refreshing every %u seconds. Press ctrl-c to exit\n", pwcSocket, refreshMs / 1000 );
+
+            return CUnixSocket::Serve( pwcSocket, [this] ( const string & request, string & response ) { Answer( request, response ); } );
+        } //Run
+}; //CMetadataDaemon
+
+// Sends one request to a daemon and writes the response to stdout
+
+bool QueryDaemon( const WCHAR * pwcSocket, const WCHAR * pwcRequest )
+{
+    if ( !CUnixSocket::Startup() )
+        return false;
+
+    char acRequest[ 4096 ];
+    if ( 0 == WideCharToMultiByte( CP_UTF8, 0, pwcRequest, -1, acRequest, sizeof acRequest, NULL, NULL ) )
+        return false;
+
+    string response;
+    if ( !CUnixSocket::Query( pwcSocket, acRequest, response ) )
+        return false;
+
+    fwrite( response.c_str(), 1, response.size(), stdout );
+    return true;
+} //QueryDaemon
+
+// Partial-result files start with a header identifying the app mode and shard
+
+const DWORD PartialSignature = 0x50444941;     // AIDP
+const DWORD PartialVersion = 3;
+
+// The shard of a file depends only on its path below the root, so every host with the same tree
+// partitions it the same way no matter where the tree is mounted. FNV-1a of the lowercase path.
+
+bool InShard( const WCHAR * pwcPath, size_t rootLen, int shard, int shardCount )
+{
+    unsigned long long hash = 14695981039346656037ull;
+
+    for ( const WCHAR * p = pwcPath + __min( rootLen, wcslen( pwcPath ) ); 0 != *p; p++ )
+    {
+        hash ^= towlower( *p );
+        hash *= 1099511628211ull;
+    }
+
+    return ( (int) ( hash % shardCount ) == shard );
+} //InShard
+
+bool WritePartial( const WCHAR * pwcPath, EnumAppMode appMode, int shard, int shardCount, size_t fileCount, CAggregates & agg )
+{
+    CPartialWriter w;
+    w.Put( PartialSignature );
+    w.Put( PartialVersion );
+    w.Put( (DWORD) appMode );
+    w.Put( (DWORD) shard );
+    w.Put( (DWORD) shardCount );
+    w.Put( (ULONGLONG) fileCount );
+    agg.Write( w );
+
+    bool ok = w.Save( pwcPath );
+
+    if ( ok )
+        printf( "wrote partial results for shard %d of %d to %ws\n", shard, shardCount, pwcPath );
+    else
+        printf( "can't write partial results to %ws, error %d\n", pwcPath, GetLastError() );
+
+    return ok;
+} //WritePartial
+
+// Expands a ;-separated list of partial-result files. Entries can have wildcards in the file name.
+
+void ExpandPartialPaths( const wstring & list, vector<wstring> & paths )
+{
+    size_t start = 0;
+
+    do
+    {
+        size_t end = list.find( L';', start );
+        wstring entry = list.substr( start, ( wstring::npos == end ) ? wstring::npos : end - start );
+
+        if ( 0 != entry.size() )
+        {
+            WCHAR awcFull[ MAX_PATH + 1 ];
+            _wfullpath( awcFull, entry.c_str(), _countof( awcFull ) );
+
+            if ( NULL == wcspbrk( awcFull, L"*?" ) )
+                paths.push_back( awcFull );
+            else
+            {
+                WCHAR * pwcName = wcsrchr( awcFull, L'\\' );
+                wstring folder( awcFull, ( NULL == pwcName ) ? 0 : pwcName + 1 - awcFull );
+
+                WIN32_FIND_DATA fd;
+                HANDLE hFind = FindFirstFile( awcFull, &fd );
+
+                if ( INVALID_HANDLE_VALUE != hFind )
+                {
+                    do
+                    {
+                        if ( 0 == ( fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY ) )
+                            paths.push_back( folder + fd.cFileName );
+                    } while ( FindNextFile( hFind, &fd ) );
+
+                    FindClose( hFind );
+                }
+            }
+        }
+
+        start = ( wstring::npos == end ) ? wstring::npos : end + 1;
+    } while ( wstring::npos != start );
+
+    sort( paths.begin(), paths.end() );
+} //ExpandPartialPaths
+
+// Reads the paths in a list file, or stdin for -. Paths are separated by newlines or NULs so the output of
+// tools like find -print0 works. Paths are used as they are, with no _wstat or _wfullpath, since lists can be long.
+
+bool LoadFileList( const WCHAR * pwcList, CStringArray & array )
+{
+    FILE * fp = NULL;
+
+    if ( !wcscmp( pwcList, L"-" ) )
+    {
+        _setmode( _fileno( stdin ), _O_BINARY );
+        fp = stdin;
+    }
+    else
+        fp = _wfopen( pwcList, L"rb" );
+
+    if ( NULL == fp )
+    {
+        printf( "can't open list file %ws\n", pwcList );
+        return false;
+    }
+
+    vector<char> bytes;
+    static char buffer[ 64 * 1024 ];
+    size_t cb;
+
+    while ( 0 != ( cb = fread( buffer, 1, sizeof buffer, fp ) ) )
+        bytes.insert( bytes.end(), buffer, buffer + cb );
+
+    if ( stdin != fp )
+        fclose( fp );
+
+    wstring text;
+
+    if ( bytes.size() >= 2 && 0xff == (BYTE) bytes[ 0 ] && 0xfe == (BYTE) bytes[ 1 ] )
+        text.assign( (WCHAR *) ( bytes.data() + 2 ), ( bytes.size() - 2 ) / sizeof( WCHAR ) );
+    else
+    {
+        size_t skip = ( bytes.size() >= 3 && !memcmp( bytes.data(), "\xef\xbb\xbf", 3 ) ) ? 3 : 0;
+        int cc = (int) ( bytes.size() - skip );
+
+        // UTF-8 never needs more WCHARs than bytes. Embedded NULs are converted since the length is given.
+
+        if ( cc > 0 )
+        {
+            text.resize( cc );
+            text.resize( MultiByteToWideChar( CP_UTF8, 0, bytes.data() + skip, cc, &text[ 0 ], cc ) );
+        }
+    }
+
+    size_t start = 0;
+    size_t tooLong = 0;
+
+    for ( size_t i = 0; i <= text.size(); i++ )
+    {
+        if ( i < text.size() && 0 != text[ i ] && L'\n' != text[ i ] && L'\r' != text[ i ] )
+            continue;
+
+        if ( i > start )
+        {
+            if ( ( i - start ) > MAX_PATH )
+                tooLong++;
+            else
+            {
+                if ( i < text.size() )
+                    text[ i ] = 0;
+
+                array.Add( &text[ start ] );
+            }
+        }
+
+        start = i + 1;
+    }
+
+    if ( 0 != tooLong )
+        printf( "skipped %zd paths in the list longer than %d characters\n", tooLong, MAX_PATH );
+
+    return true;
+} //LoadFileList
+
+// Combines partial results into agg. All partials must be from the same app mode and shard count.
+// Missing and repeated shards are reported since the totals would be wrong.
+
+bool MergePartials( vector<wstring> & paths, EnumAppMode & appMode, CAggregates & agg )
+{
+    DWORD mode = 0, shardCount = 0;
+    vector<int> seen;
+    ULONGLONG fileCount = 0;
+
+    for ( size_t i = 0; i < paths.size(); i++ )
+    {
+        CPartialReader r;
+        if ( !r.Load( paths[ i ].c_str() ) )
+        {
+            printf( "can't read partial results %ws\n", paths[ i ].c_str() );
+            return false;
+        }
+
+        DWORD signature = r.Get<DWORD>();
+        DWORD version = r.Get<DWORD>();
+        DWORD fileMode = r.Get<DWORD>();
+        DWORD shard = r.Get<DWORD>();
+        DWORD fileShardCount = r.Get<DWORD>();
+        ULONGLONG files = r.Get<ULONGLONG>();
+
+        if ( PartialSignature != signature || PartialVersion != version || !r.Ok() || shard >= fileShardCount ||
+             fileMode > (DWORD) EnumAppMode::modeExposure )
+        {
+            printf( "%ws isn't a partial results file from this version of aid\n", paths[ i ].c_str() );
+            return false;
+        }
+
+        if ( 0 == i )
+        {
+            mode = fileMode;
+            shardCount = fileShardCount;
+            seen.resize( shardCount );
+        }
+        else if ( fileMode != mode || fileShardCount != shardCount )
+        {
+            printf( "%ws is from a different app mode or shard count than %ws\n", paths[ i ].c_str(), paths[ 0 ].c_str() );
+            return false;
+        }
+
+        if ( !agg.Read( r ) || !r.AtEnd() )
+        {
+            printf( "partial results file %ws is corrupt\n", paths[ i ].c_str() );
+            return false;
+        }
+
+        seen[ shard ]++;
+        fileCount += files;
+    }
+
+    if ( 0 == paths.size() )
+    {
+        printf( "no partial results files found\n" );
+        return false;
+    }
+
+    appMode = (EnumAppMode) mode;
+    printf( "merged %zd partial results covering %llu files\n", paths.size(), fileCount );
+
+    for ( DWORD s = 0; s < shardCount; s++ )
+    {
+        if ( 0 == seen[ s ] )
+            printf( "warning: shard %u of %u is missing\n", s, shardCount );
+        else if ( seen[ s ] > 1 )
+            printf( "warning: shard %u of %u was merged %d times\n", s, shardCount, seen[ s ] );
+    }
+
+    printf( "\n" );
+    return true;
+} //MergePartials
+
+const WCHAR * MusicExtensions[] =
+{
+    L"flac",
+    L"mp3",
+};
+
+extern "C" int __cdecl wmain( int argc, WCHAR * argv[] )
+{
+#if false
+    int tmpFlag = _CrtSetDbgFlag( _CRTDBG_REPORT_FLAG );
+    tmpFlag |= ( _CRTDBG_LEAK_CHECK_DF | _CRTDBG_CHECK_ALWAYS_DF | _CRTDBG_DELAY_FREE_MEM_DF );
+    _CrtSetDbgFlag( tmpFlag );
+#endif
+
+    Scoped_SE_Translator scoped_se_translator{ SE_trans_func };
+
+    if ( argc < 2 )
+        Usage();
+
+    tracer.Enable( false, L"aid.txt", true );
+
+    std::mutex mtx;
+    bool verboseTracing = false;
+    int traceLevel = CDJLTrace::TraceInfo;
+    unsigned int traceCategories = 0xffffffff;
+    EnumAppMode appMode = EnumAppMode::modeSerialNumbers;
+
+    static WCHAR awcFilename[ MAX_PATH + 1 ] = { 0 };
+    static WCHAR awcFileList[ MAX_PATH + 1 ] = { 0 };
+    bool eachFile = false;
+    bool showProgress = false;
+    static WCHAR awcRootPath[ MAX_PATH + 1 ] = { 0 };
+    static WCHAR awcExtension[ MAX_PATH + 1 ] = { 0 };
+    static char acCameraModel[ 100 ] = { 0 };
+    const WCHAR * pwcRoot = 0;
+    const WCHAR * pwcFile = 0;
+    bool sortOnCount = false;
+    bool createEmbeddedImages = false;
+    bool oneThread = false;
+    int geohashPrecision = CGeoIndex::DefaultPrecision;
+    bool radiusQuery = false;
+    double queryLat = 0.0, queryLon = 0.0, queryKm = 0.0;
+    static WCHAR awcBulkList[ MAX_PATH + 1 ] = { 0 };
+    static WCHAR awcJournal[ MAX_PATH + 1 ] = { 0 };
+    CBulkMetadataWriter::FlushPolicy flushPolicy = CBulkMetadataWriter::flushEachFile;
+    bool recoverBulk = false;
+    bool rollbackBulk = false;
+    bool watch = false;
+    int watchSeconds = 60;
+    bool includeArchives = false;
+    CIoScheduler::Settings ioSettings;
+    CIoScheduler::ParseSettings( L"auto", ioSettings );
+    int parseThreads = __max( 1, (int) thread::hardware_concurrency() );
+    bool diskOrder = false;
+    size_t sampleCount = 0;
+    double samplePercent = 0.0;
+    bool sampleByFolder = false;
+    int shard = 0;
+    int shardCount = 0;
+    static WCHAR awcPartial[ MAX_PATH + 1 ] = { 0 };
+    wstring mergeList;
+    static WCHAR awcDaemonSocket[ MAX_PATH + 1 ] = { 0 };
+    static WCHAR awcQuerySocket[ MAX_PATH + 1 ] = { 0 };
+    static WCHAR awcQuarantine[ MAX_PATH + 1 ] = { 0 };
+    DWORD budgetMs = 0;
 
-        if ( ( L'-' == a0 ) || ( L'/' == a0 ) )
+    int iArg = 1;
+    while ( iArg < argc )
+    {
+        const WCHAR * pwcArg = argv[iArg];
+        WCHAR a0 = pwcArg[0];
+
+        if ( ( ( L'-' == a0 ) || ( L'/' == a0 ) ) && ( 0 != pwcArg[1] ) )
         {
            WCHAR a1 = towlower( pwcArg[1] );
 
@@ -859,6 +2568,8 @@ extern "C" int __cdecl wmain( int argc, WCHAR * argv[] )
                    appMode = EnumAppMode::modeSerialNumbers;
                else if ( L'a' == mode )
                    appMode = EnumAppMode::modeAdobeEdits;
+               else if ( L'd' == mode )
+                   appMode = EnumAppMode::modeDuplicates;
                else if ( L'e' == mode )
                    appMode = EnumAppMode::modeEmbedded;
                else if ( L'f' == mode )
@@ -875,11 +2586,124 @@ extern "C" int __cdecl wmain( int argc, WCHAR * argv[] )
                    appMode = EnumAppMode::modeLenses;
                else if ( L'r' == mode )
                    appMode = EnumAppMode::modeRatings;
+               else if ( L'c' == mode )
+                   appMode = EnumAppMode::modeLooks;
+               else if ( L'x' == mode )
+                   appMode = EnumAppMode::modeExposure;
                else
                    Usage();
            }
+           else if ( !_wcsicmp( pwcArg + 1, L"background" ) )
+               CBackgroundIo::Enabled() = true;
+           else if ( !_wcsicmp( pwcArg + 1, L"background:unbuffered" ) )
+               CBackgroundIo::Enabled() = CBackgroundIo::Unbuffered() = true;
+           else if ( !_wcsnicmp( pwcArg + 1, L"budget:", 7 ) )
+           {
+               budgetMs = (DWORD) _wtoi( pwcArg + 8 );
+
+               if ( 0 == budgetMs )
+                   Usage();
+           }
+           else if ( L'b' == a1 )
+           {
+               if ( L':' != pwcArg[2] || 0 == pwcArg[3] )
+                   Usage();
+
+               wcscpy_s( awcBulkList, _countof( awcBulkList ), pwcArg + 3 );
+           }
+           else if ( !_wcsnicmp( pwcArg + 1, L"cpu:", 4 ) )
+           {
+               parseThreads = _wtoi( pwcArg + 5 );
+               if ( parseThreads < 1 || parseThreads > 1024 )
+                   Usage();
+           }
            else if ( L'c' == a1 )
                createEmbeddedImages = true;
+           else if ( L'd' == a1 )
+           {
+               if ( L':' != pwcArg[2] || 0 == pwcArg[3] )
+                   Usage();
+
+               wcscpy_s( awcDaemonSocket, _countof( awcDaemonSocket ), pwcArg + 3 );
+           }
+           else if ( L'f' == a1 )
+           {
+               if ( L':' != pwcArg[2] )
+                   Usage();
+
+               WCHAR mode = tolower( pwcArg[3] );
+
+               if ( L'f' == mode )
+                   flushPolicy = CBulkMetadataWriter::flushEachFile;
+               else if ( L'n' == mode )
+                   flushPolicy = CBulkMetadataWriter::flushNone;
+               else
+                   Usage();
+           }
+           else if ( !_wcsnicmp( pwcArg + 1, L"quarantine:", 11 ) )
+           {
+               if ( 0 == pwcArg[ 12 ] )
+                   Usage();
+
+               _wfullpath( awcQuarantine, pwcArg + 12, _countof( awcQuarantine ) );
+           }
+           else if ( L'q' == a1 )
+           {
+               if ( L':' != pwcArg[2] || 0 == pwcArg[3] )
+                   Usage();
+
+               wcscpy_s( awcQuerySocket, _countof( awcQuerySocket ), pwcArg + 3 );
+           }
+           else if ( L'j' == a1 )
+           {
+               if ( L':' != pwcArg[2] || 0 == pwcArg[3] )
+                   Usage();
+
+               wcscpy_s( awcJournal, _countof( awcJournal ), pwcArg + 3 );
+           }
+           else if ( L'u' == a1 )
+           {
+               if ( L':' != pwcArg[2] )
+                   Usage();
+
+               if ( !_wcsicmp( pwcArg + 3, L"resume" ) )
+                   rollbackBulk = false;
+               else if ( !_wcsicmp( pwcArg + 3, L"rollback" ) )
+                   rollbackBulk = true;
+               else
+                   Usage();
+
+               recoverBulk = true;
+           }
+           else if ( !_wcsnicmp( pwcArg + 1, L"sample:", 7 ) )
+           {
+               WCHAR * pwcEnd = NULL;
+               double n = wcstod( pwcArg + 8, &pwcEnd );
+
+               if ( n <= 0.0 || pwcEnd == pwcArg + 8 )
+                   Usage();
+
+               if ( L'%' == *pwcEnd )
+               {
+                   if ( n >= 100.0 )
+                       Usage();
+
+                   samplePercent = n;
+                   pwcEnd++;
+               }
+               else
+                   sampleCount = (size_t) n;
+
+               if ( !_wcsicmp( pwcEnd, L",d" ) )
+                   sampleByFolder = true;
+               else if ( 0 != *pwcEnd )
+                   Usage();
+           }
+           else if ( !_wcsnicmp( pwcArg + 1, L"shard:", 6 ) )
+           {
+               if ( 2 != swscanf_s( pwcArg + 7, L"%d/%d", &shard, &shardCount ) || shardCount < 1 || shard < 0 || shard >= shardCount )
+                   Usage();
+           }
            else if ( L's' == a1 )
            {
                if ( L':' != pwcArg[2] )
@@ -892,10 +2716,77 @@ extern "C" int __cdecl wmain( int argc, WCHAR * argv[] )
                else
                    Usage();
            }
+           else if ( L'g' == a1 )
+           {
+               if ( L':' != pwcArg[2] )
+                   Usage();
+
+               geohashPrecision = _wtoi( pwcArg + 3 );
+               if ( geohashPrecision < 1 || geohashPrecision > CGeoIndex::MaxPrecision )
+                   Usage();
+           }
+           else if ( L'r' == a1 )
+           {
+               if ( L':' != pwcArg[2] )
+                   Usage();
+
+               if ( 3 != swscanf_s( pwcArg + 3, L"%lf,%lf,%lf", &queryLat, &queryLon, &queryKm ) ||
+                    !CGeoIndex::ValidCoordinate( queryLat, queryLon ) || queryKm <= 0.0 )
+                   Usage();
+
+               radiusQuery = true;
+           }
            else if ( L'v' == a1 )
+           {
                verboseTracing = TRUE;
+
+               if ( L':' == pwcArg[2] )
+               {
+                   int fields = swscanf_s( pwcArg + 3, L"%d,%x", &traceLevel, &traceCategories );
+                   if ( fields < 1 || traceLevel < CDJLTrace::TraceError || traceLevel > CDJLTrace::TraceVerbose )
+                       Usage();
+               }
+           }
+           else if ( L'w' == a1 )
+           {
+               watch = true;
+
+               if ( L':' == pwcArg[2] )
+               {
+                   watchSeconds = _wtoi( pwcArg + 3 );
+                   if ( watchSeconds <= 0 )
+                       Usage();
+               }
+               else if ( 0 != pwcArg[2] )
+                   Usage();
+           }
+           else if ( !_wcsnicmp( pwcArg + 1, L"io:", 3 ) )
+           {
+               if ( !CIoScheduler::ParseSettings( pwcArg + 4, ioSettings ) )
+                   Usage();
+           }
+           else if ( !_wcsnicmp( pwcArg + 1, L"order:", 6 ) )
+           {
+               if ( !_wcsicmp( pwcArg + 7, L"disk" ) )
+                   diskOrder = true;
+               else if ( !_wcsicmp( pwcArg + 7, L"path" ) )
+                   diskOrder = false;
+               else
+                   Usage();
+           }
            else if ( L'o' == a1 )
                oneThread = TRUE;
+           else if ( L'z' == a1 )
+               includeArchives = true;
+           else if ( !_wcsnicmp( pwcArg + 1, L"partial:", 8 ) )
+           {
+               if ( 0 == pwcArg[ 9 ] )
+                   Usage();
+
+               _wfullpath( awcPartial, pwcArg + 9, _countof( awcPartial ) );
+           }
+           else if ( !_wcsicmp( pwcArg + 1, L"progress" ) )
+               showProgress = true;
            else if ( L'p' == a1 )
            {
                if ( ( 0 != awcRootPath[ 0 ] ) ||
@@ -905,6 +2796,8 @@ extern "C" int __cdecl wmain( int argc, WCHAR * argv[] )
                wcscpy( awcRootPath, pwcArg + 3 );
                pwcRoot = pwcArg + 3;
            }
+           else if ( !_wcsicmp( pwcArg + 1, L"each" ) )
+               eachFile = true;
            else if ( L'e' == a1 )
            {
                if ( 0 != awcExtension[0] )
@@ -917,6 +2810,16 @@ extern "C" int __cdecl wmain( int argc, WCHAR * argv[] )
 
                wcscpy( awcExtension, pwcExt );
            }
+           else if ( !_wcsnicmp( pwcArg + 1, L"merge:", 6 ) )
+           {
+               if ( 0 == pwcArg[ 7 ] )
+                   Usage();
+
+               if ( 0 != mergeList.size() )
+                   mergeList += L';';
+
+               mergeList += pwcArg + 7;
+           }
            else if ( L'm' == a1 )
            {
                if ( 0 != acCameraModel[0] )
@@ -932,6 +2835,13 @@ extern "C" int __cdecl wmain( int argc, WCHAR * argv[] )
                Usage();
            }
         }
+        else if ( L'@' == a0 || !wcscmp( pwcArg, L"-" ) )
+        {
+            if ( 0 != awcFileList[ 0 ] || ( L'@' == a0 && 0 == pwcArg[ 1 ] ) )
+                Usage();
+
+            wcscpy( awcFileList, ( L'@' == a0 ) ? pwcArg + 1 : pwcArg );
+        }
         else
         {
             if ( 0 != awcFilename[ 0 ] )
@@ -944,11 +2854,113 @@ extern "C" int __cdecl wmain( int argc, WCHAR * argv[] )
        iArg++;
     }
 
+    // threads append to their own ring buffers so tracing doesn't serialize the parsing threads
+
+    if ( verboseTracing )
+    {
+        tracer.Enable( true, L"aid.txt", true );
+        tracer.SetFilter( traceLevel, traceCategories );
+        tracer.UseRingBuffers( true );
+    }
+
+    // aid parses each file once, so the shared metadata cache would only cost memory and a lookup per file
+
+    CImageData::MetadataCache().SetCapacity( 0 );
+
+    if ( 0 != awcBulkList[0] || recoverBulk )
+    {
+        if ( ( 0 != awcBulkList[0] && recoverBulk ) || 0 != awcFilename[0] || 0 != awcRootPath[0] || 0 != awcFileList[0] )
+            Usage();
+
+        WCHAR awcFullJournal[ MAX_PATH + 1 ];
+        _wfullpath( awcFullJournal, ( 0 == awcJournal[0] ) ? L"aid-journal.txt" : awcJournal, _countof( awcFullJournal ) );
+
+        bool ok = false;
+        CBulkMetadataWriter writer( flushPolicy, oneThread );
+
+        if ( recoverBulk )
+            ok = writer.Recover( awcFullJournal, rollbackBulk );
+        else if ( writer.LoadRequests( awcBulkList ) )
+            ok = writer.Run( awcFullJournal );
+
+        tracer.Shutdown();
+        return ok ? 0 : 1;
+    }
+
+    if ( 0 != awcQuerySocket[0] )
+    {
+        if ( 0 == pwcFile || 0 != awcRootPath[0] || 0 != awcDaemonSocket[0] )
+            Usage();
+
+        return QueryDaemon( awcQuerySocket, pwcFile ) ? 0 : 1;
+    }
+
+    if ( 0 != mergeList.size() )
+    {
+        if ( 0 != awcFilename[0] || 0 != awcRootPath[0] || 0 != awcFileList[0] || 0 != awcDaemonSocket[0] || 0 != shardCount || 0 != awcPartial[0] )
+            Usage();
+
+        vector<wstring> partials;
+        ExpandPartialPaths( mergeList, partials );
+
+        CAggregates agg( geohashPrecision );
+        bool ok = MergePartials( partials, appMode, agg );
+
+        if ( ok )
+        {
+            // the GPS grid isn't in partial results
+
+            ReportOptions options = { sortOnCount, verboseTracing, oneThread, createEmbeddedImages, false, 0.0, 0.0, 0.0, true };
+            PrintReport( appMode, agg, options );
+        }
+
+        tracer.Shutdown();
+        return ok ? 0 : 1;
+    }
+
     if ( 0 == awcExtension[0] )
         wcscpy( awcExtension, L"*" );
 
-    if ( ( ( 0 == awcFilename[0] ) && ( 0 == awcRootPath[0] ) ) ||
-         ( ( 0 != awcFilename[0] ) && ( 0 != awcRootPath[0] ) ) )
+    if ( 0 != awcDaemonSocket[0] )
+    {
+        if ( 0 == pwcRoot || 0 != awcFilename[0] || 0 != awcFileList[0] )
+            Usage();
+
+        // the daemon can hold several roots, separated with semicolons
+
+        vector<wstring> roots;
+        wstring rootList( pwcRoot );
+        size_t start = 0;
+
+        do
+        {
+            size_t end = rootList.find( L';', start );
+            wstring root = rootList.substr( start, ( wstring::npos == end ) ? wstring::npos : end - start );
+
+            if ( 0 != root.size() )
+            {
+                WCHAR awcRoot[ MAX_PATH + 1 ];
+                _wfullpath( awcRoot, root.c_str(), _countof( awcRoot ) );
+                AppendBackslashAndLowercase( awcRoot );
+                roots.push_back( awcRoot );
+            }
+
+            start = ( wstring::npos == end ) ? wstring::npos : end + 1;
+        } while ( wstring::npos != start );
+
+        wstring spec( L"*." );
+        spec += awcExtension;
+
+        CMetadataDaemon daemon( roots, spec.c_str(), acCameraModel, oneThread, watch ? watchSeconds : 300, includeArchives, budgetMs, awcQuarantine );
+        bool ok = daemon.Run( awcDaemonSocket );
+
+        tracer.Shutdown();
+        return ok ? 0 : 1;
+    }
+
+    // exactly one of a file, a root, or a list
+
+    if ( 1 != ( ( 0 != awcFilename[0] ) + ( 0 != awcRootPath[0] ) + ( 0 != awcFileList[0] ) ) )
         Usage();
 
     if ( ( 0 != awcRootPath[0] ) && ( 0 == awcExtension[0] ) )
@@ -981,25 +2993,57 @@ extern "C" int __cdecl wmain( int argc, WCHAR * argv[] )
                     _wfullpath( awcFilename, pwcFile, _countof( awcFilename ) );
                 }
             }
+            else if ( CArchive::IsMemberPath( awcFilename ) )
+                _wfullpath( awcFilename, pwcFile, _countof( awcFilename ) );
         }
     }
 
     if ( 0 != pwcRoot )
        _wfullpath( awcRootPath, pwcRoot, _countof( awcRootPath ) );
 
+    // duplicate detection and embedded image hashes are computed over the whole set, and exposure sketches can't remove
+    // a value, so they can't be maintained incrementally
+
+    if ( watch && ( 0 != awcFilename[0] || 0 != awcFileList[0] || EnumAppMode::modeDuplicates == appMode || EnumAppMode::modeEmbedded == appMode ||
+         EnumAppMode::modeExposure == appMode ) )
+        Usage();
+
+    // change notifications are for the archive file, not its members
+
+    if ( watch && includeArchives )
+        Usage();
+
+    // duplicates need every file, percentiles of a stratified sample would need weighting, and a sample can't be watched since changes would be to unsampled files
+
+    bool sampling = ( 0 != sampleCount || 0.0 != samplePercent );
+
+    if ( sampling && ( watch || 0 != awcFilename[0] || EnumAppMode::modeDuplicates == appMode || EnumAppMode::modeEmbedded == appMode ||
+         EnumAppMode::modeExposure == appMode ) )
+        Usage();
+
+    // duplicates can be in different shards, and partial results don't hold estimates or watch state
+
+    if ( ( 0 != shardCount || 0 != awcPartial[0] ) && ( sampling || watch || 0 != awcFilename[0] || EnumAppMode::modeDuplicates == appMode ) )
+        Usage();
+
     //printf( "awcFilename:  %ws\n", awcFilename );
     //printf( "awcRootPath:  %ws\n", awcRootPath );
     //printf( "awcExtension: %ws\n", awcExtension );
 
-    LONG hasImageCount = 0;
-    LONG hasGPSCount = 0;
-
     try
     {
         if ( 0 != awcFilename[0] )
         {
             CImageData id;
             char acModel[ MetadataBufferSize ] = { 0 };
+            WCHAR awcSidecar[ MAX_PATH + 1 ];
+
+            if ( ( EnumAppMode::modeAdobeEdits == appMode || EnumAppMode::modeRatings == appMode ) &&
+                 CSidecars::FindBeside( awcFilename, awcSidecar, _countof( awcSidecar ) ) )
+            {
+                printf( "using sidecar %ws\n", awcSidecar );
+                id.UseSidecar( awcFilename, awcSidecar );
+            }
 
             if ( EnumAppMode::modeAdobeEdits == appMode )
             {
@@ -1126,6 +3170,24 @@ extern "C" int __cdecl wmain( int argc, WCHAR * argv[] )
                 else
                     printf( "camera model unavailable\n" );
             }
+            else if ( EnumAppMode::modeLooks == appMode )
+            {
+                CDCJpeg::Look look;
+
+                if ( GetLook( id, awcFilename, look ) )
+                {
+                    printf( "dominant color:  %s (%.0lf%% of the image)\n", CDCJpeg::ColorName( look.dominant ), look.dominantShare * 100.0 );
+                    printf( "mean luma:       %.1lf\n", look.meanLuma );
+                    printf( "luma histogram: " );
+
+                    for ( int b = 0; b < CDCJpeg::HistogramBins; b++ )
+                        printf( " %lu", look.histogram[ b ] );
+
+                    printf( "\n1/8 scale size:  %d x %d\n", look.width, look.height );
+                }
+                else
+                    printf( "no JPEG preview or JPEG data that can be decoded\n" );
+            }
             else if ( EnumAppMode::modeHasImage == appMode )
             {
                 long long offset, length;
@@ -1157,8 +3219,56 @@ extern "C" int __cdecl wmain( int argc, WCHAR * argv[] )
                     printf( "latitude:   %lf\n", lat );
                     printf( "longitude:  %lf\n", lon );
                     printf( "https://www.google.com/maps/search/?api=1&query=%lf,%lf\n", lat, lon );
+
+                    if ( CGeoIndex::ValidCoordinate( lat, lon ) )
+                    {
+                        char acHash[ CGeoIndex::MaxPrecision + 1 ];
+                        CGeoIndex::Encode( lat, lon, geohashPrecision, acHash );
+                        printf( "geohash:    %s\n", acHash );
+
+                        if ( radiusQuery )
+                            printf( "distance:   %.3lf km from %lf, %lf\n", CGeoIndex::DistanceKm( lat, lon, queryLat, queryLon ), queryLat, queryLon );
+                    }
                 }
             }
+            else if ( EnumAppMode::modeExposure == appMode )
+            {
+                int iso;
+                double seconds, fNumber;
+
+                if ( id.FindISO( awcFilename, &iso ) )
+                    printf( "ISO:       %d\n", iso );
+                else
+                    printf( "ISO:       unknown\n" );
+
+                if ( id.FindExposureTime( awcFilename, &seconds ) )
+                    printf( "shutter:   %.6lf sec\n", seconds );
+                else
+                    printf( "shutter:   unknown\n" );
+
+                if ( id.FindFNumber( awcFilename, &fNumber ) )
+                    printf( "aperture:  f/%.1lf\n", fNumber );
+                else
+                    printf( "aperture:  unknown\n" );
+            }
+            else if ( EnumAppMode::modeDuplicates == appMode )
+            {
+                char acMake[ MetadataBufferSize ] = { 0 };
+                char acDateTime[ MetadataBufferSize ] = { 0 };
+                long long offset, length;
+                int orientation, width, height, fullWidth, fullHeight;
+
+                id.GetCameraInfo( awcFilename, acMake, MetadataBufferSize, acModel, MetadataBufferSize );
+                id.FindDateTime( awcFilename, acDateTime, _countof( acDateTime ) );
+                if ( !id.FindEmbeddedImage( awcFilename, &offset, &length, &orientation, &width, &height, &fullWidth, &fullHeight ) )
+                    offset = length = 0;
+
+                printf( "duplicate detection key:\n" );
+                printf( "make:          %s\n", acMake );
+                printf( "model:         %s\n", acModel );
+                printf( "date/time:     %s\n", acDateTime );
+                printf( "preview:       offset %lld, length %lld\n", offset, length );
+            }
             else if ( EnumAppMode::modeEmbedded == appMode )
             {
                 long long offset, length;
@@ -1177,15 +3287,15 @@ extern "C" int __cdecl wmain( int argc, WCHAR * argv[] )
                     printf( "full width:    %d\n", fullWidth );
                     printf( "full height:   %d\n", fullHeight );
 
-                    CStream stream( awcFilename, offset, length );
-                    if ( ! stream.Ok() )
+                    unique_ptr<CStream> stream( CArchive::Open( awcFilename, offset, length ) );
+                    if ( !stream || !stream->Ok() )
                     {
                         printf( "can't open the stream %ws\n", awcFilename );
                     }
                     else
                     {
                         vector<byte> vImage( length );
-                        stream.Read( vImage.data(), length );
+                        stream->Read( vImage.data(), length );
 
                         char acSha256[ 65 ];
                         acSha256[ 64 ] = 0;
@@ -1215,88 +3325,157 @@ extern "C" int __cdecl wmain( int argc, WCHAR * argv[] )
             }
 
             CStringArray array;
-            CEnumFolder enumerate( true, &array, pExtensions, cExtensions );
-            enumerate.Enumerate( awcRootPath, awcSpec );
-            array.Sort();
-            printf( "found %zd files\n\n", array.Count() );
-
-            CEntryTracker<SerialNumberEntry> bodies;
-            CEntryTracker<SerialNumberEntry> lenses;
-            CEntryTracker<FocalLengthEntry> focalLengths;
-            CEntryTracker<FNumberEntry> fNumbers;
-            CEntryTracker<RatingEntry> ratings;
-            CEntryTracker<ModelEntry> models;
-            CEntryTracker<EmbeddedImageEntry> embeddedImages;
-            LONG withAdobeEdits = 0;
-            LONG withoutAdobeEdits = 0;
-
-            // This is ugly, but I don't know how to tell ppl to use 1 thread in an elegant way
 
-            if ( oneThread )
+            // RAW files keep Adobe edits and ratings in .xmp sidecars, paired with images as folders are listed
+
+            CSidecars sidecars;
+            bool useSidecars = ( EnumAppMode::modeAdobeEdits == appMode || EnumAppMode::modeRatings == appMode );
+
+            if ( 0 != awcFileList[0] )
             {
-                for ( int i = 0; i < array.Count(); i++ )
-                    ProcessFile( appMode, verboseTracing, mtx, acCameraModel, hasImageCount, hasGPSCount, array, i, bodies, lenses,
-                                 focalLengths, fNumbers, ratings, models, embeddedImages, withAdobeEdits, withoutAdobeEdits );
+                if ( !LoadFileList( awcFileList, array ) )
+                {
+                    tracer.Shutdown();
+                    return 1;
+                }
+
+                printf( "read %zd files from the list\n\n", array.Count() );
             }
             else
             {
-                parallel_for ( 0, (int) array.Count(), [&] ( int i  )
-                {
-                    ProcessFile( appMode, verboseTracing, mtx, acCameraModel, hasImageCount, hasGPSCount, array, i, bodies, lenses,
-                                 focalLengths, fNumbers, ratings, models, embeddedImages, withAdobeEdits, withoutAdobeEdits );
-                }, static_partitioner() );
+                CEnumFolder enumerate( true, &array, pExtensions, cExtensions );
+                enumerate.IncludeArchives( includeArchives );
+                enumerate.SerialFolders( ioSettings.serialEnumeration );
+                if ( useSidecars )
+                    enumerate.CollectSidecars( &sidecars );
+                enumerate.Enumerate( awcRootPath, awcSpec );
+                array.Sort();
+
+                if ( 0 != sidecars.Count() )
+                    printf( "found %zd files, %zd with .xmp sidecars\n\n", array.Count(), sidecars.Count() );
+                else
+                    printf( "found %zd files\n\n", array.Count() );
             }
 
-            if ( EnumAppMode::modeAdobeEdits == appMode )
-            {
-                printf( "files with    adobe edits: %d\n", withAdobeEdits );
-                printf( "files without adobe edits: %d\n", withoutAdobeEdits );
-            }
-            else if ( EnumAppMode::modeSerialNumbers == appMode )
+            if ( 0 != shardCount )
             {
-                bodies.PrintEntries( "bodies", sortOnCount );
-    
-                printf( "\n" );
+                size_t rootLen = wcslen( awcRootPath );
+                vector<size_t> keep;
 
-                lenses.PrintEntries( "lenses", sortOnCount );
-            }
-            else if ( EnumAppMode::modeFocalLengths == appMode )
-            {
-                focalLengths.PrintEntries( "focal lengths", sortOnCount );
+                for ( size_t i = 0; i < array.Count(); i++ )
+                    if ( InShard( array[ i ], rootLen, shard, shardCount ) )
+                        keep.push_back( i );
+
+                array.Keep( keep );
+                printf( "shard %d of %d has %zd files\n\n", shard, shardCount, array.Count() );
             }
-            else if ( EnumAppMode::modeFNumbers == appMode )
+
+            CAggregates agg( geohashPrecision );
+            CStratifiedSample sample;
+
+            if ( sampling )
             {
-                fNumbers.PrintEntries( "FNumbers", sortOnCount );
+                size_t target = ( 0 != sampleCount ) ? sampleCount : (size_t) ceil( array.Count() * samplePercent / 100.0 );
+
+                if ( target < array.Count() )
+                {
+                    sample.Select( array, wcslen( awcRootPath ), target, sampleByFolder );
+                    agg.pSample = &sample;
+                    if ( sample.Sampled() > target )
+                        printf( "parsing a sample of %zd files from %zd strata; more than the %zd asked for, since each stratum gets at least 2\n\n",
+                                sample.Sampled(), sample.Strata(), target );
+                    else
+                        printf( "parsing a sample of %zd files from %zd strata\n\n", sample.Sampled(), sample.Strata() );
+                }
             }
-            else if ( EnumAppMode::modeRatings == appMode )
+
+            // Files are started in array order, so this makes the reads one sweep across the disk.
+            // The aggregates don't depend on the order files are parsed in, so the report is the same.
+            // A sample's strata are looked up by position, so they're reordered the same way.
+
+            if ( diskOrder )
             {
-                ratings.PrintEntries( "ratings", sortOnCount );
+                vector<size_t> order = CDiskLayout::Order( array, ioSettings.serialEnumeration );
+
+                if ( NULL != agg.pSample )
+                    sample.Reorder( order );
             }
-            else if ( EnumAppMode::modeModels == appMode )
+            vector<FileContributions> contributions( watch ? array.Count() : 0 );
+            bool printEachFile = ( verboseTracing || eachFile );
+
+            CProgress progress( showProgress && !printEachFile, array.Count() );
+
+            // A fault or timeout in one file is recorded and the scan goes on with the next file
+
+            CFileGuard guard( budgetMs, ( 0 == budgetMs ) ? 10000 : budgetMs / 2 );
+
+            if ( oneThread )
             {
-                models.PrintEntries( "models", sortOnCount );
+                CBackgroundIo::CThreadScope background;
+
+                for ( int i = 0; i < array.Count(); i++ )
+                {
+                    CImageData id;
+                    id.UseSidecar( array[ i ], sidecars.Find( array[ i ] ) );
+                    guard.Start();
+                    bool ok = guard.Run( [&] () { ProcessFile( appMode, printEachFile, mtx, acCameraModel, array, i, agg, watch ? & contributions[ i ] : NULL, &id ); } );
+                    ok = !guard.Finish( array[ i ] ) && ok && id.Readable( array[ i ] );
+                    progress.FileDone( !ok );
+                }
             }
-            else if ( EnumAppMode::modeLenses == appMode )
+            else
             {
-                models.PrintEntries( "lenses", sortOnCount );
+                // Reading and parsing have separate limits; see /io and /cpu. The time budget covers both.
+
+                CIoScheduler scheduler( ioSettings, parseThreads );
+
+                scheduler.Run<unique_ptr<CImageData>>( array.Count(),
+                    [&] ( size_t i, unique_ptr<CImageData> & id )
+                    {
+                        id.reset( new CImageData() );
+                        id->UseSidecar( array[ i ], sidecars.Find( array[ i ] ) );
+                        guard.Start();
+                        guard.Run( [&] () { id->Preload( array[ i ], PreloadBytes ); } );
+                    },
+                    [&] ( size_t i, unique_ptr<CImageData> & id )
+                    {
+                        bool ok = guard.Run( [&] () { ProcessFile( appMode, printEachFile, mtx, acCameraModel, array, (int) i, agg, watch ? & contributions[ i ] : NULL, id.get() ); } );
+                        ok = !guard.Finish( array[ i ] ) && ok && id->Readable( array[ i ] );
+                        progress.FileDone( !ok );
+                        id.reset();
+                    } );
             }
-            else if ( EnumAppMode::modeHasImage == appMode )
+
+            progress.Stop();
+
+            if ( 0 != guard.Quarantined() || 0 != guard.Slow() )
             {
-                printf( "files with an image: %d\n", hasImageCount );
+                printf( "%zd files quarantined, %zd slow\n", guard.Quarantined(), guard.Slow() );
+
+                if ( 0 != awcQuarantine[0] )
+                    guard.Write( awcQuarantine );
+                else
+                    guard.Print();
+
+                printf( "\n" );
             }
-            else if ( EnumAppMode::modeHasGPS == appMode )
+
+            tracer.Trace( "makernote layout cache: %zd hits, %zd misses\n", CImageData::MakernoteLayouts().Hits(), CImageData::MakernoteLayouts().Misses() );
+
+            if ( 0 != awcPartial[0] )
             {
-                printf( "files with GPS coordinates: %d\n", hasGPSCount );
+                bool ok = WritePartial( awcPartial, appMode, shard, __max( shardCount, 1 ), array.Count(), agg );
+                tracer.Shutdown();
+                return ok ? 0 : 1;
             }
-            else if ( EnumAppMode::modeEmbedded == appMode )
-            {
-                embeddedImages.PrintEntries( "embedded images", sortOnCount );
 
-                printf( "found %zd unique embedded images in %d files\n", embeddedImages.Count(), hasImageCount );
+            ReportOptions options = { sortOnCount, verboseTracing, oneThread, createEmbeddedImages, radiusQuery, queryLat, queryLon, queryKm, watch };
 
-                if ( createEmbeddedImages )
-                    CreateEmbeddedImages( embeddedImages );
-            }
+            PrintReport( appMode, agg, options );
+
+            if ( watch )
+                WatchFolder( appMode, verboseTracing, mtx, acCameraModel, awcRootPath, awcSpec, pExtensions, cExtensions,
+                             array, agg, contributions, options, watchSeconds, guard, awcQuarantine, sidecars, useSidecars );
         }
     }
     catch( const SE_Exception & e )
@@ -0,0 +1,431 @@
+//
+// aidlib.dll: the C interface in aidlib.h over CImageData, CEnumFolder, and the I/O scheduler aid uses.
+// Build with mlib.bat.
+//
+
+#define AIDLIB_EXPORTS
+
+#include <windows.h>
+#include <ppl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <eh.h>
+#include <math.h>
+
+#include <memory>
+#include <mutex>
+#include <map>
+#include <vector>
+#include <string>
+
+#include <djlimagedata.hxx>
+#include <djlenum.hxx>
+#include <djlexcept.hxx>
+#include <djl_iosched.hxx>
+#include <djl_guard.hxx>
+
+#include "aidlib.h"
+
+using namespace std;
+using namespace concurrency;
+
+CDJLTrace tracer;
+
+const ULONG PreloadBytes = 256 * 1024;     // same as aid; enough for the metadata of most formats
+
+// Version 1 of AidMetadata ends with dateTime. Callers built against later versions pass a larger size.
+
+const size_t MinMetadataSize = offsetof( AidMetadata, dateTime ) + AID_TEXT_LEN;
+
+struct AidInstance
+{
+    CIoScheduler::Settings ioSettings;
+    int parseThreads;
+    DWORD budgetMs;
+};
+
+struct AidFileList
+{
+    CStringArray paths;
+};
+
+struct AidAggregate
+{
+    int by;
+    std::mutex mtx;
+    map<pair<double, string>, uint64_t> counts;       // numeric keys sort on the double, text keys on the string
+    vector<pair<string, uint64_t>> entries;            // counts in order, rebuilt after adds
+    bool stale;
+};
+
+static void Extract( CImageData & id, const WCHAR * pwcPath, AidMetadata & m )
+{
+    if ( !id.Readable( pwcPath ) )
+    {
+        m.status = AID_UNREADABLE;
+        return;
+    }
+
+    if ( id.GetSerialNumbers( pwcPath, m.make, AID_TEXT_LEN, m.model, AID_TEXT_LEN, m.serialNumber, AID_TEXT_LEN,
+                              m.lensMake, AID_TEXT_LEN, m.lensModel, AID_TEXT_LEN, m.lensSerialNumber, AID_TEXT_LEN ) )
+        m.flags |= AID_HAS_SERIAL_NUMBERS;
+
+    if ( 0 != m.make[ 0 ] || 0 != m.model[ 0 ] )
+        m.flags |= AID_HAS_CAMERA;
+
+    if ( 0 != m.lensMake[ 0 ] || 0 != m.lensModel[ 0 ] )
+        m.flags |= AID_HAS_LENS;
+
+    if ( id.FindDateTime( pwcPath, m.dateTime, AID_TEXT_LEN ) && 0 != m.dateTime[ 0 ] )
+        m.flags |= AID_HAS_DATE_TIME;
+
+    double focalLength, flGuess, flComputed;
+    int flIn35mmFilm;
+    char acModel[ AID_TEXT_LEN ];
+    double flBestGuess = id.FindFocalLength( pwcPath, focalLength, flIn35mmFilm, flGuess, flComputed, acModel, _countof( acModel ) );
+
+    if ( 0.0 != flBestGuess )
+    {
+        m.focalLength = flBestGuess;
+        m.focalLengthIn35mmFilm = __max( 0, flIn35mmFilm );
+        m.flags |= AID_HAS_FOCAL_LENGTH;
+    }
+
+    if ( id.FindFNumber( pwcPath, &m.fNumber ) )
+        m.flags |= AID_HAS_FNUMBER;
+
+    if ( id.FindISO( pwcPath, &m.iso ) )
+        m.flags |= AID_HAS_ISO;
+
+    if ( id.FindExposureTime( pwcPath, &m.exposureSeconds ) )
+        m.flags |= AID_HAS_EXPOSURE_TIME;
+
+    if ( id.GetGPSLocation( pwcPath, &m.latitude, &m.longitude ) )
+        m.flags |= AID_HAS_GPS;
+
+    int orientation;
+    if ( id.GetOrientation( pwcPath, &orientation ) )
+        m.flags |= AID_HAS_ORIENTATION;
+    m.orientation = orientation;
+
+    char rating;
+    if ( id.GetRating( pwcPath, rating ) )
+    {
+        m.rating = rating;
+        m.flags |= AID_HAS_RATING;
+    }
+
+    long long offset, length;
+    int embeddedOrientation;
+
+    if ( id.FindEmbeddedImage( pwcPath, &offset, &length, &embeddedOrientation, &m.embeddedWidth, &m.embeddedHeight, &m.width, &m.height ) )
+    {
+        m.embeddedOffset = offset;
+        m.embeddedLength = length;
+        m.flags |= AID_HAS_EMBEDDED_IMAGE;
+    }
+
+    if ( id.HoldsAdobeEditsInXMP( pwcPath ) )
+        m.flags |= AID_HAS_ADOBE_EDITS;
+} //Extract
+
+static void ClearMetadata( AidMetadata & m )
+{
+    memset( &m, 0, sizeof m );
+    m.width = -1;
+    m.height = -1;
+    m.orientation = 1;
+} //ClearMetadata
+
+// Element i of the caller's array, whose elements are cbResult bytes. Fields the caller's version doesn't
+// have are dropped, and fields it has that this version doesn't are zeroed.
+
+static void StoreResult( AidMetadata * results, size_t cbResult, size_t i, const AidMetadata & m )
+{
+    BYTE * p = (BYTE *) results + i * cbResult;
+    size_t cb = __min( cbResult, sizeof m );
+
+    memcpy( p, &m, cb );
+    if ( cbResult > cb )
+        memset( p + cb, 0, cbResult - cb );
+} //StoreResult
+
+static void LoadResult( const AidMetadata * results, size_t cbResult, size_t i, AidMetadata & m )
+{
+    ClearMetadata( m );
+    memcpy( &m, (const BYTE *) results + i * cbResult, __min( cbResult, sizeof m ) );
+} //LoadResult
+
+extern "C" AIDLIB_API uint32_t __cdecl AidVersion( void )
+{
+    return AID_VERSION;
+} //AidVersion
+
+extern "C" AIDLIB_API AidInstance * __cdecl AidCreate( uint32_t parseThreads, uint32_t budgetMs )
+{
+    try
+    {
+        unique_ptr<AidInstance> instance( new AidInstance() );
+        CIoScheduler::ParseSettings( L"auto", instance->ioSettings );
+        instance->parseThreads = ( 0 == parseThreads ) ? __max( 1, (int) thread::hardware_concurrency() ) : (int) parseThreads;
+        instance->budgetMs = budgetMs;
+
+        // callers hand over many files once each, so caching them only costs memory
+
+        CImageData::MetadataCache().SetCapacity( 0 );
+        return instance.release();
+    }
+    catch ( ... )
+    {
+        return NULL;
+    }
+} //AidCreate
+
+extern "C" AIDLIB_API void __cdecl AidDestroy( AidInstance * instance )
+{
+    delete instance;
+} //AidDestroy
+
+extern "C" AIDLIB_API int64_t __cdecl AidExtract( AidInstance * instance, const wchar_t * const * paths, size_t count,
+                                                  AidMetadata * results, size_t cbResult )
+{
+    if ( NULL == instance || ( 0 != count && ( NULL == paths || NULL == results ) ) || cbResult < MinMetadataSize )
+        return -1;
+
+    try
+    {
+        AidMetadata empty;
+        ClearMetadata( empty );
+
+        for ( size_t i = 0; i < count; i++ )
+            StoreResult( results, cbResult, i, empty );
+
+        // Faults and timeouts in one file are isolated to it, just as in aid scans
+
+        CFileGuard guard( instance->budgetMs, 0 );
+        CIoScheduler scheduler( instance->ioSettings, instance->parseThreads );
+        atomic<int64_t> parsed( 0 );
+
+        scheduler.Run<unique_ptr<CImageData>>( count,
+            [&] ( size_t i, unique_ptr<CImageData> & id )
+            {
+                id.reset( new CImageData() );
+                guard.Start();
+                guard.Run( [&] () { id->Preload( paths[ i ], PreloadBytes ); } );
+            },
+            [&] ( size_t i, unique_ptr<CImageData> & id )
+            {
+                AidMetadata m;
+                ClearMetadata( m );
+                bool ok = guard.Run( [&] () { Extract( *id, paths[ i ], m ); } );
+
+                if ( guard.Finish( paths[ i ] ) || !ok )
+                {
+                    ClearMetadata( m );
+                    m.status = AID_FAULTED;
+                }
+                else if ( AID_OK == m.status )
+                    parsed++;
+
+                StoreResult( results, cbResult, i, m );
+                id.reset();
+            } );
+
+        return parsed;
+    }
+    catch ( ... )
+    {
+        return -1;
+    }
+} //AidExtract
+
+extern "C" AIDLIB_API AidFileList * __cdecl AidEnumerate( AidInstance * instance, const wchar_t * root, const wchar_t * spec, int includeArchives )
+{
+    if ( NULL == instance || NULL == root )
+        return NULL;
+
+    try
+    {
+        unique_ptr<AidFileList> list( new AidFileList() );
+        CEnumFolder enumerate( true, & list->paths, NULL, 0 );
+        enumerate.IncludeArchives( 0 != includeArchives );
+        enumerate.SerialFolders( instance->ioSettings.serialEnumeration );
+        enumerate.Enumerate( root, spec );
+        list->paths.Sort();
+        return list.release();
+    }
+    catch ( ... )
+    {
+        return NULL;
+    }
+} //AidEnumerate
+
+extern "C" AIDLIB_API size_t __cdecl AidFileListCount( AidFileList * list )
+{
+    return ( NULL == list ) ? 0 : list->paths.Count();
+} //AidFileListCount
+
+extern "C" AIDLIB_API const wchar_t * __cdecl AidFileListPath( AidFileList * list, size_t i )
+{
+    if ( NULL == list || i >= list->paths.Count() )
+        return NULL;
+
+    return list->paths[ i ];
+} //AidFileListPath
+
+extern "C" AIDLIB_API const wchar_t * const * __cdecl AidFileListPaths( AidFileList * list )
+{
+    return ( NULL == list ) ? NULL : list->paths.Array();
+} //AidFileListPaths
+
+extern "C" AIDLIB_API void __cdecl AidFileListFree( AidFileList * list )
+{
+    delete list;
+} //AidFileListFree
+
+extern "C" AIDLIB_API AidAggregate * __cdecl AidAggregateCreate( int by )
+{
+    if ( by < AID_BY_MODEL || by > AID_BY_RATING )
+        return NULL;
+
+    try
+    {
+        AidAggregate * aggregate = new AidAggregate();
+        aggregate->by = by;
+        aggregate->stale = false;
+        return aggregate;
+    }
+    catch ( ... )
+    {
+        return NULL;
+    }
+} //AidAggregateCreate
+
+// The key for the metadata, or false if it doesn't have the field counted
+
+static bool AggregateKey( int by, const AidMetadata & m, pair<double, string> & key )
+{
+    char ac[ 2 * AID_TEXT_LEN + 2 ];
+
+    if ( AID_BY_MODEL == by && ( m.flags & AID_HAS_CAMERA ) )
+    {
+        // the make is left out when the model already starts with it, e.g. Canon's "Canon EOS R5"
+
+        size_t makeLen = strlen( m.make );
+
+        if ( 0 == makeLen || !_strnicmp( m.model, m.make, makeLen ) )
+            strcpy_s( ac, _countof( ac ), m.model );
+        else
+            sprintf_s( ac, _countof( ac ), "%s %s", m.make, m.model );
+
+        key = make_pair( 0.0, string( ac ) );
+    }
+    else if ( AID_BY_LENS == by && ( m.flags & AID_HAS_LENS ) && 0 != m.lensModel[ 0 ] )
+    {
+        sprintf_s( ac, _countof( ac ), "%s %s", m.lensMake, m.lensModel );
+        key = make_pair( 0.0, string( ( 0 == m.lensMake[ 0 ] ) ? m.lensModel : ac ) );
+    }
+    else if ( AID_BY_FOCAL_LENGTH == by && ( m.flags & AID_HAS_FOCAL_LENGTH ) )
+    {
+        double fl = (double) lround( m.focalLength );
+        sprintf_s( ac, _countof( ac ), "%.0lf", fl );
+        key = make_pair( fl, string( ac ) );
+    }
+    else if ( AID_BY_FNUMBER == by && ( m.flags & AID_HAS_FNUMBER ) )
+    {
+        double f = round( m.fNumber * 10.0 ) / 10.0;
+        sprintf_s( ac, _countof( ac ), "%.1lf", f );
+        key = make_pair( f, string( ac ) );
+    }
+    else if ( AID_BY_ISO == by && ( m.flags & AID_HAS_ISO ) )
+    {
+        sprintf_s( ac, _countof( ac ), "%d", m.iso );
+        key = make_pair( (double) m.iso, string( ac ) );
+    }
+    else if ( AID_BY_RATING == by && ( m.flags & AID_HAS_RATING ) )
+    {
+        sprintf_s( ac, _countof( ac ), "%d", m.rating );
+        key = make_pair( (double) m.rating, string( ac ) );
+    }
+    else
+        return false;
+
+    return true;
+} //AggregateKey
+
+extern "C" AIDLIB_API void __cdecl AidAggregateAdd( AidAggregate * aggregate, const AidMetadata * results, size_t count, size_t cbResult )
+{
+    if ( NULL == aggregate || NULL == results || cbResult < MinMetadataSize )
+        return;
+
+    try
+    {
+        lock_guard<mutex> lock( aggregate->mtx );
+
+        for ( size_t i = 0; i < count; i++ )
+        {
+            AidMetadata m;
+            LoadResult( results, cbResult, i, m );
+            pair<double, string> key;
+
+            if ( AID_OK == m.status && AggregateKey( aggregate->by, m, key ) )
+            {
+                aggregate->counts[ key ]++;
+                aggregate->stale = true;
+            }
+        }
+    }
+    catch ( ... )
+    {
+    }
+} //AidAggregateAdd
+
+extern "C" AIDLIB_API size_t __cdecl AidAggregateCount( AidAggregate * aggregate )
+{
+    if ( NULL == aggregate )
+        return 0;
+
+    lock_guard<mutex> lock( aggregate->mtx );
+    return aggregate->counts.size();
+} //AidAggregateCount
+
+// Returns 0 if i is out of range or the key doesn't fit in cbKey bytes
+
+extern "C" AIDLIB_API int __cdecl AidAggregateEntry( AidAggregate * aggregate, size_t i, char * key, size_t cbKey, uint64_t * count )
+{
+    if ( NULL == aggregate || NULL == key || NULL == count )
+        return 0;
+
+    try
+    {
+        lock_guard<mutex> lock( aggregate->mtx );
+
+        if ( aggregate->stale )
+        {
+            aggregate->entries.clear();
+
+            for ( auto it = aggregate->counts.begin(); it != aggregate->counts.end(); it++ )
+                aggregate->entries.push_back( make_pair( it->first.second, it->second ) );
+
+            aggregate->stale = false;
+        }
+
+        if ( i >= aggregate->entries.size() || aggregate->entries[ i ].first.size() >= cbKey )
+            return 0;
+
+        strcpy_s( key, cbKey, aggregate->entries[ i ].first.c_str() );
+        *count = aggregate->entries[ i ].second;
+        return 1;
+    }
+    catch ( ... )
+    {
+        return 0;
+    }
+} //AidAggregateEntry
+
+extern "C" AIDLIB_API void __cdecl AidAggregateFree( AidAggregate * aggregate )
+{
+    delete aggregate;
+} //AidAggregateFree
+
@@ -0,0 +1,130 @@
+#pragma once
+
+//
+// C interface to aid's metadata extraction, for apps and other languages that load aidlib.dll instead of
+// running aid.exe and parsing its output. Build it with mlib.bat.
+// The ABI is stable: functions use the C calling convention and the structs have fixed layouts.
+// New fields are only ever added to the end of AidMetadata, and AidExtract takes the struct size the
+// caller was built with, so callers built against older versions keep working.
+// Every function can be called from any thread. Nothing throws across this interface.
+//
+
+#include <stddef.h>
+#include <stdint.h>
+#include <wchar.h>
+
+#ifdef AIDLIB_EXPORTS
+#define AIDLIB_API __declspec( dllexport )
+#else
+#define AIDLIB_API __declspec( dllimport )
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define AID_VERSION 1
+#define AID_TEXT_LEN 100
+
+// AidMetadata.status
+
+#define AID_OK           0
+#define AID_UNREADABLE   1      // the file couldn't be opened
+#define AID_FAULTED      2      // parsing faulted or ran out of time; the fields are empty
+
+// AidMetadata.flags: which fields hold data from the file
+
+#define AID_HAS_CAMERA           0x0001     // make and model
+#define AID_HAS_SERIAL_NUMBERS   0x0002     // serialNumber and/or lensSerialNumber
+#define AID_HAS_LENS             0x0004     // lensMake and/or lensModel
+#define AID_HAS_DATE_TIME        0x0008
+#define AID_HAS_FOCAL_LENGTH     0x0010
+#define AID_HAS_FNUMBER          0x0020
+#define AID_HAS_ISO              0x0040
+#define AID_HAS_EXPOSURE_TIME    0x0080
+#define AID_HAS_GPS              0x0100
+#define AID_HAS_ORIENTATION      0x0200
+#define AID_HAS_RATING           0x0400
+#define AID_HAS_EMBEDDED_IMAGE   0x0800     // embeddedOffset, embeddedLength, embeddedWidth, embeddedHeight
+#define AID_HAS_ADOBE_EDITS      0x1000
+
+#pragma pack( push, 8 )
+
+typedef struct AidMetadata
+{
+    int32_t status;                          // AID_OK, AID_UNREADABLE, or AID_FAULTED
+    uint32_t flags;                          // AID_HAS_*
+    int32_t width;                           // of the full image, or -1
+    int32_t height;
+    int32_t orientation;                     // EXIF orientation 1-8
+    int32_t iso;
+    int32_t rating;                          // 0-5
+    int32_t focalLengthIn35mmFilm;           // 0 if the file doesn't say
+    double focalLength;                      // the best guess in mm
+    double fNumber;
+    double exposureSeconds;
+    double latitude;
+    double longitude;
+    int64_t embeddedOffset;                  // of the largest embedded JPG preview in the file
+    int64_t embeddedLength;
+    int32_t embeddedWidth;
+    int32_t embeddedHeight;
+    char make[ AID_TEXT_LEN ];               // UTF-8 strings, null-terminated
+    char model[ AID_TEXT_LEN ];
+    char serialNumber[ AID_TEXT_LEN ];
+    char lensMake[ AID_TEXT_LEN ];
+    char lensModel[ AID_TEXT_LEN ];
+    char lensSerialNumber[ AID_TEXT_LEN ];
+    char dateTime[ AID_TEXT_LEN ];           // as in EXIF, "yyyy:mm:dd hh:mm:ss"
+} AidMetadata;
+
+#pragma pack( pop )
+
+typedef struct AidInstance AidInstance;
+typedef struct AidFileList AidFileList;
+typedef struct AidAggregate AidAggregate;
+
+AIDLIB_API uint32_t __cdecl AidVersion( void );
+
+// An instance holds the settings for extraction. Reuse one: the parsing caches it warms are shared.
+// parseThreads: files parsed at once, 0 for one per core. budgetMs: give up on files after this long, 0 for none.
+
+AIDLIB_API AidInstance * __cdecl AidCreate( uint32_t parseThreads, uint32_t budgetMs );
+AIDLIB_API void __cdecl AidDestroy( AidInstance * instance );
+
+// Fills results[ i ] with the metadata of paths[ i ] using the thread pool. cbResult is sizeof( AidMetadata ) as the
+// caller was built; results is stepped through by that size and only the fields both sides know are filled.
+// Returns the number of files parsed with status AID_OK, or -1 if the arguments are bad.
+
+AIDLIB_API int64_t __cdecl AidExtract( AidInstance * instance, const wchar_t * const * paths, size_t count,
+                                       AidMetadata * results, size_t cbResult );
+
+// Lists files under root matching spec (e.g. L"*.cr3", NULL for all), sorted, with lowercase paths.
+// Zip and tar members are listed as archive|member paths if includeArchives is nonzero.
+
+AIDLIB_API AidFileList * __cdecl AidEnumerate( AidInstance * instance, const wchar_t * root, const wchar_t * spec, int includeArchives );
+AIDLIB_API size_t __cdecl AidFileListCount( AidFileList * list );
+AIDLIB_API const wchar_t * __cdecl AidFileListPath( AidFileList * list, size_t i );    // valid until the list is freed
+AIDLIB_API const wchar_t * const * __cdecl AidFileListPaths( AidFileList * list );    // for passing to AidExtract
+AIDLIB_API void __cdecl AidFileListFree( AidFileList * list );
+
+// Counts files by one field, like aid's reports. Add results from any number of AidExtract calls.
+// Entries are ordered by value for numeric fields and by text for the others.
+
+#define AID_BY_MODEL          1
+#define AID_BY_LENS           2
+#define AID_BY_FOCAL_LENGTH   3
+#define AID_BY_FNUMBER        4
+#define AID_BY_ISO            5
+#define AID_BY_RATING         6
+
+AIDLIB_API AidAggregate * __cdecl AidAggregateCreate( int by );
+AIDLIB_API void __cdecl AidAggregateAdd( AidAggregate * aggregate, const AidMetadata * results, size_t count, size_t cbResult );
+AIDLIB_API size_t __cdecl AidAggregateCount( AidAggregate * aggregate );
+AIDLIB_API int __cdecl AidAggregateEntry( AidAggregate * aggregate, size_t i, char * key, size_t cbKey, uint64_t * count );
+AIDLIB_API void __cdecl AidAggregateFree( AidAggregate * aggregate );
+
+#ifdef __cplusplus
+}
+#endif
+
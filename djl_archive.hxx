@@ -0,0 +1,503 @@
+#pragma once
+
+//
+// Reads the member lists of zip and tar archives so files inside them can be parsed without extracting them.
+// A member's path is the archive's path, a |, then the member's path within the archive, e.g.
+// d:\bundles\2019.zip|dcim\100canon\img_0001.jpg. Member names are lowercase with backslashes like enumerated paths.
+// Stored members are read in place through a CStream over their offset in the archive. Deflated members are
+// decompressed into memory: just the start, where metadata lives, when parsing, or all of it when hashing.
+// Each archive's member list is read once and cached for the life of the process.
+//
+
+#include <windows.h>
+#include <limits.h>
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <algorithm>
+
+#include "djl_strm.hxx"
+#include "djl_inflate.hxx"
+
+using namespace std;
+
+class CArchive
+{
+    public:
+        static const WCHAR Separator = L'|';
+        static const size_t MaxInflatedPrefix = 2 * 1024 * 1024;
+        static const unsigned long long MaxInflatedMember = 512 * 1024 * 1024;
+
+        struct Member
+        {
+            wstring name;
+            unsigned long long offset;            // zip: the local file header. tar: the data
+            unsigned long long compressedSize;
+            unsigned long long size;
+            WORD method;                          // MethodStored or MethodDeflated
+            bool zip;
+        };
+
+        typedef vector<Member> MemberList;       // sorted by name
+
+        static const WORD MethodStored = 0;
+        static const WORD MethodDeflated = 8;
+
+    private:
+        static std::mutex & CacheMutex()
+        {
+            static std::mutex mtx;
+            return mtx;
+        } //CacheMutex
+
+        static map<wstring, shared_ptr<const MemberList>> & Cache()
+        {
+            static map<wstring, shared_ptr<const MemberList>> cache;
+            return cache;
+        } //Cache
+
+        static void Normalize( wstring & name )
+        {
+            for ( size_t i = 0; i < name.size(); i++ )
+                name[ i ] = ( L'/' == name[ i ] ) ? L'\\' : towlower( name[ i ] );
+        } //Normalize
+
+        static wstring Widen( const char * pc, size_t len, bool utf8 )
+        {
+            // zip names that aren't flagged as UTF-8 are in code page 437
+
+            wstring result;
+            int cwc = MultiByteToWideChar( utf8 ? CP_UTF8 : 437, 0, pc, (int) len, NULL, 0 );
+
+            if ( cwc > 0 )
+            {
+                result.resize( cwc );
+                MultiByteToWideChar( utf8 ? CP_UTF8 : 437, 0, pc, (int) len, &result[ 0 ], cwc );
+            }
+
+            return result;
+        } //Widen
+
+        static unsigned long long Le( const BYTE * p, int bytes )
+        {
+            unsigned long long x = 0;
+
+            for ( int i = bytes - 1; i >= 0; i-- )
+                x = ( x << 8 ) | p[ i ];
+
+            return x;
+        } //Le
+
+        static bool ReadAt( CStream & s, __int64 offset, void * p, ULONG cb )
+        {
+            return ( s.Seek( offset ) && cb == s.Read( p, cb ) );
+        } //ReadAt
+
+        static bool ReadZip( CStream & s, MemberList & members )
+        {
+            // the end of central directory record is within the last 64k + 22 bytes, after an optional comment
+
+            __int64 len = s.Length();
+            ULONG tail = (ULONG) __min( len, (__int64) 65535 + 22 );
+            vector<BYTE> buf( __max( tail, (ULONG) 1 ) );
+
+            if ( tail < 22 || !ReadAt( s, len - tail, buf.data(), tail ) )
+                return false;
+
+            int eocd = -1;
+
+            for ( int i = tail - 22; i >= 0; i-- )
+            {
+                if ( 0x06054b50 == Le( &buf[ i ], 4 ) )
+                {
+                    eocd = i;
+                    break;
+                }
+            }
+
+            if ( -1 == eocd )
+                return false;
+
+            unsigned long long entries = Le( &buf[ eocd + 10 ], 2 );
+            unsigned long long cdSize = Le( &buf[ eocd + 12 ], 4 );
+            unsigned long long cdOffset = Le( &buf[ eocd + 16 ], 4 );
+
+            // zip64 archives have a locator for the zip64 end record just before the end record
+
+            if ( eocd >= 20 && 0x07064b50 == Le( &buf[ eocd - 20 ], 4 ) )
+            {
+                BYTE rec[ 56 ];
+
+                if ( !ReadAt( s, Le( &buf[ eocd - 20 + 8 ], 8 ), rec, sizeof rec ) || 0x06064b50 != Le( rec, 4 ) )
+                    return false;
+
+                entries = Le( rec + 32, 8 );
+                cdSize = Le( rec + 40, 8 );
+                cdOffset = Le( rec + 48, 8 );
+            }
+
+            if ( ( cdOffset + cdSize ) > (unsigned long long) len || cdSize > 0x7fffffff )
+                return false;
+
+            vector<BYTE> cd( (size_t) cdSize );
+
+            if ( !ReadAt( s, cdOffset, cd.data(), (ULONG) cdSize ) )
+                return false;
+
+            size_t p = 0;
+
+            for ( unsigned long long e = 0; e < entries && ( p + 46 ) <= cd.size(); e++ )
+            {
+                const BYTE * h = &cd[ p ];
+
+                if ( 0x02014b50 != Le( h, 4 ) )
+                    break;
+
+                WORD flags = (WORD) Le( h + 8, 2 );
+                WORD method = (WORD) Le( h + 10, 2 );
+                size_t nameLen = (size_t) Le( h + 28, 2 );
+                size_t extraLen = (size_t) Le( h + 30, 2 );
+                size_t commentLen = (size_t) Le( h + 32, 2 );
+
+                if ( ( p + 46 + nameLen + extraLen + commentLen ) > cd.size() )
+                    break;
+
+                Member m;
+                m.compressedSize = Le( h + 20, 4 );
+                m.size = Le( h + 24, 4 );
+                m.offset = Le( h + 42, 4 );
+                m.method = method;
+                m.zip = true;
+
+                // zip64 values are in extra field 1, in this order, only for the fields that are 0xffffffff above
+
+                const BYTE * x = h + 46 + nameLen;
+                const BYTE * xEnd = x + extraLen;
+
+                while ( ( x + 4 ) <= xEnd )
+                {
+                    WORD id = (WORD) Le( x, 2 );
+                    const BYTE * d = x + 4;
+                    const BYTE * dEnd = __min( d + Le( x + 2, 2 ), xEnd );
+
+                    if ( 1 == id )
+                    {
+                        if ( 0xffffffff == m.size && ( d + 8 ) <= dEnd )
+                        {
+                            m.size = Le( d, 8 );
+                            d += 8;
+                        }
+
+                        if ( 0xffffffff == m.compressedSize && ( d + 8 ) <= dEnd )
+                        {
+                            m.compressedSize = Le( d, 8 );
+                            d += 8;
+                        }
+
+                        if ( 0xffffffff == m.offset && ( d + 8 ) <= dEnd )
+                            m.offset = Le( d, 8 );
+                    }
+
+                    x = dEnd;
+                }
+
+                bool directory = ( nameLen > 0 && '/' == h[ 46 + nameLen - 1 ] );
+                bool encrypted = ( 0 != ( flags & 1 ) );
+
+                if ( !directory && !encrypted && ( MethodStored == method || MethodDeflated == method ) )
+                {
+                    m.name = Widen( (const char *) h + 46, nameLen, 0 != ( flags & 0x800 ) );
+                    Normalize( m.name );
+                    members.push_back( m );
+                }
+
+                p += 46 + nameLen + extraLen + commentLen;
+            }
+
+            return true;
+        } //ReadZip
+
+        static unsigned long long TarNumber( const BYTE * p, int len )
+        {
+            // GNU tar stores values too large for octal in base 256, flagged by the high bit
+
+            unsigned long long x = 0;
+
+            if ( p[ 0 ] & 0x80 )
+            {
+                x = p[ 0 ] & 0x7f;
+
+                for ( int i = 1; i < len; i++ )
+                    x = ( x << 8 ) | p[ i ];
+
+                return x;
+            }
+
+            for ( int i = 0; i < len && 0 != p[ i ]; i++ )
+            {
+                if ( p[ i ] >= '0' && p[ i ] <= '7' )
+                    x = ( x * 8 ) + ( p[ i ] - '0' );
+                else if ( ' ' != p[ i ] )
+                    break;
+            }
+
+            return x;
+        } //TarNumber
+
+        static bool TarChecksumOk( const BYTE * h )
+        {
+            // the checksum is computed with its own field treated as spaces
+
+            unsigned long long sum = 0;
+
+            for ( int i = 0; i < 512; i++ )
+                sum += ( i >= 148 && i < 156 ) ? ' ' : h[ i ];
+
+            return ( sum == TarNumber( h + 148, 8 ) );
+        } //TarChecksumOk
+
+        static bool ReadTar( CStream & s, MemberList & members )
+        {
+            BYTE h[ 512 ];
+            __int64 offset = 0;
+            string longName;     // from a GNU 'L' entry or a pax 'x' entry, applied to the next file
+
+            while ( ( offset + 512 ) <= s.Length() && ReadAt( s, offset, h, sizeof h ) )
+            {
+                // the archive ends with zero blocks
+
+                if ( 0 == h[ 0 ] )
+                    break;
+
+                if ( !TarChecksumOk( h ) )
+                    return ( 0 != offset );
+
+                unsigned long long size = TarNumber( h + 124, 12 );
+                char type = (char) h[ 156 ];
+                __int64 data = offset + 512;
+
+                if ( 'L' == type || 'x' == type )
+                {
+                    vector<char> text( (size_t) __min( size, (unsigned long long) 65536 ) + 1 );
+
+                    if ( !ReadAt( s, data, text.data(), (ULONG) text.size() - 1 ) )
+                        break;
+
+                    text[ text.size() - 1 ] = 0;
+
+                    if ( 'L' == type )
+                        longName = text.data();
+                    else
+                    {
+                        // pax records are "length keyword=value\n"
+
+                        const char * pc = strstr( text.data(), " path=" );
+
+                        if ( NULL != pc )
+                        {
+                            pc += 6;
+                            const char * end = strchr( pc, '\n' );
+                            longName.assign( pc, ( NULL == end ) ? strlen( pc ) : end - pc );
+                        }
+                    }
+                }
+                else
+                {
+                    if ( '0' == type || 0 == type || '7' == type )
+                    {
+                        string name;
+
+                        if ( 0 != longName.size() )
+                            name = longName;
+                        else
+                        {
+                            if ( !memcmp( h + 257, "ustar", 5 ) && 0 != h[ 345 ] )
+                            {
+                                name.assign( (const char *) h + 345, strnlen( (const char *) h + 345, 155 ) );
+                                name += '/';
+                            }
+
+                            name.append( (const char *) h, strnlen( (const char *) h, 100 ) );
+                        }
+
+                        Member m;
+                        m.name = Widen( name.c_str(), name.size(), true );
+                        Normalize( m.name );
+                        m.offset = data;
+                        m.size = m.compressedSize = size;
+                        m.method = MethodStored;
+                        m.zip = false;
+                        members.push_back( m );
+                    }
+
+                    longName.clear();
+                }
+
+                offset = data + ( ( size + 511 ) & ~511ull );
+            }
+
+            return true;
+        } //ReadTar
+
+        static __int64 DataOffset( CStream & s, const Member & m )
+        {
+            if ( !m.zip )
+                return m.offset;
+
+            // the local header's name and extra field lengths can differ from the central directory's
+
+            BYTE h[ 30 ];
+            if ( !ReadAt( s, m.offset, h, sizeof h ) || 0x04034b50 != Le( h, 4 ) )
+                return -1;
+
+            return m.offset + 30 + Le( h + 26, 2 ) + Le( h + 28, 2 );
+        } //DataOffset
+
+    public:
+        static bool IsArchive( const WCHAR * pwcPath )
+        {
+            const WCHAR * pwcExt = wcsrchr( pwcPath, L'.' );
+
+            return ( NULL != pwcExt && ( !_wcsicmp( pwcExt, L".zip" ) || !_wcsicmp( pwcExt, L".tar" ) ) );
+        } //IsArchive
+
+        static bool IsMemberPath( const WCHAR * pwcPath ) { return ( NULL != wcschr( pwcPath, Separator ) ); }
+
+        static shared_ptr<const MemberList> Members( const WCHAR * pwcArchive )
+        {
+            wstring key( pwcArchive );
+            Normalize( key );
+
+            {
+                lock_guard<mutex> lock( CacheMutex() );
+                auto it = Cache().find( key );
+                if ( it != Cache().end() )
+                    return it->second;
+            }
+
+            // read outside the lock so archives are indexed in parallel
+
+            shared_ptr<MemberList> list = make_shared<MemberList>();
+            CStream s( pwcArchive );
+
+            if ( s.Ok() )
+            {
+                const WCHAR * pwcExt = wcsrchr( pwcArchive, L'.' );
+                bool ok = ( NULL != pwcExt && !_wcsicmp( pwcExt, L".zip" ) ) ? ReadZip( s, *list ) : ReadTar( s, *list );
+
+                if ( !ok )
+                {
+                    tracer.Trace( "can't read the member list of archive %ws\n", pwcArchive );
+                    list->clear();
+                }
+
+                sort( list->begin(), list->end(), [] ( const Member & a, const Member & b ) { return a.name < b.name; } );
+            }
+
+            lock_guard<mutex> lock( CacheMutex() );
+            shared_ptr<const MemberList> & slot = Cache()[ key ];
+            if ( !slot )
+                slot = list;
+
+            return slot;
+        } //Members
+
+        static bool FindMember( const WCHAR * pwcPath, wstring & archive, Member & member )
+        {
+            const WCHAR * pwcSep = wcschr( pwcPath, Separator );
+            if ( NULL == pwcSep )
+                return false;
+
+            archive.assign( pwcPath, pwcSep - pwcPath );
+            shared_ptr<const MemberList> list = Members( archive.c_str() );
+
+            Member key;
+            key.name = pwcSep + 1;
+            Normalize( key.name );
+
+            auto it = lower_bound( list->begin(), list->end(), key, [] ( const Member & a, const Member & b ) { return a.name < b.name; } );
+            if ( it == list->end() || it->name != key.name )
+                return false;
+
+            member = *it;
+            return true;
+        } //FindMember
+
+        // Size and last write time of a file, or of a member and its archive
+
+        static bool GetFileInfo( const WCHAR * pwcPath, unsigned long long & size, unsigned long long & lastWrite )
+        {
+            wstring archive;
+            Member m;
+            bool isMember = IsMemberPath( pwcPath );
+
+            if ( isMember && !FindMember( pwcPath, archive, m ) )
+                return false;
+
+            WIN32_FILE_ATTRIBUTE_DATA data;
+            if ( !GetFileAttributesEx( isMember ? archive.c_str() : pwcPath, GetFileExInfoStandard, &data ) )
+                return false;
+
+            size = isMember ? m.size : ( ( (unsigned long long) data.nFileSizeHigh ) << 32 ) | data.nFileSizeLow;
+            lastWrite = ( ( (unsigned long long) data.ftLastWriteTime.dwHighDateTime ) << 32 ) | data.ftLastWriteTime.dwLowDateTime;
+            return true;
+        } //GetFileInfo
+
+        // Opens length bytes at offset in a file or archive member. Returns NULL if it can't.
+        // With prefixOnly, offset and length are ignored and only the start of a deflated member is decompressed;
+        // the stream still has the member's full length but reads past what was decompressed return nothing.
+
+        static CStream * Open( const WCHAR * pwcPath, __int64 offset = 0, __int64 length = _I64_MAX, bool prefixOnly = false )
+        {
+            if ( !IsMemberPath( pwcPath ) )
+                return new CStream( pwcPath, offset, length );
+
+            wstring archive;
+            Member m;
+
+            if ( prefixOnly )
+            {
+                offset = 0;
+                length = _I64_MAX;
+            }
+
+            if ( !FindMember( pwcPath, archive, m ) || offset < 0 || length < 0 || (unsigned long long) offset > m.size )
+                return NULL;
+
+            length = (__int64) __min( (unsigned long long) length, m.size - offset );
+
+            CStream s( archive.c_str() );
+            __int64 dataOffset = DataOffset( s, m );
+            if ( dataOffset < 0 )
+                return NULL;
+
+            if ( MethodStored == m.method )
+            {
+                s.CloseFile();
+                return new CStream( archive.c_str(), dataOffset + offset, length );
+            }
+
+            unsigned long long want = prefixOnly ? __min( m.size, (unsigned long long) MaxInflatedPrefix ) : offset + length;
+            if ( want > MaxInflatedMember )
+                return NULL;
+
+            vector<BYTE> data;
+            s.Seek( dataOffset );
+
+            if ( !CInflate::Inflate( s, m.compressedSize, data, (size_t) want ) )
+                tracer.Trace( "can't decompress archive member %ws\n", pwcPath );
+
+            if ( prefixOnly )
+                return new CStream( data, m.size );
+
+            if ( data.size() < want )
+                return NULL;
+
+            data.erase( data.begin(), data.begin() + (size_t) offset );
+            return new CStream( data, length );
+        } //Open
+}; //CArchive
+
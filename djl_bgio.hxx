@@ -0,0 +1,99 @@
+#pragma once
+
+//
+// Lets a scan of many terabytes share a host with other services.
+// Scan threads in background mode have very low I/O priority, so other apps' reads go first, and very low
+// memory priority, so the pages they read go on the low priority standby list. Windows reuses those pages
+// before the cached pages other apps depend on, so a big scan doesn't push their data out of the cache.
+// Metadata regions are still read with one large read per file (see CImageData::Preload).
+// Large previews can be read with the cache bypassed entirely, which avoids caching data that's read once.
+//
+
+#include <windows.h>
+
+#include "djl_strm.hxx"
+
+class CBackgroundIo
+{
+    public:
+        static const ULONG MinUnbufferedBytes = 1024 * 1024;   // smaller reads cost more unbuffered than cached
+
+        static bool & Enabled()
+        {
+            static bool enabled = false;
+            return enabled;
+        } //Enabled
+
+        static bool & Unbuffered()
+        {
+            static bool unbuffered = false;
+            return unbuffered;
+        } //Unbuffered
+
+        // Puts the calling thread in background mode for the object's lifetime if background mode is enabled
+
+        class CThreadScope
+        {
+            private:
+                bool entered;
+
+            public:
+                CThreadScope()
+                {
+                    entered = Enabled() && SetThreadPriority( GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN );
+                } //CThreadScope
+
+                ~CThreadScope()
+                {
+                    if ( entered )
+                        SetThreadPriority( GetCurrentThread(), THREAD_MODE_BACKGROUND_END );
+                } //~CThreadScope
+        }; //CThreadScope
+
+        // Reads cb bytes at location of the file without the cache. Unbuffered reads must start and end on
+        // sector boundaries into aligned memory, so the whole sectors are read into a page aligned buffer.
+        // Returns the number of bytes read, which is less than cb near the end of the file.
+
+        static ULONG ReadUnbuffered( const WCHAR * pwcFile, __int64 location, void * pv, ULONG cb )
+        {
+            const __int64 Alignment = 4096;       // a multiple of the sector size of disks in use
+
+            __int64 start = location & ~( Alignment - 1 );
+            __int64 end = ( location + cb + Alignment - 1 ) & ~( Alignment - 1 );
+            ULONG span = (ULONG) ( end - start );
+            ULONG skip = (ULONG) ( location - start );
+
+            HANDLE hFile = CreateFile( pwcFile, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING,
+                                       FILE_FLAG_NO_BUFFERING | FILE_FLAG_SEQUENTIAL_SCAN, NULL );
+            if ( INVALID_HANDLE_VALUE == hFile )
+                return 0;
+
+            BYTE * buffer = (BYTE *) VirtualAlloc( NULL, span, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE );
+            DWORD dwRead = 0;
+
+            if ( NULL != buffer )
+            {
+                LARGE_INTEGER li;
+                li.QuadPart = start;
+
+                if ( !SetFilePointerEx( hFile, li, NULL, FILE_BEGIN ) || !ReadFile( hFile, buffer, span, &dwRead, NULL ) )
+                {
+                    tracer.Trace( "unbuffered read of %ws failed, error %d\n", pwcFile, GetLastError() );
+                    dwRead = 0;
+                }
+            }
+
+            CStream::ThreadBytesRead() += dwRead;
+
+            ULONG result = ( dwRead > skip ) ? __min( cb, dwRead - skip ) : 0;
+            if ( 0 != result )
+                memcpy( pv, buffer + skip, result );
+
+            if ( NULL != buffer )
+                VirtualFree( buffer, 0, MEM_RELEASE );
+
+            CloseHandle( hFile );
+            return result;
+        } //ReadUnbuffered
+}; //CBackgroundIo
+
@@ -0,0 +1,497 @@
+#pragma once
+
+//
+// Applies rating and rotation updates to many files at once.
+//   1) Parse the list of requests. Each line is an action then a path: 0..5 sets the rating,
+//      r rotates right, l rotates left. Multiple lines for one file are applied in order.
+//   2) In parallel and read-only, find the file offsets of the XMP rating and EXIF orientation.
+//   3) Write every planned change (offset, old bytes, new bytes) to a journal and flush it.
+//   4) In parallel, apply the changes with positional writes, optionally flushing each file.
+//   5) Delete the journal.
+// If the batch is interrupted, the journal remains and the batch can be resumed or rolled back.
+// Each write checks the bytes currently in the file first, so resuming and rolling back are
+// idempotent and files changed by someone else since planning are left alone.
+//
+
+#include <windows.h>
+#include <stdio.h>
+#include <io.h>
+#include <fcntl.h>
+#include <ppl.h>
+
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "djlimagedata.hxx"
+
+using namespace std;
+using namespace concurrency;
+
+class CBulkMetadataWriter
+{
+    public:
+        enum FlushPolicy { flushNone, flushEachFile };
+
+    private:
+        struct Request
+        {
+            wstring path;
+            WCHAR action;       // L'0'..L'5', L'r', or L'l'
+            size_t order;       // position in the list, so actions on a file apply in list order
+        };
+
+        struct PlannedWrite
+        {
+            size_t file;        // index into files
+            __int64 offset;
+            ULONG cb;           // 1 for ratings, 2 for orientation
+            byte oldBytes[ 2 ];
+            byte newBytes[ 2 ];
+        };
+
+        struct FileActions
+        {
+            size_t first;       // index into requests
+            size_t count;
+        };
+
+        vector<Request> requests;
+        vector<wstring> files;
+        vector<PlannedWrite> writes;     // grouped by file
+        FlushPolicy flush;
+        bool oneThread;
+
+        LONG unwritable;                 // files with no rating/orientation field to update
+        LONG applied;
+        LONG alreadyApplied;
+        LONG conflicts;
+        LONG failures;
+
+        static const WCHAR * JournalSignature() { return L"aid-journal 1"; }
+
+        static void TrimNewline( WCHAR * pwc )
+        {
+            size_t len = wcslen( pwc );
+            while ( len > 0 && ( L'\n' == pwc[ len - 1 ] || L'\r' == pwc[ len - 1 ] ) )
+                pwc[ --len ] = 0;
+        } //TrimNewline
+
+        template <class T> void ForEach( size_t count, T work )
+        {
+            if ( oneThread )
+            {
+                for ( size_t i = 0; i < count; i++ )
+                    work( i );
+            }
+            else
+            {
+                parallel_for ( (size_t) 0, count, [&] ( size_t i )
+                {
+                    work( i );
+                } );
+            }
+        } //ForEach
+
+        void PlanFile( size_t f, FileActions & fa, vector<PlannedWrite> & planned )
+        {
+            CImageData id;
+            const WCHAR * pwcPath = files[ f ].c_str();
+            __int64 ratingOffset = 0;
+            char rating = 0;
+            __int64 oOffset = 0, oOffset2 = 0;
+            int orientation = 0;
+            bool littleEndian = true;
+
+            bool canRate = id.GetRatingLocation( pwcPath, ratingOffset, rating );
+            bool canRotate = id.GetOrientationLocation( pwcPath, oOffset, oOffset2, orientation, littleEndian );
+            char newRating = rating;
+            WORD newOrientation = (WORD) orientation;
+            bool ok = true;
+
+            for ( size_t r = fa.first; r < fa.first + fa.count; r++ )
+            {
+                WCHAR action = requests[ r ].action;
+
+                if ( action >= L'0' && action <= L'5' )
+                {
+                    ok = ok && canRate;
+                    newRating = (char) ( action - L'0' );
+                }
+                else
+                {
+                    ok = ok && canRotate;
+
+                    if ( newOrientation < 1 || newOrientation > 8 )
+                        newOrientation = 1;         // some cameras write 0; treated as 1, as RotateImage does
+
+                    newOrientation = CImageData::NextOrientation( newOrientation, ( L'r' == action ) );
+                }
+            }
+
+            if ( !ok )
+            {
+                tracer.Trace( "bulk write: file has no rating or orientation field to update: %ws\n", pwcPath );
+                InterlockedIncrement( &unwritable );
+                return;
+            }
+
+            if ( canRate && newRating != rating )
+            {
+                PlannedWrite w = { f, ratingOffset, 1, { (byte) ( '0' + rating ), 0 }, { (byte) ( '0' + newRating ), 0 } };
+                planned.push_back( w );
+            }
+
+            if ( canRotate && newOrientation != (WORD) orientation )
+            {
+                WORD o = littleEndian ? (WORD) orientation : _byteswap_ushort( (WORD) orientation );
+                WORD n = littleEndian ? newOrientation : _byteswap_ushort( newOrientation );
+                PlannedWrite w = { f, oOffset, 2 };
+                memcpy( w.oldBytes, &o, sizeof o );
+                memcpy( w.newBytes, &n, sizeof n );
+                planned.push_back( w );
+
+                if ( 0 != oOffset2 )
+                {
+                    w.offset = oOffset2;
+                    planned.push_back( w );
+                }
+            }
+        } //PlanFile
+
+        static bool PositionalRead( HANDLE h, __int64 offset, void * pv, ULONG cb )
+        {
+            OVERLAPPED o = { 0 };
+            o.Offset = (DWORD) ( offset & 0xffffffff );
+            o.OffsetHigh = (DWORD) ( offset >> 32 );
+            DWORD dwRead = 0;
+            return ReadFile( h, pv, cb, &dwRead, &o ) && ( dwRead == cb );
+        } //PositionalRead
+
+        static bool PositionalWrite( HANDLE h, __int64 offset, const void * pv, ULONG cb )
+        {
+            OVERLAPPED o = { 0 };
+            o.Offset = (DWORD) ( offset & 0xffffffff );
+            o.OffsetHigh = (DWORD) ( offset >> 32 );
+            DWORD dwWritten = 0;
+            return WriteFile( h, pv, cb, &dwWritten, &o ) && ( dwWritten == cb );
+        } //PositionalWrite
+
+        // Applies (or undoes) the writes for one file. Writes for a file are adjacent in the writes vector.
+
+        void ApplyFile( size_t first, size_t count, bool rollback )
+        {
+            const WCHAR * pwcPath = files[ writes[ first ].file ].c_str();
+            HANDLE h = CreateFile( pwcPath, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL );
+
+            if ( INVALID_HANDLE_VALUE == h )
+            {
+                tracer.Trace( "bulk write: can't open file for write, error %d: %ws\n", GetLastError(), pwcPath );
+                InterlockedExchangeAdd( &failures, (LONG) count );
+                return;
+            }
+
+            bool wrote = false;
+
+            for ( size_t i = first; i < first + count; i++ )
+            {
+                PlannedWrite & w = writes[ i ];
+                const byte * pExpected = rollback ? w.newBytes : w.oldBytes;
+                const byte * pTarget = rollback ? w.oldBytes : w.newBytes;
+                byte current[ 2 ];
+
+                if ( !PositionalRead( h, w.offset, current, w.cb ) )
+                {
+                    tracer.Trace( "bulk write: can't read offset %lld, error %d: %ws\n", w.offset, GetLastError(), pwcPath );
+                    InterlockedIncrement( &failures );
+                }
+                else if ( !memcmp( current, pTarget, w.cb ) )
+                    InterlockedIncrement( &alreadyApplied );
+                else if ( memcmp( current, pExpected, w.cb ) )
+                {
+                    tracer.Trace( "bulk write: file changed since the batch was planned, offset %lld: %ws\n", w.offset, pwcPath );
+                    InterlockedIncrement( &conflicts );
+                }
+                else if ( PositionalWrite( h, w.offset, pTarget, w.cb ) )
+                {
+                    InterlockedIncrement( &applied );
+                    wrote = true;
+                }
+                else
+                {
+                    tracer.Trace( "bulk write: can't write offset %lld, error %d: %ws\n", w.offset, GetLastError(), pwcPath );
+                    InterlockedIncrement( &failures );
+                }
+            }
+
+            if ( wrote && flushEachFile == flush )
+            {
+                if ( !FlushFileBuffers( h ) )
+                {
+                    tracer.Trace( "bulk write: can't flush file, error %d: %ws\n", GetLastError(), pwcPath );
+                    InterlockedIncrement( &failures );
+                }
+            }
+
+            CloseHandle( h );
+        } //ApplyFile
+
+        void ApplyAll( bool rollback )
+        {
+            vector<size_t> starts;
+            for ( size_t i = 0; i < writes.size(); i++ )
+                if ( 0 == i || writes[ i ].file != writes[ i - 1 ].file )
+                    starts.push_back( i );
+
+            starts.push_back( writes.size() );
+
+            ForEach( starts.size() - 1, [&] ( size_t s )
+            {
+                ApplyFile( starts[ s ], starts[ s + 1 ] - starts[ s ], rollback );
+            } );
+        } //ApplyAll
+
+        bool WriteJournal( const WCHAR * pwcJournal )
+        {
+            FILE * fp = _wfopen( pwcJournal, L"wt, ccs=UTF-8" );
+            if ( NULL == fp )
+            {
+                printf( "can't create journal file %ws\n", pwcJournal );
+                return false;
+            }
+
+            fwprintf( fp, L"%ls\n", JournalSignature() );
+
+            for ( size_t i = 0; i < writes.size(); i++ )
+            {
+                PlannedWrite & w = writes[ i ];
+                fwprintf( fp, L"W %I64d %u %u %u %ls\n", w.offset, w.cb,
+                          (unsigned int) ( w.oldBytes[ 0 ] | ( w.oldBytes[ 1 ] << 8 ) ),
+                          (unsigned int) ( w.newBytes[ 0 ] | ( w.newBytes[ 1 ] << 8 ) ), files[ w.file ].c_str() );
+            }
+
+            // the journal must be durable before any file is modified
+
+            bool ok = ( 0 == fflush( fp ) ) && ( 0 == _commit( _fileno( fp ) ) );
+            fclose( fp );
+
+            if ( !ok )
+                printf( "can't flush journal file %ws\n", pwcJournal );
+
+            return ok;
+        } //WriteJournal
+
+        bool ReadJournal( const WCHAR * pwcJournal )
+        {
+            FILE * fp = _wfopen( pwcJournal, L"rt, ccs=UTF-8" );
+            if ( NULL == fp )
+            {
+                printf( "can't open journal file %ws\n", pwcJournal );
+                return false;
+            }
+
+            static WCHAR awcLine[ MAX_PATH + 100 ];
+            bool ok = ( NULL != fgetws( awcLine, _countof( awcLine ), fp ) );
+
+            if ( ok )
+            {
+                TrimNewline( awcLine );
+                ok = !wcscmp( awcLine, JournalSignature() );
+            }
+
+            while ( ok && fgetws( awcLine, _countof( awcLine ), fp ) )
+            {
+                TrimNewline( awcLine );
+
+                __int64 offset;
+                unsigned int cb, oldValue, newValue;
+                int pathStart = 0;
+
+                if ( 4 != swscanf_s( awcLine, L"W %I64d %u %u %u %n", &offset, &cb, &oldValue, &newValue, &pathStart ) ||
+                     ( cb < 1 || cb > 2 ) || 0 == pathStart || 0 == awcLine[ pathStart ] )
+                {
+                    ok = false;
+                    break;
+                }
+
+                if ( files.empty() || wcscmp( files.back().c_str(), awcLine + pathStart ) )
+                    files.push_back( awcLine + pathStart );
+
+                PlannedWrite w = { files.size() - 1, offset, cb,
+                                   { (byte) ( oldValue & 0xff ), (byte) ( oldValue >> 8 ) },
+                                   { (byte) ( newValue & 0xff ), (byte) ( newValue >> 8 ) } };
+                writes.push_back( w );
+            }
+
+            fclose( fp );
+
+            if ( !ok )
+                printf( "journal file %ws is corrupt\n", pwcJournal );
+
+            return ok;
+        } //ReadJournal
+
+        void PrintSummary( const char * pcWhat )
+        {
+            printf( "%s: %zd writes planned in %zd files\n", pcWhat, writes.size(), files.size() );
+            printf( "  applied:                  %d\n", applied );
+            printf( "  already applied:          %d\n", alreadyApplied );
+            printf( "  skipped, file changed:    %d\n", conflicts );
+            printf( "  failed:                   %d\n", failures );
+
+            if ( unwritable > 0 )
+                printf( "  files with no field to update: %d\n", unwritable );
+        } //PrintSummary
+
+        bool Finish( const WCHAR * pwcJournal, const char * pcWhat )
+        {
+            PrintSummary( pcWhat );
+
+            if ( 0 != failures )
+            {
+                printf( "journal %ws was kept; rerun with /u:resume or /u:rollback\n", pwcJournal );
+                return false;
+            }
+
+            DeleteFile( pwcJournal );
+            return true;
+        } //Finish
+
+    public:
+        CBulkMetadataWriter( FlushPolicy f, bool one ) :
+            flush( f ), oneThread( one ), unwritable( 0 ), applied( 0 ), alreadyApplied( 0 ), conflicts( 0 ), failures( 0 ) {}
+
+        // The list is a file or L"-" for stdin. Returns false if the list has errors.
+
+        bool LoadRequests( const WCHAR * pwcList )
+        {
+            FILE * fp = NULL;
+
+            if ( !wcscmp( pwcList, L"-" ) )
+            {
+                _setmode( _fileno( stdin ), _O_U8TEXT );
+                fp = stdin;
+            }
+            else
+                fp = _wfopen( pwcList, L"rt, ccs=UTF-8" );
+
+            if ( NULL == fp )
+            {
+                printf( "can't open list file %ws\n", pwcList );
+                return false;
+            }
+
+            static WCHAR awcLine[ MAX_PATH + 100 ];
+            bool ok = true;
+            size_t lineNumber = 0;
+
+            while ( fgetws( awcLine, _countof( awcLine ), fp ) )
+            {
+                lineNumber++;
+                TrimNewline( awcLine );
+
+                WCHAR * pwc = awcLine;
+                while ( iswspace( *pwc ) )
+                    pwc++;
+
+                if ( 0 == *pwc || L'#' == *pwc )
+                    continue;
+
+                WCHAR action = towlower( *pwc );
+                WCHAR * pwcPath = pwc + 1;
+                while ( iswspace( *pwcPath ) )
+                    pwcPath++;
+
+                if ( ( ( action < L'0' || action > L'5' ) && L'r' != action && L'l' != action ) ||
+                     !iswspace( pwc[ 1 ] ) || 0 == *pwcPath )
+                {
+                    printf( "list line %zd is malformed; expected 0-5, r, or l followed by a path: %ws\n", lineNumber, awcLine );
+                    ok = false;
+                    continue;
+                }
+
+                WCHAR awcFull[ MAX_PATH + 1 ];
+                if ( NULL == _wfullpath( awcFull, pwcPath, _countof( awcFull ) ) )
+                {
+                    printf( "list line %zd has an invalid path: %ws\n", lineNumber, pwcPath );
+                    ok = false;
+                    continue;
+                }
+
+                Request r = { awcFull, action, requests.size() };
+                requests.push_back( r );
+            }
+
+            if ( stdin != fp )
+                fclose( fp );
+
+            return ok;
+        } //LoadRequests
+
+        bool Run( const WCHAR * pwcJournal )
+        {
+            if ( INVALID_FILE_ATTRIBUTES != GetFileAttributes( pwcJournal ) )
+            {
+                printf( "journal %ws from an interrupted batch exists; use /u:resume or /u:rollback first\n", pwcJournal );
+                return false;
+            }
+
+            // group requests by file, keeping list order within a file
+
+            sort( requests.begin(), requests.end(), [] ( const Request & a, const Request & b )
+            {
+                int c = _wcsicmp( a.path.c_str(), b.path.c_str() );
+                if ( 0 != c )
+                    return c < 0;
+
+                return a.order < b.order;
+            } );
+
+            vector<FileActions> actions;
+            for ( size_t r = 0; r < requests.size(); r++ )
+            {
+                if ( 0 == r || _wcsicmp( requests[ r ].path.c_str(), requests[ r - 1 ].path.c_str() ) )
+                {
+                    FileActions fa = { r, 0 };
+                    actions.push_back( fa );
+                    files.push_back( requests[ r ].path );
+                }
+
+                actions.back().count++;
+            }
+
+            printf( "%zd requests for %zd files\n", requests.size(), files.size() );
+
+            vector<vector<PlannedWrite>> planned( files.size() );
+
+            ForEach( files.size(), [&] ( size_t f )
+            {
+                PlanFile( f, actions[ f ], planned[ f ] );
+            } );
+
+            for ( size_t f = 0; f < planned.size(); f++ )
+                writes.insert( writes.end(), planned[ f ].begin(), planned[ f ].end() );
+
+            if ( 0 == writes.size() )
+            {
+                PrintSummary( "nothing to update" );
+                return ( 0 == unwritable );
+            }
+
+            if ( !WriteJournal( pwcJournal ) )
+                return false;
+
+            ApplyAll( false );
+            return Finish( pwcJournal, "bulk update" );
+        } //Run
+
+        bool Recover( const WCHAR * pwcJournal, bool rollback )
+        {
+            if ( !ReadJournal( pwcJournal ) )
+                return false;
+
+            ApplyAll( rollback );
+            return Finish( pwcJournal, rollback ? "rollback" : "resume" );
+        } //Recover
+}; //CBulkMetadataWriter
+
@@ -779,7 +779,7 @@ class CCropFactor
             //tracer.Trace( "crop factor lookup for %s: %lf\n", pcCameraModel, result );
 
             if ( DBL_MAX == result )
-                tracer.Trace( "crop factor can't find camera model '%s'\n", pcCameraModel );
+                tracer.TraceAt( CDJLTrace::TraceVerbose, CDJLTrace::CategoryParse, "crop factor can't find camera model '%s'\n", pcCameraModel );
 
             return result;
         } //GetCropFactor
@@ -0,0 +1,683 @@
+#pragma once
+
+//
+// Decodes just the DC coefficient of each 8x8 block of a JPEG, which is the block's average, so the result
+// is the image at 1/8 scale with no IDCT. The AC coefficients still have to be Huffman decoded to find
+// where the next block starts, but they aren't dequantized or transformed.
+// Handles baseline and extended sequential files with interleaved scans, and progressive files whose
+// first scan is the interleaved DC scan, which is how cameras and libjpeg write them. 12-bit, lossless,
+// arithmetic coded, and CMYK files aren't handled; Decode returns false for them.
+// Analyze summarizes the 1/8 scale image: mean luminance, a luminance histogram, and the dominant color.
+//
+
+#include <windows.h>
+#include <math.h>
+
+#include <vector>
+
+#if defined( _M_X64 ) || defined( _M_IX86 ) || defined( __SSE2__ )
+    #include <emmintrin.h>
+    #define DCJPG_SSE2
+#endif
+
+using namespace std;
+
+class CDCJpeg
+{
+    public:
+        enum Color { colorBlack, colorGray, colorWhite, colorRed, colorOrange, colorYellow, colorGreen,
+                     colorCyan, colorBlue, colorPurple, colorMagenta, colorCount };
+
+        static const int HistogramBins = 8;
+
+        struct Look
+        {
+            int width;                          // of the 1/8 scale image
+            int height;
+            double meanLuma;                    // 0..255
+            ULONG histogram[ HistogramBins ];   // pixels with luma in each 1/8 of the range
+            Color dominant;                     // the color of the most pixels
+            double dominantShare;               // fraction of pixels that are the dominant color
+        };
+
+        static const char * ColorName( int c )
+        {
+            static const char * names[ colorCount ] = { "black", "gray", "white", "red", "orange", "yellow", "green",
+                                                        "cyan", "blue", "purple", "magenta" };
+
+            return ( c >= 0 && c < colorCount ) ? names[ c ] : "unknown";
+        } //ColorName
+
+    private:
+        static const int LookBits = 9;          // codes this long or shorter are decoded with one lookup
+
+        struct HuffmanTable
+        {
+            bool defined;
+            BYTE lookLength[ 1 << LookBits ];   // 0 if the code is longer than LookBits
+            BYTE lookValue[ 1 << LookBits ];
+            int maxCode[ 18 ];                  // largest code of each length, -1 if none
+            int valueOffset[ 17 ];
+            BYTE values[ 256 ];
+        };
+
+        struct Component
+        {
+            int id;
+            int h, v;                           // sampling factors
+            int quantTable;
+            int dcTable, acTable;
+            int predictor;
+        };
+
+        const BYTE * pData;
+        size_t cbData;
+        size_t pos;
+        unsigned int bitBuffer;                 // next bits at the top
+        int bitCount;
+        size_t overrun;                         // zero bytes supplied past the end of the data
+
+        HuffmanTable dcTables[ 4 ];
+        HuffmanTable acTables[ 4 ];
+        int quantDC[ 4 ];
+        Component components[ 3 ];
+        int componentCount;
+        int width, height;
+        int hMax, vMax;
+        int restartInterval;
+        bool progressive;
+
+        int outWidth, outHeight;                // of the planes, a whole number of MCUs
+        vector<BYTE> planes[ 3 ];
+
+        // Returns false if the counts don't form a Huffman code, i.e. there are more codes of a length than
+        // that many bits can hold. The codes index the lookup tables, so that's checked before they're filled.
+
+        static bool BuildTable( HuffmanTable & t, const BYTE * counts )
+        {
+            memset( t.lookLength, 0, sizeof t.lookLength );
+            t.defined = false;
+            int code = 0, k = 0;
+
+            for ( int len = 1; len <= 16; len++ )
+            {
+                if ( code + counts[ len - 1 ] > ( 1 << len ) )
+                    return false;
+
+                t.valueOffset[ len ] = k - code;
+
+                for ( int i = 0; i < counts[ len - 1 ]; i++ )
+                {
+                    if ( len <= LookBits )
+                    {
+                        int shift = LookBits - len;
+
+                        for ( int fill = 0; fill < ( 1 << shift ); fill++ )
+                        {
+                            t.lookLength[ ( code << shift ) | fill ] = (BYTE) len;
+                            t.lookValue[ ( code << shift ) | fill ] = t.values[ k ];
+                        }
+                    }
+
+                    code++;
+                    k++;
+                }
+
+                t.maxCode[ len ] = ( 0 == counts[ len - 1 ] ) ? -1 : code - 1;
+                code <<= 1;
+            }
+
+            t.maxCode[ 17 ] = INT_MAX;
+            t.defined = true;
+            return true;
+        } //BuildTable
+
+        // Fills the bit buffer to at least 25 bits. Stuffed zero bytes are dropped, and at a marker or the
+        // end of the data zeros are supplied; a marker is left for the restart logic to consume.
+
+        void Fill()
+        {
+            while ( bitCount <= 24 )
+            {
+                unsigned int b = 0;
+
+                if ( pos < cbData && ( 0xff != pData[ pos ] || ( pos + 1 < cbData && 0 == pData[ pos + 1 ] ) ) )
+                {
+                    b = pData[ pos ];
+                    pos += ( 0xff == b ) ? 2 : 1;
+                }
+                else
+                    overrun++;
+
+                bitBuffer |= b << ( 24 - bitCount );
+                bitCount += 8;
+            }
+        } //Fill
+
+        int GetBits( int n )
+        {
+            if ( 0 == n )
+                return 0;
+
+            Fill();
+            int bits = (int) ( bitBuffer >> ( 32 - n ) );
+            bitBuffer <<= n;
+            bitCount -= n;
+            return bits;
+        } //GetBits
+
+        // F.12: a value of s bits is negative if its top bit is clear
+
+        static int Extend( int value, int s )
+        {
+            return ( value < ( 1 << ( s - 1 ) ) ) ? value - ( 1 << s ) + 1 : value;
+        } //Extend
+
+        int Decode( HuffmanTable & t )
+        {
+            Fill();
+
+            int look = (int) ( bitBuffer >> ( 32 - LookBits ) );
+            int len = t.lookLength[ look ];
+
+            if ( 0 != len )
+            {
+                bitBuffer <<= len;
+                bitCount -= len;
+                return t.lookValue[ look ];
+            }
+
+            int code = look;
+            len = LookBits;
+
+            while ( code > t.maxCode[ len ] )
+            {
+                len++;
+                code = (int) ( bitBuffer >> ( 32 - len ) );
+            }
+
+            bitBuffer <<= len;
+            bitCount -= len;
+
+            if ( len > 16 )
+                return 0;
+
+            return t.values[ ( t.valueOffset[ len ] + code ) & 0xff ];
+        } //Decode
+
+        WORD SegmentLength( size_t at ) { return (WORD) ( ( pData[ at ] << 8 ) | pData[ at + 1 ] ); }
+
+        bool ParseFrame( const BYTE * p, size_t cb )
+        {
+            if ( cb < 6 || 8 != p[ 0 ] )
+                return false;
+
+            height = ( p[ 1 ] << 8 ) | p[ 2 ];
+            width = ( p[ 3 ] << 8 ) | p[ 4 ];
+            componentCount = p[ 5 ];
+
+            if ( 0 == width || 0 == height || ( 1 != componentCount && 3 != componentCount ) || cb < 6 + 3 * (size_t) componentCount )
+                return false;
+
+            hMax = vMax = 1;
+
+            for ( int c = 0; c < componentCount; c++ )
+            {
+                Component & comp = components[ c ];
+                comp.id = p[ 6 + c * 3 ];
+                comp.h = p[ 7 + c * 3 ] >> 4;
+                comp.v = p[ 7 + c * 3 ] & 0xf;
+                comp.quantTable = p[ 8 + c * 3 ] & 3;
+
+                if ( comp.h < 1 || comp.h > 4 || comp.v < 1 || comp.v > 4 )
+                    return false;
+
+                hMax = __max( hMax, comp.h );
+                vMax = __max( vMax, comp.v );
+            }
+
+            for ( int c = 0; c < componentCount; c++ )
+                if ( 0 != ( hMax % components[ c ].h ) || 0 != ( vMax % components[ c ].v ) )
+                    return false;
+
+            // a grayscale scan isn't interleaved, so each block is an MCU whatever the sampling factors say
+
+            if ( 1 == componentCount )
+                components[ 0 ].h = components[ 0 ].v = hMax = vMax = 1;
+
+            return true;
+        } //ParseFrame
+
+        bool ParseHuffman( const BYTE * p, size_t cb )
+        {
+            while ( cb >= 17 )
+            {
+                int tableClass = p[ 0 ] >> 4;
+                int id = p[ 0 ] & 3;
+                size_t total = 0;
+
+                for ( int i = 0; i < 16; i++ )
+                    total += p[ 1 + i ];
+
+                if ( tableClass > 1 || total > 256 || cb < 17 + total )
+                    return false;
+
+                HuffmanTable & t = ( 0 == tableClass ) ? dcTables[ id ] : acTables[ id ];
+                memcpy( t.values, p + 17, total );
+                if ( !BuildTable( t, p + 1 ) )
+                    return false;
+
+                p += 17 + total;
+                cb -= 17 + total;
+            }
+
+            return true;
+        } //ParseHuffman
+
+        void ParseQuantization( const BYTE * p, size_t cb )
+        {
+            while ( cb >= 65 )
+            {
+                int precision = p[ 0 ] >> 4;
+                int id = p[ 0 ] & 3;
+                size_t size = 1 + ( precision ? 128 : 64 );
+
+                if ( cb < size )
+                    break;
+
+                quantDC[ id ] = precision ? ( ( p[ 1 ] << 8 ) | p[ 2 ] ) : p[ 1 ];
+                p += size;
+                cb -= size;
+            }
+        } //ParseQuantization
+
+        bool Restart()
+        {
+            bitBuffer = 0;
+            bitCount = 0;
+
+            while ( pos + 1 < cbData && !( 0xff == pData[ pos ] && pData[ pos + 1 ] >= 0xd0 && pData[ pos + 1 ] <= 0xd7 ) )
+                pos++;
+
+            if ( pos + 1 >= cbData )
+                return false;
+
+            pos += 2;
+            overrun = 0;
+
+            for ( int c = 0; c < componentCount; c++ )
+                components[ c ].predictor = 0;
+
+            return true;
+        } //Restart
+
+        void Store( int c, int x, int y, int value )
+        {
+            Component & comp = components[ c ];
+            int dx = hMax / comp.h;
+            int dy = vMax / comp.v;
+            BYTE sample = (BYTE) __max( 0, __min( 255, value ) );
+
+            for ( int row = 0; row < dy; row++ )
+                memset( planes[ c ].data() + ( y * dy + row ) * outWidth + x * dx, sample, dx );
+        } //Store
+
+        bool DecodeScan( const BYTE * p, size_t cb, size_t scanStart )
+        {
+            int scanComponents = p[ 0 ];
+
+            if ( scanComponents != componentCount || cb < 4 + 2 * (size_t) scanComponents )
+                return false;
+
+            for ( int s = 0; s < scanComponents; s++ )
+            {
+                int id = p[ 1 + s * 2 ];
+                int c = 0;
+
+                while ( c < componentCount && components[ c ].id != id )
+                    c++;
+
+                if ( c != s )
+                    return false;
+
+                components[ c ].dcTable = p[ 2 + s * 2 ] >> 4;
+                components[ c ].acTable = p[ 2 + s * 2 ] & 3;
+                components[ c ].predictor = 0;
+
+                if ( components[ c ].dcTable > 3 || !dcTables[ components[ c ].dcTable ].defined )
+                    return false;
+            }
+
+            const BYTE * pSpectral = p + 1 + 2 * scanComponents;
+            int spectralStart = pSpectral[ 0 ];
+            int spectralEnd = pSpectral[ 1 ];
+            int approximationHigh = pSpectral[ 2 ] >> 4;
+            int approximationLow = pSpectral[ 2 ] & 0xf;
+            bool hasAC = !progressive;
+
+            // a progressive file's first scan has to be the DC scan to get the DC values from one scan
+
+            if ( progressive && ( 0 != spectralStart || 0 != spectralEnd || 0 != approximationHigh ) )
+                return false;
+
+            if ( !progressive )
+            {
+                approximationLow = 0;
+
+                for ( int c = 0; c < componentCount; c++ )
+                    if ( !acTables[ components[ c ].acTable ].defined )
+                        return false;
+            }
+
+            int mcusX = ( width + 8 * hMax - 1 ) / ( 8 * hMax );
+            int mcusY = ( height + 8 * vMax - 1 ) / ( 8 * vMax );
+            outWidth = mcusX * hMax;
+            outHeight = mcusY * vMax;
+
+            // Every block takes at least one bit of the scan, plus the few bytes of overrun allowed below, so a
+            // frame with more blocks than that is corrupt. This keeps bogus SOF dimensions from sizing the planes.
+
+            size_t blocks = 0;
+            for ( int c = 0; c < componentCount; c++ )
+                blocks += (size_t) mcusX * mcusY * components[ c ].h * components[ c ].v;
+
+            if ( scanStart > cbData || blocks > 8 * ( cbData - scanStart + 8 ) )
+                return false;
+
+            for ( int c = 0; c < componentCount; c++ )
+                planes[ c ].resize( (size_t) outWidth * outHeight );
+
+            pos = scanStart;
+            bitBuffer = 0;
+            bitCount = 0;
+            overrun = 0;
+            int mcusToRestart = restartInterval;
+
+            for ( int my = 0; my < mcusY; my++ )
+            {
+                for ( int mx = 0; mx < mcusX; mx++ )
+                {
+                    if ( 0 != restartInterval )
+                    {
+                        if ( 0 == mcusToRestart )
+                        {
+                            if ( !Restart() )
+                                return false;
+
+                            mcusToRestart = restartInterval;
+                        }
+
+                        mcusToRestart--;
+                    }
+
+                    for ( int c = 0; c < componentCount; c++ )
+                    {
+                        Component & comp = components[ c ];
+                        HuffmanTable & dc = dcTables[ comp.dcTable ];
+                        HuffmanTable & ac = acTables[ comp.acTable ];
+
+                        for ( int by = 0; by < comp.v; by++ )
+                        {
+                            for ( int bx = 0; bx < comp.h; bx++ )
+                            {
+                                int s = Decode( dc ) & 0xf;
+                                comp.predictor += ( 0 == s ) ? 0 : Extend( GetBits( s ), s );
+
+                                if ( hasAC )
+                                {
+                                    for ( int k = 1; k < 64; k++ )
+                                    {
+                                        int rs = Decode( ac );
+                                        int run = rs >> 4;
+                                        int size = rs & 0xf;
+
+                                        if ( 0 == size )
+                                        {
+                                            if ( 15 != run )
+                                                break;
+
+                                            k += 15;
+                                        }
+                                        else
+                                        {
+                                            k += run;
+                                            GetBits( size );
+                                        }
+                                    }
+                                }
+
+                                // the DC coefficient is 8 times the block's average, less the 128 level shift
+
+                                long long value = ( (long long) comp.predictor * ( 1 << approximationLow ) * quantDC[ comp.quantTable ] ) / 8 + 128;
+                                Store( c, mx * comp.h + bx, my * comp.v + by, (int) __max( -1, __min( 256, value ) ) );
+                            }
+                        }
+                    }
+
+                    if ( overrun > 8 )
+                        return false;
+                }
+            }
+
+            return true;
+        } //DecodeScan
+
+        // The color of each 1/8 scale pixel is looked up from its chroma, in 32 x 32 cells of Cb and Cr.
+        // Cells with little saturation are neutral and are classified by luma instead.
+
+        struct HueTable
+        {
+            BYTE cells[ 32 * 32 ];
+
+            HueTable()
+            {
+                for ( int cb = 0; cb < 32; cb++ )
+                {
+                    for ( int cr = 0; cr < 32; cr++ )
+                    {
+                        double u = cb * 8 + 4 - 128.0;
+                        double v = cr * 8 + 4 - 128.0;
+                        double r = 128.0 + 1.402 * v;
+                        double g = 128.0 - 0.344136 * u - 0.714136 * v;
+                        double b = 128.0 + 1.772 * u;
+                        double hi = __max( r, __max( g, b ) );
+                        double lo = __min( r, __min( g, b ) );
+                        BYTE color = colorGray;
+
+                        if ( hi - lo >= 24.0 )
+                        {
+                            double hue;
+
+                            if ( hi == r )
+                                hue = 60.0 * fmod( ( g - b ) / ( hi - lo ) + 6.0, 6.0 );
+                            else if ( hi == g )
+                                hue = 60.0 * ( ( b - r ) / ( hi - lo ) + 2.0 );
+                            else
+                                hue = 60.0 * ( ( r - g ) / ( hi - lo ) + 4.0 );
+
+                            if ( hue < 15.0 || hue >= 340.0 )
+                                color = colorRed;
+                            else if ( hue < 45.0 )
+                                color = colorOrange;
+                            else if ( hue < 70.0 )
+                                color = colorYellow;
+                            else if ( hue < 160.0 )
+                                color = colorGreen;
+                            else if ( hue < 200.0 )
+                                color = colorCyan;
+                            else if ( hue < 255.0 )
+                                color = colorBlue;
+                            else if ( hue < 290.0 )
+                                color = colorPurple;
+                            else
+                                color = colorMagenta;
+                        }
+
+                        cells[ cb * 32 + cr ] = color;
+                    }
+                }
+            }
+        };
+
+        static ULONGLONG SumBytes( const BYTE * p, size_t cb )
+        {
+            ULONGLONG sum = 0;
+            size_t i = 0;
+
+#ifdef DCJPG_SSE2
+            // psadbw against zero adds each 8 bytes into a 64-bit lane
+
+            __m128i zero = _mm_setzero_si128();
+            __m128i total = _mm_setzero_si128();
+
+            for ( ; i + 16 <= cb; i += 16 )
+                total = _mm_add_epi64( total, _mm_sad_epu8( _mm_loadu_si128( (const __m128i *) ( p + i ) ), zero ) );
+
+            ULONGLONG lanes[ 2 ];
+            _mm_storeu_si128( (__m128i *) lanes, total );
+            sum = lanes[ 0 ] + lanes[ 1 ];
+#endif
+
+            for ( ; i < cb; i++ )
+                sum += p[ i ];
+
+            return sum;
+        } //SumBytes
+
+    public:
+        CDCJpeg() : width( 0 ), height( 0 ), outWidth( 0 ), outHeight( 0 ), componentCount( 0 ) {}
+
+        // Decodes the DC coefficients of the JPEG in p. Returns false if it's not a JPEG this can decode.
+
+        bool Decode( const BYTE * p, size_t cb )
+        {
+            pData = p;
+            cbData = cb;
+            restartInterval = 0;
+            progressive = false;
+            componentCount = 0;
+            bool haveFrame = false;
+
+            for ( int t = 0; t < 4; t++ )
+            {
+                dcTables[ t ].defined = false;
+                acTables[ t ].defined = false;
+                quantDC[ t ] = 1;
+            }
+
+            if ( cb < 4 || 0xff != p[ 0 ] || 0xd8 != p[ 1 ] )
+                return false;
+
+            size_t at = 2;
+
+            while ( at + 4 <= cb )
+            {
+                if ( 0xff != p[ at ] )
+                    return false;
+
+                BYTE marker = p[ at + 1 ];
+
+                if ( 0xff == marker )
+                {
+                    at++;
+                    continue;
+                }
+
+                size_t len = SegmentLength( at + 2 );
+                if ( len < 2 || at + 2 + len > cb )
+                    return false;
+
+                const BYTE * pSegment = p + at + 4;
+                size_t cbSegment = len - 2;
+
+                if ( 0xc0 == marker || 0xc1 == marker || 0xc2 == marker )
+                {
+                    progressive = ( 0xc2 == marker );
+                    haveFrame = ParseFrame( pSegment, cbSegment );
+                    if ( !haveFrame )
+                        return false;
+                }
+                else if ( ( marker >= 0xc3 && marker <= 0xcf ) && 0xc4 != marker && 0xc8 != marker && 0xcc != marker )
+                    return false;                       // lossless, hierarchical, and arithmetic coding
+                else if ( 0xc4 == marker )
+                {
+                    if ( !ParseHuffman( pSegment, cbSegment ) )
+                        return false;
+                }
+                else if ( 0xdb == marker )
+                    ParseQuantization( pSegment, cbSegment );
+                else if ( 0xdd == marker && cbSegment >= 2 )
+                    restartInterval = ( pSegment[ 0 ] << 8 ) | pSegment[ 1 ];
+                else if ( 0xda == marker )
+                    return haveFrame && cbSegment >= 6 && DecodeScan( pSegment, cbSegment, at + 2 + len );
+                else if ( 0xd9 == marker )
+                    return false;
+
+                at += 2 + len;
+            }
+
+            return false;
+        } //Decode
+
+        int Width() { return ( width + 7 ) / 8; }
+        int Height() { return ( height + 7 ) / 8; }
+
+        // Summarizes the decoded image. Only the part of the planes within the image is used.
+
+        void Analyze( Look & look )
+        {
+            memset( &look, 0, sizeof look );
+            look.width = Width();
+            look.height = Height();
+
+            static const HueTable hueTable;        // initialized once, thread-safe
+            const BYTE * hues = hueTable.cells;
+            ULONG colorCounts[ colorCount ] = { 0 };
+            ULONGLONG lumaSum = 0;
+
+            for ( int y = 0; y < look.height; y++ )
+            {
+                const BYTE * pY = planes[ 0 ].data() + (size_t) y * outWidth;
+                lumaSum += SumBytes( pY, look.width );
+
+                for ( int x = 0; x < look.width; x++ )
+                {
+                    BYTE luma = pY[ x ];
+                    look.histogram[ luma >> 5 ]++;
+
+                    int color = colorGray;
+
+                    if ( 3 == componentCount )
+                    {
+                        BYTE cb = planes[ 1 ][ (size_t) y * outWidth + x ];
+                        BYTE cr = planes[ 2 ][ (size_t) y * outWidth + x ];
+                        color = hues[ ( cb >> 3 ) * 32 + ( cr >> 3 ) ];
+                    }
+
+                    // very dark and very bright pixels look black and white whatever their chroma
+
+                    if ( luma < 32 )
+                        color = colorBlack;
+                    else if ( luma > 235 )
+                        color = colorWhite;
+                    else if ( colorGray == color && luma < 80 )
+                        color = colorBlack;
+                    else if ( colorGray == color && luma > 190 )
+                        color = colorWhite;
+
+                    colorCounts[ color ]++;
+                }
+            }
+
+            size_t pixels = (size_t) look.width * look.height;
+            look.meanLuma = ( 0 == pixels ) ? 0.0 : (double) lumaSum / pixels;
+            look.dominant = colorBlack;
+
+            for ( int c = 1; c < colorCount; c++ )
+                if ( colorCounts[ c ] > colorCounts[ look.dominant ] )
+                    look.dominant = (Color) c;
+
+            look.dominantShare = ( 0 == pixels ) ? 0.0 : (double) colorCounts[ look.dominant ] / pixels;
+        } //Analyze
+}; //CDCJpeg
+
@@ -0,0 +1,406 @@
+#pragma once
+
+//
+// Finds duplicate files in stages so most files are ruled out without reading their image data:
+//   1) a cheap key from metadata that's already parsed: file size, make, model, serial number,
+//      DateTimeOriginal, and the offset and length of the embedded preview
+//   2) a hash of a few sampled blocks, only for files whose cheap keys collide
+//   3) a full SHA-256, only for files whose sampled hashes still collide
+// Files with the same camera, serial number, and capture time but different bytes are reported
+// as near duplicates (e.g. an edited copy written back to the file or a re-export).
+//
+
+#include <windows.h>
+#include <stdio.h>
+#include <ppl.h>
+
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "djl_strm.hxx"
+#include "djl_archive.hxx"
+#include "djl_sha256.hxx"
+
+using namespace std;
+using namespace concurrency;
+
+class CDuplicateFinder
+{
+    private:
+        static const ULONG SampleBlockSize = 64 * 1024;
+        static const int SampleBlocks = 3;              // beginning, middle, and end of the file
+        static const ULONG FullHashChunkSize = 1024 * 1024;
+
+        struct Candidate
+        {
+            const WCHAR * pwcPath;
+            unsigned long long size;
+            string shot;                                // make, model, serial, and capture time; empty if any are unknown
+            string key;                                 // shot plus size and preview location
+            char acSample[ 65 ];
+            char acFull[ 65 ];
+        };
+
+        struct DuplicateSet
+        {
+            size_t first;                               // index into sets
+            size_t count;
+            unsigned long long wasted;
+        };
+
+        combinable<vector<Candidate>> locals;
+        vector<Candidate> candidates;
+        vector<Candidate *> sets;                       // duplicate sets, adjacent in this vector
+        vector<DuplicateSet> duplicates;
+        vector<Candidate *> nearSets;
+        vector<DuplicateSet> nearDuplicates;
+        size_t sampledFiles;
+        size_t fullyHashedFiles;
+
+        static bool CompareKey( const Candidate * a, const Candidate * b )
+        {
+            if ( a->size != b->size )
+                return a->size < b->size;
+
+            return a->key < b->key;
+        } //CompareKey
+
+        static bool SameKey( const Candidate * a, const Candidate * b )
+        {
+            return ( a->size == b->size && a->key == b->key );
+        } //SameKey
+
+        static bool CompareSample( const Candidate * a, const Candidate * b )
+        {
+            if ( !SameKey( a, b ) )
+                return CompareKey( a, b );
+
+            return strcmp( a->acSample, b->acSample ) < 0;
+        } //CompareSample
+
+        static bool SameSample( const Candidate * a, const Candidate * b )
+        {
+            return SameKey( a, b ) && !strcmp( a->acSample, b->acSample );
+        } //SameSample
+
+        static bool CompareFull( const Candidate * a, const Candidate * b )
+        {
+            if ( !SameSample( a, b ) )
+                return CompareSample( a, b );
+
+            int c = strcmp( a->acFull, b->acFull );
+            if ( 0 != c )
+                return c < 0;
+
+            return _wcsicmp( a->pwcPath, b->pwcPath ) < 0;
+        } //CompareFull
+
+        static bool SameFull( const Candidate * a, const Candidate * b )
+        {
+            return SameSample( a, b ) && !strcmp( a->acFull, b->acFull );
+        } //SameFull
+
+        static bool CompareShot( const Candidate * a, const Candidate * b )
+        {
+            int c = a->shot.compare( b->shot );
+            if ( 0 != c )
+                return c < 0;
+
+            return _wcsicmp( a->pwcPath, b->pwcPath ) < 0;
+        } //CompareShot
+
+        // Sort the list, then keep only runs of 2 or more items that are the same
+
+        template <class Less, class Same> static void KeepCollisions( vector<Candidate *> & list, Less less, Same same )
+        {
+            sort( list.begin(), list.end(), less );
+
+            vector<Candidate *> kept;
+            size_t i = 0;
+
+            while ( i < list.size() )
+            {
+                size_t j = i + 1;
+                while ( j < list.size() && same( list[ i ], list[ j ] ) )
+                    j++;
+
+                if ( ( j - i ) > 1 )
+                    kept.insert( kept.end(), list.begin() + i, list.begin() + j );
+
+                i = j;
+            }
+
+            list.swap( kept );
+        } //KeepCollisions
+
+        template <class Same> static void BuildSets( vector<Candidate *> & list, vector<DuplicateSet> & result, Same same )
+        {
+            size_t i = 0;
+
+            while ( i < list.size() )
+            {
+                size_t j = i + 1;
+                while ( j < list.size() && same( list[ i ], list[ j ] ) )
+                    j++;
+
+                DuplicateSet ds = { i, j - i, list[ i ]->size * ( j - i - 1 ) };
+                result.push_back( ds );
+                i = j;
+            }
+        } //BuildSets
+
+        static bool HashSample( Candidate & c )
+        {
+            unique_ptr<CStream> stream( CArchive::Open( c.pwcPath ) );
+            if ( !stream || !stream->Ok() )
+                return false;
+
+            // small files are hashed in full here, so they skip the third stage
+
+            ULONG cbToRead = ( c.size <= ( SampleBlockSize * SampleBlocks ) ) ? (ULONG) c.size : SampleBlockSize * SampleBlocks;
+            vector<byte> buf( __max( cbToRead, (ULONG) 1 ) );
+
+            if ( c.size <= ( SampleBlockSize * SampleBlocks ) )
+            {
+                if ( cbToRead != stream->Read( buf.data(), cbToRead ) )
+                    return false;
+            }
+            else
+            {
+                __int64 offsets[ SampleBlocks ] = { 0, (__int64) ( ( c.size - SampleBlockSize ) / 2 ), (__int64) ( c.size - SampleBlockSize ) };
+
+                for ( int b = 0; b < SampleBlocks; b++ )
+                {
+                    if ( !stream->Seek( offsets[ b ] ) )
+                        return false;
+
+                    if ( SampleBlockSize != stream->Read( buf.data() + b * SampleBlockSize, SampleBlockSize ) )
+                        return false;
+                }
+            }
+
+            CSha256 sha;
+            if ( !sha.Hash( buf.data(), cbToRead, c.acSample ) )
+                return false;
+
+            if ( c.size <= ( SampleBlockSize * SampleBlocks ) )
+                strcpy( c.acFull, c.acSample );
+
+            return true;
+        } //HashSample
+
+        static bool HashFull( Candidate & c )
+        {
+            unique_ptr<CStream> stream( CArchive::Open( c.pwcPath ) );
+            if ( !stream || !stream->Ok() )
+                return false;
+
+            CSha256 sha;
+            if ( !sha.Start() )
+                return false;
+
+            vector<byte> buf( FullHashChunkSize );
+            unsigned long long remaining = c.size;
+
+            while ( remaining > 0 )
+            {
+                ULONG cb = (ULONG) __min( remaining, (unsigned long long) FullHashChunkSize );
+                if ( cb != stream->Read( buf.data(), cb ) )
+                    return false;
+
+                if ( !sha.Add( buf.data(), cb ) )
+                    return false;
+
+                remaining -= cb;
+            }
+
+            return sha.Finish( c.acFull );
+        } //HashFull
+
+        template <class T> static void RunStage( vector<Candidate *> & list, bool oneThread, T work )
+        {
+            if ( oneThread )
+            {
+                for ( size_t i = 0; i < list.size(); i++ )
+                    work( * list[ i ] );
+            }
+            else
+            {
+                parallel_for ( (size_t) 0, list.size(), [&] ( size_t i )
+                {
+                    work( * list[ i ] );
+                } );
+            }
+        } //RunStage
+
+    public:
+        CDuplicateFinder() : sampledFiles( 0 ), fullyHashedFiles( 0 ) {}
+
+        // Called concurrently by the scan workers. No locks; each thread has its own list.
+        // The path must stay valid until the finder is destroyed.
+
+        void Add( const WCHAR * pwcPath, unsigned long long size, const char * pcMake, const char * pcModel, const char * pcSerial,
+                  const char * pcDateTime, long long previewOffset, long long previewLength )
+        {
+            if ( 0 == size )
+                return;
+
+            Candidate c;
+            c.pwcPath = pwcPath;
+            c.size = size;
+            c.acSample[ 0 ] = 0;
+            c.acFull[ 0 ] = 0;
+
+            if ( 0 != pcModel[ 0 ] && 0 != pcDateTime[ 0 ] )
+            {
+                c.shot = pcMake;
+                c.shot += '|';
+                c.shot += pcModel;
+                c.shot += '|';
+                c.shot += pcSerial;
+                c.shot += '|';
+                c.shot += pcDateTime;
+            }
+
+            char acPreview[ 50 ];
+            sprintf_s( acPreview, _countof( acPreview ), "|%lld|%lld", previewOffset, previewLength );
+
+            c.key = c.shot;
+            c.key += acPreview;
+
+            locals.local().push_back( c );
+        } //Add
+
+        // Call once after the scan completes
+
+        void Find( bool oneThread )
+        {
+            candidates.clear();
+            locals.combine_each( [&] ( vector<Candidate> & local )
+            {
+                candidates.insert( candidates.end(), local.begin(), local.end() );
+                local.clear();
+            } );
+
+            // near duplicates: the same shot with different sizes or preview locations
+
+            vector<Candidate *> shots;
+            for ( size_t i = 0; i < candidates.size(); i++ )
+                if ( !candidates[ i ].shot.empty() )
+                    shots.push_back( & candidates[ i ] );
+
+            KeepCollisions( shots, CompareShot, [] ( const Candidate * a, const Candidate * b ) { return a->shot == b->shot; } );
+
+            // stage 1: cheap keys. No file data is read.
+
+            vector<Candidate *> list( candidates.size() );
+            for ( size_t i = 0; i < candidates.size(); i++ )
+                list[ i ] = & candidates[ i ];
+
+            KeepCollisions( list, CompareKey, SameKey );
+
+            // stage 2: sampled blocks
+
+            sampledFiles = list.size();
+            RunStage( list, oneThread, [] ( Candidate & c ) { if ( !HashSample( c ) ) sprintf_s( c.acSample, _countof( c.acSample ), "error %p", &c ); } );
+            KeepCollisions( list, CompareSample, SameSample );
+
+            // stage 3: full hash for files larger than the samples
+
+            vector<Candidate *> large;
+            for ( size_t i = 0; i < list.size(); i++ )
+                if ( 0 == list[ i ]->acFull[ 0 ] )
+                    large.push_back( list[ i ] );
+
+            fullyHashedFiles = large.size();
+            RunStage( large, oneThread, [] ( Candidate & c ) { if ( !HashFull( c ) ) sprintf_s( c.acFull, _countof( c.acFull ), "error %p", &c ); } );
+            KeepCollisions( list, CompareFull, SameFull );
+
+            sets.swap( list );
+            duplicates.clear();
+            BuildSets( sets, duplicates, SameFull );
+
+            // exact duplicates of each other aren't also near duplicates
+
+            nearSets.clear();
+            nearDuplicates.clear();
+            size_t i = 0;
+
+            while ( i < shots.size() )
+            {
+                size_t j = i + 1;
+                while ( j < shots.size() && shots[ i ]->shot == shots[ j ]->shot )
+                    j++;
+
+                bool allSame = true;
+                for ( size_t k = i + 1; k < j && allSame; k++ )
+                    allSame = ( 0 != shots[ i ]->acFull[ 0 ] ) && SameFull( shots[ i ], shots[ k ] );
+
+                if ( !allSame )
+                {
+                    DuplicateSet ds = { nearSets.size(), j - i, 0 };
+                    nearDuplicates.push_back( ds );
+                    nearSets.insert( nearSets.end(), shots.begin() + i, shots.begin() + j );
+                }
+
+                i = j;
+            }
+        } //Find
+
+        void PrintSets( bool sortOnCount, bool verbose )
+        {
+            vector<DuplicateSet> order( duplicates );
+
+            // default is the most wasted space first
+
+            sort( order.begin(), order.end(), [&] ( const DuplicateSet & a, const DuplicateSet & b )
+            {
+                if ( sortOnCount && a.count != b.count )
+                    return a.count > b.count;
+
+                if ( a.wasted != b.wasted )
+                    return a.wasted > b.wasted;
+
+                return _wcsicmp( sets[ a.first ]->pwcPath, sets[ b.first ]->pwcPath ) < 0;
+            } );
+
+            unsigned long long totalWasted = 0;
+            size_t totalFiles = 0;
+
+            for ( size_t d = 0; d < order.size(); d++ )
+            {
+                DuplicateSet & ds = order[ d ];
+                totalWasted += ds.wasted;
+                totalFiles += ds.count;
+
+                printf( "%zd copies, %llu bytes each, %llu bytes wasted, sha256 %s\n", ds.count, sets[ ds.first ]->size, ds.wasted, sets[ ds.first ]->acFull );
+
+                for ( size_t i = ds.first; i < ds.first + ds.count; i++ )
+                    printf( "    %ws\n", sets[ i ]->pwcPath );
+            }
+
+            if ( order.size() > 0 )
+                printf( "\n" );
+
+            printf( "%zd files checked, %zd had colliding metadata keys and were sampled, %zd were fully hashed\n",
+                    candidates.size(), sampledFiles, fullyHashedFiles );
+            printf( "found %zd duplicate sets with %zd files, wasting %llu bytes (%.2lf MB)\n",
+                    order.size(), totalFiles, totalWasted, (double) totalWasted / 1024.0 / 1024.0 );
+
+            printf( "found %zd sets of near duplicates: same camera, serial number, and capture time with different contents\n", nearDuplicates.size() );
+
+            if ( verbose )
+            {
+                for ( size_t d = 0; d < nearDuplicates.size(); d++ )
+                {
+                    DuplicateSet & ds = nearDuplicates[ d ];
+                    printf( "  %s\n", nearSets[ ds.first ]->shot.c_str() );
+
+                    for ( size_t i = ds.first; i < ds.first + ds.count; i++ )
+                        printf( "    %12llu %ws\n", nearSets[ i ]->size, nearSets[ i ]->pwcPath );
+                }
+            }
+        } //PrintSets
+}; //CDuplicateFinder
+
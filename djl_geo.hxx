@@ -0,0 +1,391 @@
+#pragma once
+
+//
+// Aggregates GPS coordinates into a geohash grid and answers "within R km of a point" queries.
+// Workers add points to per-thread tables so no locks are taken during the parallel scan.
+// Call Merge() once after the scan, then use the Print* functions.
+//
+
+#include <windows.h>
+#include <stdio.h>
+#include <math.h>
+#include <ppl.h>
+
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+
+using namespace std;
+using namespace concurrency;
+
+class CGeoIndex
+{
+    public:
+        static const int MaxPrecision = 12;
+        static const int DefaultPrecision = 5;  // cells are about 4.9km x 4.9km at the equator
+
+        struct GeoPoint
+        {
+            double lat;
+            double lon;
+            const WCHAR * pwcPath;
+        };
+
+        struct GeoCell
+        {
+            char acHash[ MaxPrecision + 1 ];
+            size_t count;
+            double minLat, maxLat, minLon, maxLon;    // bounding box of the points in the cell, not the cell itself
+            double sumLat, sumLon;
+            vector<GeoPoint> points;
+
+            double CenterLat() { return sumLat / (double) count; }
+            double CenterLon() { return sumLon / (double) count; }
+        };
+
+    private:
+        struct GeoLocal
+        {
+            map<string, GeoCell> cells;
+        };
+
+        combinable<GeoLocal> locals;
+        vector<GeoCell> cells;         // valid after Merge(), sorted by geohash
+        int precision;
+
+        static int CellCompareCount( const void * a, const void * b )
+        {
+            GeoCell * pa = * (GeoCell **) a;
+            GeoCell * pb = * (GeoCell **) b;
+
+            if ( pa->count > pb->count )
+                return -1;
+
+            if ( pa->count < pb->count )
+                return 1;
+
+            return strcmp( pa->acHash, pb->acHash );
+        } //CellCompareCount
+
+        static double Radians( double d ) { return d * 3.14159265358979323846 / 180.0; }
+
+        static void AddToCell( GeoCell & cell, GeoPoint & pt )
+        {
+            if ( 0 == cell.count )
+            {
+                cell.minLat = cell.maxLat = pt.lat;
+                cell.minLon = cell.maxLon = pt.lon;
+            }
+            else
+            {
+                cell.minLat = __min( cell.minLat, pt.lat );
+                cell.maxLat = __max( cell.maxLat, pt.lat );
+                cell.minLon = __min( cell.minLon, pt.lon );
+                cell.maxLon = __max( cell.maxLon, pt.lon );
+            }
+
+            cell.count++;
+            cell.sumLat += pt.lat;
+            cell.sumLon += pt.lon;
+            cell.points.push_back( pt );
+        } //AddToCell
+
+    public:
+        CGeoIndex( int p = DefaultPrecision )
+        {
+            SetPrecision( p );
+        }
+
+        void SetPrecision( int p )
+        {
+            precision = __max( 1, __min( p, MaxPrecision ) );
+        }
+
+        int Precision() { return precision; }
+        size_t CellCount() { return cells.size(); }
+
+        static bool ValidCoordinate( double lat, double lon )
+        {
+            return ( !isnan( lat ) && !isnan( lon ) && fabs( lat ) <= 90.0 && fabs( lon ) <= 180.0 );
+        } //ValidCoordinate
+
+        // https://en.wikipedia.org/wiki/Geohash
+
+        static void Encode( double lat, double lon, int prec, char * pcHash )
+        {
+            static const char base32[] = "0123456789bcdefghjkmnpqrstuvwxyz";
+            double latLo = -90.0, latHi = 90.0;
+            double lonLo = -180.0, lonHi = 180.0;
+            bool evenBit = true;
+            int bit = 0;
+            int ch = 0;
+            int len = 0;
+
+            while ( len < prec )
+            {
+                if ( evenBit )
+                {
+                    double mid = ( lonLo + lonHi ) / 2.0;
+                    if ( lon >= mid )
+                    {
+                        ch = ( ch << 1 ) | 1;
+                        lonLo = mid;
+                    }
+                    else
+                    {
+                        ch <<= 1;
+                        lonHi = mid;
+                    }
+                }
+                else
+                {
+                    double mid = ( latLo + latHi ) / 2.0;
+                    if ( lat >= mid )
+                    {
+                        ch = ( ch << 1 ) | 1;
+                        latLo = mid;
+                    }
+                    else
+                    {
+                        ch <<= 1;
+                        latHi = mid;
+                    }
+                }
+
+                evenBit = !evenBit;
+
+                if ( 5 == ++bit )
+                {
+                    pcHash[ len++ ] = base32[ ch ];
+                    bit = 0;
+                    ch = 0;
+                }
+            }
+
+            pcHash[ len ] = 0;
+        } //Encode
+
+        // Returns the bounds of the cell named by the geohash
+
+        static void Decode( const char * pcHash, double & latLo, double & latHi, double & lonLo, double & lonHi )
+        {
+            static const char base32[] = "0123456789bcdefghjkmnpqrstuvwxyz";
+            latLo = -90.0; latHi = 90.0;
+            lonLo = -180.0; lonHi = 180.0;
+            bool evenBit = true;
+
+            for ( const char * pc = pcHash; 0 != *pc; pc++ )
+            {
+                const char * pcFound = strchr( base32, *pc );
+                if ( NULL == pcFound )
+                    break;
+
+                int val = (int) ( pcFound - base32 );
+
+                for ( int b = 4; b >= 0; b-- )
+                {
+                    int bitSet = ( val >> b ) & 1;
+
+                    if ( evenBit )
+                    {
+                        double mid = ( lonLo + lonHi ) / 2.0;
+                        if ( bitSet )
+                            lonLo = mid;
+                        else
+                            lonHi = mid;
+                    }
+                    else
+                    {
+                        double mid = ( latLo + latHi ) / 2.0;
+                        if ( bitSet )
+                            latLo = mid;
+                        else
+                            latHi = mid;
+                    }
+
+                    evenBit = !evenBit;
+                }
+            }
+        } //Decode
+
+        static double DistanceKm( double lat1, double lon1, double lat2, double lon2 )
+        {
+            // haversine
+
+            const double earthRadiusKm = 6371.0088;
+            double dLat = Radians( lat2 - lat1 );
+            double dLon = Radians( lon2 - lon1 );
+            double a = sin( dLat / 2.0 ) * sin( dLat / 2.0 ) +
+                       cos( Radians( lat1 ) ) * cos( Radians( lat2 ) ) * sin( dLon / 2.0 ) * sin( dLon / 2.0 );
+
+            return 2.0 * earthRadiusKm * atan2( sqrt( a ), sqrt( 1.0 - a ) );
+        } //DistanceKm
+
+        // Called concurrently by the scan workers. No locks; each thread has its own table.
+
+        void Add( double lat, double lon, const WCHAR * pwcPath )
+        {
+            if ( !ValidCoordinate( lat, lon ) )
+                return;
+
+            char acHash[ MaxPrecision + 1 ];
+            Encode( lat, lon, precision, acHash );
+
+            GeoCell & cell = locals.local().cells[ acHash ];
+            if ( 0 == cell.count )
+            {
+                strcpy( cell.acHash, acHash );
+                cell.sumLat = 0.0;
+                cell.sumLon = 0.0;
+            }
+
+            GeoPoint pt = { lat, lon, pwcPath };
+            AddToCell( cell, pt );
+        } //Add
+
+        // Combine the per-thread tables. Call once after the scan completes.
+
+        void Merge()
+        {
+            map<string, GeoCell> all;
+
+            locals.combine_each( [&] ( GeoLocal & local )
+            {
+                for ( auto & it : local.cells )
+                {
+                    GeoCell & cell = all[ it.first ];
+                    if ( 0 == cell.count )
+                    {
+                        strcpy( cell.acHash, it.second.acHash );
+                        cell.sumLat = 0.0;
+                        cell.sumLon = 0.0;
+                    }
+
+                    for ( size_t p = 0; p < it.second.points.size(); p++ )
+                        AddToCell( cell, it.second.points[ p ] );
+                }
+
+                local.cells.clear();
+            } );
+
+            cells.clear();
+            cells.reserve( all.size() );
+
+            for ( auto & it : all )
+                cells.push_back( std::move( it.second ) );
+        } //Merge
+
+        void PrintCells( bool sortOnCount )
+        {
+            size_t fileCount = 0;
+            double minLat = 90.0, maxLat = -90.0, minLon = 180.0, maxLon = -180.0;
+            vector<GeoCell *> order( cells.size() );
+
+            for ( size_t i = 0; i < cells.size(); i++ )
+            {
+                GeoCell & c = cells[ i ];
+                fileCount += c.count;
+                minLat = __min( minLat, c.minLat );
+                maxLat = __max( maxLat, c.maxLat );
+                minLon = __min( minLon, c.minLon );
+                maxLon = __max( maxLon, c.maxLon );
+                order[ i ] = & c;
+            }
+
+            printf( "found %zu unique geohash cells at precision %d in %zu files with GPS data\n", cells.size(), precision, fileCount );
+
+            if ( 0 == fileCount )
+                return;
+
+            printf( "bounding box of all files: (%lf, %lf) to (%lf, %lf)\n\n", minLat, minLon, maxLat, maxLon );
+
+            if ( sortOnCount )
+                qsort( order.data(), order.size(), sizeof( GeoCell * ), CellCompareCount );
+
+            printf( "geohash          count    center                        bounding box\n" );
+            printf( "-------          -----    ------                        ------------\n" );
+
+            for ( size_t i = 0; i < order.size(); i++ )
+            {
+                GeoCell & c = * order[ i ];
+                printf( "%-12s %9zu    %11.6lf, %11.6lf    (%.6lf, %.6lf) to (%.6lf, %.6lf)\n",
+                        c.acHash, c.count, c.CenterLat(), c.CenterLon(), c.minLat, c.minLon, c.maxLat, c.maxLon );
+            }
+        } //PrintCells
+
+        void PrintTopLocations( size_t maxLocations )
+        {
+            vector<GeoCell *> order( cells.size() );
+            for ( size_t i = 0; i < cells.size(); i++ )
+                order[ i ] = & cells[ i ];
+
+            qsort( order.data(), order.size(), sizeof( GeoCell * ), CellCompareCount );
+
+            size_t toShow = __min( maxLocations, order.size() );
+            printf( "top %zu locations\n", toShow );
+
+            for ( size_t i = 0; i < toShow; i++ )
+            {
+                GeoCell & c = * order[ i ];
+                printf( "  %9zu  %-12s https://www.google.com/maps/search/?api=1&query=%lf,%lf\n", c.count, c.acHash, c.CenterLat(), c.CenterLon() );
+            }
+        } //PrintTopLocations
+
+        // Prints files within radiusKm of (lat, lon), closest first. Only cells whose bounds
+        // could hold a match are examined.
+
+        void PrintWithin( double lat, double lon, double radiusKm )
+        {
+            struct Match
+            {
+                double km;
+                const WCHAR * pwcPath;
+                bool operator < ( const Match & m ) const { return km < m.km; }
+            };
+
+            vector<Match> matches;
+
+            // a conservative lat/lon window around the query point. 111.2 km per degree of latitude
+
+            double dLat = radiusKm / 111.19;
+            double cosLat = cos( Radians( lat ) );
+            double dLon = ( cosLat > 0.000001 ) ? ( dLat / cosLat ) : 360.0;
+            double qLatLo = lat - dLat, qLatHi = lat + dLat;
+            double qLonLo = lon - dLon, qLonHi = lon + dLon;
+            bool wrapsLon = ( qLonLo < -180.0 || qLonHi > 180.0 );
+
+            for ( size_t i = 0; i < cells.size(); i++ )
+            {
+                GeoCell & c = cells[ i ];
+                double latLo, latHi, lonLo, lonHi;
+                Decode( c.acHash, latLo, latHi, lonLo, lonHi );
+
+                if ( latHi < qLatLo || latLo > qLatHi )
+                    continue;
+
+                if ( !wrapsLon && ( lonHi < qLonLo || lonLo > qLonHi ) )
+                    continue;
+
+                for ( size_t p = 0; p < c.points.size(); p++ )
+                {
+                    GeoPoint & pt = c.points[ p ];
+                    double km = DistanceKm( lat, lon, pt.lat, pt.lon );
+
+                    if ( km <= radiusKm )
+                    {
+                        Match m = { km, pt.pwcPath };
+                        matches.push_back( m );
+                    }
+                }
+            }
+
+            sort( matches.begin(), matches.end() );
+
+            printf( "found %zu files within %.3lf km of %lf, %lf\n", matches.size(), radiusKm, lat, lon );
+
+            for ( size_t i = 0; i < matches.size(); i++ )
+                printf( "  %10.3lf km  %ws\n", matches[ i ].km, matches[ i ].pwcPath );
+        } //PrintWithin
+}; //CGeoIndex
+
@@ -0,0 +1,261 @@
+#pragma once
+
+//
+// Keeps one bad file from stopping a scan of millions of them.
+// Run calls the work for a file with a structured exception translator on the calling thread, so an access
+// violation or other fault in a parser becomes an SE_Exception that's caught, recorded, and the scan goes on.
+// Stack overflows can't be recovered from this way and still end the process.
+// Each file also has a time budget that starts when Start is called. A watchdog thread looks at the files in
+// progress a few times a second, and for any over budget it sets the thread's CStream cancel flag so every
+// later read fails, and calls CancelSynchronousIo so a read that's blocked (e.g. on a network share that
+// stopped responding) returns now. Parsing then ends quickly with no data.
+// Finish records files that faulted, ran out of time, or were slow, and Write saves them with the reasons.
+//
+
+#include <windows.h>
+#include <stdio.h>
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+
+#include "djlexcept.hxx"
+#include "djl_strm.hxx"
+
+using namespace std;
+
+class CFileGuard
+{
+    private:
+        // One per thread that processes files. Only the watchdog and the owning thread touch it.
+        // busy, cancelled, and start are changed under mtx so the watchdog can't cancel the next file
+        // between deciding the current one is over budget and cancelling it.
+
+        struct Slot
+        {
+            HANDLE hThread;
+            volatile LONG busy;
+            volatile LONG cancelled;         // the thread's CStream cancel flag points here; read without the lock
+            ULONGLONG start;
+            bool faulted;
+            char acReason[ 100 ];
+        };
+
+        struct Record
+        {
+            wstring path;
+            string reason;
+            ULONGLONG ms;
+            bool quarantined;                // false if it was just slow
+        };
+
+        DWORD budgetMs;
+        DWORD slowMs;
+        std::mutex mtx;                      // protects slots, records, and stopping
+        condition_variable cv;
+        vector<unique_ptr<Slot>> slots;
+        vector<Record> records;
+        size_t quarantined;
+        bool stopping;
+        thread watchdog;
+
+        Slot * ThreadSlot()
+        {
+            static thread_local CFileGuard * owner = NULL;
+            static thread_local Slot * slot = NULL;
+
+            if ( this != owner )
+            {
+                unique_ptr<Slot> s( new Slot() );
+                s->hThread = OpenThread( THREAD_TERMINATE, FALSE, GetCurrentThreadId() );
+
+                lock_guard<mutex> lock( mtx );
+                slots.push_back( move( s ) );
+                slot = slots.back().get();
+                owner = this;
+            }
+
+            return slot;
+        } //ThreadSlot
+
+        void Watch()
+        {
+            DWORD interval = __max( 10, __min( 250, budgetMs / 4 ) );
+            unique_lock<mutex> lock( mtx );
+
+            while ( !cv.wait_for( lock, chrono::milliseconds( interval ), [this] { return stopping; } ) )
+            {
+                ULONGLONG now = GetTickCount64();
+
+                for ( size_t i = 0; i < slots.size(); i++ )
+                {
+                    Slot & s = * slots[ i ];
+
+                    if ( s.busy && !s.cancelled && ( now - s.start ) > budgetMs )
+                    {
+                        InterlockedExchange( &s.cancelled, 1 );
+
+                        if ( NULL != s.hThread )
+                            CancelSynchronousIo( s.hThread );
+                    }
+                }
+            }
+        } //Watch
+
+    public:
+        // A budget of 0 means files can take as long as they need. Files that take longer than slowMs are listed.
+
+        CFileGuard( DWORD budget, DWORD slow ) : budgetMs( budget ), slowMs( slow ), quarantined( 0 ), stopping( false )
+        {
+            if ( 0 != budgetMs )
+                watchdog = thread( [this] () { Watch(); } );
+        } //CFileGuard
+
+        ~CFileGuard()
+        {
+            if ( watchdog.joinable() )
+            {
+                {
+                    lock_guard<mutex> lock( mtx );
+                    stopping = true;
+                }
+
+                cv.notify_all();
+                watchdog.join();
+            }
+
+            for ( size_t i = 0; i < slots.size(); i++ )
+                if ( NULL != slots[ i ]->hThread )
+                    CloseHandle( slots[ i ]->hThread );
+        } //~CFileGuard
+
+        // Starts the file's time budget on this thread
+
+        void Start()
+        {
+            Slot * s = ThreadSlot();
+            s->faulted = false;
+            s->acReason[ 0 ] = 0;
+            CStream::ThreadCancelFlag() = & s->cancelled;
+
+            lock_guard<mutex> lock( mtx );
+            InterlockedExchange( &s->cancelled, 0 );
+            s->start = GetTickCount64();
+            s->busy = 1;
+        } //Start
+
+        // Calls work, catching and noting anything it throws. Returns false if it threw or the file is out of time.
+
+        template<class F> bool Run( F work )
+        {
+            Slot * s = ThreadSlot();
+
+            if ( s->faulted || s->cancelled )
+                return false;
+
+            Scoped_SE_Translator translator{ SE_trans_func };
+
+            try
+            {
+                work();
+            }
+            catch ( SE_Exception & e )
+            {
+                sprintf_s( s->acReason, _countof( s->acReason ), "structured exception %#x", e.getSeNumber() );
+                s->faulted = true;
+            }
+            catch ( exception & e )
+            {
+                sprintf_s( s->acReason, _countof( s->acReason ), "exception %s", e.what() );
+                s->faulted = true;
+            }
+            catch ( ... )
+            {
+                strcpy_s( s->acReason, _countof( s->acReason ), "unknown exception" );
+                s->faulted = true;
+            }
+
+            return !s->faulted && !s->cancelled;
+        } //Run
+
+        // Ends the file's time budget and records it if it faulted, ran out of time, or was slow.
+        // Returns true if the file was quarantined.
+
+        bool Finish( const WCHAR * pwcPath )
+        {
+            Slot * s = ThreadSlot();
+            CStream::ThreadCancelFlag() = NULL;
+            bool cancelled;
+
+            {
+                lock_guard<mutex> lock( mtx );
+                s->busy = 0;
+                cancelled = ( 0 != s->cancelled );
+            }
+
+            ULONGLONG ms = GetTickCount64() - s->start;
+            Record r = { pwcPath, string(), ms, true };
+
+            if ( cancelled )
+            {
+                char ac[ 100 ];
+                sprintf_s( ac, _countof( ac ), "over the %u ms budget; its reads were cancelled", budgetMs );
+                r.reason = ac;
+            }
+            else if ( s->faulted )
+                r.reason = s->acReason;
+            else if ( 0 != slowMs && ms > slowMs )
+            {
+                r.reason = "slow";
+                r.quarantined = false;
+            }
+            else
+                return false;
+
+            tracer.Trace( "file guard: %s, %llu ms, %ws\n", r.reason.c_str(), ms, pwcPath );
+
+            lock_guard<mutex> lock( mtx );
+            records.push_back( r );
+            if ( r.quarantined )
+                quarantined++;
+
+            return r.quarantined;
+        } //Finish
+
+        size_t Quarantined() { return quarantined; }
+        size_t Slow() { return records.size() - quarantined; }
+        size_t Count() { return records.size(); }
+
+        // One line per file: Q for quarantined or S for slow, milliseconds, path, and reason
+
+        bool Write( const WCHAR * pwcFile )
+        {
+            FILE * fp = _wfopen( pwcFile, L"wt, ccs=UTF-8" );
+            if ( NULL == fp )
+            {
+                printf( "can't create quarantine file %ws\n", pwcFile );
+                return false;
+            }
+
+            for ( size_t i = 0; i < records.size(); i++ )
+                fwprintf( fp, L"%c %llu %ls\t%hs\n", records[ i ].quarantined ? L'Q' : L'S', records[ i ].ms, records[ i ].path.c_str(), records[ i ].reason.c_str() );
+
+            bool ok = ( 0 == fflush( fp ) );
+            fclose( fp );
+            return ok;
+        } //Write
+
+        // Prints the records from first on, so a long-running scan can print just the ones added since it last did
+
+        void Print( size_t first = 0 )
+        {
+            for ( size_t i = first; i < records.size(); i++ )
+                printf( "%s %llu ms %ws: %s\n", records[ i ].quarantined ? "quarantined" : "slow", records[ i ].ms,
+                        records[ i ].path.c_str(), records[ i ].reason.c_str() );
+        } //Print
+}; //CFileGuard
+
@@ -0,0 +1,365 @@
+#pragma once
+
+//
+// Decoder for DEFLATE (RFC 1951) data read from a CStream, as used by zip members.
+// Output can be limited so just the start of a large member is decompressed.
+// Huffman decoding is canonical and bit-at-a-time; it's small, and decoding is cheap next to the I/O.
+//
+
+#include <vector>
+
+#include "djl_strm.hxx"
+
+class CInflate
+{
+    private:
+        static const int MaxBits = 15;
+        static const ULONG InputBufferSize = 64 * 1024;
+
+        struct Huffman
+        {
+            short counts[ MaxBits + 1 ];     // number of codes of each length
+            short symbols[ 288 ];            // symbols ordered by code
+        };
+
+        CStream & in;
+        __int64 inRemaining;
+        std::vector<BYTE> inBuf;
+        ULONG inPos, inLen;
+        DWORD bitBuf;
+        int bitCount;
+        std::vector<BYTE> & out;
+        size_t maxOut;
+
+        CInflate( CStream & input, __int64 compressedLength, std::vector<BYTE> & output, size_t maxOutput ) :
+            in( input ), inRemaining( compressedLength ), inBuf( InputBufferSize ), inPos( 0 ), inLen( 0 ),
+            bitBuf( 0 ), bitCount( 0 ), out( output ), maxOut( maxOutput ) {}
+
+        bool Full() { return ( out.size() >= maxOut ); }
+
+        int NextByte()
+        {
+            if ( inPos == inLen )
+            {
+                if ( inRemaining <= 0 )
+                    return -1;
+
+                inLen = in.Read( inBuf.data(), (ULONG) __min( inRemaining, (__int64) InputBufferSize ) );
+                if ( 0 == inLen )
+                    return -1;
+
+                inRemaining -= inLen;
+                inPos = 0;
+            }
+
+            return inBuf[ inPos++ ];
+        } //NextByte
+
+        bool Bits( int need, int & val )
+        {
+            DWORD v = bitBuf;
+
+            while ( bitCount < need )
+            {
+                int b = NextByte();
+                if ( b < 0 )
+                    return false;
+
+                v |= (DWORD) b << bitCount;
+                bitCount += 8;
+            }
+
+            bitBuf = v >> need;
+            bitCount -= need;
+            val = (int) ( v & ( ( 1ul << need ) - 1 ) );
+            return true;
+        } //Bits
+
+        static bool Build( Huffman & h, const short * lengths, int n )
+        {
+            memset( h.counts, 0, sizeof h.counts );
+
+            for ( int s = 0; s < n; s++ )
+                h.counts[ lengths[ s ] ]++;
+
+            if ( n == h.counts[ 0 ] )
+                return true;
+
+            // an over-subscribed set of lengths isn't a valid code
+
+            int left = 1;
+
+            for ( int len = 1; len <= MaxBits; len++ )
+            {
+                left <<= 1;
+                left -= h.counts[ len ];
+                if ( left < 0 )
+                    return false;
+            }
+
+            short offs[ MaxBits + 1 ];
+            offs[ 1 ] = 0;
+
+            for ( int len = 1; len < MaxBits; len++ )
+                offs[ len + 1 ] = offs[ len ] + h.counts[ len ];
+
+            for ( int s = 0; s < n; s++ )
+                if ( 0 != lengths[ s ] )
+                    h.symbols[ offs[ lengths[ s ] ]++ ] = (short) s;
+
+            return true;
+        } //Build
+
+        int Decode( const Huffman & h )
+        {
+            int code = 0, first = 0, index = 0;
+
+            for ( int len = 1; len <= MaxBits; len++ )
+            {
+                int bit;
+                if ( !Bits( 1, bit ) )
+                    return -1;
+
+                code |= bit;
+                int count = h.counts[ len ];
+
+                if ( code - count < first )
+                    return h.symbols[ index + ( code - first ) ];
+
+                index += count;
+                first += count;
+                first <<= 1;
+                code <<= 1;
+            }
+
+            return -1;
+        } //Decode
+
+        bool Stored()
+        {
+            // stored blocks start on a byte boundary
+
+            bitBuf = 0;
+            bitCount = 0;
+
+            int b[ 4 ];
+            for ( int i = 0; i < 4; i++ )
+                if ( ( b[ i ] = NextByte() ) < 0 )
+                    return false;
+
+            unsigned len = b[ 0 ] | ( b[ 1 ] << 8 );
+            unsigned nlen = b[ 2 ] | ( b[ 3 ] << 8 );
+
+            if ( len != ( ~nlen & 0xffff ) )
+                return false;
+
+            while ( len-- && !Full() )
+            {
+                int x = NextByte();
+                if ( x < 0 )
+                    return false;
+
+                out.push_back( (BYTE) x );
+            }
+
+            return true;
+        } //Stored
+
+        bool Codes( const Huffman & lencode, const Huffman & distcode )
+        {
+            static const short lbase[ 29 ] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+            static const short lext[ 29 ] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+            static const short dbase[ 30 ] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073,
+                                               4097, 6145, 8193, 12289, 16385, 24577 };
+            static const short dext[ 30 ] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+            do
+            {
+                int symbol = Decode( lencode );
+                if ( symbol < 0 )
+                    return false;
+
+                if ( 256 == symbol )
+                    return true;
+
+                if ( symbol < 256 )
+                    out.push_back( (BYTE) symbol );
+                else
+                {
+                    symbol -= 257;
+                    if ( symbol >= 29 )
+                        return false;
+
+                    int extra;
+                    if ( !Bits( lext[ symbol ], extra ) )
+                        return false;
+
+                    int len = lbase[ symbol ] + extra;
+
+                    symbol = Decode( distcode );
+                    if ( symbol < 0 || symbol >= 30 )
+                        return false;
+
+                    if ( !Bits( dext[ symbol ], extra ) )
+                        return false;
+
+                    size_t dist = dbase[ symbol ] + extra;
+                    if ( dist > out.size() )
+                        return false;
+
+                    while ( len-- && !Full() )
+                    {
+                        BYTE x = out[ out.size() - dist ];
+                        out.push_back( x );
+                    }
+                }
+            } while ( !Full() );
+
+            return true;
+        } //Codes
+
+        bool Fixed()
+        {
+            Huffman lencode, distcode;
+            short lengths[ 288 ];
+
+            for ( int s = 0; s < 288; s++ )
+                lengths[ s ] = ( s < 144 ) ? 8 : ( s < 256 ) ? 9 : ( s < 280 ) ? 7 : 8;
+
+            Build( lencode, lengths, 288 );
+
+            for ( int s = 0; s < 30; s++ )
+                lengths[ s ] = 5;
+
+            Build( distcode, lengths, 30 );
+
+            return Codes( lencode, distcode );
+        } //Fixed
+
+        bool Dynamic()
+        {
+            static const BYTE order[ 19 ] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+            int nlen, ndist, ncode;
+            if ( !Bits( 5, nlen ) || !Bits( 5, ndist ) || !Bits( 4, ncode ) )
+                return false;
+
+            nlen += 257;
+            ndist += 1;
+            ncode += 4;
+
+            if ( nlen > 286 || ndist > 30 )
+                return false;
+
+            short lengths[ 286 + 30 ];
+            memset( lengths, 0, sizeof lengths );
+
+            for ( int i = 0; i < ncode; i++ )
+            {
+                int len;
+                if ( !Bits( 3, len ) )
+                    return false;
+
+                lengths[ order[ i ] ] = (short) len;
+            }
+
+            Huffman lencode, distcode;
+            if ( !Build( lencode, lengths, 19 ) )
+                return false;
+
+            int index = 0;
+
+            while ( index < nlen + ndist )
+            {
+                int symbol = Decode( lencode );
+                if ( symbol < 0 )
+                    return false;
+
+                if ( symbol < 16 )
+                    lengths[ index++ ] = (short) symbol;
+                else
+                {
+                    short len = 0;
+                    int repeat;
+
+                    if ( 16 == symbol )
+                    {
+                        if ( 0 == index || !Bits( 2, repeat ) )
+                            return false;
+
+                        len = lengths[ index - 1 ];
+                        repeat += 3;
+                    }
+                    else if ( 17 == symbol )
+                    {
+                        if ( !Bits( 3, repeat ) )
+                            return false;
+
+                        repeat += 3;
+                    }
+                    else
+                    {
+                        if ( !Bits( 7, repeat ) )
+                            return false;
+
+                        repeat += 11;
+                    }
+
+                    if ( index + repeat > nlen + ndist )
+                        return false;
+
+                    while ( repeat-- )
+                        lengths[ index++ ] = len;
+                }
+            }
+
+            // there must be an end-of-block code
+
+            if ( 0 == lengths[ 256 ] )
+                return false;
+
+            if ( !Build( lencode, lengths, nlen ) || !Build( distcode, lengths + nlen, ndist ) )
+                return false;
+
+            return Codes( lencode, distcode );
+        } //Dynamic
+
+        bool Run()
+        {
+            int last, type;
+
+            do
+            {
+                if ( !Bits( 1, last ) || !Bits( 2, type ) )
+                    return false;
+
+                bool ok = false;
+
+                if ( 0 == type )
+                    ok = Stored();
+                else if ( 1 == type )
+                    ok = Fixed();
+                else if ( 2 == type )
+                    ok = Dynamic();
+
+                if ( !ok )
+                    return false;
+            } while ( !last && !Full() );
+
+            return true;
+        } //Run
+
+    public:
+        // Decompresses compressedLength bytes starting at the stream's current position.
+        // Stops once maxOutput bytes are produced. Returns false if the data is malformed or truncated.
+
+        static bool Inflate( CStream & input, __int64 compressedLength, std::vector<BYTE> & output, size_t maxOutput )
+        {
+            output.clear();
+            output.reserve( maxOutput );
+
+            CInflate inflate( input, compressedLength, output, maxOutput );
+            return inflate.Run();
+        } //Inflate
+}; //CInflate
+
@@ -0,0 +1,259 @@
+#pragma once
+
+//
+// Runs a two stage pipeline over a list of items: a read stage, then a parse stage. Each stage has its
+// own limit, so a USB hard disk can have one or two reads in flight while every core parses, and an
+// NVMe drive or network share can have dozens of reads in flight.
+// When adaptive, the read limit is tuned by hill climbing. Each interval the read stage's throughput is
+// measured. The limit keeps moving the same way while throughput improves by more than 5%; when it
+// doesn't, the limit goes back to the best one seen and the direction reverses with half the step.
+// The best limit is measured again each time it's used since throughput changes as a scan moves on.
+//
+
+#include <windows.h>
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <chrono>
+#include <exception>
+
+#include "djl_bgio.hxx"
+
+using namespace std;
+using namespace std::chrono;
+
+class CIoScheduler
+{
+    public:
+        struct Settings
+        {
+            int startInFlight;
+            int minInFlight;
+            int maxInFlight;
+            bool adaptive;
+            bool serialEnumeration;      // walking folders in parallel makes a hard disk seek
+        };
+
+    private:
+        static const DWORD IntervalMs = 1000;
+        static const size_t MinSamples = 16;   // fewer completions than this in an interval is too noisy
+
+        Settings settings;
+        std::mutex mtx;
+        condition_variable cvRead, cvParse;
+        int readLimit, readsInFlight;
+        int parseLimit, parsesInFlight;
+
+        // hill climbing state, protected by mtx
+
+        steady_clock::time_point intervalStart;
+        size_t completions;
+        double latencySumMs;
+        int bestLimit;
+        double bestThroughput;
+        int step;
+        int direction;
+
+        int Clamp( int limit ) { return __min( settings.maxInFlight, __max( settings.minInFlight, limit ) ); }
+
+        void Adjust( double seconds )
+        {
+            double throughput = completions / seconds;
+            double latencyMs = latencySumMs / completions;
+            int previous = readLimit;
+
+            if ( readLimit == bestLimit )
+                bestThroughput = throughput;
+            else if ( throughput > bestThroughput * 1.05 )
+            {
+                bestThroughput = throughput;
+                bestLimit = readLimit;
+            }
+            else
+            {
+                direction = -direction;
+                step = __max( 1, step / 2 );
+                readLimit = bestLimit;
+            }
+
+            if ( readLimit == bestLimit )
+            {
+                int next = Clamp( readLimit + direction * step );
+
+                if ( next == readLimit )
+                {
+                    direction = -direction;
+                    next = Clamp( readLimit + direction * step );
+                }
+
+                readLimit = next;
+            }
+
+            tracer.Trace( "io: %.1lf files/s, %.2lf ms average read with %d in flight; best %d at %.1lf files/s; now %d\n",
+                          throughput, latencyMs, previous, bestLimit, bestThroughput, readLimit );
+
+            if ( readLimit > previous )
+                cvRead.notify_all();
+        } //Adjust
+
+        void BeginRead()
+        {
+            unique_lock<mutex> lock( mtx );
+            cvRead.wait( lock, [this] { return readsInFlight < readLimit; } );
+            readsInFlight++;
+        } //BeginRead
+
+        void EndRead( double ms )
+        {
+            lock_guard<mutex> lock( mtx );
+            readsInFlight--;
+            completions++;
+            latencySumMs += ms;
+
+            if ( settings.adaptive )
+            {
+                steady_clock::time_point now = steady_clock::now();
+                double seconds = duration_cast<duration<double>>( now - intervalStart ).count();
+
+                if ( seconds * 1000.0 >= IntervalMs && completions >= MinSamples )
+                {
+                    Adjust( seconds );
+                    intervalStart = now;
+                    completions = 0;
+                    latencySumMs = 0.0;
+                }
+            }
+
+            cvRead.notify_one();
+        } //EndRead
+
+        void BeginParse()
+        {
+            unique_lock<mutex> lock( mtx );
+            cvParse.wait( lock, [this] { return parsesInFlight < parseLimit; } );
+            parsesInFlight++;
+        } //BeginParse
+
+        void EndParse()
+        {
+            lock_guard<mutex> lock( mtx );
+            parsesInFlight--;
+            cvParse.notify_one();
+        } //EndParse
+
+    public:
+        // hdd, ssd, net, auto, or a fixed number of reads in flight
+
+        static bool ParseSettings( const WCHAR * pwc, Settings & s )
+        {
+            int cores = __max( 1, (int) thread::hardware_concurrency() );
+
+            if ( !_wcsicmp( pwc, L"hdd" ) )
+                s = { 1, 1, 2, true, true };
+            else if ( !_wcsicmp( pwc, L"ssd" ) )
+                s = { 16, 4, 64, true, false };
+            else if ( !_wcsicmp( pwc, L"net" ) )
+                s = { 32, 8, 128, true, false };
+            else if ( !_wcsicmp( pwc, L"auto" ) )
+                s = { cores, 1, 64, true, false };
+            else
+            {
+                int n = _wtoi( pwc );
+                if ( n < 1 || n > 256 )
+                    return false;
+
+                s = { n, n, n, false, false };
+            }
+
+            return true;
+        } //ParseSettings
+
+        CIoScheduler( Settings & s, int parseThreads ) : settings( s ), readsInFlight( 0 ), parsesInFlight( 0 )
+        {
+            readLimit = bestLimit = Clamp( settings.startInFlight );
+            parseLimit = __max( 1, parseThreads );
+            completions = 0;
+            latencySumMs = 0.0;
+            bestThroughput = 0.0;
+            step = __max( 1, readLimit / 2 );
+            direction = 1;
+        } //CIoScheduler
+
+        // Calls readStage then parseStage for each of count items. Items are started in order. Each worker
+        // has a T that both stages for an item get, e.g. for what the read stage loaded.
+        // An exception from either stage stops the run and is rethrown once every worker is done.
+
+        template<class T> void Run( size_t count, function<void( size_t, T & )> readStage, function<void( size_t, T & )> parseStage )
+        {
+            atomic<size_t> next( 0 );
+            exception_ptr failure;
+            std::mutex mtxFailure;
+
+            intervalStart = steady_clock::now();
+            size_t workers = __min( count, (size_t) ( settings.maxInFlight + parseLimit ) );
+            vector<thread> threads;
+
+            for ( size_t w = 0; w < workers; w++ )
+            {
+                threads.emplace_back( [&] ()
+                {
+                    CBackgroundIo::CThreadScope background;
+                    T state;
+
+                    do
+                    {
+                        size_t i = next++;
+                        if ( i >= count )
+                            break;
+
+                        bool reading = false, parsing = false;
+
+                        try
+                        {
+                            BeginRead();
+                            reading = true;
+                            steady_clock::time_point start = steady_clock::now();
+                            readStage( i, state );
+                            reading = false;
+                            EndRead( duration_cast<duration<double, milli>>( steady_clock::now() - start ).count() );
+
+                            BeginParse();
+                            parsing = true;
+                            parseStage( i, state );
+                            parsing = false;
+                            EndParse();
+                        }
+                        catch ( ... )
+                        {
+                            // give back the slot so workers waiting for it can see the run is over
+
+                            if ( reading )
+                                EndRead( 0.0 );
+                            else if ( parsing )
+                                EndParse();
+
+                            lock_guard<mutex> lock( mtxFailure );
+                            if ( !failure )
+                                failure = current_exception();
+
+                            next = count;
+                            break;
+                        }
+                    } while ( true );
+                } );
+            }
+
+            for ( size_t w = 0; w < threads.size(); w++ )
+                threads[ w ].join();
+
+            tracer.Trace( "io: finished with %d reads in flight allowed\n", readLimit );
+
+            if ( failure )
+                rethrow_exception( failure );
+        } //Run
+}; //CIoScheduler
+
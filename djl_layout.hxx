@@ -0,0 +1,148 @@
+#pragma once
+
+//
+// Orders a list of files by where their data is on disk so that reading them in order on a hard disk
+// is close to one sequential sweep rather than a seek per file.
+// The location of a file is its first extent's logical cluster number from FSCTL_GET_RETRIEVAL_POINTERS.
+// Files with no extents (small files stored in the MFT, empty files, or file systems that don't support
+// the call) sort by file index instead, which follows the order of their MFT records; they're put first.
+// Archive members sort with their archive, in their original order.
+//
+
+#include <windows.h>
+#include <winioctl.h>
+#include <ppl.h>
+
+#include <vector>
+#include <map>
+#include <mutex>
+#include <string>
+#include <algorithm>
+
+#include "djlsav.hxx"
+#include "djl_archive.hxx"
+
+using namespace std;
+using namespace concurrency;
+
+class CDiskLayout
+{
+    private:
+        struct Location
+        {
+            DWORD volume;
+            bool inExtent;          // false if key is a file index rather than a cluster number
+            ULONGLONG key;
+        };
+
+        static Location GetLocation( const WCHAR * pwcPath )
+        {
+            Location loc = { 0, false, 0 };
+
+            HANDLE h = CreateFile( pwcPath, FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, 0, NULL );
+            if ( INVALID_HANDLE_VALUE == h )
+                return loc;
+
+            BY_HANDLE_FILE_INFORMATION info;
+            if ( GetFileInformationByHandle( h, &info ) )
+            {
+                loc.volume = info.dwVolumeSerialNumber;
+                loc.key = ( ( (ULONGLONG) info.nFileIndexHigh ) << 32 ) | info.nFileIndexLow;
+            }
+
+            // just the first extent is needed; ERROR_MORE_DATA means there are others
+
+            STARTING_VCN_INPUT_BUFFER in;
+            in.StartingVcn.QuadPart = 0;
+            RETRIEVAL_POINTERS_BUFFER out;
+            DWORD cb = 0;
+
+            BOOL ok = DeviceIoControl( h, FSCTL_GET_RETRIEVAL_POINTERS, &in, sizeof in, &out, sizeof out, &cb, NULL );
+
+            if ( ( ok || ERROR_MORE_DATA == GetLastError() ) && out.ExtentCount > 0 && -1 != out.Extents[ 0 ].Lcn.QuadPart )
+            {
+                loc.inExtent = true;
+                loc.key = out.Extents[ 0 ].Lcn.QuadPart;
+            }
+
+            CloseHandle( h );
+            return loc;
+        } //GetLocation
+
+    public:
+        // Reorders array. Locations are looked up one file at a time when serial, which avoids seeking
+        // between MFT records on a hard disk, or in parallel otherwise.
+        // Returns the permutation: element i of the new array was element order[ i ] of the old one.
+
+        static vector<size_t> Order( CStringArray & array, bool serial )
+        {
+            size_t count = array.Count();
+            vector<Location> locations( count );
+            map<wstring, Location> archives;
+            std::mutex mtxArchives;
+
+            auto locate = [&] ( size_t i )
+            {
+                if ( !CArchive::IsMemberPath( array[ i ] ) )
+                {
+                    locations[ i ] = GetLocation( array[ i ] );
+                    return;
+                }
+
+                wstring archive( array[ i ], wcschr( array[ i ], CArchive::Separator ) - array[ i ] );
+
+                {
+                    lock_guard<mutex> lock( mtxArchives );
+                    auto it = archives.find( archive );
+                    if ( archives.end() != it )
+                    {
+                        locations[ i ] = it->second;
+                        return;
+                    }
+                }
+
+                Location loc = GetLocation( archive.c_str() );
+                locations[ i ] = loc;
+
+                lock_guard<mutex> lock( mtxArchives );
+                archives[ archive ] = loc;
+            };
+
+            if ( serial )
+            {
+                for ( size_t i = 0; i < count; i++ )
+                    locate( i );
+            }
+            else
+                parallel_for( (size_t) 0, count, locate );
+
+            vector<size_t> order( count );
+            for ( size_t i = 0; i < count; i++ )
+                order[ i ] = i;
+
+            stable_sort( order.begin(), order.end(), [&] ( size_t a, size_t b )
+            {
+                const Location & la = locations[ a ];
+                const Location & lb = locations[ b ];
+
+                if ( la.volume != lb.volume )
+                    return la.volume < lb.volume;
+
+                if ( la.inExtent != lb.inExtent )
+                    return !la.inExtent;
+
+                return la.key < lb.key;
+            } );
+
+            size_t inExtents = 0;
+            for ( size_t i = 0; i < count; i++ )
+                if ( locations[ i ].inExtent )
+                    inExtents++;
+
+            tracer.Trace( "ordered %zd files by disk location; %zd by first extent, the rest by file index\n", count, inExtents );
+
+            array.Keep( order );
+            return order;
+        } //Order
+}; //CDiskLayout
+
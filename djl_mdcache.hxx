@@ -0,0 +1,143 @@
+#pragma once
+
+//
+// A bounded, least-recently-used cache of parsed metadata shared by every CImageData in the process.
+// Interactive apps like viewers ask for the rating, orientation, and other metadata of many files in turn,
+// and without this each switch between files re-parses one of them.
+// Entries are keyed by path, ignoring case, and hold the file's size and last write time when it was parsed.
+// A lookup is a hit only if the file still has that size and time, so files changed by other apps or
+// processes are parsed again. Writes through CImageData store the updated metadata with the new size and time.
+// A capacity of 0 turns the cache off; lookups then return right away without taking the lock.
+//
+
+#include <windows.h>
+
+#include <list>
+#include <unordered_map>
+#include <string>
+#include <mutex>
+#include <atomic>
+
+using namespace std;
+
+template<class T> class CMetadataCache
+{
+    private:
+        struct Entry
+        {
+            wstring key;
+            unsigned long long size;
+            unsigned long long lastWrite;
+            T data;
+        };
+
+        std::mutex mtx;
+        list<Entry> entries;                                      // most recently used first
+        unordered_map<wstring, typename list<Entry>::iterator> index;
+        atomic<size_t> capacity;
+        atomic<size_t> hits, misses;
+
+        static wstring Key( const WCHAR * pwcPath )
+        {
+            wstring key( pwcPath );
+
+            for ( size_t i = 0; i < key.length(); i++ )
+                key[ i ] = towlower( key[ i ] );
+
+            return key;
+        } //Key
+
+        void Trim()
+        {
+            while ( entries.size() > capacity )
+            {
+                index.erase( entries.back().key );
+                entries.pop_back();
+            }
+        } //Trim
+
+    public:
+        static const size_t DefaultCapacity = 256;
+
+        CMetadataCache() : capacity( DefaultCapacity ), hits( 0 ), misses( 0 ) {}
+
+        bool Enabled() { return ( 0 != capacity ); }
+
+        void SetCapacity( size_t c )
+        {
+            lock_guard<mutex> lock( mtx );
+            capacity = c;
+            Trim();
+        } //SetCapacity
+
+        // Copies the cached metadata to data if the file hasn't changed since it was cached
+
+        bool Find( const WCHAR * pwcPath, unsigned long long size, unsigned long long lastWrite, T & data )
+        {
+            if ( !Enabled() )
+                return false;
+
+            wstring key = Key( pwcPath );
+            lock_guard<mutex> lock( mtx );
+
+            auto it = index.find( key );
+            if ( index.end() == it )
+            {
+                misses++;
+                return false;
+            }
+
+            if ( it->second->size != size || it->second->lastWrite != lastWrite )
+            {
+                entries.erase( it->second );
+                index.erase( it );
+                misses++;
+                return false;
+            }
+
+            entries.splice( entries.begin(), entries, it->second );
+            data = it->second->data;
+            hits++;
+            return true;
+        } //Find
+
+        void Store( const WCHAR * pwcPath, unsigned long long size, unsigned long long lastWrite, const T & data )
+        {
+            if ( !Enabled() )
+                return;
+
+            wstring key = Key( pwcPath );
+            lock_guard<mutex> lock( mtx );
+
+            auto it = index.find( key );
+            if ( index.end() != it )
+            {
+                entries.splice( entries.begin(), entries, it->second );
+                it->second->size = size;
+                it->second->lastWrite = lastWrite;
+                it->second->data = data;
+                return;
+            }
+
+            entries.push_front( { key, size, lastWrite, data } );
+            index[ key ] = entries.begin();
+            Trim();
+        } //Store
+
+        void Remove( const WCHAR * pwcPath )
+        {
+            wstring key = Key( pwcPath );
+            lock_guard<mutex> lock( mtx );
+
+            auto it = index.find( key );
+            if ( index.end() != it )
+            {
+                entries.erase( it->second );
+                index.erase( it );
+            }
+        } //Remove
+
+        size_t Hits() { return hits; }
+        size_t Misses() { return misses; }
+}; //CMetadataCache
+
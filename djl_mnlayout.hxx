@@ -0,0 +1,132 @@
+#pragma once
+
+//
+// Caches where in a makernote the tags that CImageData uses are, per camera make, model, and firmware.
+// Files from one camera and firmware almost always have the same makernote layout, so once a file has been
+// walked, later files can read just those tags. Each cached tag is validated before it's used: the IFD
+// entry at the cached position must have the same id, type, and count, and the makernote's first IFD must
+// have the same number of tags. If anything differs the caller walks the makernote as before.
+// The cache is read by every parsing thread and written only when a layout is learned or changes, so it's
+// guarded by a slim reader/writer lock.
+//
+
+#include <windows.h>
+
+#include <vector>
+#include <map>
+#include <string>
+#include <atomic>
+
+using namespace std;
+
+class CMakernoteLayoutCache
+{
+    public:
+        enum Field : BYTE
+        {
+            fieldSerialString,        // string value, inline if count <= 4
+            fieldSerialBytes,         // count bytes at offset
+            fieldLensModelString,
+            fieldLensSerialString,
+            fieldISO,                 // the value is the ISO
+            fieldNikonPreviewIFD,     // offset of an IFD to walk
+            fieldOlympusSettingsIFD,
+        };
+
+        struct Entry
+        {
+            __int64 delta;            // of the IFD entry from the start of the makernote
+            WORD id;
+            WORD type;
+            DWORD count;
+            Field field;
+            bool makernoteBase;       // true if offsets are relative to the makernote, false if to the header
+            __int64 baseDelta;        // added to the makernote start when makernoteBase
+            bool detectGarbage;
+        };
+
+        struct Layout
+        {
+            bool littleEndian;
+            bool haveFirstIFD;
+            __int64 firstIFDDelta;    // of the first IFD from the start of the makernote
+            WORD firstIFDTags;
+            vector<Entry> entries;
+
+            Layout() : littleEndian( true ), haveFirstIFD( false ), firstIFDDelta( 0 ), firstIFDTags( 0 ) {}
+
+            bool Same( const Layout & other ) const
+            {
+                if ( littleEndian != other.littleEndian || haveFirstIFD != other.haveFirstIFD ||
+                     firstIFDDelta != other.firstIFDDelta || firstIFDTags != other.firstIFDTags ||
+                     entries.size() != other.entries.size() )
+                    return false;
+
+                for ( size_t i = 0; i < entries.size(); i++ )
+                {
+                    const Entry & a = entries[ i ];
+                    const Entry & b = other.entries[ i ];
+
+                    if ( a.delta != b.delta || a.id != b.id || a.type != b.type || a.count != b.count || a.field != b.field ||
+                         a.makernoteBase != b.makernoteBase || a.baseDelta != b.baseDelta || a.detectGarbage != b.detectGarbage )
+                        return false;
+                }
+
+                return true;
+            } //Same
+        };
+
+    private:
+        SRWLOCK lock;                  // shared for lookups, exclusive to add a layout
+        map<string, Layout> layouts;
+        atomic<size_t> hits, misses;
+
+    public:
+        CMakernoteLayoutCache() : hits( 0 ), misses( 0 ) { InitializeSRWLock( &lock ); }
+
+        static string Key( const char * pcMake, const char * pcModel, const char * pcFirmware )
+        {
+            string key( pcMake );
+            key += '|';
+            key += pcModel;
+            key += '|';
+            key += pcFirmware;
+            return key;
+        } //Key
+
+        bool Find( const string & key, Layout & layout )
+        {
+            AcquireSRWLockShared( &lock );
+
+            auto it = layouts.find( key );
+            bool found = ( layouts.end() != it );
+            if ( found )
+                layout = it->second;
+
+            ReleaseSRWLockShared( &lock );
+            return found;
+        } //Find
+
+        void Store( const string & key, const Layout & layout )
+        {
+            AcquireSRWLockShared( &lock );
+            auto it = layouts.find( key );
+            bool same = ( layouts.end() != it && it->second.Same( layout ) );
+            ReleaseSRWLockShared( &lock );
+
+            if ( same )
+                return;
+
+            AcquireSRWLockExclusive( &lock );
+            layouts[ key ] = layout;
+            ReleaseSRWLockExclusive( &lock );
+
+            tracer.Trace( "learned makernote layout with %zd tags for %s\n", layout.entries.size(), key.c_str() );
+        } //Store
+
+        void Hit() { hits++; }
+        void Miss() { misses++; }
+        size_t Hits() { return hits; }
+        size_t Misses() { return misses; }
+}; //CMakernoteLayoutCache
+
@@ -0,0 +1,135 @@
+#pragma once
+
+//
+// Partial-result files hold the aggregates from one shard of a scan so shards can run in separate
+// processes or on separate machines and be merged later with no coordinator.
+// Values are little-endian and strings are a WORD length followed by the characters, no terminator.
+// The reader checks every read against the end of the data; after a short read Ok() is false and
+// every Get returns 0 or an empty string.
+//
+
+#include <windows.h>
+
+#include <vector>
+#include <string>
+
+#include "djl_strm.hxx"
+
+using namespace std;
+
+class CPartialWriter
+{
+    private:
+        vector<BYTE> data;
+
+    public:
+        template<class T> void Put( T value )
+        {
+            BYTE * p = (BYTE *) &value;
+            data.insert( data.end(), p, p + sizeof value );
+        } //Put
+
+        void PutString( const char * pc )
+        {
+            WORD len = (WORD) strnlen( pc, 0xffff );
+            Put( len );
+            data.insert( data.end(), (BYTE *) pc, (BYTE *) pc + len );
+        } //PutString
+
+        void PutString( const WCHAR * pwc )
+        {
+            WORD len = (WORD) wcsnlen( pwc, 0xffff );
+            Put( len );
+            data.insert( data.end(), (BYTE *) pwc, (BYTE *) ( pwc + len ) );
+        } //PutString
+
+        bool Save( const WCHAR * pwcPath )
+        {
+            CStream stream( pwcPath, true );
+            if ( !stream.Ok() )
+                return false;
+
+            return ( data.size() == stream.Write( data.data(), (ULONG) data.size() ) );
+        } //Save
+}; //CPartialWriter
+
+class CPartialReader
+{
+    private:
+        vector<BYTE> data;
+        size_t pos;
+        bool ok;
+
+        bool Have( size_t cb )
+        {
+            if ( ok && ( data.size() - pos ) < cb )
+                ok = false;
+
+            return ok;
+        } //Have
+
+    public:
+        CPartialReader() : pos( 0 ), ok( false ) {}
+
+        bool Load( const WCHAR * pwcPath )
+        {
+            CStream stream( pwcPath );
+            ok = stream.Ok() && stream.Length() < 0x7fffffff;
+            pos = 0;
+
+            if ( ok )
+            {
+                data.resize( (size_t) stream.Length() );
+                ok = ( data.size() == stream.Read( data.data(), (ULONG) data.size() ) );
+            }
+
+            return ok;
+        } //Load
+
+        bool Ok() { return ok; }
+        bool AtEnd() { return ( pos == data.size() ); }
+
+        template<class T> T Get()
+        {
+            T value = 0;
+
+            if ( Have( sizeof value ) )
+            {
+                memcpy( &value, data.data() + pos, sizeof value );
+                pos += sizeof value;
+            }
+
+            return value;
+        } //Get
+
+        // Copies the string to pc, truncating it to fit in cc characters including the terminator
+
+        void GetString( char * pc, size_t cc )
+        {
+            WORD len = Get<WORD>();
+            pc[ 0 ] = 0;
+
+            if ( Have( len ) )
+            {
+                size_t copy = __min( (size_t) len, cc - 1 );
+                memcpy( pc, data.data() + pos, copy );
+                pc[ copy ] = 0;
+                pos += len;
+            }
+        } //GetString
+
+        void GetString( WCHAR * pwc, size_t cc )
+        {
+            WORD len = Get<WORD>();
+            pwc[ 0 ] = 0;
+
+            if ( Have( len * sizeof( WCHAR ) ) )
+            {
+                size_t copy = __min( (size_t) len, cc - 1 );
+                memcpy( pwc, data.data() + pos, copy * sizeof( WCHAR ) );
+                pwc[ copy ] = 0;
+                pos += len * sizeof( WCHAR );
+            }
+        } //GetString
+}; //CPartialReader
+
@@ -0,0 +1,188 @@
+#pragma once
+
+//
+// Shows a scan's progress on one line of stderr: files done, files/s, MB/s read, errors, and the time left.
+// Parsing threads add to counters in their own cache line with relaxed atomics, so finishing a file takes
+// no lock and doesn't contend with other threads. A reporter thread sums the counters once a second.
+// The time left uses a smoothed rate so a few slow files don't swing it.
+// Nothing is shown if stderr isn't a console, e.g. when it's redirected to a file.
+//
+
+#include <windows.h>
+#include <stdio.h>
+#include <io.h>
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+
+#include "djl_strm.hxx"
+
+using namespace std;
+using namespace std::chrono;
+
+class CProgress
+{
+    private:
+        static const size_t Slots = 64;            // threads beyond this share slots
+        static const DWORD IntervalMs = 1000;
+
+        struct alignas( 64 ) Slot
+        {
+            atomic<ULONGLONG> files;
+            atomic<ULONGLONG> bytes;
+            atomic<ULONGLONG> errors;
+        };
+
+        // Which slot this thread adds to, and how much of CStream's count for the thread has been added
+
+        struct ThreadState
+        {
+            CProgress * owner;
+            Slot * slot;
+            ULONGLONG bytesSeen;
+        };
+
+        Slot slots[ Slots ];
+        atomic<size_t> nextSlot;
+        size_t total;
+        bool enabled;
+        bool stopping;
+        std::mutex mtx;
+        condition_variable cv;
+        thread reporter;
+        steady_clock::time_point start, last;
+        ULONGLONG lastFiles;
+        double rate;                                // smoothed files per second
+
+        static ThreadState & State()
+        {
+            static thread_local ThreadState state = { NULL, NULL, 0 };
+            return state;
+        } //State
+
+        static void FormatTime( char * pc, size_t cc, double seconds )
+        {
+            ULONGLONG s = (ULONGLONG) seconds;
+            sprintf_s( pc, cc, "%llu:%02llu:%02llu", s / 3600, ( s / 60 ) % 60, s % 60 );
+        } //FormatTime
+
+        void Report( bool final )
+        {
+            ULONGLONG files = 0, bytes = 0, errors = 0;
+
+            for ( size_t i = 0; i < Slots; i++ )
+            {
+                files += slots[ i ].files.load( memory_order_relaxed );
+                bytes += slots[ i ].bytes.load( memory_order_relaxed );
+                errors += slots[ i ].errors.load( memory_order_relaxed );
+            }
+
+            steady_clock::time_point now = steady_clock::now();
+            double elapsed = __max( 0.001, duration_cast<duration<double>>( now - start ).count() );
+            double interval = duration_cast<duration<double>>( now - last ).count();
+
+            if ( interval > 0.0 )
+            {
+                double current = ( files - lastFiles ) / interval;
+                rate = ( 0 == lastFiles ) ? current : ( 0.7 * rate + 0.3 * current );
+            }
+
+            last = now;
+            lastFiles = files;
+
+            double percent = ( 0 == total ) ? 100.0 : ( 100.0 * files / total );
+            double mbPerSecond = bytes / elapsed / ( 1024.0 * 1024.0 );
+            char acTime[ 40 ];
+
+            if ( final )
+                FormatTime( acTime, _countof( acTime ), elapsed );
+            else if ( rate > 0.0 )
+                FormatTime( acTime, _countof( acTime ), ( total - __min( (ULONGLONG) total, files ) ) / rate );
+            else
+                strcpy_s( acTime, _countof( acTime ), "?" );
+
+            fprintf( stderr, "\r%llu of %zd files (%.0lf%%), %.0lf files/s, %.1lf MB/s, %llu errors, %s %s   ",
+                     files, total, percent, final ? files / elapsed : rate, mbPerSecond, errors, final ? "took" : "eta", acTime );
+
+            if ( final )
+                fprintf( stderr, "\n" );
+
+            fflush( stderr );
+        } //Report
+
+    public:
+        CProgress( bool requested, size_t totalFiles ) : nextSlot( 0 ), total( totalFiles ), stopping( false ), lastFiles( 0 ), rate( 0.0 )
+        {
+            enabled = requested && _isatty( _fileno( stderr ) );
+
+            for ( size_t i = 0; i < Slots; i++ )
+            {
+                slots[ i ].files = 0;
+                slots[ i ].bytes = 0;
+                slots[ i ].errors = 0;
+            }
+
+            start = last = steady_clock::now();
+
+            if ( enabled )
+            {
+                reporter = thread( [this] ()
+                {
+                    unique_lock<mutex> lock( mtx );
+
+                    while ( !cv.wait_for( lock, milliseconds( (DWORD) IntervalMs ), [this] { return stopping; } ) )
+                        Report( false );
+                } );
+            }
+        } //CProgress
+
+        ~CProgress() { Stop(); }
+
+        // Call when a file is done. Bytes are what CStream read on this thread since its last call.
+        // Scan threads start with a count of 0, so the first call on a thread includes everything it read.
+
+        void FileDone( bool error )
+        {
+            if ( !enabled )
+                return;
+
+            ThreadState & state = State();
+
+            if ( this != state.owner )
+            {
+                state.owner = this;
+                state.slot = & slots[ nextSlot++ % Slots ];
+                state.bytesSeen = 0;
+            }
+
+            ULONGLONG bytes = CStream::ThreadBytesRead();
+
+            state.slot->files.fetch_add( 1, memory_order_relaxed );
+            state.slot->bytes.fetch_add( bytes - state.bytesSeen, memory_order_relaxed );
+            if ( error )
+                state.slot->errors.fetch_add( 1, memory_order_relaxed );
+
+            state.bytesSeen = bytes;
+        } //FileDone
+
+        // Stops the reporter and prints the final line. Call before printing anything else to stdout.
+
+        void Stop()
+        {
+            if ( !enabled || !reporter.joinable() )
+                return;
+
+            {
+                lock_guard<mutex> lock( mtx );
+                stopping = true;
+            }
+
+            cv.notify_all();
+            reporter.join();
+            Report( true );
+        } //Stop
+}; //CProgress
+
@@ -0,0 +1,204 @@
+#pragma once
+
+//
+// Picks a random sample of files so a report can be estimated by parsing just the sample.
+// Files can be stratified by the folder under the enumeration root that holds them. Each stratum gets a
+// share of the sample proportional to its size, but at least 2 files so its variance can be estimated.
+// Within a stratum files are chosen with a partial Fisher-Yates shuffle so every subset is equally likely.
+// Counts seen in the sample are scaled by each stratum's population / sampled, and the 95% confidence
+// interval is the normal approximation with the finite population correction.
+// Tally is called for every counter a parsed file touches, so each thread counts in its own map with no lock.
+// The maps are merged the first time Estimate is called, after the scan.
+//
+
+#include <windows.h>
+#include <math.h>
+#include <ppl.h>
+
+#include <vector>
+#include <map>
+#include <mutex>
+#include <random>
+#include <string>
+#include <algorithm>
+
+#include "djlsav.hxx"
+
+using namespace std;
+using namespace concurrency;
+
+class CStratifiedSample
+{
+    private:
+        struct Stratum
+        {
+            size_t population;
+            size_t sampled;
+        };
+
+        vector<Stratum> strata;
+        vector<size_t> fileStratum;                                  // stratum of each file in the sampled array
+        typedef map<pair<const void *, size_t>, vector<size_t>> Tallies;   // per-stratum counts of each counter or table row
+
+        size_t population;
+        combinable<Tallies> locals;
+        std::mutex mtx;                                              // protects tallies and merged
+        Tallies tallies;                                             // valid once merged
+        bool merged;
+
+        void Merge()
+        {
+            locals.combine_each( [&] ( Tallies & local )
+            {
+                for ( auto & it : local )
+                {
+                    vector<size_t> & counts = tallies[ it.first ];
+                    if ( counts.empty() )
+                        counts.resize( strata.size() );
+
+                    for ( size_t h = 0; h < it.second.size(); h++ )
+                        counts[ h ] += it.second[ h ];
+                }
+            } );
+
+            merged = true;
+        } //Merge
+
+    public:
+        CStratifiedSample() : population( 0 ), merged( false ) {}
+
+        // Replaces the contents of array with the sample, keeping the files in their original order.
+        // The sample can be larger than sampleSize since each stratum gets at least 2 files; see Sampled().
+        // rootLen is the length of the enumeration root, so the stratum is the first folder below it.
+
+        void Select( CStringArray & array, size_t rootLen, size_t sampleSize, bool byFolder )
+        {
+            population = array.Count();
+            map<wstring, vector<size_t>> groups;
+
+            for ( size_t i = 0; i < array.Count(); i++ )
+            {
+                wstring key;
+
+                if ( byFolder )
+                {
+                    const WCHAR * pwcRest = array[ i ] + __min( rootLen, wcslen( array[ i ] ) );
+                    const WCHAR * pwcEnd = wcspbrk( pwcRest, L"\\|" );
+
+                    if ( NULL != pwcEnd )
+                        key.assign( pwcRest, pwcEnd - pwcRest );
+                }
+
+                groups[ key ].push_back( i );
+            }
+
+            std::random_device rd;
+            std::mt19937_64 gen( rd() );
+            vector<pair<size_t, size_t>> picks;                        // file index, stratum
+
+            for ( auto & g : groups )
+            {
+                vector<size_t> & members = g.second;
+                size_t n = (size_t) llround( (double) sampleSize * members.size() / population );
+                n = __min( members.size(), __max( n, (size_t) 2 ) );
+
+                for ( size_t j = 0; j < n; j++ )
+                {
+                    std::uniform_int_distribution<size_t> distrib( j, members.size() - 1 );
+                    swap( members[ j ], members[ distrib( gen ) ] );
+                    picks.push_back( make_pair( members[ j ], strata.size() ) );
+                }
+
+                strata.push_back( { members.size(), n } );
+            }
+
+            // parse in path order; it's kinder to the disk than random order
+
+            sort( picks.begin(), picks.end() );
+
+            vector<size_t> keep( picks.size() );
+            fileStratum.resize( picks.size() );
+
+            for ( size_t k = 0; k < picks.size(); k++ )
+            {
+                keep[ k ] = picks[ k ].first;
+                fileStratum[ k ] = picks[ k ].second;
+            }
+
+            array.Keep( keep );
+            tracer.Trace( "sampled %zd of %zd files in %zd strata\n", picks.size(), population, strata.size() );
+        } //Select
+
+        size_t Population() { return population; }
+        size_t Sampled() { return fileStratum.size(); }
+        size_t Strata() { return strata.size(); }
+        size_t StratumOf( size_t i ) { return fileStratum[ i ]; }
+
+        // Call after the sampled array is reordered, e.g. by CDiskLayout::Order, with the same permutation
+
+        void Reorder( const vector<size_t> & order )
+        {
+            vector<size_t> reordered( order.size() );
+
+            for ( size_t i = 0; i < order.size(); i++ )
+                reordered[ i ] = fileStratum[ order[ i ] ];
+
+            fileStratum.swap( reordered );
+        } //Reorder
+
+        // Counts one sampled file for a counter or table row. owner and id identify it. Call only during the scan.
+
+        void Tally( const void * owner, size_t id, size_t stratum )
+        {
+            vector<size_t> & counts = locals.local()[ make_pair( owner, id ) ];
+            if ( counts.empty() )
+                counts.resize( strata.size() );
+
+            counts[ stratum ]++;
+        } //Tally
+
+        // The estimated count across all files and its 95% confidence interval.
+        // The low end is never less than the count actually seen in the sample.
+
+        void Estimate( const void * owner, size_t id, double & estimate, double & low, double & high )
+        {
+            estimate = low = high = 0.0;
+
+            lock_guard<mutex> lock( mtx );
+
+            if ( !merged )
+                Merge();
+
+            auto it = tallies.find( make_pair( owner, id ) );
+            if ( tallies.end() == it )
+                return;
+
+            double observed = 0.0;
+            double variance = 0.0;
+
+            for ( size_t h = 0; h < strata.size(); h++ )
+            {
+                double y = (double) it->second[ h ];
+                double n = (double) strata[ h ].sampled;
+                double N = (double) strata[ h ].population;
+
+                if ( 0.0 == n )
+                    continue;
+
+                double p = y / n;
+                estimate += N * p;
+                observed += y;
+
+                if ( n > 1.0 )
+                {
+                    double s2 = p * ( 1.0 - p ) * n / ( n - 1.0 );
+                    variance += N * N * ( 1.0 - n / N ) * s2 / n;
+                }
+            }
+
+            double margin = 1.959964 * sqrt( variance );
+            low = __max( observed, estimate - margin );
+            high = __min( (double) population, estimate + margin );
+        } //Estimate
+}; //CStratifiedSample
+
@@ -157,5 +157,52 @@ class CSha256
             memcpy( pbOut, pbHash, cbHash );
             return true;
         } //Hash
+
+        // Incremental hashing for data too large to hold in memory: Start(), Add() as needed, then Finish()
+
+        bool Start()
+        {
+            if ( 0 != hHash )    
+            {
+                BCryptDestroyHash( hHash );
+                hHash = 0;
+            }
+        
+            NTSTATUS s = BCryptCreateHash( hAlg, &hHash, pbHashObject, cbHashObject, 0, 0, 0 );
+            if ( NT_FAILED( s ) )
+            {
+                printf( "can't create hash: %#x\n", s );
+                return false;
+            }
+
+            return true;
+        } //Start
+
+        bool Add( byte * pb, unsigned long cb )
+        {
+            NTSTATUS s = BCryptHashData( hHash, pb, cb, 0 );
+            if ( NT_FAILED( s ) )
+            {
+                printf( "can't BCryptHashData: %#x\n", s );
+                return false;
+            }
+
+            return true;
+        } //Add
+
+        bool Finish( char * pcHash )
+        {
+            NTSTATUS s = BCryptFinishHash( hHash, pbHash, cbHash, 0 );
+            if ( NT_FAILED( s ) )
+            {
+                printf( "can't BCryptFinishHash: %#x\n", s );
+                return false;
+            }
+
+            for ( int i = 0; i < 32; i++ )
+                sprintf( pcHash + ( 2 * i ), "%02x", (unsigned int) pbHash[ i ] );
+
+            return true;
+        } //Finish
 }; //CSha256
 
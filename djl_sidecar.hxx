@@ -0,0 +1,98 @@
+#pragma once
+
+//
+// Pairs RAW files with the .xmp sidecar files Adobe apps write next to them to hold ratings and edits.
+// CEnumFolder fills this as it lists each folder: sidecars and images come from the same listing and are
+// joined on the file name without its extension (or with it, for apps that name sidecars img.cr2.xmp).
+// Formats that hold XMP themselves (JPG, TIFF, DNG, etc.) never get a sidecar, just as Adobe apps don't
+// write one for them, so an img.jpg next to img.cr2 and img.xmp is left alone.
+// Add is called from many enumeration threads at once; Find is for after enumeration is done.
+// The folder watcher calls Add and Remove between batches as sidecars come and go.
+//
+
+#include <windows.h>
+
+#include <unordered_map>
+#include <string>
+#include <mutex>
+
+using namespace std;
+
+class CSidecars
+{
+    private:
+        std::mutex mtx;
+        unordered_map<wstring, wstring> pairs;        // lowercase image path to sidecar path
+
+    public:
+        static bool IsSidecar( const WCHAR * pwcName )
+        {
+            const WCHAR * pext = wcsrchr( pwcName, L'.' );
+            return ( NULL != pext && !_wcsicmp( pext, L".xmp" ) );
+        } //IsSidecar
+
+        static bool EmbedsXMP( const WCHAR * pwcName )
+        {
+            static const WCHAR * embedders[] = { L".dng", L".heic", L".hif", L".jpeg", L".jpg", L".png", L".tif", L".tiff" };
+            const WCHAR * pext = wcsrchr( pwcName, L'.' );
+
+            if ( NULL == pext )
+                return false;
+
+            for ( size_t i = 0; i < _countof( embedders ); i++ )
+                if ( !_wcsicmp( pext, embedders[ i ] ) )
+                    return true;
+
+            return false;
+        } //EmbedsXMP
+
+        // For one image outside of an enumeration: looks for img.cr2.xmp then img.xmp next to it
+
+        static bool FindBeside( const WCHAR * pwcImage, WCHAR * pwcSidecar, size_t cwcSidecar )
+        {
+            if ( EmbedsXMP( pwcImage ) )
+                return false;
+
+            wstring path( pwcImage );
+            wstring candidates[ 2 ] = { path + L".xmp", path.substr( 0, path.find_last_of( L'.' ) ) + L".xmp" };
+
+            for ( size_t i = 0; i < _countof( candidates ); i++ )
+            {
+                DWORD attr = GetFileAttributes( candidates[ i ].c_str() );
+
+                if ( INVALID_FILE_ATTRIBUTES != attr && 0 == ( attr & FILE_ATTRIBUTE_DIRECTORY ) && candidates[ i ].size() < cwcSidecar )
+                {
+                    wcscpy_s( pwcSidecar, cwcSidecar, candidates[ i ].c_str() );
+                    return true;
+                }
+            }
+
+            return false;
+        } //FindBeside
+
+        void Add( const WCHAR * pwcImage, const WCHAR * pwcSidecar )
+        {
+            lock_guard<mutex> lock( mtx );
+            pairs[ pwcImage ] = pwcSidecar;
+        } //Add
+
+        void Remove( const WCHAR * pwcImage )
+        {
+            lock_guard<mutex> lock( mtx );
+            pairs.erase( pwcImage );
+        } //Remove
+
+        // Returns the image's sidecar path or NULL if it has none. pwcImage must be as enumerated (lowercase).
+
+        const WCHAR * Find( const WCHAR * pwcImage )
+        {
+            if ( pairs.empty() )
+                return NULL;
+
+            auto it = pairs.find( pwcImage );
+            return ( pairs.end() == it ) ? NULL : it->second.c_str();
+        } //Find
+
+        size_t Count() { return pairs.size(); }
+}; //CSidecars
+
@@ -0,0 +1,421 @@
+#pragma once
+
+//
+// Streaming quantiles for exposure values: ISO, shutter speed, and f-number.
+// CQuantileSketch is a DDSketch: each positive value goes in the bucket ceil( log( v ) / log( gamma ) ),
+// so any quantile it returns is within RelativeAccuracy of a value that was added. Sketches merge by
+// adding bucket counts, which gives the same result as adding every value to one sketch.
+// The bucket count is capped; if a sketch would need more, its lowest buckets are folded together.
+// Exposure values span 20 stops or less, which is a few hundred buckets, so the cap is rarely hit.
+// CExposureStats keeps one set of sketches per camera model and per lens. Each thread adds to its own
+// sets and they're merged once when the scan is done, so memory depends on the number of models and
+// lenses, not the number of files.
+//
+
+#include <windows.h>
+#include <stdio.h>
+#include <math.h>
+#include <ppl.h>
+
+#include <vector>
+#include <map>
+#include <string>
+#include <algorithm>
+
+#include "djl_partial.hxx"
+
+using namespace std;
+using namespace concurrency;
+
+class CQuantileSketch
+{
+    private:
+        static const size_t MaxBins = 1024;
+
+        int offset;                      // bucket index of bins[ 0 ]
+        vector<ULONGLONG> bins;
+        ULONGLONG count;
+        double minValue, maxValue;
+
+        static double LogGamma()
+        {
+            static const double logGamma = log( ( 1.0 + RelativeAccuracy ) / ( 1.0 - RelativeAccuracy ) );
+            return logGamma;
+        } //LogGamma
+
+        static int Index( double v ) { return (int) ceil( log( v ) / LogGamma() ); }
+
+        // The value of the bucket with the least relative error for everything in it
+
+        static double Value( int index )
+        {
+            double gamma = exp( LogGamma() );
+            return 2.0 * pow( gamma, index ) / ( gamma + 1.0 );
+        } //Value
+
+        ULONGLONG & Bin( int index )
+        {
+            if ( bins.empty() )
+            {
+                offset = index;
+                bins.assign( 1, 0 );
+            }
+            else if ( index < offset )
+            {
+                // values below the lowest bucket that fits go in the lowest bucket
+
+                size_t grow = __min( (size_t) ( offset - index ), MaxBins - bins.size() );
+                bins.insert( bins.begin(), grow, 0 );
+                offset -= (int) grow;
+
+                if ( index < offset )
+                    return bins[ 0 ];
+            }
+            else if ( index >= offset + (int) bins.size() )
+            {
+                size_t need = index - offset + 1;
+
+                if ( need > MaxBins )
+                {
+                    size_t drop = need - MaxBins;
+                    size_t fold = __min( drop, bins.size() );
+                    ULONGLONG folded = 0;
+
+                    for ( size_t b = 0; b < fold; b++ )
+                        folded += bins[ b ];
+
+                    bins.erase( bins.begin(), bins.begin() + fold );
+                    offset += (int) drop;
+                    bins.resize( MaxBins, 0 );
+                    bins[ 0 ] += folded;
+                }
+                else
+                    bins.resize( need, 0 );
+            }
+
+            return bins[ index - offset ];
+        } //Bin
+
+    public:
+        static constexpr double RelativeAccuracy = 0.01;
+
+        CQuantileSketch() : offset( 0 ), count( 0 ), minValue( 0.0 ), maxValue( 0.0 ) {}
+
+        ULONGLONG Count() const { return count; }
+
+        // Values that aren't positive are ignored; callers pass 0 for unknown
+
+        void Add( double v )
+        {
+            if ( !( v > 0.0 ) || !isfinite( v ) )
+                return;
+
+            Bin( Index( v ) )++;
+
+            if ( 0 == count++ )
+                minValue = maxValue = v;
+            else
+            {
+                minValue = __min( minValue, v );
+                maxValue = __max( maxValue, v );
+            }
+        } //Add
+
+        void Merge( const CQuantileSketch & other )
+        {
+            if ( 0 == other.count )
+                return;
+
+            for ( size_t b = 0; b < other.bins.size(); b++ )
+                if ( 0 != other.bins[ b ] )
+                    Bin( other.offset + (int) b ) += other.bins[ b ];
+
+            if ( 0 == count )
+            {
+                minValue = other.minValue;
+                maxValue = other.maxValue;
+            }
+            else
+            {
+                minValue = __min( minValue, other.minValue );
+                maxValue = __max( maxValue, other.maxValue );
+            }
+
+            count += other.count;
+        } //Merge
+
+        // q is 0.0 to 1.0. Returns 0 if nothing was added.
+
+        double Quantile( double q ) const
+        {
+            if ( 0 == count )
+                return 0.0;
+
+            ULONGLONG rank = (ULONGLONG) ( q * ( count - 1 ) );
+            ULONGLONG seen = 0;
+
+            for ( size_t b = 0; b < bins.size(); b++ )
+            {
+                seen += bins[ b ];
+
+                if ( seen > rank )
+                    return __min( maxValue, __max( minValue, Value( offset + (int) b ) ) );
+            }
+
+            return maxValue;
+        } //Quantile
+
+        // Counts values by the nearest of the ascending centers, in log space. Values past either end count
+        // toward that end.
+
+        void Histogram( const double * centers, size_t cCenters, vector<ULONGLONG> & counts ) const
+        {
+            counts.assign( cCenters, 0 );
+
+            for ( size_t b = 0; b < bins.size(); b++ )
+            {
+                if ( 0 == bins[ b ] )
+                    continue;
+
+                double v = Value( offset + (int) b );
+                size_t c = upper_bound( centers, centers + cCenters, v ) - centers;
+
+                if ( c == cCenters )
+                    c--;
+                else if ( c > 0 && ( v * v < centers[ c - 1 ] * centers[ c ] ) )
+                    c--;
+
+                counts[ c ] += bins[ b ];
+            }
+        } //Histogram
+
+        void Write( CPartialWriter & w ) const
+        {
+            w.Put( count );
+            w.Put( minValue );
+            w.Put( maxValue );
+            w.Put( offset );
+            w.Put( (ULONGLONG) bins.size() );
+
+            for ( size_t b = 0; b < bins.size(); b++ )
+                w.Put( bins[ b ] );
+        } //Write
+
+        // Adds a sketch from a partial result to this one
+
+        bool Read( CPartialReader & r )
+        {
+            CQuantileSketch other;
+            other.count = r.Get<ULONGLONG>();
+            other.minValue = r.Get<double>();
+            other.maxValue = r.Get<double>();
+            other.offset = r.Get<int>();
+            ULONGLONG size = r.Get<ULONGLONG>();
+
+            if ( size > MaxBins )
+                return false;
+
+            other.bins.resize( (size_t) size );
+
+            for ( size_t b = 0; b < other.bins.size(); b++ )
+                other.bins[ b ] = r.Get<ULONGLONG>();
+
+            if ( r.Ok() )
+                Merge( other );
+
+            return r.Ok();
+        } //Read
+}; //CQuantileSketch
+
+class CExposureStats
+{
+    private:
+        struct Sketches
+        {
+            CQuantileSketch iso, shutter, aperture;
+
+            void Merge( const Sketches & other )
+            {
+                iso.Merge( other.iso );
+                shutter.Merge( other.shutter );
+                aperture.Merge( other.aperture );
+            }
+        };
+
+        struct Groups
+        {
+            map<string, Sketches> models;
+            map<string, Sketches> lenses;
+        };
+
+        combinable<Groups> locals;
+        Groups merged;
+
+        static void MergeGroups( map<string, Sketches> & to, map<string, Sketches> & from )
+        {
+            for ( auto it = from.begin(); it != from.end(); it++ )
+                to[ it->first ].Merge( it->second );
+
+            from.clear();
+        } //MergeGroups
+
+        static void WriteGroups( CPartialWriter & w, map<string, Sketches> & groups )
+        {
+            w.Put( (ULONGLONG) groups.size() );
+
+            for ( auto it = groups.begin(); it != groups.end(); it++ )
+            {
+                w.PutString( it->first.c_str() );
+                it->second.iso.Write( w );
+                it->second.shutter.Write( w );
+                it->second.aperture.Write( w );
+            }
+        } //WriteGroups
+
+        static bool ReadGroups( CPartialReader & r, map<string, Sketches> & groups )
+        {
+            ULONGLONG count = r.Get<ULONGLONG>();
+
+            for ( ULONGLONG i = 0; i < count && r.Ok(); i++ )
+            {
+                char ac[ 256 ];
+                r.GetString( ac, _countof( ac ) );
+                Sketches & s = groups[ ac ];
+
+                if ( !s.iso.Read( r ) || !s.shutter.Read( r ) || !s.aperture.Read( r ) )
+                    return false;
+            }
+
+            return r.Ok();
+        } //ReadGroups
+
+        static void Label( char * pc, size_t cc, int kind, double v )
+        {
+            if ( 0 == kind )
+                sprintf_s( pc, cc, "%.0lf", v );
+            else if ( 1 == kind )
+            {
+                if ( v < 0.5 )
+                    sprintf_s( pc, cc, "1/%.0lf", 1.0 / v );
+                else
+                    sprintf_s( pc, cc, "%.2gs", v );
+            }
+            else
+                sprintf_s( pc, cc, "f/%.2g", v );
+        } //Label
+
+        static void PrintRow( const char * pcName, int kind, const CQuantileSketch & s )
+        {
+            // nominal full stops
+
+            static const double isoStops[] = { 25, 50, 100, 200, 400, 800, 1600, 3200, 6400, 12800, 25600, 51200, 102400, 204800, 409600 };
+            static const double shutterStops[] = { 1.0 / 32000, 1.0 / 16000, 1.0 / 8000, 1.0 / 4000, 1.0 / 2000, 1.0 / 1000, 1.0 / 500, 1.0 / 250,
+                                                   1.0 / 125, 1.0 / 60, 1.0 / 30, 1.0 / 15, 1.0 / 8, 1.0 / 4, 1.0 / 2, 1, 2, 4, 8, 15, 30, 60 };
+            static const double apertureStops[] = { 0.95, 1.4, 2, 2.8, 4, 5.6, 8, 11, 16, 22, 32, 45, 64 };
+
+            if ( 0 == s.Count() )
+                return;
+
+            char ac5[ 20 ], ac50[ 20 ], ac95[ 20 ];
+            Label( ac5, _countof( ac5 ), kind, s.Quantile( 0.05 ) );
+            Label( ac50, _countof( ac50 ), kind, s.Quantile( 0.50 ) );
+            Label( ac95, _countof( ac95 ), kind, s.Quantile( 0.95 ) );
+            printf( "    %-10s %10llu %10s %10s %10s   ", pcName, s.Count(), ac5, ac50, ac95 );
+
+            const double * stops = ( 0 == kind ) ? isoStops : ( 1 == kind ) ? shutterStops : apertureStops;
+            size_t cStops = ( 0 == kind ) ? _countof( isoStops ) : ( 1 == kind ) ? _countof( shutterStops ) : _countof( apertureStops );
+            vector<ULONGLONG> counts;
+            s.Histogram( stops, cStops, counts );
+
+            for ( size_t i = 0; i < counts.size(); i++ )
+            {
+                if ( 0 != counts[ i ] )
+                {
+                    char ac[ 20 ];
+                    Label( ac, _countof( ac ), kind, stops[ i ] );
+                    printf( " %s:%llu", ac, counts[ i ] );
+                }
+            }
+
+            printf( "\n" );
+        } //PrintRow
+
+        static void PrintGroups( const char * pcKind, const char * pcKinds, map<string, Sketches> & groups, bool sortOnCount )
+        {
+            vector<map<string, Sketches>::iterator> order;
+            for ( auto it = groups.begin(); it != groups.end(); it++ )
+                order.push_back( it );
+
+            if ( sortOnCount )
+                stable_sort( order.begin(), order.end(), [] ( map<string, Sketches>::iterator a, map<string, Sketches>::iterator b )
+                {
+                    ULONGLONG ca = __max( a->second.iso.Count(), __max( a->second.shutter.Count(), a->second.aperture.Count() ) );
+                    ULONGLONG cb = __max( b->second.iso.Count(), __max( b->second.shutter.Count(), b->second.aperture.Count() ) );
+                    return ca > cb;
+                } );
+
+            printf( "exposure by %s for %zd %s\n", pcKind, groups.size(), pcKinds );
+
+            for ( size_t i = 0; i < order.size(); i++ )
+            {
+                printf( "\n%s\n", order[ i ]->first.c_str() );
+                printf( "                    count         p5        p50        p95    histogram by full stop\n" );
+                PrintRow( "ISO", 0, order[ i ]->second.iso );
+                PrintRow( "shutter", 1, order[ i ]->second.shutter );
+                PrintRow( "aperture", 2, order[ i ]->second.aperture );
+            }
+        } //PrintGroups
+
+    public:
+        // Any of iso, seconds, and fNumber can be 0 if unknown. pcLens can be empty.
+
+        void Add( const char * pcModel, const char * pcLens, double iso, double seconds, double fNumber )
+        {
+            Groups & local = locals.local();
+
+            Sketches & m = local.models[ pcModel ];
+            m.iso.Add( iso );
+            m.shutter.Add( seconds );
+            m.aperture.Add( fNumber );
+
+            if ( 0 != pcLens[ 0 ] )
+            {
+                Sketches & l = local.lenses[ pcLens ];
+                l.iso.Add( iso );
+                l.shutter.Add( seconds );
+                l.aperture.Add( fNumber );
+            }
+        } //Add
+
+        // Call once the threads are done adding
+
+        void Merge()
+        {
+            locals.combine_each( [&] ( Groups & local )
+            {
+                MergeGroups( merged.models, local.models );
+                MergeGroups( merged.lenses, local.lenses );
+            } );
+        } //Merge
+
+        void Write( CPartialWriter & w )
+        {
+            Merge();
+            WriteGroups( w, merged.models );
+            WriteGroups( w, merged.lenses );
+        } //Write
+
+        bool Read( CPartialReader & r )
+        {
+            return ReadGroups( r, merged.models ) && ReadGroups( r, merged.lenses );
+        } //Read
+
+        void Print( bool sortOnCount )
+        {
+            Merge();
+            PrintGroups( "model", "models", merged.models, sortOnCount );
+            printf( "\n" );
+            PrintGroups( "lens", "lenses", merged.lenses, sortOnCount );
+        } //Print
+}; //CExposureStats
+
@@ -1,7 +1,12 @@
 #pragma once
 
+#include <vector>
+
 //
 // Stream over a file or subset of a file
+// Prefetch reads a range into memory in one call; Reads that fall entirely within it are served from memory.
+// Bytes read from files are counted per thread so progress reporting can show a read rate without shared counters.
+// A watchdog can make every read on a thread fail by setting the flag that thread's ThreadCancelFlag points to.
 //
 
 class CStream
@@ -14,8 +19,34 @@ class CStream
         bool handleOwned;
         bool seekCalled;
         bool forWrite;
+        std::vector<BYTE> window;
+        __int64 windowOffset;
+        bool memoryOnly;                  // there is no file; all data is in the window
+
+        static bool Cancelled()
+        {
+            volatile LONG * p = ThreadCancelFlag();
+            return ( NULL != p && 0 != *p );
+        } //Cancelled
+
+        bool InWindow( __int64 location, ULONG cb )
+        {
+            return ( location >= windowOffset && ( location + cb ) <= ( windowOffset + (__int64) window.size() ) );
+        } //InWindow
 
     public:
+        static ULONGLONG & ThreadBytesRead()
+        {
+            static thread_local ULONGLONG bytes = 0;
+            return bytes;
+        } //ThreadBytesRead
+
+        static volatile LONG * & ThreadCancelFlag()
+        {
+            static thread_local volatile LONG * p = NULL;
+            return p;
+        } //ThreadCancelFlag
+
         CStream()
         {
             length = 0;
@@ -25,6 +56,8 @@ class CStream
             handleOwned = false;
             seekCalled = false;
             forWrite = false;
+            windowOffset = 0;
+            memoryOnly = false;
         } //CStream
 
         CStream( WCHAR const * pwcFile, bool write = false )
@@ -35,6 +68,8 @@ class CStream
             seekCalled = false;
             handleOwned = true;
             forWrite = write;
+            windowOffset = 0;
+            memoryOnly = false;
 
             if ( forWrite )
                 hFile = CreateFile( pwcFile, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, CREATE_ALWAYS, 0, 0 );
@@ -60,6 +95,8 @@ class CStream
             handleOwned = false;
             hFile = h;
             forWrite = false;
+            windowOffset = 0;
+            memoryOnly = false;
 
             LARGE_INTEGER liSize;
             BOOL ok = GetFileSizeEx( hFile, &liSize );
@@ -81,6 +118,8 @@ class CStream
             seekCalled = true; // need to get to virtual 0 on first read
             handleOwned = true;
             forWrite = false;
+            windowOffset = 0;
+            memoryOnly = false;
             hFile = CreateFile( pwcFile, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, 0 );
 
             if ( INVALID_HANDLE_VALUE == hFile )
@@ -109,6 +148,54 @@ class CStream
              }
         } //CStream
 
+        // A view of part of another stream that shares its handle, so the file isn't opened again.
+        // The part of the parent's window that overlaps the view is copied so those reads stay in memory.
+
+        CStream( CStream & parent, __int64 viewOffset, __int64 viewLength )
+        {
+            if ( viewOffset < 0 || viewLength < 0 || viewOffset > parent.length )
+            {
+                viewOffset = 0;
+                viewLength = 0;
+            }
+
+            embedOffset = parent.embedOffset + viewOffset;
+            length = __min( parent.length - viewOffset, viewLength );
+            offset = 0;
+            seekCalled = true; // the parent may have moved the file pointer
+            handleOwned = false;
+            forWrite = false;
+            hFile = parent.hFile;
+            windowOffset = 0;
+            memoryOnly = parent.memoryOnly;
+
+            __int64 start = __max( viewOffset, parent.windowOffset );
+            __int64 end = __min( viewOffset + length, parent.windowOffset + (__int64) parent.window.size() );
+
+            if ( end > start )
+            {
+                window.assign( parent.window.begin() + ( start - parent.windowOffset ), parent.window.begin() + ( end - parent.windowOffset ) );
+                windowOffset = start - viewOffset;
+            }
+        } //CStream
+
+        // A read-only stream over data in memory, e.g. a decompressed archive member. fullLength can exceed
+        // the size of data when only the start was decompressed; reads past the data return nothing.
+
+        CStream( std::vector<BYTE> & data, __int64 fullLength )
+        {
+            embedOffset = 0;
+            offset = 0;
+            seekCalled = false;
+            handleOwned = false;
+            forWrite = false;
+            hFile = INVALID_HANDLE_VALUE;
+            window.swap( data );
+            windowOffset = 0;
+            memoryOnly = true;
+            length = __max( fullLength, (__int64) window.size() );
+        } //CStream
+
         void CloseFile()
         {
             if ( handleOwned && INVALID_HANDLE_VALUE != hFile )
@@ -125,17 +212,9 @@ class CStream
 
         ULONG Read( void *pv, ULONG cb )
         {
-            if ( 0 == length )
+            if ( 0 == length || Cancelled() )
                 return 0;
 
-            if ( seekCalled )
-            {
-                LARGE_INTEGER li;
-                li.QuadPart = offset + embedOffset;
-                SetFilePointerEx( hFile, li, NULL, FILE_BEGIN );
-                seekCalled = false;
-            }
-
             if ( ( offset + cb ) > length )
             {
                 if ( length > offset )
@@ -144,8 +223,34 @@ class CStream
                     cb = 0;
             }
 
+            if ( memoryOnly && !InWindow( offset, cb ) )
+            {
+                __int64 available = windowOffset + (__int64) window.size() - offset;
+                cb = ( offset >= windowOffset && available > 0 ) ? (ULONG) __min( (__int64) cb, available ) : 0;
+
+                if ( 0 == cb )
+                    return 0;
+            }
+
+            if ( InWindow( offset, cb ) )
+            {
+                memcpy( pv, window.data() + ( offset - windowOffset ), cb );
+                offset += cb;
+                seekCalled = true; // the file pointer didn't move
+                return cb;
+            }
+
+            if ( seekCalled )
+            {
+                LARGE_INTEGER li;
+                li.QuadPart = offset + embedOffset;
+                SetFilePointerEx( hFile, li, NULL, FILE_BEGIN );
+                seekCalled = false;
+            }
+
             DWORD dwRead = 0;
             BOOL ok = ReadFile( hFile, pv, cb, &dwRead, NULL );
+            ThreadBytesRead() += dwRead;
 
             if ( ok )
                 offset += cb;
@@ -169,11 +274,42 @@ class CStream
             return true;
         } //Seek
 
-        bool Ok() { return ( INVALID_HANDLE_VALUE != hFile ); }
+        bool Ok() { return ( INVALID_HANDLE_VALUE != hFile || memoryOnly ); }
         __int64 Tell() { return offset; }
         __int64 Length() { return length; }
         bool AtEOF() { return ( offset >= length ); }
 
+        // Replaces the in-memory window with cb bytes at location. Returns false if they couldn't all be read.
+
+        bool Prefetch( __int64 location, ULONG cb )
+        {
+            if ( location < 0 || location >= length || Cancelled() )
+                return false;
+
+            cb = (ULONG) __min( (__int64) cb, length - location );
+
+            if ( InWindow( location, cb ) )
+                return true;
+
+            if ( memoryOnly )
+                return false;
+
+            window.resize( cb );
+            windowOffset = location;
+
+            LARGE_INTEGER li;
+            li.QuadPart = location + embedOffset;
+            DWORD dwRead = 0;
+
+            if ( !SetFilePointerEx( hFile, li, NULL, FILE_BEGIN ) || !ReadFile( hFile, window.data(), cb, &dwRead, NULL ) )
+                dwRead = 0;
+
+            ThreadBytesRead() += dwRead;
+            window.resize( dwRead );
+            seekCalled = true;
+            return ( dwRead == cb );
+        } //Prefetch
+
         void GetBytes( __int64 seek_offset, void * pData, int byteCount )
         {
             memset( pData, 0, byteCount );
@@ -184,6 +320,8 @@ class CStream
 
         ULONG Write( void *pv, ULONG cb )
         {
+            window.clear();
+
             if ( seekCalled )
             {
                 LARGE_INTEGER li;
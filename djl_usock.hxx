@@ -0,0 +1,218 @@
+#pragma once
+
+//
+// A minimal request/response server and client over a Unix domain socket (AF_UNIX is available in
+// Winsock on Windows 10 1803 and later). A request is one line of text; the response is everything
+// the server sends before closing the connection. Each connection is handled on its own thread so
+// slow clients don't block others.
+// Include this before windows.h, or define WIN32_LEAN_AND_MEAN, so winsock.h isn't pulled in first.
+//
+
+#include <winsock2.h>
+#include <afunix.h>
+#include <windows.h>
+#include <stdio.h>
+
+#include <string>
+#include <thread>
+#include <functional>
+
+#pragma comment( lib, "ws2_32.lib" )
+
+#ifndef IO_REPARSE_TAG_AF_UNIX
+#define IO_REPARSE_TAG_AF_UNIX 0x80000023L         // winnt.h in SDKs before 10.0.17063
+#endif
+
+using namespace std;
+
+class CUnixSocket
+{
+    private:
+        static const size_t MaxRequest = 4096;
+
+        static bool MakeAddress( const WCHAR * pwcPath, sockaddr_un & addr )
+        {
+            memset( &addr, 0, sizeof addr );
+            addr.sun_family = AF_UNIX;
+
+            size_t len = 0;
+            if ( 0 != wcstombs_s( &len, addr.sun_path, _countof( addr.sun_path ), pwcPath, _TRUNCATE ) || len >= _countof( addr.sun_path ) )
+            {
+                printf( "socket path is too long: %ws\n", pwcPath );
+                return false;
+            }
+
+            return true;
+        } //MakeAddress
+
+        static bool ReadLine( SOCKET s, string & line )
+        {
+            line.clear();
+            char ac[ 512 ];
+
+            while ( line.size() < MaxRequest )
+            {
+                int cb = recv( s, ac, sizeof ac, 0 );
+                if ( cb <= 0 )
+                    break;
+
+                line.append( ac, cb );
+
+                size_t eol = line.find( '\n' );
+                if ( string::npos != eol )
+                {
+                    line.resize( eol );
+                    break;
+                }
+            }
+
+            while ( line.size() > 0 && ( '\r' == line.back() || '\n' == line.back() ) )
+                line.pop_back();
+
+            return ( line.size() > 0 && line.size() < MaxRequest );
+        } //ReadLine
+
+        static bool SendAll( SOCKET s, const char * p, size_t cb )
+        {
+            while ( cb > 0 )
+            {
+                int sent = send( s, p, (int) __min( cb, (size_t) 64 * 1024 ), 0 );
+                if ( sent <= 0 )
+                    return false;
+
+                p += sent;
+                cb -= sent;
+            }
+
+            return true;
+        } //SendAll
+
+        // A socket file left by a previous instance makes bind fail, so it's removed. Anything else at the
+        // path is left alone, so a mistyped /d: path can't delete a user's file.
+
+        static bool RemoveStaleSocket( const WCHAR * pwcPath )
+        {
+            if ( INVALID_FILE_ATTRIBUTES == GetFileAttributes( pwcPath ) )
+                return true;
+
+            WIN32_FIND_DATA fd;
+            HANDLE hFind = FindFirstFile( pwcPath, &fd );
+            if ( INVALID_HANDLE_VALUE == hFind )
+                return true;
+
+            FindClose( hFind );
+
+            if ( 0 == ( fd.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT ) || IO_REPARSE_TAG_AF_UNIX != fd.dwReserved0 )
+            {
+                printf( "%ws exists and isn't a Unix domain socket; not replacing it\n", pwcPath );
+                return false;
+            }
+
+            if ( !DeleteFile( pwcPath ) )
+            {
+                printf( "can't remove the old socket %ws, error %d\n", pwcPath, GetLastError() );
+                return false;
+            }
+
+            return true;
+        } //RemoveStaleSocket
+
+    public:
+        static bool Startup()
+        {
+            WSADATA wsaData;
+            int err = WSAStartup( MAKEWORD( 2, 2 ), &wsaData );
+            if ( 0 != err )
+                printf( "WSAStartup failed, error %d\n", err );
+
+            return ( 0 == err );
+        } //Startup
+
+        // Accepts connections until the process exits. handler is called concurrently.
+
+        static bool Serve( const WCHAR * pwcPath, function<void( const string & request, string & response )> handler )
+        {
+            sockaddr_un addr;
+            if ( !MakeAddress( pwcPath, addr ) )
+                return false;
+
+            if ( !RemoveStaleSocket( pwcPath ) )
+                return false;
+
+            SOCKET listener = socket( AF_UNIX, SOCK_STREAM, 0 );
+            if ( INVALID_SOCKET == listener )
+            {
+                printf( "can't create socket, error %d\n", WSAGetLastError() );
+                return false;
+            }
+
+            if ( SOCKET_ERROR == bind( listener, (sockaddr *) &addr, sizeof addr ) ||
+                 SOCKET_ERROR == listen( listener, SOMAXCONN ) )
+            {
+                printf( "can't listen on socket %ws, error %d\n", pwcPath, WSAGetLastError() );
+                closesocket( listener );
+                return false;
+            }
+
+            do
+            {
+                SOCKET client = accept( listener, NULL, NULL );
+                if ( INVALID_SOCKET == client )
+                {
+                    tracer.Trace( "accept failed, error %d\n", WSAGetLastError() );
+                    continue;
+                }
+
+                thread t( [client, handler] ()
+                {
+                    string request, response;
+
+                    if ( ReadLine( client, request ) )
+                        handler( request, response );
+                    else
+                        response = "error: malformed request\n";
+
+                    SendAll( client, response.c_str(), response.size() );
+                    shutdown( client, SD_SEND );
+                    closesocket( client );
+                } );
+
+                t.detach();
+            } while ( true );
+        } //Serve
+
+        static bool Query( const WCHAR * pwcPath, const string & request, string & response )
+        {
+            sockaddr_un addr;
+            if ( !MakeAddress( pwcPath, addr ) )
+                return false;
+
+            SOCKET s = socket( AF_UNIX, SOCK_STREAM, 0 );
+            if ( INVALID_SOCKET == s )
+                return false;
+
+            bool ok = ( SOCKET_ERROR != connect( s, (sockaddr *) &addr, sizeof addr ) );
+
+            if ( ok )
+            {
+                string line = request + "\n";
+                ok = SendAll( s, line.c_str(), line.size() );
+            }
+
+            if ( ok )
+            {
+                shutdown( s, SD_SEND );
+                char ac[ 4096 ];
+                int cb;
+
+                while ( ( cb = recv( s, ac, sizeof ac, 0 ) ) > 0 )
+                    response.append( ac, cb );
+            }
+            else
+                printf( "can't connect to %ws, error %d\n", pwcPath, WSAGetLastError() );
+
+            closesocket( s );
+            return ok;
+        } //Query
+}; //CUnixSocket
+
@@ -0,0 +1,198 @@
+#pragma once
+
+//
+// Watches a folder tree for file changes with ReadDirectoryChangesW.
+// Bursts of notifications (e.g. a card import of thousands of files) are coalesced per path and
+// debounced: WaitForBatch returns once no new notifications have arrived for a quiet period or a
+// maximum batch time has passed. Each path is reported once per batch based on whether it exists
+// when the batch is returned, so a file created then deleted in the same burst isn't reported as changed.
+//
+
+#include <windows.h>
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+#include <map>
+
+using namespace std;
+
+class CFolderWatcher
+{
+    private:
+        static const DWORD BufferSize = 64 * 1024;   // larger buffers fail for network shares
+
+        wstring root;                      // ends with a backslash
+        HANDLE hDir;
+        HANDLE hEvent;
+        OVERLAPPED overlapped;
+        vector<DWORD> buffer;              // DWORD-aligned as ReadDirectoryChangesW requires
+        bool readPending;
+        bool overflowed;
+        map<wstring, DWORD> pending;       // lowercase full path to the most recent FILE_ACTION_*
+
+        bool IssueRead()
+        {
+            memset( &overlapped, 0, sizeof overlapped );
+            overlapped.hEvent = hEvent;
+
+            BOOL ok = ReadDirectoryChangesW( hDir, buffer.data(), BufferSize, TRUE,
+                                             FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME |
+                                             FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE,
+                                             NULL, &overlapped, NULL );
+            readPending = ( 0 != ok );
+
+            if ( !readPending )
+                tracer.Trace( "ReadDirectoryChangesW failed, error %d\n", GetLastError() );
+
+            return readPending;
+        } //IssueRead
+
+        void Consume( DWORD cb )
+        {
+            if ( 0 == cb )
+            {
+                // the notification buffer overflowed and changes were lost
+
+                overflowed = true;
+                return;
+            }
+
+            byte * p = (byte *) buffer.data();
+
+            do
+            {
+                FILE_NOTIFY_INFORMATION * pfni = (FILE_NOTIFY_INFORMATION *) p;
+                wstring path = root;
+                path.append( pfni->FileName, pfni->FileNameLength / sizeof( WCHAR ) );
+
+                for ( size_t i = 0; i < path.size(); i++ )
+                    path[ i ] = towlower( path[ i ] );
+
+                DWORD & action = pending[ path ];
+
+                // a directory that's added is enumerated; don't let a later modify notification hide that
+
+                if ( FILE_ACTION_MODIFIED != pfni->Action || ( FILE_ACTION_ADDED != action && FILE_ACTION_RENAMED_NEW_NAME != action ) )
+                    action = pfni->Action;
+
+                if ( 0 == pfni->NextEntryOffset )
+                    break;
+
+                p += pfni->NextEntryOffset;
+            } while ( true );
+        } //Consume
+
+        // Returns true if notifications arrived within timeoutMs
+
+        bool Wait( DWORD timeoutMs )
+        {
+            if ( !readPending && !IssueRead() )
+                return false;
+
+            DWORD result = WaitForSingleObject( hEvent, timeoutMs );
+
+            if ( WAIT_OBJECT_0 != result )
+                return false;
+
+            DWORD cb = 0;
+            readPending = false;
+
+            if ( GetOverlappedResult( hDir, &overlapped, &cb, FALSE ) )
+                Consume( cb );
+            else
+            {
+                tracer.Trace( "GetOverlappedResult for directory changes failed, error %d\n", GetLastError() );
+                overflowed = true;
+            }
+
+            IssueRead();
+            return true;
+        } //Wait
+
+    public:
+        CFolderWatcher( const WCHAR * pwcRoot ) : readPending( false ), overflowed( false ), buffer( BufferSize / sizeof( DWORD ) )
+        {
+            root = pwcRoot;
+            if ( root.size() > 0 && L'\\' != root.back() )
+                root += L'\\';
+
+            hDir = CreateFile( root.c_str(), FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                               NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, NULL );
+            hEvent = CreateEvent( NULL, TRUE, FALSE, NULL );
+
+            if ( INVALID_HANDLE_VALUE == hDir )
+                tracer.Trace( "can't open folder %ws to watch it, error %d\n", root.c_str(), GetLastError() );
+            else
+                IssueRead();
+        } //CFolderWatcher
+
+        ~CFolderWatcher()
+        {
+            if ( INVALID_HANDLE_VALUE != hDir )
+            {
+                CancelIo( hDir );
+
+                if ( readPending )
+                {
+                    DWORD cb;
+                    GetOverlappedResult( hDir, &overlapped, &cb, TRUE );
+                }
+
+                CloseHandle( hDir );
+            }
+
+            if ( NULL != hEvent )
+                CloseHandle( hEvent );
+        } //~CFolderWatcher
+
+        bool Ok() { return ( INVALID_HANDLE_VALUE != hDir && NULL != hEvent && readPending ); }
+
+        // Waits up to timeoutMs for a notification. Once one arrives, keeps collecting until none arrive
+        // for quietMs or maxMs has passed. Returns false if nothing changed within timeoutMs.
+        // changedFiles: files that exist and were created, modified, or renamed into the tree
+        // addedFolders: folders created or moved into the tree; their files aren't reported individually
+        // removed:      paths that no longer exist; they may have been files or folders
+        // rescan:       notifications were lost, so the whole tree should be rescanned
+
+        bool WaitForBatch( DWORD timeoutMs, DWORD quietMs, DWORD maxMs, vector<wstring> & changedFiles,
+                           vector<wstring> & addedFolders, vector<wstring> & removed, bool & rescan )
+        {
+            changedFiles.clear();
+            addedFolders.clear();
+            removed.clear();
+            rescan = false;
+
+            if ( !Wait( timeoutMs ) )
+                return false;
+
+            ULONGLONG start = GetTickCount64();
+
+            while ( ( GetTickCount64() - start ) < maxMs )
+            {
+                if ( !Wait( quietMs ) )
+                    break;
+            }
+
+            for ( auto & it : pending )
+            {
+                DWORD attr = GetFileAttributes( it.first.c_str() );
+
+                if ( INVALID_FILE_ATTRIBUTES == attr )
+                    removed.push_back( it.first );
+                else if ( attr & FILE_ATTRIBUTE_DIRECTORY )
+                {
+                    if ( FILE_ACTION_ADDED == it.second || FILE_ACTION_RENAMED_NEW_NAME == it.second )
+                        addedFolders.push_back( it.first );
+                }
+                else
+                    changedFiles.push_back( it.first );
+            }
+
+            pending.clear();
+            rescan = overflowed;
+            overflowed = false;
+            return true;
+        } //WaitForBatch
+}; //CFolderWatcher
+
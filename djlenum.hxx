@@ -6,12 +6,17 @@
 
 #include <windows.h>
 #include <windowsx.h>
+#include <shlwapi.h>
 
 #include <djlsav.hxx>
 #include <djl_pa.hxx>
 #include <djltrace.hxx>
+#include <djl_archive.hxx>
+#include <djl_sidecar.hxx>
 #include <ppl.h>
 
+#pragma comment( lib, "shlwapi.lib" )
+
 using namespace concurrency;
 
 class CEnumFolder
@@ -22,6 +27,9 @@ class CEnumFolder
         CPathArray * resultPaths;
         const WCHAR * const * extensions;
         int extensionCount;
+        bool includeArchives;
+        bool serialFolders;
+        CSidecars * sidecars;
 
         bool HasValidExtension( const WCHAR * pwc )
         {
@@ -48,6 +56,40 @@ class CEnumFolder
             return false;
         }
 
+        // Adds the members of a zip or tar file that match the spec as archive|member paths
+
+        void EnumerateArchive( WCHAR * pwcArchive, const WCHAR * pwcSpec, WIN32_FIND_DATA & fd )
+        {
+            shared_ptr<const CArchive::MemberList> members = CArchive::Members( pwcArchive );
+            size_t archiveLen = wcslen( pwcArchive );
+            WCHAR awc[ MAX_PATH ];
+
+            for ( size_t i = 0; i < members->size(); i++ )
+            {
+                const wstring & name = ( *members )[ i ].name;
+                size_t slash = name.find_last_of( L'\\' );
+                const WCHAR * pwcName = name.c_str() + ( ( wstring::npos == slash ) ? 0 : slash + 1 );
+
+                if ( !PathMatchSpec( pwcName, pwcSpec ) || !HasValidExtension( pwcName ) )
+                    continue;
+
+                if ( ( archiveLen + 1 + name.size() ) >= _countof( awc ) )
+                {
+                    tracer.Trace( "skipping very long archive member path %ws in %ws\n", name.c_str(), pwcArchive );
+                    continue;
+                }
+
+                wcscpy_s( awc, _countof( awc ), pwcArchive );
+                awc[ archiveLen ] = CArchive::Separator;
+                wcscpy_s( awc + archiveLen + 1, _countof( awc ) - archiveLen - 1, name.c_str() );
+
+                if ( 0 != resultPaths )
+                    resultPaths->Add( awc, fd.ftCreationTime, fd.ftLastWriteTime );
+                if ( 0 != resultStrings )
+                    resultStrings->Add( awc );
+            }
+        } //EnumerateArchive
+
     public:
         // recurse:      true to recurse into folders
         // pPathArray:   files found
@@ -61,6 +103,9 @@ class CEnumFolder
             resultPaths = pPathArray;
             extensions = aExtensions;
             extensionCount = cExtensions;
+            includeArchives = false;
+            serialFolders = false;
+            sidecars = NULL;
         }
 
         CEnumFolder( bool recurseFolders, CStringArray * pStringArray, const WCHAR * const * aExtensions, int cExtensions )
@@ -70,8 +115,23 @@ class CEnumFolder
             resultPaths = NULL;
             extensions = aExtensions;
             extensionCount = cExtensions;
+            includeArchives = false;
+            serialFolders = false;
+            sidecars = NULL;
         }
 
+        // Treat zip and tar files as folders, returning their members as archive|member paths
+
+        void IncludeArchives( bool include ) { includeArchives = include; }
+
+        // Enumerate subfolders one at a time. Walking them in parallel makes a hard disk seek
+
+        void SerialFolders( bool serial ) { serialFolders = serial; }
+
+        // Pair images with .xmp sidecars in the same folder. Sidecars aren't returned as files.
+
+        void CollectSidecars( CSidecars * pSidecars ) { sidecars = pSidecars; }
+
         // pwcFolder:   the root of the enumeration, e.g. C:\users
         // pwcFileSpec: a wildcard string like "*", "*.jpg", or "??.jpg". Can be NULL for "*"
 
@@ -103,6 +163,21 @@ class CEnumFolder
 
             bool allFiles = ( !wcscmp( pwcSpec, L"*" ) || !wcscmp( pwcSpec, L"*.*" ) );
 
+            // Sidecars don't match a spec like *.cr2, so list everything once and match the spec here.
+            // That also finds folders and archives, so the extra listings below aren't needed.
+
+            bool matchSpec = false;
+
+            if ( NULL != sidecars && !allFiles )
+            {
+                wcscpy_s( awc + len, _countof( awc ) - len, L"*" );
+                allFiles = true;
+                matchSpec = true;
+            }
+
+            vector<wstring> images;                            // images here that could have a sidecar
+            unordered_map<wstring, wstring> folderSidecars;    // sidecar name without .xmp to its path
+
             CStringArray aDirs;
             WIN32_FIND_DATA fd;
             HANDLE hFile = FindFirstFileEx( awc, FindExInfoBasic, &fd, FindExSearchNameMatch, 0, FIND_FIRST_EX_LARGE_FETCH | FIND_FIRST_EX_ON_DISK_ENTRIES_ONLY );
@@ -125,12 +200,24 @@ class CEnumFolder
                                 if ( recurse && allFiles )
                                     aDirs.Add( awc );
                             }
-                            else if ( HasValidExtension( fd.cFileName ) )
+                            else if ( includeArchives && CArchive::IsArchive( fd.cFileName ) )
+                            {
+                                if ( allFiles )
+                                    EnumerateArchive( awc, pwcSpec, fd );
+                            }
+                            else if ( NULL != sidecars && CSidecars::IsSidecar( fd.cFileName ) )
+                            {
+                                folderSidecars[ wstring( fd.cFileName, namelen - 4 ) ] = awc;
+                            }
+                            else if ( HasValidExtension( fd.cFileName ) && ( !matchSpec || PathMatchSpec( fd.cFileName, pwcSpec ) ) )
                             {
                                 if ( 0 != resultPaths )
                                     resultPaths->Add( awc, fd.ftCreationTime, fd.ftLastWriteTime );
                                 if ( 0 != resultStrings )
                                     resultStrings->Add( awc );
+
+                                if ( NULL != sidecars && !CSidecars::EmbedsXMP( fd.cFileName ) )
+                                    images.push_back( awc );
                             }
                         }
                         else
@@ -143,6 +230,53 @@ class CEnumFolder
                 FindClose( hFile );
             }
 
+            // Join this folder's images with its sidecars: img.cr2.xmp first, then img.xmp
+
+            if ( !folderSidecars.empty() )
+            {
+                for ( size_t i = 0; i < images.size(); i++ )
+                {
+                    wstring name = images[ i ].substr( len );
+                    auto it = folderSidecars.find( name );
+
+                    if ( folderSidecars.end() == it )
+                        it = folderSidecars.find( name.substr( 0, name.find_last_of( L'.' ) ) );
+
+                    if ( folderSidecars.end() != it )
+                        sidecars->Add( images[ i ].c_str(), it->second.c_str() );
+                }
+            }
+
+            // If the filespec didn't include all files, the archives here weren't found above
+
+            if ( includeArchives && !allFiles )
+            {
+                const WCHAR * archiveSpecs[] = { L"*.zip", L"*.tar" };
+
+                for ( int a = 0; a < _countof( archiveSpecs ); a++ )
+                {
+                    wcscpy_s( awc + len, _countof( awc ) - len, archiveSpecs[ a ] );
+                    hFile = FindFirstFileEx( awc, FindExInfoBasic, &fd, FindExSearchNameMatch, 0, FIND_FIRST_EX_LARGE_FETCH );
+
+                    if ( INVALID_HANDLE_VALUE != hFile )
+                    {
+                        do
+                        {
+                            size_t namelen = wcslen( fd.cFileName );
+
+                            if ( 0 == ( fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY ) && ( namelen + len ) < _countof( awc ) )
+                            {
+                                _wcslwr( fd.cFileName );
+                                wcscpy_s( awc + len, namelen + 1, fd.cFileName );
+                                EnumerateArchive( awc, pwcSpec, fd );
+                            }
+                        } while ( FindNextFile( hFile, &fd ) );
+
+                        FindClose( hFile );
+                    }
+                }
+            }
+
             if ( recurse )
             {
                 // If the filespec didn't include all files, look for folders here
@@ -179,10 +313,18 @@ class CEnumFolder
                     }
                 }
 
-                parallel_for( 0, (int) aDirs.Count(), [&] ( int i )
+                if ( serialFolders )
                 {
-                    Enumerate( aDirs[ i ], pwcFileSpec );
-                } );
+                    for ( size_t i = 0; i < aDirs.Count(); i++ )
+                        Enumerate( aDirs[ i ], pwcFileSpec );
+                }
+                else
+                {
+                    parallel_for( 0, (int) aDirs.Count(), [&] ( int i )
+                    {
+                        Enumerate( aDirs[ i ], pwcFileSpec );
+                    } );
+                }
             }
         }
 };
@@ -27,7 +27,19 @@
 
 #include "djltrace.hxx"
 #include "djl_strm.hxx"
+#include "djl_archive.hxx"
 #include "djl_crop.hxx"
+#include "djl_mnlayout.hxx"
+#include "djl_mdcache.hxx"
+
+#if defined( _M_X64 ) || defined( _M_IX86 )
+    #include <intrin.h>
+    #include <tmmintrin.h>
+    #define IMAGEDATA_SSSE3
+#elif defined( __SSSE3__ )
+    #include <tmmintrin.h>
+    #define IMAGEDATA_SSSE3
+#endif
 
 #pragma warning( disable: 4189 ) // many places parse data that's unused in order to get to later data
 
@@ -49,85 +61,11 @@ using namespace std;
   13 = IFD pointer (Olympus ORF uses this)
 */
 
-class CImageData
-{
-private:
-    struct TwoDWORDs
-    {
-        DWORD dw1;
-        DWORD dw2;
-
-        void Endian( bool littleEndian )
-        {
-            if ( !littleEndian )
-            {
-                dw1= _byteswap_ulong( dw1 );
-                dw2 = _byteswap_ulong( dw2 );
-            }
-        }
-    };
-
-    struct IFDHeader
-    {
-        WORD id;
-        WORD type;
-        DWORD count;
-        DWORD offset;
-
-        void Endian( bool littleEndian )
-        {
-            if ( !littleEndian )
-            {
-                id = _byteswap_ushort( id );
-                type = _byteswap_ushort( type );
-                count = _byteswap_ulong( count );
-                offset = _byteswap_ulong( offset );
-            }
-
-            offset = AdjustOffset( littleEndian );
-        }
+// Everything parsing a file finds. It's a base of CImageData so the parsing code can use the fields directly,
+// and so a file's metadata can be copied to and from the shared metadata cache in one assignment.
 
-        private:
-
-            DWORD AdjustOffset( bool littleEndian )
-            {
-                if ( 1 != count )
-                    return offset;
-            
-                if ( littleEndian )
-                {
-                    if ( 1 == type || 6 == type )
-                        return offset & 0xff;
-            
-                    if ( 3 == type || 8 == type )
-                        return offset & 0xffff;
-                }
-                else
-                {
-                    // The DWORD has already been swapped, but to interpret it as a 1 or 2 byte quantity,
-                    // that must be shifted as well.
-    
-                    if ( 1 == type || 6 == type )
-                        return ( offset >> 24 );
-            
-                    if ( 3 == type || 8 == type )
-                        return ( offset >> 16 );
-                }
-            
-                return offset;
-            } //AdjustOffset
-    };
-    
-    std::mutex g_mtx;
-    CCropFactor g_factor;
-    CStream * g_pStream = NULL;
-    const double InvalidCoordinate = 1000.0;
-    static const WORD MaxIFDHeaders = 200; // assume anything more than this is a corrupt or badly parsed file.
-                                           // panasonic makernotes sometimes have 133 entries.
-    
-    WCHAR g_awcPath[ MAX_PATH + 1 ];
-    FILETIME g_ftWrite;
-    
+struct ParsedImageData
+{
     DWORD g_Heif_Exif_ItemID                = 0xffffffff;
     __int64 g_Heif_Exif_Offset              = 0;
     __int64 g_Heif_Exif_Length              = 0;
@@ -177,13 +115,145 @@ private:
     char g_acMake[ 100 ];
     char g_acModel[ 100 ];
     char g_acSerialNumber[ 100 ];
+    char g_acSoftware[ 100 ];                   // usually the camera firmware version
     bool g_holdsAdobeEditsInXMP;
     __int64 g_RatingInXMP_Offset = 0; // offset of 1 ascii character in the range of 0-5.
     char g_RatingInXMP = 0;
+    bool g_RatingInSidecar = false;   // g_RatingInXMP_Offset is in the .xmp sidecar, not the image
+};
+
+class CImageData : private ParsedImageData
+{
+private:
+    struct TwoDWORDs
+    {
+        DWORD dw1;
+        DWORD dw2;
+
+        void Endian( bool littleEndian )
+        {
+            if ( !littleEndian )
+            {
+                dw1= _byteswap_ulong( dw1 );
+                dw2 = _byteswap_ulong( dw2 );
+            }
+        }
+    };
+
+    struct IFDHeader
+    {
+        WORD id;
+        WORD type;
+        DWORD count;
+        DWORD offset;
+
+        // Converts entries as read from the file. Byte order is a template argument so a whole IFD is converted
+        // by one instantiation rather than testing it for each field of each entry.
+        // Big-endian entries are swapped 4 at a time (48 bytes) with SSSE3 shuffles when the CPU has them.
+
+        template<bool LittleEndian> static void FromFile( IFDHeader * pHeader, size_t numHeaders )
+        {
+            size_t i = 0;
+
+            if ( !LittleEndian )
+            {
+#ifdef IMAGEDATA_SSSE3
+                if ( HaveSSSE3() )
+                {
+                    for ( ; i + 4 <= numHeaders; i += 4 )
+                        SwapFour( pHeader + i );
+                }
+#endif
+
+                for ( ; i < numHeaders; i++ )
+                {
+                    pHeader[ i ].id = _byteswap_ushort( pHeader[ i ].id );
+                    pHeader[ i ].type = _byteswap_ushort( pHeader[ i ].type );
+                    pHeader[ i ].count = _byteswap_ulong( pHeader[ i ].count );
+                    pHeader[ i ].offset = _byteswap_ulong( pHeader[ i ].offset );
+                }
+            }
+
+            for ( i = 0; i < numHeaders; i++ )
+                pHeader[ i ].offset = pHeader[ i ].AdjustOffset<LittleEndian>();
+        } //FromFile
+
+        private:
+
+            template<bool LittleEndian> DWORD AdjustOffset()
+            {
+                if ( 1 != count )
+                    return offset;
+
+                // Big-endian DWORDs have already been swapped, but to interpret one as a 1 or 2 byte quantity,
+                // it must be shifted as well.
+
+                if ( 1 == type || 6 == type )
+                    return LittleEndian ? ( offset & 0xff ) : ( offset >> 24 );
+
+                if ( 3 == type || 8 == type )
+                    return LittleEndian ? ( offset & 0xffff ) : ( offset >> 16 );
+
+                return offset;
+            } //AdjustOffset
+
+#ifdef IMAGEDATA_SSSE3
+            static bool HaveSSSE3()
+            {
+#ifdef __SSSE3__
+                return true;
+#else
+                static bool have = [] () { int info[ 4 ]; __cpuid( info, 1 ); return 0 != ( info[ 2 ] & ( 1 << 9 ) ); } ();
+                return have;
+#endif
+            } //HaveSSSE3
+
+            // Entries are 12 bytes, so 4 are three 16 byte loads. No field crosses a 16 byte boundary,
+            // so each load's bytes are swapped in place with its own mask.
+
+            static void SwapFour( IFDHeader * p )
+            {
+                const __m128i mask0 = _mm_setr_epi8( 1, 0, 3, 2, 7, 6, 5, 4, 11, 10, 9, 8, 13, 12, 15, 14 );
+                const __m128i mask1 = _mm_setr_epi8( 3, 2, 1, 0, 7, 6, 5, 4, 9, 8, 11, 10, 15, 14, 13, 12 );
+                const __m128i mask2 = _mm_setr_epi8( 3, 2, 1, 0, 5, 4, 7, 6, 11, 10, 9, 8, 15, 14, 13, 12 );
+                __m128i * pm = (__m128i *) p;
+
+                _mm_storeu_si128( pm, _mm_shuffle_epi8( _mm_loadu_si128( pm ), mask0 ) );
+                _mm_storeu_si128( pm + 1, _mm_shuffle_epi8( _mm_loadu_si128( pm + 1 ), mask1 ) );
+                _mm_storeu_si128( pm + 2, _mm_shuffle_epi8( _mm_loadu_si128( pm + 2 ), mask2 ) );
+            } //SwapFour
+#endif
+    };
+
+    static_assert( 12 == sizeof( IFDHeader ), "IFDHeader must match the 12 byte TIFF IFD entry" );
+    
+    std::mutex g_mtx;
+    CCropFactor g_factor;
+    CStream * g_pStream = NULL;
+    const double InvalidCoordinate = 1000.0;
+    static const WORD MaxIFDHeaders = 200; // assume anything more than this is a corrupt or badly parsed file.
+                                           // panasonic makernotes sometimes have 133 entries.
+    
+    WCHAR g_awcPath[ MAX_PATH + 1 ];
+    FILETIME g_ftWrite;
+
+    unique_ptr<CStream> g_pPreloaded;           // opened and read by Preload, parsed by the next UpdateCache
+    WCHAR g_awcPreloadPath[ MAX_PATH + 1 ];
+
+    WCHAR g_awcSidecarImage[ MAX_PATH + 1 ];    // set by UseSidecar; the sidecar is read after this image is parsed
+    WCHAR g_awcSidecar[ MAX_PATH + 1 ];
+    static const ULONG MaxSidecarBytes = 4 * 1024 * 1024;
+
+    // Makernote layout learning. Offsets are relative to the headerBase passed to EnumerateMakernotes
+
+    __int64 g_MakernoteOffset = 0;
+    bool g_LearningMakernoteLayout = false;
+    bool g_MakernoteWalkFailed = false;
+    CMakernoteLayoutCache::Layout g_LearnedMakernoteLayout;
     
-    WORD FixEndianWORD( WORD w, bool littleEndian )
+    template<bool LittleEndian> WORD FixEndianWORD( WORD w )
     {
-        if ( !littleEndian )
+        if ( !LittleEndian )
             w = _byteswap_ushort( w );
 
         return w;
@@ -204,7 +274,11 @@ private:
         return ull;
     } //GetULONGULONG
 
-    DWORD GetDWORD( __int64 offset, bool littleEndian )
+    // The IFD walkers are templates on byte order, as are the reads they make. The byte order is tested once
+    // where an II or MM header starts an IFD chain (the file, a CR3 box, or a makernote with its own header)
+    // to pick the instantiation, rather than on every read. The bool overloads are for everything else.
+
+    template<bool LittleEndian> DWORD GetDWORD( __int64 offset )
     {
         DWORD dw = 0;     // Note: some files are malformed and point to reads beyond the EOF. Return 0 in these cases
 
@@ -212,14 +286,19 @@ private:
         {
             g_pStream->Read( &dw, sizeof dw );
     
-            if ( !littleEndian )
+            if ( !LittleEndian )
                 dw = _byteswap_ulong( dw );
         }
     
         return dw;
     } //GetDWORD
+
+    DWORD GetDWORD( __int64 offset, bool littleEndian )
+    {
+        return littleEndian ? GetDWORD<true>( offset ) : GetDWORD<false>( offset );
+    } //GetDWORD
     
-    WORD GetWORD( __int64 offset, bool littleEndian )
+    template<bool LittleEndian> WORD GetWORD( __int64 offset )
     {
         WORD w = 0;
 
@@ -227,12 +306,17 @@ private:
         {
             g_pStream->Read( &w, sizeof w );
     
-            if ( !littleEndian )
+            if ( !LittleEndian )
                 w = _byteswap_ushort( w );
         }
     
         return w;
     } //GetWORD
+
+    WORD GetWORD( __int64 offset, bool littleEndian )
+    {
+        return littleEndian ? GetWORD<true>( offset ) : GetWORD<false>( offset );
+    } //GetWORD
     
     byte GetBYTE( __int64 offset )
     {
@@ -252,7 +336,7 @@ private:
             g_pStream->Read( pData, byteCount );
     } //GetBytes
 
-    bool GetIFDHeaders( __int64 offset, IFDHeader * pHeader, WORD numHeaders, bool littleEndian )
+    template<bool LittleEndian> bool GetIFDHeaders( __int64 offset, IFDHeader * pHeader, WORD numHeaders )
     {
         if ( 0 == numHeaders )
             return true;
@@ -261,8 +345,8 @@ private:
         int cb = sizeof IFDHeader * numHeaders;
 
         GetBytes( offset, pHeader, cb );
-        for ( WORD i = 0; i < numHeaders; i++ )
-            pHeader[i].Endian( littleEndian );
+
+        IFDHeader::FromFile<LittleEndian>( pHeader, numHeaders );
 
         for ( WORD i = 0; i < numHeaders; i++ )
         {
@@ -275,7 +359,7 @@ private:
 
             if ( pHeader[i].type > 13 )
             {
-                tracer.Trace( "record %d has invalid type %#x make %s, model %s, path %ws\n", i, pHeader[i].type, g_acMake, g_acModel, g_awcPath );
+                tracer.TraceAt( CDJLTrace::TraceVerbose, CDJLTrace::CategoryParse, "record %d has invalid type %#x make %s, model %s, path %ws\n", i, pHeader[i].type, g_acMake, g_acModel, g_awcPath );
                 ok = false;
                 break;
             }
@@ -283,11 +367,16 @@ private:
 
         return ok;
     } //GetIFDHeaders
+
+    bool GetIFDHeaders( __int64 offset, IFDHeader * pHeader, WORD numHeaders, bool littleEndian )
+    {
+        return littleEndian ? GetIFDHeaders<true>( offset, pHeader, numHeaders ) : GetIFDHeaders<false>( offset, pHeader, numHeaders );
+    } //GetIFDHeaders
     
-    int GetTwoDWORDs( __int64 offset, TwoDWORDs * pb, bool littleEndian )
+    template<bool LittleEndian> int GetTwoDWORDs( __int64 offset, TwoDWORDs * pb )
     {
         GetBytes( offset, pb, sizeof TwoDWORDs );
-        pb->Endian( littleEndian );
+        pb->Endian( LittleEndian );
         return sizeof TwoDWORDs;
     } //GetTwoDWORDs
     
@@ -364,7 +453,7 @@ private:
         return IsPerhapsAnImageHeader( x );
     } //IsPerhapsAnImage
 
-    void EnumerateGPSTags( int depth, __int64 IFDOffset, __int64 headerBase, bool littleEndian )
+    template<bool LittleEndian> void EnumerateGPSTags( int depth, __int64 IFDOffset, __int64 headerBase )
     {
         if ( 0xffffffff == IFDOffset )
             return;
@@ -376,7 +465,7 @@ private:
     
         while ( 0 != IFDOffset ) 
         {
-            WORD NumTags = GetWORD( IFDOffset + headerBase, littleEndian );
+            WORD NumTags = GetWORD<LittleEndian>( IFDOffset + headerBase );
             IFDOffset += 2;
 
             // the file is problematic if this is true
@@ -384,7 +473,7 @@ private:
             if ( NumTags > MaxIFDHeaders )
                 break;
         
-            if ( !GetIFDHeaders( IFDOffset + headerBase, aHeaders.data(), NumTags, littleEndian ) )
+            if ( !GetIFDHeaders<LittleEndian>( IFDOffset + headerBase, aHeaders.data(), NumTags ) )
                 break;
         
             for ( int i = 0; i < NumTags; i++ )
@@ -402,16 +491,16 @@ private:
                 }
                 else if ( 2 == head.id && ( ( 10 == head.type ) || ( 5 == head.type ) ) && 3 == head.count )
                 {
-                    LONG num1 = GetDWORD( (__int64) head.offset +      headerBase, littleEndian );
-                    LONG den1 = GetDWORD( (__int64) head.offset +  4 + headerBase, littleEndian );
+                    LONG num1 = GetDWORD<LittleEndian>( (__int64) head.offset +      headerBase );
+                    LONG den1 = GetDWORD<LittleEndian>( (__int64) head.offset +  4 + headerBase );
                     double d1 = (double) num1 / (double) den1;
     
-                    LONG num2 = GetDWORD( (__int64) head.offset +  8 + headerBase, littleEndian );
-                    LONG den2 = GetDWORD( (__int64) head.offset + 12 + headerBase, littleEndian );
+                    LONG num2 = GetDWORD<LittleEndian>( (__int64) head.offset +  8 + headerBase );
+                    LONG den2 = GetDWORD<LittleEndian>( (__int64) head.offset + 12 + headerBase );
                     double d2 = (double) num2 / (double) den2;
     
-                    LONG num3 = GetDWORD( (__int64) head.offset + 16 + headerBase, littleEndian );
-                    LONG den3 = GetDWORD( (__int64) head.offset + 20 + headerBase, littleEndian );
+                    LONG num3 = GetDWORD<LittleEndian>( (__int64) head.offset + 16 + headerBase );
+                    LONG den3 = GetDWORD<LittleEndian>( (__int64) head.offset + 20 + headerBase );
                     double d3 = (double) num3 / (double) den3;
     
                     g_Latitude = d1 + ( d2 / 60.0 ) + ( d3 / 3600.0 );
@@ -426,23 +515,23 @@ private:
                 }
                 else if ( 4 == head.id && ( ( 10 == head.type ) || ( 5 == head.type ) ) && 3 == head.count )
                 {
-                    LONG num1 = GetDWORD( (__int64) head.offset +      headerBase, littleEndian );
-                    LONG den1 = GetDWORD( (__int64) head.offset +  4 + headerBase, littleEndian );
+                    LONG num1 = GetDWORD<LittleEndian>( (__int64) head.offset +      headerBase );
+                    LONG den1 = GetDWORD<LittleEndian>( (__int64) head.offset +  4 + headerBase );
                     double d1 = (double) num1 / (double) den1;
     
-                    LONG num2 = GetDWORD( (__int64) head.offset +  8 + headerBase, littleEndian );
-                    LONG den2 = GetDWORD( (__int64) head.offset + 12 + headerBase, littleEndian );
+                    LONG num2 = GetDWORD<LittleEndian>( (__int64) head.offset +  8 + headerBase );
+                    LONG den2 = GetDWORD<LittleEndian>( (__int64) head.offset + 12 + headerBase );
                     double d2 = (double) num2 / (double) den2;
     
-                    LONG num3 = GetDWORD( (__int64) head.offset + 16 + headerBase, littleEndian );
-                    LONG den3 = GetDWORD( (__int64) head.offset + 20 + headerBase, littleEndian );
+                    LONG num3 = GetDWORD<LittleEndian>( (__int64) head.offset + 16 + headerBase );
+                    LONG den3 = GetDWORD<LittleEndian>( (__int64) head.offset + 20 + headerBase );
                     double d3 = (double) num3 / (double) den3;
     
                     g_Longitude = d1 + ( d2 / 60.0 ) + ( d3 / 3600.0 );
                 }
             }
     
-            IFDOffset = GetDWORD( IFDOffset + headerBase, littleEndian );
+            IFDOffset = GetDWORD<LittleEndian>( IFDOffset + headerBase );
     
             if ( 0xffffffff == IFDOffset )
                 break;
@@ -455,7 +544,7 @@ private:
             g_Longitude = -g_Longitude;
     } //EnumerateGPSTags
     
-    void EnumerateNikonPreviewIFD( int depth, __int64 IFDOffset, __int64 headerBase, bool littleEndian )
+    template<bool LittleEndian> void EnumerateNikonPreviewIFD( int depth, __int64 IFDOffset, __int64 headerBase )
     {
         vector<IFDHeader> aHeaders( MaxIFDHeaders );
         __int64 provisionalOffset = 0;
@@ -464,13 +553,13 @@ private:
         {
             provisionalOffset = 0;
 
-            WORD NumTags = GetWORD( IFDOffset + headerBase, littleEndian );
+            WORD NumTags = GetWORD<LittleEndian>( IFDOffset + headerBase );
             IFDOffset += 2;
     
             if ( NumTags > MaxIFDHeaders )
                 break;
 
-            if ( !GetIFDHeaders( IFDOffset + headerBase, aHeaders.data(), NumTags, littleEndian ) )
+            if ( !GetIFDHeaders<LittleEndian>( IFDOffset + headerBase, aHeaders.data(), NumTags ) )
                 break;
         
             for ( int i = 0; i < NumTags; i++ )
@@ -493,11 +582,11 @@ private:
                 }
             }
     
-            IFDOffset = GetDWORD( IFDOffset + headerBase, littleEndian );
+            IFDOffset = GetDWORD<LittleEndian>( IFDOffset + headerBase );
         }
     } //EnumerateNikonPreviewIFD
     
-    void EnumerateNikonMakernotes( int depth, __int64 IFDOffset, __int64 headerBase, bool littleEndian )
+    template<bool LittleEndian> void EnumerateNikonMakernotes( int depth, __int64 IFDOffset, __int64 headerBase )
     {
         // https://www.exiv2.org/tags-nikon.html
     
@@ -506,14 +595,21 @@ private:
     
         while ( 0 != IFDOffset ) 
         {
-            WORD NumTags = GetWORD( IFDOffset + headerBase, littleEndian );
+            WORD NumTags = GetWORD<LittleEndian>( IFDOffset + headerBase );
+            LearnMakernoteIFD( IFDOffset, NumTags, LittleEndian );
             IFDOffset += 2;
     
             if ( NumTags > MaxIFDHeaders )
+            {
+                g_MakernoteWalkFailed = true;
                 break;
+            }
         
-            if ( !GetIFDHeaders( IFDOffset + headerBase, aHeaders.data(), NumTags, littleEndian ) )
+            if ( !GetIFDHeaders<LittleEndian>( IFDOffset + headerBase, aHeaders.data(), NumTags ) )
+            {
+                g_MakernoteWalkFailed = true;
                 break;
+            }
 
             for ( int i = 0; i < NumTags; i++ )
             {
@@ -523,36 +619,38 @@ private:
                 if ( 2 == head.id && 3 == head.type )
                 {
                     g_ISO = head.offset;
+                    LearnMakernoteEntry( CMakernoteLayoutCache::fieldISO, IFDOffset, head );
                 }
                 else if ( 17 == head.id && 4 == head.type && 1 == head.count )
                 {
                     // Nikon Preview IFD
+                    LearnMakernoteEntry( CMakernoteLayoutCache::fieldNikonPreviewIFD, IFDOffset, head, true, originalNikonMakernotesOffset - g_MakernoteOffset );
     
                     // This "original - 8" in originalNikonMakernotesOffset is clearly a hack. But it woks on images from the D300, D70, and D100
                     // Note it's needed to correctly compute both the preview IFD start and the embedded JPG preview start
     
-                    EnumerateNikonPreviewIFD( depth + 1, head.offset, originalNikonMakernotesOffset + headerBase, littleEndian );
+                    EnumerateNikonPreviewIFD<LittleEndian>( depth + 1, head.offset, originalNikonMakernotesOffset + headerBase );
                 }
             }
     
-            IFDOffset = GetDWORD( IFDOffset + headerBase, littleEndian );
+            IFDOffset = GetDWORD<LittleEndian>( IFDOffset + headerBase );
         }
     } //EnumerateNikonMakernotes
     
-    void EnumerateOlympusCameraSettingsIFD( int depth, __int64 IFDOffset, __int64 headerBase, bool littleEndian )
+    template<bool LittleEndian> void EnumerateOlympusCameraSettingsIFD( int depth, __int64 IFDOffset, __int64 headerBase )
     {
         bool previewIsValid = false;
         vector<IFDHeader> aHeaders( MaxIFDHeaders );
     
         while ( 0 != IFDOffset ) 
         {
-            WORD NumTags = GetWORD( IFDOffset + headerBase, littleEndian );
+            WORD NumTags = GetWORD<LittleEndian>( IFDOffset + headerBase );
             IFDOffset += 2;
     
             if ( NumTags > MaxIFDHeaders )
                 break;
 
-            if ( !GetIFDHeaders( IFDOffset + headerBase, aHeaders.data(), NumTags, littleEndian ) )
+            if ( !GetIFDHeaders<LittleEndian>( IFDOffset + headerBase, aHeaders.data(), NumTags ) )
                 break;
         
             for ( int i = 0; i < NumTags; i++ )
@@ -576,11 +674,11 @@ private:
                 }
             }
     
-            IFDOffset = GetDWORD( IFDOffset + headerBase, littleEndian );
+            IFDOffset = GetDWORD<LittleEndian>( IFDOffset + headerBase );
         }
     } //EnumerateOlympusCameraSettingsIFD
     
-    void EnumerateFujifilmMakernotes( int depth, __int64 IFDOffset, __int64 headerBase, bool littleEndian )
+    template<bool LittleEndian> void EnumerateFujifilmMakernotes( int depth, __int64 IFDOffset, __int64 headerBase )
     {
         // https://www.exiv2.org/tags-fujifilm.html
     
@@ -592,14 +690,21 @@ private:
     
         while ( 0 != IFDOffset ) 
         {
-            WORD NumTags = GetWORD( IFDOffset + headerBase, littleEndian );
+            WORD NumTags = GetWORD<LittleEndian>( IFDOffset + headerBase );
+            LearnMakernoteIFD( IFDOffset, NumTags, LittleEndian );
             IFDOffset += 2;
     
             if ( NumTags > MaxIFDHeaders )
+            {
+                g_MakernoteWalkFailed = true;
                 break;
+            }
         
-            if ( !GetIFDHeaders( IFDOffset + headerBase, aHeaders.data(), NumTags, littleEndian ) )
+            if ( !GetIFDHeaders<LittleEndian>( IFDOffset + headerBase, aHeaders.data(), NumTags ) )
+            {
+                g_MakernoteWalkFailed = true;
                 break;
+            }
     
             for ( int i = 0; i < NumTags; i++ )
             {
@@ -610,6 +715,7 @@ private:
                 {
                     ULONG stringOffset = ( head.count <= 4 ) ? ( (ULONG) IFDOffset - 4 ) : head.offset;
                     GetString( stringOffset + tagHeaderBase + headerBase, g_acSerialNumber, _countof( g_acSerialNumber ), head.count );
+                    LearnMakernoteEntry( CMakernoteLayoutCache::fieldSerialString, IFDOffset, head, true, tagHeaderBase - g_MakernoteOffset );
                     //tracer.Trace( "fujifilm makernote (alternate) Serial #: %s\n", g_acSerialNumber );
                 }
                 else if ( 5169 == head.id && 4 == head.type )
@@ -624,7 +730,7 @@ private:
                 }
             }
     
-            IFDOffset = GetDWORD( IFDOffset + headerBase, littleEndian );
+            IFDOffset = GetDWORD<LittleEndian>( IFDOffset + headerBase );
         }
     } //EnumerateFujifilmMakernotes
 
@@ -642,20 +748,27 @@ private:
         }
     } //DetectGarbage
 
-    void EnumeratePanasonicMakernotes( int depth, __int64 IFDOffset, __int64 headerBase, bool littleEndian )
+    template<bool LittleEndian> void EnumeratePanasonicMakernotes( int depth, __int64 IFDOffset, __int64 headerBase )
     {
         vector<IFDHeader> aHeaders( MaxIFDHeaders );
     
         while ( 0 != IFDOffset ) 
         {
-            WORD NumTags = GetWORD( IFDOffset + headerBase, littleEndian );
+            WORD NumTags = GetWORD<LittleEndian>( IFDOffset + headerBase );
+            LearnMakernoteIFD( IFDOffset, NumTags, LittleEndian );
             IFDOffset += 2;
     
             if ( NumTags > MaxIFDHeaders )
+            {
+                g_MakernoteWalkFailed = true;
                 break;
+            }
         
-            if ( !GetIFDHeaders( IFDOffset + headerBase, aHeaders.data(), NumTags, littleEndian ) )
+            if ( !GetIFDHeaders<LittleEndian>( IFDOffset + headerBase, aHeaders.data(), NumTags ) )
+            {
+                g_MakernoteWalkFailed = true;
                 break;
+            }
     
             // Note: Photomatix Pro 5.0.1 (64-bit) generates .tif files where these 3 strings are garbage.
             // Detect this case and make the strings empty.
@@ -672,26 +785,29 @@ private:
                     ULONG stringOffset = ( head.count <= 4 ) ? ( (ULONG) IFDOffset - 4 ) : head.offset;
                     GetString( stringOffset + headerBase, g_acSerialNumber, _countof( g_acSerialNumber ), head.count );
                     DetectGarbage( g_acSerialNumber );
+                    LearnMakernoteEntry( CMakernoteLayoutCache::fieldSerialString, IFDOffset, head, false, 0, true );
                 }
                 else if ( 81 == head.id && 2 == head.type )
                 {
                     ULONG stringOffset = ( head.count <= 4 ) ? ( (ULONG) IFDOffset - 4 ) : head.offset;
                     GetString( stringOffset + headerBase, g_acLensModel, _countof( g_acLensModel ), head.count );
                     DetectGarbage( g_acLensModel );
+                    LearnMakernoteEntry( CMakernoteLayoutCache::fieldLensModelString, IFDOffset, head, false, 0, true );
                 }
                 else if ( 82 == head.id && 2 == head.type )
                 {
                     ULONG stringOffset = ( head.count <= 4 ) ? ( (ULONG) IFDOffset - 4 ) : head.offset;
                     GetString( stringOffset + headerBase, g_acLensSerialNumber, _countof( g_acLensSerialNumber ), head.count );
                     DetectGarbage( g_acLensSerialNumber );
+                    LearnMakernoteEntry( CMakernoteLayoutCache::fieldLensSerialString, IFDOffset, head, false, 0, true );
                 }
             }
     
-            IFDOffset = GetDWORD( IFDOffset + headerBase, littleEndian );
+            IFDOffset = GetDWORD<LittleEndian>( IFDOffset + headerBase );
         }
     } //EnumeratePanasonicMakernotes
 
-    void EnumerateMakernotes( int depth, __int64 IFDOffset, __int64 headerBase, bool littleEndian )
+    template<bool LittleEndian> void WalkMakernotes( int depth, __int64 IFDOffset, __int64 headerBase )
     {
         __int64 originalIFDOffset = IFDOffset;
     
@@ -713,43 +829,52 @@ private:
         if ( !strcmp( g_acMake, "NIKON CORPORATION" ) )
         {
             IFDOffset += 10;
-            WORD endian = GetWORD( IFDOffset + headerBase, littleEndian );
-            littleEndian = ( 0x4d4d != endian );
+            WORD endian = GetWORD<LittleEndian>( IFDOffset + headerBase );
     
-            // https://www.exiv2.org/tags-nikon.html     Format 3 for D100
+            // https://www.exiv2.org/tags-nikon.html     Format 3 for D100.
+            // The makernotes have their own TIFF header, so their byte order is picked here.
     
             IFDOffset += 8;
             isNikon = true;
     
-            EnumerateNikonMakernotes( depth, IFDOffset, headerBase, littleEndian );
+            if ( 0x4d4d != endian )
+                EnumerateNikonMakernotes<true>( depth, IFDOffset, headerBase );
+            else
+                EnumerateNikonMakernotes<false>( depth, IFDOffset, headerBase );
             return;
         }
         if ( !strcmp( g_acMake, "Nikon" ) )
         {
             IFDOffset += 10;
-            WORD endian = GetWORD( IFDOffset + headerBase, littleEndian );
-            littleEndian = ( 0x4d4d != endian );
+            WORD endian = GetWORD<LittleEndian>( IFDOffset + headerBase );
     
-            // https://www.exiv2.org/tags-nikon.html     Format 3 for D100
+            // https://www.exiv2.org/tags-nikon.html     Format 3 for D100.
+            // The makernotes have their own TIFF header, so their byte order is picked here.
     
             IFDOffset += 8;
             isNikon = true;
     
-            EnumerateNikonMakernotes( depth, IFDOffset, headerBase, littleEndian );
+            if ( 0x4d4d != endian )
+                EnumerateNikonMakernotes<true>( depth, IFDOffset, headerBase );
+            else
+                EnumerateNikonMakernotes<false>( depth, IFDOffset, headerBase );
             return;
         }
         if ( !strcmp( g_acMake, "NIKON" ) )
         {
             IFDOffset += 10;
-            WORD endian = GetWORD( IFDOffset + headerBase, littleEndian );
-            littleEndian = ( 0x4d4d != endian );
+            WORD endian = GetWORD<LittleEndian>( IFDOffset + headerBase );
     
-            // https://www.exiv2.org/tags-nikon.html     Format 3 for D100
+            // https://www.exiv2.org/tags-nikon.html     Format 3 for D100.
+            // The makernotes have their own TIFF header, so their byte order is picked here.
     
             IFDOffset += 8;
             isNikon = true;
     
-            EnumerateNikonMakernotes( depth, IFDOffset, headerBase, littleEndian );
+            if ( 0x4d4d != endian )
+                EnumerateNikonMakernotes<true>( depth, IFDOffset, headerBase );
+            else
+                EnumerateNikonMakernotes<false>( depth, IFDOffset, headerBase );
             return;
         }
         else if ( !strcmp( g_acMake, "LEICA CAMERA AG" ) )
@@ -799,7 +924,7 @@ private:
             IFDOffset += 12;
             isFujifilm = true;
     
-            EnumerateFujifilmMakernotes( depth, IFDOffset, headerBase, littleEndian );
+            EnumerateFujifilmMakernotes<LittleEndian>( depth, IFDOffset, headerBase );
             return;
         }
         else if ( !strcmp( g_acMake, "Panasonic" ) )
@@ -807,18 +932,20 @@ private:
             IFDOffset += 12;
             isPanasonic = true;
 
-            EnumeratePanasonicMakernotes( depth, IFDOffset, headerBase, littleEndian );
+            EnumeratePanasonicMakernotes<LittleEndian>( depth, IFDOffset, headerBase );
             return;
         }
         else if ( !strcmp( g_acMake, "Apple" ) )
         {
-            if ( !strcmp( g_acModel, "iPhone 12" ) )
+            // iPhone 12 makernotes are big-endian whatever the rest of the file is
+
+            if ( LittleEndian && !strcmp( g_acModel, "iPhone 12" ) )
             {
-                IFDOffset += 14;
-                littleEndian = false;
+                WalkMakernotes<false>( depth, IFDOffset, headerBase );
+                return;
             }
-            else
-                IFDOffset += 14;
+
+            IFDOffset += 14;
     
             isApple = true;
         }
@@ -848,16 +975,23 @@ private:
 
         while ( 0 != IFDOffset ) 
         {
-            WORD NumTags = GetWORD( IFDOffset + headerBase, littleEndian );
+            WORD NumTags = GetWORD<LittleEndian>( IFDOffset + headerBase );
+            LearnMakernoteIFD( IFDOffset, NumTags, LittleEndian );
             IFDOffset += 2;
     
             // the file is problematic if this is true
 
             if ( NumTags > MaxIFDHeaders )
+            {
+                g_MakernoteWalkFailed = true;
                 break;
+            }
         
-            if ( !GetIFDHeaders( IFDOffset + headerBase, aHeaders.data(), NumTags, littleEndian ) )
+            if ( !GetIFDHeaders<LittleEndian>( IFDOffset + headerBase, aHeaders.data(), NumTags ) )
+            {
+                g_MakernoteWalkFailed = true;
                 break;
+            }
         
             for ( int i = 0; i < NumTags; i++ )
             {
@@ -870,6 +1004,7 @@ private:
                     {
                         GetBytes( head.offset + headerBase, g_acSerialNumber, head.count );
                         g_acSerialNumber[ head.count ] = 0;
+                        LearnMakernoteEntry( CMakernoteLayoutCache::fieldSerialBytes, IFDOffset, head );
                     }
                 }
                 else if ( 12 == head.id && 4 == head.type && 1 == head.count && isCanon )
@@ -891,13 +1026,13 @@ private:
                     GetBytes( head.offset + headerBase, &sd, sizeof sd );
 
 /*
-                    short sensorWidth = FixEndianWORD( sd.width, littleEndian );
-                    short sensorHeight = FixEndianWORD( sd.height, littleEndian );
+                    short sensorWidth = FixEndianWORD<LittleEndian>( sd.width );
+                    short sensorHeight = FixEndianWORD<LittleEndian>( sd.height );
     
-                    short leftBorder = FixEndianWORD( sd.lborder, littleEndian );
-                    short topBorder = FixEndianWORD( sd.tborder, littleEndian );
-                    short rightBorder = FixEndianWORD( sd.rborder, littleEndian );
-                    short bottomBorder = FixEndianWORD( sd.bborder, littleEndian );
+                    short leftBorder = FixEndianWORD<LittleEndian>( sd.lborder );
+                    short topBorder = FixEndianWORD<LittleEndian>( sd.tborder );
+                    short rightBorder = FixEndianWORD<LittleEndian>( sd.rborder );
+                    short bottomBorder = FixEndianWORD<LittleEndian>( sd.bborder );
 */
                 }
                 else if ( 553 == head.id && isRicoh )
@@ -909,6 +1044,7 @@ private:
                         // Ricoh assumes the base is originalIFDOffset
 
                         GetString( originalIFDOffset + stringOffset + headerBase, g_acSerialNumber, _countof( g_acSerialNumber ), head.count );
+                        LearnMakernoteEntry( CMakernoteLayoutCache::fieldSerialString, IFDOffset, head, true, originalIFDOffset - g_MakernoteOffset );
                     }
                 }
                 else if ( 1280 == head.id && isLeica )
@@ -920,15 +1056,141 @@ private:
                 }
                 else if ( 8224 == head.id && 13 == head.type && isOlympus )
                 {
-                    EnumerateOlympusCameraSettingsIFD( depth + 1, head.offset, originalIFDOffset + headerBase, littleEndian );
+                    EnumerateOlympusCameraSettingsIFD<LittleEndian>( depth + 1, head.offset, originalIFDOffset + headerBase );
+                    LearnMakernoteEntry( CMakernoteLayoutCache::fieldOlympusSettingsIFD, IFDOffset, head, true, originalIFDOffset - g_MakernoteOffset );
                 }
             }
     
-            IFDOffset = GetDWORD( IFDOffset + headerBase, littleEndian );
+            IFDOffset = GetDWORD<LittleEndian>( IFDOffset + headerBase );
+        }
+    } //WalkMakernotes
+
+    void LearnMakernoteIFD( __int64 IFDOffset, WORD numTags, bool littleEndian )
+    {
+        CMakernoteLayoutCache::Layout & layout = g_LearnedMakernoteLayout;
+
+        if ( g_LearningMakernoteLayout && !layout.haveFirstIFD )
+        {
+            layout.haveFirstIFD = true;
+            layout.firstIFDDelta = IFDOffset - g_MakernoteOffset;
+            layout.firstIFDTags = numTags;
+            layout.littleEndian = littleEndian;
+        }
+    } //LearnMakernoteIFD
+
+    // IFDOffset is just past the entry, as it is in the walkers
+
+    void LearnMakernoteEntry( CMakernoteLayoutCache::Field field, __int64 IFDOffset, IFDHeader & head,
+                              bool makernoteBase = false, __int64 baseDelta = 0, bool detectGarbage = false )
+    {
+        if ( g_LearningMakernoteLayout )
+        {
+            CMakernoteLayoutCache::Entry entry = { IFDOffset - (__int64) sizeof IFDHeader - g_MakernoteOffset, head.id, head.type, head.count,
+                                                   field, makernoteBase, baseDelta, detectGarbage };
+            g_LearnedMakernoteLayout.entries.push_back( entry );
         }
+    } //LearnMakernoteEntry
+
+    // Reads the tags in a cached layout. Returns false without changing anything if the layout doesn't match.
+
+    template<bool LittleEndian> bool ReadMakernoteLayout( int depth, CMakernoteLayoutCache::Layout & layout, __int64 headerBase )
+    {
+        if ( !layout.haveFirstIFD || layout.firstIFDTags != GetWORD<LittleEndian>( g_MakernoteOffset + layout.firstIFDDelta + headerBase ) )
+            return false;
+
+        size_t count = layout.entries.size();
+        vector<IFDHeader> aHeaders( count );
+
+        for ( size_t i = 0; i < count; i++ )
+        {
+            CMakernoteLayoutCache::Entry & entry = layout.entries[ i ];
+            IFDHeader & head = aHeaders[ i ];
+
+            if ( !GetIFDHeaders<LittleEndian>( g_MakernoteOffset + entry.delta + headerBase, &head, 1 ) ||
+                 head.id != entry.id || head.type != entry.type || head.count != entry.count )
+                return false;
+        }
+
+        for ( size_t i = 0; i < count; i++ )
+        {
+            CMakernoteLayoutCache::Entry & entry = layout.entries[ i ];
+            IFDHeader & head = aHeaders[ i ];
+            __int64 entryOffset = g_MakernoteOffset + entry.delta;
+            __int64 base = entry.makernoteBase ? ( g_MakernoteOffset + entry.baseDelta + headerBase ) : headerBase;
+            char * pcString = NULL;
+            size_t ccString = 0;
+
+            if ( CMakernoteLayoutCache::fieldSerialString == entry.field )
+            {
+                pcString = g_acSerialNumber;
+                ccString = _countof( g_acSerialNumber );
+            }
+            else if ( CMakernoteLayoutCache::fieldLensModelString == entry.field )
+            {
+                pcString = g_acLensModel;
+                ccString = _countof( g_acLensModel );
+            }
+            else if ( CMakernoteLayoutCache::fieldLensSerialString == entry.field )
+            {
+                pcString = g_acLensSerialNumber;
+                ccString = _countof( g_acLensSerialNumber );
+            }
+            else if ( CMakernoteLayoutCache::fieldSerialBytes == entry.field )
+            {
+                GetBytes( head.offset + base, g_acSerialNumber, head.count );
+                g_acSerialNumber[ head.count ] = 0;
+            }
+            else if ( CMakernoteLayoutCache::fieldISO == entry.field )
+                g_ISO = head.offset;
+            else if ( CMakernoteLayoutCache::fieldNikonPreviewIFD == entry.field )
+                EnumerateNikonPreviewIFD<LittleEndian>( depth + 1, head.offset, base );
+            else if ( CMakernoteLayoutCache::fieldOlympusSettingsIFD == entry.field )
+                EnumerateOlympusCameraSettingsIFD<LittleEndian>( depth + 1, head.offset, base );
+
+            if ( NULL != pcString )
+            {
+                __int64 stringOffset = ( head.count <= 4 ) ? ( entryOffset + 8 ) : head.offset;
+                GetString( stringOffset + base, pcString, (int) ccString, head.count );
+
+                if ( entry.detectGarbage )
+                    DetectGarbage( pcString );
+            }
+        }
+
+        return true;
+    } //ReadMakernoteLayout
+
+    // Makernote layouts are almost always the same for a given camera model and firmware, so after one file
+    // is walked, later ones just read the tags the walk used.
+
+    template<bool LittleEndian> void EnumerateMakernotes( int depth, __int64 IFDOffset, __int64 headerBase )
+    {
+        CMakernoteLayoutCache & cache = MakernoteLayouts();
+        string key = CMakernoteLayoutCache::Key( g_acMake, g_acModel, g_acSoftware );
+        CMakernoteLayoutCache::Layout layout;
+        g_MakernoteOffset = IFDOffset;
+
+        if ( cache.Find( key, layout ) &&
+             ( layout.littleEndian ? ReadMakernoteLayout<true>( depth, layout, headerBase ) : ReadMakernoteLayout<false>( depth, layout, headerBase ) ) )
+        {
+            cache.Hit();
+            return;
+        }
+
+        cache.Miss();
+        g_LearnedMakernoteLayout = CMakernoteLayoutCache::Layout();
+        g_LearningMakernoteLayout = true;
+        g_MakernoteWalkFailed = false;
+
+        WalkMakernotes<LittleEndian>( depth, IFDOffset, headerBase );
+
+        g_LearningMakernoteLayout = false;
+
+        if ( g_LearnedMakernoteLayout.haveFirstIFD && !g_MakernoteWalkFailed )
+            cache.Store( key, g_LearnedMakernoteLayout );
     } //EnumerateMakernotes
     
-    void EnumerateExifTags( int depth, __int64 IFDOffset, __int64 headerBase, bool littleEndian )
+    template<bool LittleEndian> void EnumerateExifTags( int depth, __int64 IFDOffset, __int64 headerBase )
     {
         DWORD XResolutionNum = 0;
         DWORD XResolutionDen = 0;
@@ -941,7 +1203,7 @@ private:
     
         while ( 0 != IFDOffset ) 
         {
-            WORD NumTags = GetWORD( IFDOffset + headerBase, littleEndian );
+            WORD NumTags = GetWORD<LittleEndian>( IFDOffset + headerBase );
             IFDOffset += 2;
 
             // the file is problematic if this is true
@@ -949,7 +1211,7 @@ private:
             if ( NumTags > MaxIFDHeaders )
                 break;
         
-            if ( !GetIFDHeaders( IFDOffset + headerBase, aHeaders.data(), NumTags, littleEndian ) )
+            if ( !GetIFDHeaders<LittleEndian>( IFDOffset + headerBase, aHeaders.data(), NumTags ) )
                 break;
         
             for ( int i = 0; i < NumTags; i++ )
@@ -960,7 +1222,7 @@ private:
                 if ( 33434 == head.id && 5 == head.type )
                 {
                     TwoDWORDs td;
-                    GetTwoDWORDs( head.offset + headerBase, &td, littleEndian );
+                    GetTwoDWORDs<LittleEndian>( head.offset + headerBase, &td );
                     g_ExposureNum = td.dw1;
                     g_ExposureDen = td.dw2;
                 }
@@ -972,7 +1234,7 @@ private:
                 else if ( 33437 == head.id && 5 == head.type ) // FNumber
                 {
                     TwoDWORDs td;
-                    GetTwoDWORDs( head.offset + headerBase, &td, littleEndian );
+                    GetTwoDWORDs<LittleEndian>( head.offset + headerBase, &td );
 
                     g_FNumberNum = td.dw1;
                     g_FNumberDen = td.dw2;
@@ -989,7 +1251,7 @@ private:
                 else if ( 37378 == head.id && 5 == head.type ) // ApertureValue
                 {
                     TwoDWORDs td;
-                    GetTwoDWORDs( head.offset + headerBase, &td, littleEndian );
+                    GetTwoDWORDs<LittleEndian>( head.offset + headerBase, &td );
 
                     g_ApertureNum = td.dw1;
                     g_ApertureDen = td.dw2;
@@ -997,13 +1259,13 @@ private:
                 else if ( 37386 == head.id && 5 == head.type )
                 {
                     TwoDWORDs td;
-                    GetTwoDWORDs( head.offset + headerBase, &td, littleEndian );
+                    GetTwoDWORDs<LittleEndian>( head.offset + headerBase, &td );
                     g_FocalLengthNum = td.dw1; 
                     g_FocalLengthDen = td.dw2; 
                 }
                 else if ( 37500 == head.id )
                 {
-                    EnumerateMakernotes( depth + 1, head.offset, headerBase, littleEndian );
+                    EnumerateMakernotes<LittleEndian>( depth + 1, head.offset, headerBase );
                 }
                 else if ( 40962 == head.id )
                 {
@@ -1022,14 +1284,14 @@ private:
                 else if ( 41486 == head.id )
                 {
                     TwoDWORDs td;
-                    GetTwoDWORDs( head.offset + headerBase, &td, littleEndian );
+                    GetTwoDWORDs<LittleEndian>( head.offset + headerBase, &td );
                     XResolutionNum = td.dw1;
                     XResolutionDen = td.dw2;
                 }
                 else if ( 41487 == head.id )
                 {
                     TwoDWORDs td;
-                    GetTwoDWORDs( head.offset + headerBase, &td, littleEndian );
+                    GetTwoDWORDs<LittleEndian>( head.offset + headerBase, &td );
                     YResolutionNum = td.dw1;
                     YResolutionDen = td.dw2;
                 }
@@ -1069,7 +1331,7 @@ private:
                 }
             }
     
-            IFDOffset = GetDWORD( IFDOffset + headerBase, littleEndian );
+            IFDOffset = GetDWORD<LittleEndian>( IFDOffset + headerBase );
         }
     
         if ( 0 != XResolutionNum && 0 != XResolutionDen && 0 != YResolutionNum && 0 != YResolutionDen && 0 != sensorSizeUnit &&
@@ -1112,7 +1374,7 @@ private:
         }
     } //EnumerateExifTags
 
-    void EnumerateGenericIFD( int depth, __int64 IFDOffset, __int64 headerBase, bool littleEndian )
+    template<bool LittleEndian> void EnumerateGenericIFD( int depth, __int64 IFDOffset, __int64 headerBase )
     {
         __int64 provisionalJPGOffset = 0;
         __int64 provisionalJPGFromRAWOffset = 0;
@@ -1125,7 +1387,7 @@ private:
             provisionalJPGOffset = 0;
             provisionalJPGFromRAWOffset = 0;
     
-            WORD NumTags = GetWORD( IFDOffset + headerBase, littleEndian );
+            WORD NumTags = GetWORD<LittleEndian>( IFDOffset + headerBase );
             IFDOffset += 2;
     
             // the file is problematic if this is true
@@ -1133,7 +1395,7 @@ private:
             if ( NumTags > MaxIFDHeaders )
                 break;
         
-            if ( !GetIFDHeaders( IFDOffset + headerBase, aHeaders.data(), NumTags, littleEndian ) )
+            if ( !GetIFDHeaders<LittleEndian>( IFDOffset + headerBase, aHeaders.data(), NumTags ) )
                 break;
         
             for ( int i = 0; i < NumTags; i++ )
@@ -1186,12 +1448,12 @@ private:
                 }
             }
     
-            IFDOffset = GetDWORD( IFDOffset + headerBase, littleEndian );
+            IFDOffset = GetDWORD<LittleEndian>( IFDOffset + headerBase );
             currentIFD++;
         }
     } //EnumerateGenericIFD
     
-    void GetPanasonicIFD0Tag( int depth, WORD tagID, WORD tagType, DWORD tagCount, DWORD tagOffset, __int64 headerBase, bool littleEndian, __int64 IFDOffset )
+    void GetPanasonicIFD0Tag( int depth, WORD tagID, WORD tagType, DWORD tagCount, DWORD tagOffset, __int64 headerBase, __int64 IFDOffset )
     {
         if ( 2 == tagID )
         {
@@ -1212,11 +1474,19 @@ private:
         }
     } //GetPanasonicIFD0Tag
     
+    // Audio metadata is read in one call and parsed from memory. ID3v2 tags declare their size; FLAC metadata
+    // blocks don't, so the start of the file is read and a picture block beyond that is read whole.
+
+    static const ULONG InitialFlacPrefetch = 64 * 1024;
+    static const ULONG MaxAudioTagPrefetch = 16 * 1024 * 1024;
+
     void EnumerateFlac()
     {
         // Data is big-endian!
     
         ULONG offset = 4;
+
+        g_pStream->Prefetch( 0, InitialFlacPrefetch );
     
         do
         {
@@ -1235,6 +1505,8 @@ private:
             if ( 6 == blockType )
             {
                 // Picture
+
+                g_pStream->Prefetch( offset, length );
     
                 DWORD o = offset;
     
@@ -1404,6 +1676,18 @@ private:
             }
     }; //HeifStream
     
+    // Container boxes are read whole so their children, and for CR3 the Exif IFDs in the CMT boxes, are parsed from memory.
+    // HeifStream does a Seek and Read for each value, and without this a CR3 costs dozens of tiny reads.
+
+    static const ULONG InitialHeifPrefetch = 64 * 1024;
+    static const ULONGLONG MaxPrefetchedBox = 8 * 1024 * 1024;
+
+    void PrefetchBox( HeifStream & hs, __int64 boxOffset, ULONGLONG boxLen )
+    {
+        if ( boxLen <= MaxPrefetchedBox )
+            hs.Stream()->Prefetch( hs.Offset() + boxOffset, (ULONG) boxLen );
+    } //PrefetchBox
+
     // Heif and CR3 use ISO Base Media File Format ISO/IEC 14496-12. This function walks those files and pulls out data including Exif offsets
     
     void EnumerateBoxes( HeifStream & hs, DWORD depth )
@@ -1456,6 +1740,7 @@ private:
             }
             else if ( !strcmp( tag, "meta" ) )
             {
+                PrefetchBox( hs, boxOffset, boxLen );
                 DWORD data = hs.GetDWORD( offset, true );
     
                 HeifStream hsChild( hs.Stream(), hs.Offset() + offset, boxLen - ( offset - boxOffset ) );
@@ -1664,6 +1949,7 @@ private:
             }
             else if ( !strcmp( tag, "moov" ) ) // Canon CR3 format
             {
+                PrefetchBox( hs, boxOffset, boxLen );
                 HeifStream hsChild( hs.Stream(), hs.Offset() + offset, boxLen - ( offset - boxOffset ) );
     
                 EnumerateBoxes( hsChild, depth + 1 );
@@ -1796,11 +2082,15 @@ private:
     {
         __int64 length = pStream->Length();
         HeifStream hs( pStream, 0, length );
+
+        // ftyp and usually all of meta are at the start of the file
+
+        pStream->Prefetch( 0, InitialHeifPrefetch );
     
         EnumerateBoxes( hs, 0 );
     } //EnumerateHeif
     
-    void EnumerateIFD0( int depth, __int64 IFDOffset, __int64 headerBase, bool littleEndian, WCHAR const * pwcExt )
+    template<bool LittleEndian> void EnumerateIFD0( int depth, __int64 IFDOffset, __int64 headerBase, WCHAR const * pwcExt )
     {
         int currentIFD = 0;
         __int64 provisionalJPGOffset = 0;
@@ -1814,13 +2104,13 @@ private:
             provisionalJPGOffset = 0;
             provisionalEmbeddedJPGOffset = 0;
     
-            WORD NumTags = GetWORD( IFDOffset + headerBase, littleEndian );
+            WORD NumTags = GetWORD<LittleEndian>( IFDOffset + headerBase );
             IFDOffset += 2;
         
             if ( NumTags > MaxIFDHeaders )
                 break;
 
-            if ( !GetIFDHeaders( IFDOffset + headerBase, aHeaders.data(), NumTags, littleEndian ) )
+            if ( !GetIFDHeaders<LittleEndian>( IFDOffset + headerBase, aHeaders.data(), NumTags ) )
                 break;
 
             for ( int i = 0; i < NumTags; i++ )
@@ -1830,7 +2120,7 @@ private:
 
                 if ( ( !_wcsicmp( pwcExt, L".rw2" ) ) && ( ( head.id < 254 ) || ( head.id >= 280 && head.id <= 290 ) ) )
                 {
-                    GetPanasonicIFD0Tag( depth, head.id, head.type, head.count, head.offset, headerBase, littleEndian, IFDOffset );
+                    GetPanasonicIFD0Tag( depth, head.id, head.type, head.count, head.offset, headerBase, IFDOffset );
                     continue;
                 }
     
@@ -1853,7 +2143,7 @@ private:
                 else if ( 258 == head.id && 3 == head.type && 3 == head.count )
                 {
                     // read the first one
-                    lastBitsPerSample = GetWORD( head.offset + headerBase, littleEndian );
+                    lastBitsPerSample = GetWORD<LittleEndian>( head.offset + headerBase );
                 }
                 else if ( 258 == head.id && 3 == head.type && 1 == head.count )
                 {
@@ -1869,6 +2159,11 @@ private:
                     __int64 stringOffset = ( head.count <= 4 ) ? ( IFDOffset - 4 ) : head.offset;
                     GetString( stringOffset + headerBase, g_acModel, _countof( g_acModel ), head.count );
                 }
+                else if ( 305 == head.id && 2 == head.type && 0 == currentIFD )
+                {
+                    __int64 stringOffset = ( head.count <= 4 ) ? ( IFDOffset - 4 ) : head.offset;
+                    GetString( stringOffset + headerBase, g_acSoftware, _countof( g_acSoftware ), head.count );
+                }
                 else if ( 273 == head.id && IsIntType( head.type ) )
                 {
                     if ( 0 != head.offset && 0xffffffff != head.offset && !likelyRAW && IsPerhapsAnImage( head.offset, headerBase ) )
@@ -1881,7 +2176,7 @@ private:
                         g_Orientation_Value = head.offset;
                         g_Orientation_Offset = headerBase + IFDOffset - 4;
                         g_Orientation_Type = head.type;
-                        g_Orientation_LittleEndian = littleEndian;
+                        g_Orientation_LittleEndian = LittleEndian;
                     }
                     else
                     {
@@ -1906,13 +2201,13 @@ private:
                 else if ( 330 == head.id && 4 == head.type )
                 {
                     if ( 1 == head.count )
-                        EnumerateGenericIFD( depth + 1, head.offset, headerBase, littleEndian );
+                        EnumerateGenericIFD<LittleEndian>( depth + 1, head.offset, headerBase );
                     else
                     {
                         for ( size_t item = 0; item < head.count; item++ )
                         {
-                            DWORD oIFD = GetDWORD( ( item * 4 ) + head.offset + headerBase, littleEndian );
-                            EnumerateGenericIFD( depth + 1, oIFD, headerBase, littleEndian );
+                            DWORD oIFD = GetDWORD<LittleEndian>( ( item * 4 ) + head.offset + headerBase );
+                            EnumerateGenericIFD<LittleEndian>( depth + 1, oIFD, headerBase );
                         }
                     }
                 }
@@ -1948,11 +2243,11 @@ private:
                 }
                 else if ( 34665 == head.id )
                 {
-                    EnumerateExifTags( depth + 1, head.offset, headerBase, littleEndian );
+                    EnumerateExifTags<LittleEndian>( depth + 1, head.offset, headerBase );
                 }
                 else if ( 34853 == head.id )
                 {
-                    EnumerateGPSTags( depth + 1, head.offset, headerBase, littleEndian );
+                    EnumerateGPSTags<LittleEndian>( depth + 1, head.offset, headerBase );
                 }
                 else if ( 41989 == head.id && IsIntType( head.type ) )
                 {
@@ -1976,11 +2271,11 @@ private:
                 {
                     // Sony and Ricoh Makernotes (in addition to makernotes stored in Exif IFD)
     
-                    EnumerateMakernotes( depth + 1, head.offset, headerBase, littleEndian );
+                    EnumerateMakernotes<LittleEndian>( depth + 1, head.offset, headerBase );
                 }
             }
     
-            IFDOffset = GetDWORD( IFDOffset + headerBase, littleEndian );
+            IFDOffset = GetDWORD<LittleEndian>( IFDOffset + headerBase );
     
             currentIFD++;
         }
@@ -2279,6 +2574,8 @@ private:
             return;
         }
 
+        g_pStream->Prefetch( 0, (ULONG) __min( firstFrameOffset + start.size, (__int64) MaxAudioTagPrefetch ) );
+
         __int64 frameOffset = firstFrameOffset;
     
         struct ID3v23FrameHeader
@@ -2558,10 +2855,87 @@ private:
         return pwcPath + len;
     } //FindExtension
 
-    void EnumerateImageData( HANDLE hFile, const WCHAR * pwc )
+    // Formats are found by the magic bytes at the start of the file, or by extension if no magic bytes match.
+    // Formats that one function parses completely just need a row with that function to be supported.
+    // The others are TIFF-like and parsed by EnumerateImageData, or containers whose embedded image is sniffed again.
+
+    enum ImageFormat { formatJPG, formatTIFF, formatTIFFBigEndian, formatORF, formatRW2, formatRAF, formatPNG, formatBMP,
+                       formatFlac, formatMP3, formatHeif, formatCR3 };
+
+    typedef void ( CImageData::*FormatParser )( bool embedded );
+
+    struct FormatSignature
+    {
+        ImageFormat format;
+        BYTE offset;                      // where the magic bytes are
+        BYTE cb;                          // how many magic bytes there are
+        const char * magic;
+        const WCHAR * extension;          // used if no magic bytes match. May be NULL
+        bool container;                   // the image data is elsewhere in the file
+        FormatParser parse;               // NULL if EnumerateImageData parses it
+    };
+
+    static const ULONG SniffBytes = 4096; // read once; the header and usually the first IFD are parsed from it
+    static const ULONG MaxMagicBytes = 12;
+
+    static const FormatSignature * Signatures( size_t & count )
+    {
+        static const FormatSignature signatures[] =
+        {
+            { formatJPG,           0, 2, "\xff\xd8",               NULL,      false, NULL },
+            { formatTIFF,          0, 4, "II*\0",                  NULL,      false, NULL },   // CR2 canon and standard TIF and DNG
+            { formatTIFFBigEndian, 0, 4, "MM\0*",                  NULL,      false, NULL },   // NEF nikon
+            { formatORF,           0, 4, "IIRO",                   NULL,      false, NULL },   // ORF olympus
+            { formatRW2,           0, 4, "IIU\0",                  NULL,      false, NULL },   // RW2 panasonic
+            { formatRAF,           0, 4, "FUJI",                   NULL,      false, NULL },   // RAF fujifilm
+            { formatPNG,           0, 8, "\x89PNG\r\n\x1a\n",       NULL,      false, &CImageData::ParsePNG },
+            { formatBMP,           0, 2, "BM",                     NULL,      false, &CImageData::ParseBMP },
+            { formatFlac,          0, 4, "fLaC",                   NULL,      true,  NULL },
+            { formatMP3,           0, 4, "ID3\x02",                NULL,      true,  NULL },
+            { formatMP3,           0, 4, "ID3\x03",                NULL,      true,  NULL },
+            { formatMP3,           0, 4, "ID3\x04",                NULL,      true,  NULL },
+            { formatMP3,           0, 3, "\xff\xfb\x90",           NULL,      true,  NULL },
+            { formatCR3,           4, 8, "ftypcrx ",               L".cr3",   true,  NULL },   // Canon's newer RAW format
+            { formatHeif,          4, 8, "ftypheic",               L".heic",  true,  NULL },   // Apple iOS photos
+            { formatHeif,          4, 8, "ftypheix",               L".hif",   true,  NULL },   // Canon HEIF photos
+            { formatHeif,          4, 8, "ftypmif1",               NULL,      true,  NULL },
+        };
+
+        count = _countof( signatures );
+        return signatures;
+    } //Signatures
+
+    // Returns NULL if the format isn't known. The stream's position is unchanged.
+
+    const FormatSignature * SniffFormat( CStream * pStream, __int64 offset, const WCHAR * pwcExt )
+    {
+        BYTE head[ MaxMagicBytes ];
+        __int64 position = pStream->Tell();
+        pStream->GetBytes( offset, head, sizeof head );
+        pStream->Seek( position );
+
+        size_t count;
+        const FormatSignature * signatures = Signatures( count );
+
+        for ( size_t i = 0; i < count; i++ )
+            if ( !memcmp( head + signatures[ i ].offset, signatures[ i ].magic, signatures[ i ].cb ) )
+                return & signatures[ i ];
+
+        if ( NULL != pwcExt )
+            for ( size_t i = 0; i < count; i++ )
+                if ( NULL != signatures[ i ].extension && !_wcsicmp( pwcExt, signatures[ i ].extension ) )
+                    return & signatures[ i ];
+
+        return NULL;
+    } //SniffFormat
+
+    // pFileStream is the whole file or archive member. Embedded images are parsed through views of it
+    // that share its handle and prefetched data.
+
+    void EnumerateImageData( CStream * pFileStream, const WCHAR * pwc )
     {
-        g_pStream = new CStream( hFile );
-        unique_ptr<CStream> stream( g_pStream );
+        g_pStream = pFileStream;
+        unique_ptr<CStream> stream;
     
         if ( !g_pStream->Ok() )
         {
@@ -2572,9 +2946,19 @@ private:
         bool isOuterFileJPG = false;
         WCHAR const * pwcExt = FindExtension( pwc );
         __int64 heifOffsetBase = 0;
+
+        // Reads after this come from memory until a parser needs more. It does nothing if the file was preloaded.
+
+        g_pStream->Prefetch( 0, SniffBytes );
+        const FormatSignature * format = SniffFormat( g_pStream, 0, pwcExt );
+
+        if ( NULL == format )
+        {
+            g_pStream = NULL;
+            return;
+        }
     
-        if ( !_wcsicmp( pwcExt, L".heic" ) ||          // Apple iOS photos
-             !_wcsicmp( pwcExt, L".hif" ) )            // Canon HEIF photos
+        if ( formatHeif == format->format )
         {
             // enumeration of the heif file is just to find the EXIF data offset, reflected in the g_Heif_Exif_* variables
     
@@ -2586,6 +2970,10 @@ private:
                 return;
             }
     
+            // the Exif item is parsed from memory
+
+            g_pStream->Prefetch( g_Heif_Exif_Offset, (ULONG) __min( (ULONGLONG) g_Heif_Exif_Length, MaxPrefetchedBox ) );
+
             DWORD o = GetDWORD( g_Heif_Exif_Offset, false );
     
             heifOffsetBase = o + g_Heif_Exif_Offset + 4;
@@ -2598,7 +2986,7 @@ private:
                 return;
             }
         }
-        else if ( !_wcsicmp( pwcExt, L".cr3" ) )        // Canon's newer RAW format
+        else if ( formatCR3 == format->format )
         {
             // enumeration of the heif file is just to find the EXIF data offset, reflected in the g_Canon_CR3_* variables
             // Heif and CR3 use ISO Base Media File Format ISO/IEC 14496-12
@@ -2621,6 +3009,11 @@ private:
                 return;
             }
         }
+
+        // Heif and CR3 Exif data is a TIFF header and IFDs
+
+        if ( 0 != heifOffsetBase )
+            format = SniffFormat( g_pStream, heifOffsetBase, NULL );
     
         DWORD header = 0;
         ULONG bytesread = g_pStream->Read( &header, sizeof header );
@@ -2633,18 +3026,19 @@ private:
     
         bool parsingEmbeddedImage = false;
 
-        if ( 0x43614c66 == header )
+        if ( NULL != format && formatFlac == format->format )
         {
             EnumerateFlac();
 
             if ( 0 != g_Embedded_Image_Offset && 0 != g_Embedded_Image_Length )
             {
-                CStream * embeddedImage = new CStream( pwc, g_Embedded_Image_Offset, g_Embedded_Image_Length );
+                CStream * embeddedImage = new CStream( *pFileStream, g_Embedded_Image_Offset, g_Embedded_Image_Length );
     
                 embeddedImage->Read( &header, sizeof header );
                 stream.reset( embeddedImage );
                 g_pStream = embeddedImage;
                 parsingEmbeddedImage = true; 
+                format = SniffFormat( embeddedImage, 0, NULL );
             }
             else
             {
@@ -2652,18 +3046,19 @@ private:
                 return;
             }
         }
-        else if ( 0x03334449 == header || 0x02334449 == header || 0x04334449 == header || 0x90fbff == ( header & 0xffffff ) )
+        else if ( NULL != format && formatMP3 == format->format )
         {
             ParseMP3();
     
             if ( 0 != g_Embedded_Image_Offset && 0 != g_Embedded_Image_Length )
             {
-                CStream * embeddedImage = new CStream( pwc, g_Embedded_Image_Offset, g_Embedded_Image_Length );
+                CStream * embeddedImage = new CStream( *pFileStream, g_Embedded_Image_Offset, g_Embedded_Image_Length );
     
                 embeddedImage->Read( &header, sizeof header );
                 stream.reset( embeddedImage );
                 g_pStream = embeddedImage;
                 parsingEmbeddedImage = true; 
+                format = SniffFormat( embeddedImage, 0, NULL );
             }
             else
             {
@@ -2672,14 +3067,7 @@ private:
             }
         }
     
-        if ( ( 0xd8ff     != ( header & 0xffff ) ) &&   // JPG
-             ( 0x002a4949 != header ) &&                // CR2 canon and standard TIF and DNG
-             ( 0x2a004d4d != header ) &&                // NEF nikon (big endian!)
-             ( 0x4f524949 != header ) &&                // ORF olympus
-             ( 0x00554949 != header ) &&                // RW2 panasonic
-             ( 0x494a5546 != header ) &&                // RAF fujifilm
-             ( 0x474e5089 != header ) &&                // PNG
-             ( 0x4d42     != ( header & 0xffff ) ) )    // BMP
+        if ( NULL == format || format->container )
         {
             g_pStream = NULL;
             return;
@@ -2690,28 +3078,13 @@ private:
         __int64 headerBase = 0;
         __int64 exifHeaderOffset = 12;
     
-        if ( 0x474e5089 == header ) // PNG
-        {
-            DWORD nextFour = GetDWORD( 4, false );
-    
-            if ( 0x0d0a1a0a != nextFour )
-            {
-                g_pStream = NULL;
-                return;
-            }
-    
-            ParsePNG();
-
-            g_pStream = NULL;
-            return;
-        }
-        else if ( 0x4d42 == ( header & 0xffff ) )
+        if ( NULL != format->parse )
         {
-            ParseBMP();
+            ( this->*format->parse )( false );
             g_pStream = NULL;
             return;
         }
-        else if ( 0xd8ff == ( header & 0xffff ) ) 
+        else if ( formatJPG == format->format )
         {
             // special handling for JPG files
 
@@ -2750,7 +3123,7 @@ private:
                 header = maybe;
             }
         }
-        else if ( 0x494a5546 == header )
+        else if ( formatRAF == format->format )
         {
             // RAF files aren't like TIFF files. They have their own format which isn't documented and this app can't parse.
             // But RAF files have an embedded JPG with full properties, so show those.
@@ -2813,14 +3186,17 @@ private:
     
         DWORD IFDOffset = GetDWORD( startingOffset, littleEndian );
     
-        EnumerateIFD0( 0, IFDOffset, headerBase, littleEndian, pwcExt );
+        if ( littleEndian )
+            EnumerateIFD0<true>( 0, IFDOffset, headerBase, pwcExt );
+        else
+            EnumerateIFD0<false>( 0, IFDOffset, headerBase, pwcExt );
     
         if ( ( 0 != g_Embedded_Image_Offset ) && ( 0 != g_Embedded_Image_Length ) && !wcsicmp( pwcExt, L".rw2" )  )
         {
             // Panasonic raw files sometimes have embedded JPGs with metadata not in the actual RW2 file.
             // Specifically, Serial Number, Lens Model, and Lens Serial Number can only be retrieved in this way.
     
-            g_pStream = new CStream( pwc, g_Embedded_Image_Offset, g_Embedded_Image_Length );
+            g_pStream = new CStream( *pFileStream, g_Embedded_Image_Offset, g_Embedded_Image_Length );
             stream.reset( g_pStream );
     
             if ( !g_pStream->Ok() )
@@ -2854,7 +3230,10 @@ private:
                     littleEndian = ( 0x4949 == ( header & 0xffff ) );
     
                     DWORD IFDStartingOffset = GetDWORD( startingOffset, littleEndian );
-                    EnumerateIFD0( 0, IFDStartingOffset, headerBase, littleEndian, pwcExt );
+                    if ( littleEndian )
+                        EnumerateIFD0<true>( 0, IFDStartingOffset, headerBase, pwcExt );
+                    else
+                        EnumerateIFD0<false>( 0, IFDStartingOffset, headerBase, pwcExt );
                 }
             }
         }
@@ -2863,21 +3242,30 @@ private:
         {
             WORD endian = GetWORD( g_Canon_CR3_Exif_Exif_IFD, littleEndian );
     
-            EnumerateExifTags( 0, 8, g_Canon_CR3_Exif_Exif_IFD, ( 0x4949 == endian ) );
+            if ( 0x4949 == endian )
+                EnumerateExifTags<true>( 0, 8, g_Canon_CR3_Exif_Exif_IFD );
+            else
+                EnumerateExifTags<false>( 0, 8, g_Canon_CR3_Exif_Exif_IFD );
         }
     
         if ( 0 != g_Canon_CR3_Exif_Makernotes_IFD )
         {
             WORD endian = GetWORD( g_Canon_CR3_Exif_Makernotes_IFD, littleEndian );
     
-            EnumerateMakernotes( 0, 8, g_Canon_CR3_Exif_Makernotes_IFD, ( 0x4949 == endian ) );
+            if ( 0x4949 == endian )
+                EnumerateMakernotes<true>( 0, 8, g_Canon_CR3_Exif_Makernotes_IFD );
+            else
+                EnumerateMakernotes<false>( 0, 8, g_Canon_CR3_Exif_Makernotes_IFD );
         }
     
         if ( 0 != g_Canon_CR3_Exif_GPS_IFD  )
         {
             WORD endian = GetWORD( g_Canon_CR3_Exif_GPS_IFD, littleEndian );
     
-            EnumerateGPSTags( 0, 8, g_Canon_CR3_Exif_GPS_IFD, ( 0x4949 == endian ) );
+            if ( 0x4949 == endian )
+                EnumerateGPSTags<true>( 0, 8, g_Canon_CR3_Exif_GPS_IFD );
+            else
+                EnumerateGPSTags<false>( 0, 8, g_Canon_CR3_Exif_GPS_IFD );
         }
 
         // If there is an embedded file, load and treat it as if it's the main image.
@@ -2892,7 +3280,7 @@ private:
             }
             else
             {
-                CStream * embeddedImage = new CStream( pwc, g_Embedded_Image_Offset, g_Embedded_Image_Length );
+                CStream * embeddedImage = new CStream( *pFileStream, g_Embedded_Image_Offset, g_Embedded_Image_Length );
                 unsigned long long head;
                 embeddedImage->Read( &head, sizeof head );
                 stream.reset( embeddedImage );
@@ -3004,11 +3392,108 @@ private:
         g_acMake[ 0 ] = 0;
         g_acModel[ 0 ] = 0;
         g_acSerialNumber[ 0 ] = 0;
+        g_acSoftware[ 0 ] = 0;
         g_holdsAdobeEditsInXMP = false;
         g_RatingInXMP_Offset = 0; // offset of 1 ascii character in the range of 0-5.
         g_RatingInXMP = 0;        // integer 0..5 only valid if g_RatingInXMP_Offset isn't 0
+        g_RatingInSidecar = false;
     } //InitializeGlobals
+
+    // Adobe apps keep the rating and edits for RAW files in the sidecar, so what's there replaces what the image holds
+
+    void EnumerateSidecar()
+    {
+        CStream sidecar( g_awcSidecar );
+
+        if ( !sidecar.Ok() || sidecar.Length() <= 0 || sidecar.Length() > MaxSidecarBytes )
+            return;
+
+        ULONG cb = (ULONG) sidecar.Length();
+        unique_ptr<char> bytes( new char[ cb + 1 ] );
+        bytes.get()[ cb ] = 0;
+
+        if ( cb != sidecar.Read( bytes.get(), cb ) )
+            return;
+
+        if ( strstr( bytes.get(), "Adobe XMP Core" ) )
+            g_holdsAdobeEditsInXMP = true;
+
+        __int64 imageOffset = g_RatingInXMP_Offset;
+        char imageRating = g_RatingInXMP;
+        g_RatingInXMP_Offset = 0;
+
+        EnumerateXMPData( bytes.get(), 0 );
+
+        if ( 0 != g_RatingInXMP_Offset )
+            g_RatingInSidecar = true;
+        else
+        {
+            g_RatingInXMP_Offset = imageOffset;
+            g_RatingInXMP = imageRating;
+        }
+    } //EnumerateSidecar
+
+    bool HasSidecar( const WCHAR * pwcPath )
+    {
+        return ( 0 != g_awcSidecarImage[ 0 ] && !_wcsicmp( pwcPath, g_awcSidecarImage ) );
+    } //HasSidecar
     
+    // Returns true if the file could be opened and was parsed
+
+    bool ParseFile( const WCHAR * pwcPath, HANDLE & hFile )
+    {
+        if ( g_pPreloaded && !_wcsicmp( pwcPath, g_awcPreloadPath ) )
+        {
+            unique_ptr<CStream> preloaded( g_pPreloaded.release() );
+            wcscpy_s( g_awcPath, _countof( g_awcPath ), pwcPath );
+            EnumerateImageData( preloaded.get(), pwcPath );
+            return true;
+        }
+
+        if ( CArchive::IsMemberPath( pwcPath ) )
+        {
+            // files in zip and tar archives are read in place or decompressed into memory
+
+            unique_ptr<CStream> member( CArchive::Open( pwcPath, 0, 0, true ) );
+
+            if ( !member || !member->Ok() )
+                return false;
+
+            wcscpy_s( g_awcPath, _countof( g_awcPath ), pwcPath );
+            EnumerateImageData( member.get(), pwcPath );
+            return true;
+        }
+
+        if ( INVALID_HANDLE_VALUE == hFile )
+            hFile = CreateFile( pwcPath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL );
+
+        if ( INVALID_HANDLE_VALUE == hFile )
+            return false;
+
+        wcscpy_s( g_awcPath, _countof( g_awcPath ), pwcPath );
+
+#if HANDLE_FILE_CHANGES
+        FILETIME ftCreate, ftAccess, ftWrite;
+        GetFileTime( hFile, &ftCreate, &ftAccess, &g_ftWrite );
+#endif
+
+        CStream fileStream( hFile );
+        EnumerateImageData( &fileStream, pwcPath );
+        return true;
+    } //ParseFile
+
+    // After a write the shared cache gets the updated metadata along with the file's new size and time
+
+    void UpdateSharedCache( const WCHAR * pwcPath )
+    {
+        unsigned long long size, lastWrite;
+
+        if ( CArchive::GetFileInfo( pwcPath, size, lastWrite ) )
+            MetadataCache().Store( pwcPath, size, lastWrite, *this );
+        else
+            MetadataCache().Remove( pwcPath );
+    } //UpdateSharedCache
+
     void UpdateCache( const WCHAR * pwcPath )
     {
         // protect against multiple threads updating Image Data at the same time.
@@ -3046,20 +3531,29 @@ private:
         if ( !cached )
         {
             InitializeGlobals();
-    
-            if ( INVALID_HANDLE_VALUE == hFile )
-                hFile = CreateFile( pwcPath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL );
-    
-            if ( INVALID_HANDLE_VALUE != hFile )
+
+            CMetadataCache<ParsedImageData> & shared = MetadataCache();
+            unsigned long long size = 0, lastWrite = 0;
+            bool sidecar = HasSidecar( pwcPath );
+
+            // The size and time are taken before parsing, so a change made while parsing means a miss next time.
+            // They're the image's alone, so metadata that includes a sidecar isn't shared.
+
+            bool stamped = !sidecar && shared.Enabled() && CArchive::GetFileInfo( pwcPath, size, lastWrite );
+
+            if ( stamped && shared.Find( pwcPath, size, lastWrite, *this ) )
             {
                 wcscpy_s( g_awcPath, _countof( g_awcPath ), pwcPath );
 
-#if HANDLE_FILE_CHANGES
-                FILETIME ftCreate, ftAccess, ftWrite;
-                GetFileTime( hFile, &ftCreate, &ftAccess, &g_ftWrite );
-#endif
-    
-                EnumerateImageData( hFile, pwcPath );
+                if ( g_pPreloaded && !_wcsicmp( pwcPath, g_awcPreloadPath ) )
+                    g_pPreloaded.reset();
+            }
+            else if ( ParseFile( pwcPath, hFile ) )
+            {
+                if ( sidecar )
+                    EnumerateSidecar();
+                else if ( stamped )
+                    shared.Store( pwcPath, size, lastWrite, *this );
             }
         }
     
@@ -3156,6 +3650,67 @@ private:
     
 public:
 
+    // Shared by every CImageData since layouts learned by one thread's object help the others
+
+    static CMakernoteLayoutCache & MakernoteLayouts()
+    {
+        static CMakernoteLayoutCache cache;
+        return cache;
+    } //MakernoteLayouts
+
+    // Parsed metadata of recently used files, shared by every CImageData. Call SetCapacity to size it or turn it off.
+
+    static CMetadataCache<ParsedImageData> & MetadataCache()
+    {
+        static CMetadataCache<ParsedImageData> cache;
+        return cache;
+    } //MetadataCache
+
+    // Opens the file and reads its first cbHead bytes now. The next call for the same path parses from that
+    // memory as far as it can instead of doing its own reads. This lets callers limit how many files are
+    // being read at once separately from how many are being parsed.
+
+    void Preload( const WCHAR * pwcPath, ULONG cbHead )
+    {
+        unique_ptr<CStream> stream( CArchive::Open( pwcPath, 0, _I64_MAX, true ) );
+
+        if ( stream && stream->Ok() )
+            stream->Prefetch( 0, cbHead );
+        else
+            stream.reset();
+
+        lock_guard<mutex> lock( g_mtx );
+
+        g_pPreloaded.swap( stream );
+        wcscpy_s( g_awcPreloadPath, _countof( g_awcPreloadPath ), pwcPath );
+    } //Preload
+
+    // The next parse of pwcImage also reads the rating and Adobe edits from pwcSidecar, e.g. from CSidecars.
+    // A NULL sidecar means the image has none. Ratings set later are written to the sidecar.
+
+    void UseSidecar( const WCHAR * pwcImage, const WCHAR * pwcSidecar )
+    {
+        lock_guard<mutex> lock( g_mtx );
+
+        if ( NULL == pwcSidecar )
+        {
+            if ( !HasSidecar( pwcImage ) )
+                return;
+
+            g_awcSidecarImage[ 0 ] = 0;
+        }
+        else
+        {
+            wcscpy_s( g_awcSidecarImage, _countof( g_awcSidecarImage ), pwcImage );
+            wcscpy_s( g_awcSidecar, _countof( g_awcSidecar ), pwcSidecar );
+        }
+
+        // metadata already parsed for the image doesn't reflect the change
+
+        if ( !_wcsicmp( pwcImage, g_awcPath ) )
+            g_awcPath[ 0 ] = 0;
+    } //UseSidecar
+
     double FindFocalLength( const WCHAR * pwcPath, double &focalLength, int & flIn35mmFilm, double &flGuess, double &flComputed, char * pcModel, int modelLen )
     {
         UpdateCache( pwcPath );
@@ -3232,6 +3787,28 @@ public:
         return found;
     } //FindFNumber
 
+    bool FindISO( const WCHAR * pwcPath, int * pISO )
+    {
+        UpdateCache( pwcPath );
+
+        if ( g_ISO <= 0 )
+            return false;
+
+        *pISO = g_ISO;
+        return true;
+    } //FindISO
+
+    bool FindExposureTime( const WCHAR * pwcPath, double * pSeconds )
+    {
+        UpdateCache( pwcPath );
+
+        if ( g_ExposureNum <= 0 || g_ExposureDen <= 0 )
+            return false;
+
+        *pSeconds = (double) g_ExposureNum / (double) g_ExposureDen;
+        return true;
+    } //FindExposureTime
+
     bool FindDateTime( const WCHAR * pwcPath, char * pcDateTime, int buflen )
     {
         UpdateCache( pwcPath );
@@ -3400,6 +3977,14 @@ public:
         return ( 0 != ( *pc ) );
     } //GetInterestingMetadata
     
+    // False if the file couldn't be opened
+
+    bool Readable( const WCHAR * pwcPath )
+    {
+        UpdateCache( pwcPath );
+        return !_wcsicmp( pwcPath, g_awcPath );
+    } //Readable
+
     bool GetCameraInfo( const WCHAR * pwcPath, char * pcMake, int makeLen, char * pcModel, int modelLen )
     {
         UpdateCache( pwcPath );
@@ -3495,6 +4080,11 @@ public:
             return false;
         }
 
+        // values outside 1-8 are treated as 1, as RotateImage does
+
+        if ( g_Orientation_Value >= 1 && g_Orientation_Value <= 8 )
+            *orientation = g_Orientation_Value;
+
         return true;
     } //GetOrientation
 
@@ -3519,6 +4109,67 @@ public:
         return true;
     } //GetRating
 
+    // The next two functions find where SetRating and RotateImage would write without writing anything.
+    // Bulk writers use them to plan and journal many updates before applying them.
+
+    bool GetRatingLocation( const WCHAR * pwcPath, __int64 & offset, char & rating )
+    {
+        UpdateCache( pwcPath );
+
+        // bulk writers write to the image, and this offset is in the sidecar
+
+        if ( 0 == g_RatingInXMP_Offset || g_RatingInSidecar )
+            return false;
+
+        offset = g_RatingInXMP_Offset;
+        rating = g_RatingInXMP;
+        return true;
+    } //GetRatingLocation
+
+    bool GetOrientationLocation( const WCHAR * pwcPath, __int64 & offset, __int64 & offset2, int & orientation, bool & littleEndian )
+    {
+        UpdateCache( pwcPath );
+
+        int o = g_Orientation_Value;
+
+        if ( o > 8 || o < 1 )
+            o = 1; // same default RotateImage uses
+
+        if ( -1 == g_Orientation_Value || 0 == g_Orientation_Offset || 3 != g_Orientation_Type ||
+             ( 1 != o && 6 != o && 3 != o && 8 != o ) )
+            return false;
+
+        offset = g_Orientation_Offset;
+        offset2 = ( -1 != g_Orientation_Value2 ) ? g_Orientation_Offset2 : 0;
+        orientation = g_Orientation_Value;      // as on disk, so a write can check it's unchanged; may be outside 1-8
+        littleEndian = g_Orientation_LittleEndian;
+        return true;
+    } //GetOrientationLocation
+
+    static WORD NextOrientation( WORD o, bool rotateRight )
+    {
+        // 1 --> 6 --> 3 --> 8 --> 1 ...
+
+        if ( rotateRight )
+        {
+            if ( 1 == o )
+                return 6;
+            if ( 8 == o )
+                return 1;
+            if ( 3 == o )
+                return 8;
+            return 3;
+        }
+
+        if ( 1 == o )
+            return 8;
+        if ( 8 == o )
+            return 3;
+        if ( 3 == o )
+            return 6;
+        return 1;
+    } //NextOrientation
+
     bool ToggleRating( const WCHAR * pwcPath )
     {
         // If the file can hold a rating, increment it by 1. If it's already 5, set it to 0.
@@ -3538,7 +4189,8 @@ public:
         else
             newRating = 0;
 
-        HANDLE hFile = CreateFile( pwcPath, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL );
+        const WCHAR * pwcTarget = g_RatingInSidecar ? g_awcSidecar : pwcPath;
+        HANDLE hFile = CreateFile( pwcTarget, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL );
         if ( INVALID_HANDLE_VALUE == hFile )
         {
             tracer.Trace( "can't open file for write to update rating, error %d\n", GetLastError() );
@@ -3569,6 +4221,10 @@ public:
         }
 
         CloseHandle( hFile );
+
+        if ( ok && !g_RatingInSidecar )
+            UpdateSharedCache( pwcPath );
+
         return ok;
     } //ToggleRating
 
@@ -3587,7 +4243,8 @@ public:
             return false;
         }
 
-        HANDLE hFile = CreateFile( pwcPath, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL );
+        const WCHAR * pwcTarget = g_RatingInSidecar ? g_awcSidecar : pwcPath;
+        HANDLE hFile = CreateFile( pwcTarget, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL );
         if ( INVALID_HANDLE_VALUE == hFile )
         {
             tracer.Trace( "can't open file for write to update rating, error %d\n", GetLastError() );
@@ -3618,6 +4275,10 @@ public:
         }
 
         CloseHandle( hFile );
+
+        if ( ok && !g_RatingInSidecar )
+            UpdateSharedCache( pwcPath );
+
         return ok;
     } //SetRating
 
@@ -3663,31 +4324,7 @@ public:
             return false;
         }
 
-        // 1 --> 6 --> 3 --> 8 --> 1 ...
-        WORD o = (WORD) g_Orientation_Value;
-
-        if ( rotateRight )
-        {
-            if ( 1 == o )
-                o = 6;
-            else if ( 8 == o )
-                o = 1;
-            else if ( 3 == o )
-                o = 8;
-            else
-                o = 3;
-        }
-        else
-        {
-            if ( 1 == o )
-                o = 8;
-            else if ( 8 == o )
-                o = 3;
-            else if ( 3 == o )
-                o = 6;
-            else
-                o = 1;
-        }
+        WORD o = NextOrientation( (WORD) g_Orientation_Value, rotateRight );
 
         tracer.Trace( "updating orientation value %d with %d at file offset %lld\n", g_Orientation_Value, o, g_Orientation_Offset );
 
@@ -3737,11 +4374,17 @@ public:
 
         CloseHandle( hFile );
 
+        if ( ok )
+            UpdateSharedCache( pwcPath );
+
         return ok;
     } //RotateImage
 
     void PurgeCache()
     {
+        if ( 0 != g_awcPath[ 0 ] )
+            MetadataCache().Remove( g_awcPath );
+
         InitializeGlobals();
         g_awcPath[ 0 ] = 0;
     }
@@ -3749,6 +4392,9 @@ public:
     CImageData()
     {
         InitializeGlobals();
+        g_awcPreloadPath[ 0 ] = 0;
+        g_awcSidecarImage[ 0 ] = 0;
+        g_awcSidecar[ 0 ] = 0;
     }
 
     ~CImageData()
@@ -54,18 +54,33 @@ class CStringArray
                 return;
 
             std::random_device rd;
-            std::mt19937 gen( rd() );
-            std::uniform_int_distribution<> distrib( 0, (int) elements.size() - 1 );
+            std::mt19937_64 gen( rd() );
 
-            for ( size_t i = 0; i < elements.size() * 2; i++ )
-            {
-                int a = distrib( gen );
-                int b = distrib( gen );
+            // Fisher-Yates. Swapping random pairs doesn't make every ordering equally likely
 
-                swap( elements[ a ], elements[ b ] );
+            for ( size_t i = elements.size() - 1; i > 0; i-- )
+            {
+                std::uniform_int_distribution<size_t> distrib( 0, i );
+                swap( elements[ i ], elements[ distrib( gen ) ] );
             }
         } //Randomize
 
+        // Keeps just the elements at the given indices, in that order, and frees the rest
+
+        void Keep( const vector<size_t> & indices )
+        {
+            vector<WCHAR *> kept( indices.size() );
+
+            for ( size_t k = 0; k < indices.size(); k++ )
+            {
+                kept[ k ] = elements[ indices[ k ] ];
+                elements[ indices[ k ] ] = NULL;
+            }
+
+            Clear();
+            elements.swap( kept );
+        } //Keep
+
         void Add( WCHAR * pwc )
         {
             size_t len = 1 + wcslen( pwc );
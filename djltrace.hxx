@@ -7,6 +7,11 @@
 // By default the tracing file is placed in %temp%\tracer.txt
 // Arguments to Trace() are just like printf. e.g.:
 //    tracer.Trace( "what to log with an integer argument %d and a wide string %ws\n", 10, pwcHello );
+// TraceAt() takes a level and a category; SetFilter() chooses which are written. Trace() is TraceInfo, CategoryGeneral.
+// With UseRingBuffers( true ), tracing threads don't format or take a lock. Each thread appends a binary
+// record (the format string pointer and the arguments) to its own ring buffer, and a background thread
+// formats and writes the records. Format strings must be literals since only the pointer is kept.
+// Strings arguments are copied, truncated if the record is full. Records are dropped when a ring is full.
 //
 
 #include <stdio.h>
@@ -20,6 +25,14 @@
 #include <cstring>
 #include <djl_os.hxx>
 
+#ifndef WATCOM
+    #include <atomic>
+    #include <thread>
+    #include <chrono>
+    #include <condition_variable>
+    #include <algorithm>
+#endif
+
 #if !defined(_WIN32) && !defined(WATCOM)
 
     #include <sys/unistd.h>
@@ -32,6 +45,14 @@ using namespace std;
 
 class CDJLTrace
 {
+    public:
+        enum TraceLevel { TraceError = 0, TraceWarning = 1, TraceInfo = 2, TraceVerbose = 3 };
+
+        // Categories are bits. Apps can use bits above these for their own categories.
+
+        static const uint32_t CategoryGeneral = 0x1;
+        static const uint32_t CategoryParse = 0x2;     // problems found parsing file formats
+
     private:
         FILE * fp;
 #ifndef WATCOM
@@ -39,6 +60,472 @@ class CDJLTrace
 #endif
         bool quiet; // no pid
         bool flush; // flush after each write
+        int maxLevel;
+        uint32_t categoryMask;
+
+#ifndef WATCOM
+        static const size_t RingSlots = 1024;
+        static const size_t RecordSize = 256;
+
+        enum ArgType { argNone, argPercent, argInt, argLong, argInt64, argSize, argDouble, argLongDouble, argPointer, argString, argWide };
+
+        struct Spec
+        {
+            const char * start;
+            size_t len;
+            int stars;       // * width and precision arguments
+            ArgType type;
+        };
+
+        struct Record
+        {
+            const char * format;
+            int64_t ticks;
+            uint16_t argBytes;
+            bool quietRecord;
+            bool truncated;
+            uint8_t args[ RecordSize - sizeof( const char * ) - sizeof( int64_t ) - 4 ];
+        };
+
+        // written only by its thread (head) and the flusher (tail)
+
+        struct Ring
+        {
+            Record records[ RingSlots ];
+            std::atomic<uint64_t> head;
+            std::atomic<uint64_t> tail;
+            std::atomic<bool> released;    // the thread has exited
+
+            Ring() : head( 0 ), tail( 0 ), released( false ) {}
+        };
+
+        struct RingHolder
+        {
+            CDJLTrace * owner;
+            shared_ptr<Ring> ring;
+
+            RingHolder() : owner( NULL ) {}
+            ~RingHolder() { if ( ring ) ring->released = true; }
+        };
+
+        bool useRings;
+        std::mutex mtxRings;
+        vector<shared_ptr<Ring>> rings;
+        std::thread flusher;
+        std::mutex mtxFlusher;
+        std::condition_variable cvFlusher;
+        bool stopFlusher;
+        std::atomic<uint64_t> dropped;
+        uint64_t droppedReported;
+
+        // f points at a %. Returns a pointer to the conversion character, or the terminator if there isn't one.
+
+        static const char * ParseSpec( const char * f, Spec & spec )
+        {
+            spec.start = f;
+            spec.stars = 0;
+            spec.type = argNone;
+            f++;
+
+            if ( '%' == *f )
+            {
+                spec.type = argPercent;
+                spec.len = 2;
+                return f;
+            }
+
+            while ( 0 != *f && strchr( "-+ #0'", *f ) )
+                f++;
+
+            if ( '*' == *f )
+            {
+                spec.stars++;
+                f++;
+            }
+            else while ( *f >= '0' && *f <= '9' )
+                f++;
+
+            if ( '.' == *f )
+            {
+                f++;
+
+                if ( '*' == *f )
+                {
+                    spec.stars++;
+                    f++;
+                }
+                else while ( *f >= '0' && *f <= '9' )
+                    f++;
+            }
+
+            int longs = 0;
+            bool sized = false, int64 = false, wide = false, longDouble = false;
+
+            do
+            {
+                if ( 'l' == *f )
+                    longs++;
+                else if ( 'L' == *f )
+                    longDouble = true;
+                else if ( 'w' == *f )
+                    wide = true;
+                else if ( 'z' == *f || 'j' == *f || 't' == *f )
+                    sized = true;
+                else if ( 'I' == *f )
+                {
+                    if ( '6' == f[ 1 ] && '4' == f[ 2 ] )
+                    {
+                        int64 = true;
+                        f += 2;
+                    }
+                    else if ( '3' == f[ 1 ] && '2' == f[ 2 ] )
+                        f += 2;
+                    else
+                        sized = true;
+                }
+                else if ( 'h' != *f )
+                    break;
+
+                f++;
+            } while ( true );
+
+            char c = *f;
+
+            if ( 0 != c && strchr( "diouxXc", c ) )
+                spec.type = ( int64 || longs >= 2 ) ? argInt64 : sized ? argSize : ( 1 == longs && 'c' != c ) ? argLong : argInt;
+            else if ( 0 != c && strchr( "eEfFgGaA", c ) )
+                spec.type = longDouble ? argLongDouble : argDouble;
+            else if ( 's' == c )
+                spec.type = ( wide || longs > 0 ) ? argWide : argString;
+            else if ( 'S' == c )
+                spec.type = argWide;
+            else if ( 'p' == c || 'n' == c )
+                spec.type = argPointer;
+
+            if ( 0 == c )
+                f--;
+
+            spec.len = f - spec.start + 1;
+            return f;
+        } //ParseSpec
+
+        template<class T> static bool Put( uint8_t * & p, uint8_t * end, T value )
+        {
+            if ( (size_t) ( end - p ) < sizeof value )
+                return false;
+
+            memcpy( p, &value, sizeof value );
+            p += sizeof value;
+            return true;
+        } //Put
+
+        template<class C> static bool PutString( uint8_t * & p, uint8_t * end, const C * str )
+        {
+            if ( NULL == str )
+                str = (const C *) L"";
+
+            size_t len = 0;
+            while ( 0 != str[ len ] )
+                len++;
+
+            if ( (size_t) ( end - p ) < sizeof( uint16_t ) )
+                return false;
+
+            size_t room = ( end - p - sizeof( uint16_t ) ) / sizeof( C );
+            uint16_t copy = (uint16_t) ( ( len < room ) ? len : room );
+            Put( p, end, copy );
+            memcpy( p, str, copy * sizeof( C ) );
+            p += copy * sizeof( C );
+
+            return ( copy == len );
+        } //PutString
+
+        static void Capture( Record & r, const char * format, va_list args )
+        {
+            uint8_t * p = r.args;
+            uint8_t * end = r.args + sizeof r.args;
+            bool ok = true;
+
+            for ( const char * f = format; ok && 0 != *f; f++ )
+            {
+                if ( '%' != *f )
+                    continue;
+
+                Spec spec;
+                f = ParseSpec( f, spec );
+
+                for ( int s = 0; ok && s < spec.stars; s++ )
+                    ok = Put( p, end, va_arg( args, int ) );
+
+                if ( !ok )
+                    break;
+
+                switch ( spec.type )
+                {
+                    case argInt: ok = Put( p, end, va_arg( args, int ) ); break;
+                    case argLong: ok = Put( p, end, va_arg( args, long ) ); break;
+                    case argInt64: ok = Put( p, end, va_arg( args, long long ) ); break;
+                    case argSize: ok = Put( p, end, va_arg( args, size_t ) ); break;
+                    case argDouble: ok = Put( p, end, va_arg( args, double ) ); break;
+                    case argLongDouble: ok = Put( p, end, va_arg( args, long double ) ); break;
+                    case argPointer: ok = Put( p, end, va_arg( args, void * ) ); break;
+                    case argString: ok = PutString( p, end, va_arg( args, const char * ) ); break;
+                    case argWide: ok = PutString( p, end, va_arg( args, const wchar_t * ) ); break;
+                    default: break;
+                }
+
+                if ( 0 == *f )
+                    break;
+            }
+
+            r.argBytes = (uint16_t) ( p - r.args );
+            r.truncated = !ok;
+        } //Capture
+
+        template<class T> static bool Get( const uint8_t * & p, const uint8_t * end, T & value )
+        {
+            if ( (size_t) ( end - p ) < sizeof value )
+                return false;
+
+            memcpy( &value, p, sizeof value );
+            p += sizeof value;
+            return true;
+        } //Get
+
+        template<class C> static bool GetString( const uint8_t * & p, const uint8_t * end, vector<C> & str )
+        {
+            uint16_t len;
+            if ( !Get( p, end, len ) || (size_t) ( end - p ) < len * sizeof( C ) )
+                return false;
+
+            str.resize( len + 1 );
+            memcpy( str.data(), p, len * sizeof( C ) );
+            str[ len ] = 0;
+            p += len * sizeof( C );
+            return true;
+        } //GetString
+
+        template<class T> void PrintOne( const char * spec, int stars, const int * star, T value )
+        {
+            if ( 0 == stars )
+                fprintf( fp, spec, value );
+            else if ( 1 == stars )
+                fprintf( fp, spec, star[ 0 ], value );
+            else
+                fprintf( fp, spec, star[ 0 ], star[ 1 ], value );
+        } //PrintOne
+
+        // Formats a record the way vfprintf would have when it was traced
+
+        void Write( const Record & r )
+        {
+            if ( !r.quietRecord )
+                fprintf( fp, "PID %6u -- ",
+#ifdef _WIN32
+                         (unsigned) _getpid() );
+#else
+                         getpid() );
+#endif
+
+            const uint8_t * p = r.args;
+            const uint8_t * end = r.args + r.argBytes;
+            const char * literal = r.format;
+            const char * f = r.format;
+            bool ok = true;
+            vector<char> narrow;
+            vector<wchar_t> wide;
+
+            while ( ok && 0 != *f )
+            {
+                if ( '%' != *f )
+                {
+                    f++;
+                    continue;
+                }
+
+                fwrite( literal, 1, f - literal, fp );
+
+                Spec spec;
+                const char * last = ParseSpec( f, spec );
+                char acSpec[ 32 ];
+                int star[ 2 ] = { 0, 0 };
+
+                if ( spec.len >= sizeof acSpec )
+                    fwrite( spec.start, 1, spec.len, fp );
+                else if ( argPercent == spec.type )
+                    fputc( '%', fp );
+                else if ( argNone != spec.type )
+                {
+                    memcpy( acSpec, spec.start, spec.len );
+                    acSpec[ spec.len ] = 0;
+
+                    for ( int s = 0; ok && s < spec.stars; s++ )
+                        ok = Get( p, end, star[ s ] );
+
+                    if ( ok )
+                    {
+                        switch ( spec.type )
+                        {
+                            case argInt: { int v; if ( ( ok = Get( p, end, v ) ) ) PrintOne( acSpec, spec.stars, star, v ); break; }
+                            case argLong: { long v; if ( ( ok = Get( p, end, v ) ) ) PrintOne( acSpec, spec.stars, star, v ); break; }
+                            case argInt64: { long long v; if ( ( ok = Get( p, end, v ) ) ) PrintOne( acSpec, spec.stars, star, v ); break; }
+                            case argSize: { size_t v; if ( ( ok = Get( p, end, v ) ) ) PrintOne( acSpec, spec.stars, star, v ); break; }
+                            case argDouble: { double v; if ( ( ok = Get( p, end, v ) ) ) PrintOne( acSpec, spec.stars, star, v ); break; }
+                            case argLongDouble: { long double v; if ( ( ok = Get( p, end, v ) ) ) PrintOne( acSpec, spec.stars, star, v ); break; }
+                            case argPointer: { void * v; if ( ( ok = Get( p, end, v ) ) && 'n' != *last ) PrintOne( acSpec, spec.stars, star, v ); break; }
+                            case argString: { if ( ( ok = GetString( p, end, narrow ) ) ) PrintOne( acSpec, spec.stars, star, narrow.data() ); break; }
+                            case argWide: { if ( ( ok = GetString( p, end, wide ) ) ) PrintOne( acSpec, spec.stars, star, wide.data() ); break; }
+                            default: break;
+                        }
+                    }
+                }
+
+                f = ( 0 == *last ) ? last : last + 1;
+                literal = f;
+            }
+
+            if ( ok )
+                fwrite( literal, 1, f - literal, fp );
+
+            if ( !ok || r.truncated )
+                fprintf( fp, "...(truncated)\n" );
+        } //Write
+
+        Ring * ThreadRing()
+        {
+            static thread_local RingHolder holder;
+
+            if ( this != holder.owner || !holder.ring )
+            {
+                shared_ptr<Ring> ring = make_shared<Ring>();
+
+                lock_guard<mutex> lock( mtxRings );
+                rings.push_back( ring );
+                holder.ring = ring;
+                holder.owner = this;
+            }
+
+            return holder.ring.get();
+        } //ThreadRing
+
+        void Append( bool quietRecord, const char * format, va_list args )
+        {
+            Ring * ring = ThreadRing();
+            uint64_t head = ring->head.load( std::memory_order_relaxed );
+
+            if ( ( head - ring->tail.load( std::memory_order_acquire ) ) >= RingSlots )
+            {
+                dropped++;
+                return;
+            }
+
+            Record & r = ring->records[ head % RingSlots ];
+            r.format = format;
+            r.ticks = std::chrono::steady_clock::now().time_since_epoch().count();
+            r.quietRecord = quietRecord;
+            Capture( r, format, args );
+
+            ring->head.store( head + 1, std::memory_order_release );
+        } //Append
+
+        // Writes everything in the rings, in the order it was traced across threads
+
+        void DrainRings()
+        {
+            vector<shared_ptr<Ring>> current;
+            {
+                lock_guard<mutex> lock( mtxRings );
+                current = rings;
+            }
+
+            vector<uint64_t> heads( current.size() );
+            vector<const Record *> batch;
+
+            for ( size_t i = 0; i < current.size(); i++ )
+            {
+                heads[ i ] = current[ i ]->head.load( std::memory_order_acquire );
+
+                for ( uint64_t t = current[ i ]->tail.load( std::memory_order_relaxed ); t < heads[ i ]; t++ )
+                    batch.push_back( & current[ i ]->records[ t % RingSlots ] );
+            }
+
+            stable_sort( batch.begin(), batch.end(), [] ( const Record * a, const Record * b ) { return a->ticks < b->ticks; } );
+
+            {
+                lock_guard<mutex> lock( mtx );
+
+                for ( size_t b = 0; b < batch.size(); b++ )
+                    Write( *batch[ b ] );
+
+                uint64_t d = dropped;
+                if ( d != droppedReported )
+                {
+                    fprintf( fp, "trace records dropped because a ring buffer was full: %llu\n", (unsigned long long) ( d - droppedReported ) );
+                    droppedReported = d;
+                }
+
+                if ( 0 != batch.size() )
+                    fflush( fp );
+            }
+
+            for ( size_t i = 0; i < current.size(); i++ )
+                current[ i ]->tail.store( heads[ i ], std::memory_order_release );
+
+            // rings of threads that have exited are freed once they're empty
+
+            lock_guard<mutex> lock( mtxRings );
+
+            for ( size_t i = 0; i < rings.size(); i++ )
+            {
+                if ( rings[ i ]->released && rings[ i ]->head == rings[ i ]->tail )
+                {
+                    rings.erase( rings.begin() + i );
+                    i--;
+                }
+            }
+        } //DrainRings
+
+        void StopFlusher()
+        {
+            if ( flusher.joinable() )
+            {
+                {
+                    lock_guard<mutex> lock( mtxFlusher );
+                    stopFlusher = true;
+                }
+
+                cvFlusher.notify_one();
+                flusher.join();
+            }
+
+            if ( NULL != fp )
+                DrainRings();
+        } //StopFlusher
+#endif
+
+        void Write( bool quietRecord, const char * format, va_list args )
+        {
+#ifndef WATCOM
+            if ( useRings )
+            {
+                Append( quietRecord, format, args );
+                return;
+            }
+
+            lock_guard<mutex> lock( mtx );
+#endif
+
+            if ( !quietRecord && !quiet )
+                fprintf( fp, "PID %6u -- ",
+#ifdef _WIN32
+                         (unsigned) _getpid() );
+#else
+                         getpid() );
+#endif
+            vfprintf( fp, format, args );
+            if ( flush )
+                fflush( fp );
+        } //Write
 
         static char * appendHexNibble( char * p, uint8_t val )
         {
@@ -122,7 +609,12 @@ class CDJLTrace
         } //ShowBinaryData
 
     public:
-        CDJLTrace() : fp( NULL ), quiet( false ), flush( true ) {}
+#ifndef WATCOM
+        CDJLTrace() : fp( NULL ), quiet( false ), flush( true ), maxLevel( TraceInfo ), categoryMask( 0xffffffff ),
+                      useRings( false ), stopFlusher( false ), dropped( 0 ), droppedReported( 0 ) {}
+#else
+        CDJLTrace() : fp( NULL ), quiet( false ), flush( true ), maxLevel( TraceInfo ), categoryMask( 0xffffffff ) {}
+#endif
 
         bool Enable( bool enable, const wchar_t * pcLogFile = NULL, bool destroyContents = false )
         {
@@ -180,6 +672,11 @@ class CDJLTrace
 
         void Shutdown()
         {
+#ifndef WATCOM
+            StopFlusher();
+            useRings = false;
+#endif
+
             if ( NULL != fp )
             {
                 fflush( fp );
@@ -199,47 +696,78 @@ class CDJLTrace
 
         void SetFlushEachTrace( bool f ) { flush = f; }
 
-        void Flush() { if ( 0 != fp ) fflush( fp ); }
+        // Messages above level or in no category in categories aren't written
 
-        void Trace( const char * format, ... )
+        void SetFilter( int level, uint32_t categories )
         {
-            if ( NULL != fp )
-            {
+            maxLevel = level;
+            categoryMask = categories;
+        } //SetFilter
+
+        bool Wanted( int level, uint32_t category ) { return ( NULL != fp && level <= maxLevel && 0 != ( category & categoryMask ) ); }
+
 #ifndef WATCOM
-                lock_guard<mutex> lock( mtx );
+        // Call after Enable. Records are written every flushMs and at Shutdown.
+
+        void UseRingBuffers( bool use, unsigned flushMs = 100 )
+        {
+            StopFlusher();
+            useRings = use && ( NULL != fp );
+
+            if ( useRings )
+            {
+                stopFlusher = false;
+
+                flusher = std::thread( [this, flushMs] ()
+                {
+                    unique_lock<mutex> lock( mtxFlusher );
+
+                    while ( !stopFlusher )
+                    {
+                        cvFlusher.wait_for( lock, std::chrono::milliseconds( flushMs ) );
+                        lock.unlock();
+                        DrainRings();
+                        lock.lock();
+                    }
+                } );
+            }
+        } //UseRingBuffers
 #endif
 
+        void Flush() { if ( 0 != fp ) fflush( fp ); }
+
+        void Trace( const char * format, ... )
+        {
+            if ( Wanted( TraceInfo, CategoryGeneral ) )
+            {
                 va_list args;
                 va_start( args, format );
-                if ( !quiet )
-                    fprintf( fp, "PID %6u -- ",
-#ifdef _WIN32
-                             (unsigned) _getpid() );
-#else
-                             getpid() );
-#endif
-                vfprintf( fp, format, args );
+                Write( quiet, format, args );
                 va_end( args );
-                if ( flush )
-                    fflush( fp );
             }
         } //Trace
 
+        void TraceAt( int level, uint32_t category, const char * format, ... )
+        {
+            if ( Wanted( level, category ) )
+            {
+                va_list args;
+                va_start( args, format );
+                Write( quiet, format, args );
+                va_end( args );
+            }
+        } //TraceAt
+
         // Don't prepend the PID to the trace
 
         void TraceQuiet( const char * format, ... )
         {
             if ( NULL != fp )
             {
-#ifndef WATCOM
-                lock_guard<mutex> lock( mtx );
-#endif
                 va_list args;
                 va_start( args, format );
-                vfprintf( fp, format, args );
+                Write( true, format, args );
                 va_end( args );
-                if ( flush )
-                    fflush( fp );
             }
         } //TraceQuiet
 
@@ -0,0 +1,4 @@
+del aidlib.dll
+del aidlib.lib
+del aidlib.pdb
+cl /nologo aidlib.cxx /I.\ /O2i /EHac /Zi /LD /DUNICODE /D_AMD64_ /link /opt:ref /incremental:no